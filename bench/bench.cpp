@@ -0,0 +1,599 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "bitmap.h"
+#include "bitmap_kernels.h"
+#include "bitmap_parallel.h"
+#include "bitmap.hpp"
+#include "block_store.h"
+#include "perf_counters.h"
+
+// Hot paths of the bitmap and the block store.
+// Results go to stdout as JSON unless another --benchmark_format is asked for,
+// so two builds can be diffed with Google Benchmark's tools/compare.py.
+// Where the machine has hardware counters, every benchmark also reports cycles,
+// instructions, cache and branch misses per iteration.
+
+// Reads the thread's hardware counters at construction and turns the difference at
+// report() into per-iteration benchmark counters. Without counters it does nothing.
+class HwCounters
+{
+	public:
+		HwCounters() : counters(perf_counters_thread())
+		{
+			ok = counters && perf_counters_read(counters, &start);
+		}
+
+		void report(benchmark::State &state)
+		{
+			perf_sample_t end;
+			if (!ok || !perf_counters_read(counters, &end))
+				return;
+			for (int c = 0; c < PERF_COUNTER_COUNT; c++)
+				if (end.available & (1u << c))
+					state.counters[perf_counter_name((perf_counter_t)c)] =
+						benchmark::Counter((double)(end.value[c] - start.value[c]), benchmark::Counter::kAvgIterations);
+		}
+
+	private:
+		perf_counters_t *counters;
+		perf_sample_t start;
+		bool ok;
+};
+
+// Bitmap sizes and fill ratios (percent) every bitmap benchmark is run over
+static void bitmap_args(benchmark::internal::Benchmark *b)
+{
+	for (int64_t bits : {512, 4096, 65536, 1 << 20})
+		for (int64_t fill : {0, 50, 99, 100})
+			b->Args({bits, fill});
+}
+
+// The first fill% of the bits set, the rest clear: ffz has to scan past all of them
+static bitmap_t *prefix_filled(size_t bits, size_t fill)
+{
+	bitmap_t *bitmap = bitmap_create(bits);
+	for (size_t i = 0; i < bits * fill / 100; i++)
+		bitmap_set(bitmap, i);
+	return bitmap;
+}
+
+// fill% of the bits set at random (same seed every run)
+static bitmap_t *randomly_filled(size_t bits, size_t fill)
+{
+	bitmap_t *bitmap = bitmap_create(bits);
+	std::mt19937 rng(520);
+	std::uniform_int_distribution<size_t> pct(0, 99);
+	for (size_t i = 0; i < bits; i++)
+		if (pct(rng) < fill)
+			bitmap_set(bitmap, i);
+	return bitmap;
+}
+
+static void set_bitmap_counters(benchmark::State &state, size_t bits)
+{
+	state.SetBytesProcessed(state.iterations() * (int64_t)(bits / 8));
+	state.counters["bits"] = (double)bits;
+}
+
+static void BM_bitmap_ffz(benchmark::State &state)
+{
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = prefix_filled(bits, state.range(1));
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_ffz)->Apply(bitmap_args);
+
+static void BM_bitmap_ffs(benchmark::State &state)
+{
+	// mirror image of ffz: fill% of the bits clear up front before the first set one
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = prefix_filled(bits, state.range(1));
+	bitmap_invert(bitmap);
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(bitmap_ffs(bitmap));
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_ffs)->Apply(bitmap_args);
+
+static void BM_bitmap_total_set(benchmark::State &state)
+{
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = randomly_filled(bits, state.range(1));
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_total_set)->Apply(bitmap_args);
+
+// Each set of whole-buffer kernels on its own, over bitmaps of 64 KiB and 8 MiB
+static void kernel_args(benchmark::internal::Benchmark *b)
+{
+	for (int64_t which = 0; which < BITMAP_KERNELS_COUNT; which++)
+		for (int64_t bytes : {64 << 10, 8 << 20})
+			b->Args({which, bytes});
+}
+
+static void BM_bitmap_kernels_popcount(benchmark::State &state)
+{
+	const bitmap_kernels_t *kernels = bitmap_kernels_for((BITMAP_KERNELS)state.range(0));
+	if (!kernels)
+	{
+		state.SkipWithError("not supported here");
+		return;
+	}
+	std::vector<uint8_t> data(state.range(1), 0x5A);
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(kernels->popcount(data.data(), data.size()));
+	hw.report(state);
+	state.SetLabel(kernels->name);
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_bitmap_kernels_popcount)->Apply(kernel_args);
+
+static void BM_bitmap_kernels_invert(benchmark::State &state)
+{
+	const bitmap_kernels_t *kernels = bitmap_kernels_for((BITMAP_KERNELS)state.range(0));
+	if (!kernels)
+	{
+		state.SkipWithError("not supported here");
+		return;
+	}
+	std::vector<uint8_t> data(state.range(1), 0x5A);
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		kernels->invert(data.data(), data.size());
+		benchmark::ClobberMemory();
+	}
+	hw.report(state);
+	state.SetLabel(kernels->name);
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_bitmap_kernels_invert)->Apply(kernel_args);
+
+static void count_bit(size_t bit, void *arg)
+{
+	*(size_t *)arg += bit;
+}
+
+static void BM_bitmap_for_each(benchmark::State &state)
+{
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = randomly_filled(bits, state.range(1));
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		size_t sum = 0;
+		bitmap_for_each(bitmap, count_bit, &sum);
+		benchmark::DoNotOptimize(sum);
+	}
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_for_each)->Apply(bitmap_args);
+
+static void count_batch(const size_t *bits, size_t count, void *arg)
+{
+	for (size_t i = 0; i < count; i++)
+		*(size_t *)arg += bits[i];
+}
+
+static void BM_bitmap_for_each_batch(benchmark::State &state)
+{
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = randomly_filled(bits, state.range(1));
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		size_t sum = 0;
+		bitmap_for_each_batch(bitmap, count_batch, &sum);
+		benchmark::DoNotOptimize(sum);
+	}
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_for_each_batch)->Apply(bitmap_args);
+
+static void BM_bitmap_next_set(benchmark::State &state)
+{
+	size_t bits = state.range(0);
+	bitmap_t *bitmap = randomly_filled(bits, state.range(1));
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		size_t sum = 0;
+		BITMAP_FOR_EACH_SET(bitmap, bit)
+			sum += bit;
+		benchmark::DoNotOptimize(sum);
+	}
+	hw.report(state);
+	set_bitmap_counters(state, bits);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_next_set)->Apply(bitmap_args);
+
+// Flat (range(0) == 0) against compressed (1): random set/test/reset over 2^24 bits
+// that are range(1)% full, and the memory each one takes to hold them
+static void BM_bitmap_compressed_ops(benchmark::State &state)
+{
+	const size_t bits = (size_t)1 << 24;
+	bitmap_t *bitmap = state.range(0) ? bitmap_create_compressed(bits) : bitmap_create(bits);
+	std::mt19937 rng(520);
+	std::uniform_int_distribution<size_t> pct(0, 99);
+	for (size_t bit = 0; bit < bits; bit++)
+		if (pct(rng) < (size_t)state.range(1))
+			bitmap_set(bitmap, bit);
+	uint64_t x = 88172645463325252ull;
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		size_t bit = x & (bits - 1);
+		if (bitmap_test(bitmap, bit))
+			bitmap_reset(bitmap, bit);
+		else
+			bitmap_set(bitmap, bit);
+	}
+	hw.report(state);
+	state.counters["resident"] = (double)bitmap_get_resident_bytes(bitmap);
+	state.SetLabel(state.range(0) ? "compressed" : "flat");
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_compressed_ops)->ArgsProduct({{0, 1}, {0, 1, 50, 99}});
+
+static void BM_bitmap_compressed_ffz(benchmark::State &state)
+{
+	const size_t bits = (size_t)1 << 24;
+	bitmap_t *bitmap = state.range(0) ? bitmap_create_compressed(bits) : bitmap_create(bits);
+	// all full but the last bit
+	bitmap_format(bitmap, 0xFF);
+	bitmap_reset(bitmap, bits - 1);
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	hw.report(state);
+	state.counters["resident"] = (double)bitmap_get_resident_bytes(bitmap);
+	state.SetLabel(state.range(0) ? "compressed" : "flat");
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_compressed_ffz)->Arg(0)->Arg(1);
+
+// Whole-bitmap scans over 2^30 bits (128 MiB), with a pool of range(1) threads
+// (1 is the plain single-threaded call)
+static void parallel_args(benchmark::internal::Benchmark *b)
+{
+	for (int64_t scan = 0; scan < 3; scan++)
+		for (int64_t threads : {1, 4, 16, 64})
+			b->Args({scan, threads});
+}
+
+static void BM_bitmap_parallel(benchmark::State &state)
+{
+	static const char *names[] = {"total_set", "ffz", "for_each"};
+	const size_t bits = (size_t)1 << 30;
+	// set throughout, apart from the very last bit, so ffz has to look at all of it;
+	// for_each gets every 64th bit so the callbacks don't drown out the scan
+	bitmap_t *bitmap = bitmap_create(bits);
+	if (state.range(0) == 2)
+		for (size_t bit = 0; bit < bits; bit += 64)
+			bitmap_set(bitmap, bit);
+	else
+	{
+		bitmap_invert(bitmap);
+		bitmap_reset(bitmap, bits - 1);
+	}
+	bitmap_pool_t *pool = state.range(1) > 1 ? bitmap_pool_create((unsigned)state.range(1)) : nullptr;
+	std::vector<size_t> sums(bitmap_pool_threads(pool));
+	std::vector<void *> contexts;
+	for (size_t &sum : sums)
+		contexts.push_back(&sum);
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		if (state.range(0) == 0)
+			benchmark::DoNotOptimize(bitmap_total_set_parallel(bitmap, pool));
+		else if (state.range(0) == 1)
+			benchmark::DoNotOptimize(bitmap_ffz_parallel(bitmap, pool));
+		else
+			bitmap_for_each_parallel(bitmap, pool, count_bit, contexts.data());
+	}
+	hw.report(state);
+	state.SetLabel(names[state.range(0)]);
+	set_bitmap_counters(state, bits);
+	bitmap_pool_destroy(pool);
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_parallel)->Apply(parallel_args)->UseRealTime();
+
+// The FBM-sized bitmap as hw3::bitmap<512> (range(0) == 1) against bitmap_t (0):
+// flip a bit, then look for the first free one, fill% of the way in
+static void BM_bitmap_template_512(benchmark::State &state)
+{
+	hw3::bitmap<512> fixed;
+	bitmap_t *c = bitmap_create(512);
+	size_t in_use = 512 * state.range(1) / 100;
+	for (size_t bit = 0; bit < in_use; bit++)
+	{
+		fixed.set(bit);
+		bitmap_set(c, bit);
+	}
+	size_t bit = in_use ? in_use - 1 : 0;
+	HwCounters hw;
+	if (state.range(0))
+		for (auto _ : state)
+		{
+			fixed.flip(bit);
+			benchmark::DoNotOptimize(fixed.ffz());
+		}
+	else
+		for (auto _ : state)
+		{
+			bitmap_flip(c, bit);
+			benchmark::DoNotOptimize(bitmap_ffz(c));
+		}
+	hw.report(state);
+	state.SetLabel(state.range(0) ? "template" : "bitmap_t");
+	bitmap_destroy(c);
+}
+BENCHMARK(BM_bitmap_template_512)->ArgsProduct({{0, 1}, {0, 50, 99}});
+
+// allocate + release on a device with fill% of its blocks already in use
+// (the free ones are at the end, so allocate has to look past the rest)
+// The bitmap's byte masks come from a lookup table rather than shifting, which
+// src/bitmap.c says is "10% faster"; these two are that claim, measured
+static const uint8_t bit_mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+
+template <bool Lookup>
+static void BM_bit_mask(benchmark::State &state)
+{
+	uint8_t data[512];
+	std::mt19937 rng(520);
+	for (uint8_t &byte : data)
+		byte = (uint8_t)rng();
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		size_t set = 0;
+		for (size_t bit = 0; bit < sizeof(data) * 8; bit++)
+			set += (data[bit >> 3] & (Lookup ? bit_mask[bit & 7] : (uint8_t)(1u << (bit & 7)))) != 0;
+		benchmark::DoNotOptimize(set);
+	}
+	hw.report(state);
+	state.SetItemsProcessed(state.iterations() * sizeof(data) * 8);
+}
+BENCHMARK_TEMPLATE(BM_bit_mask, true)->Name("BM_bit_mask/lookup");
+BENCHMARK_TEMPLATE(BM_bit_mask, false)->Name("BM_bit_mask/shift");
+
+static void BM_block_store_allocate(benchmark::State &state)
+{
+	block_store_t *bs = block_store_create();
+	size_t in_use = BLOCK_STORE_NUM_BLOCKS * state.range(0) / 100;
+	for (size_t id = 0; id < in_use; id++)
+		block_store_request(bs, id);
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		size_t id = block_store_allocate(bs);
+		benchmark::DoNotOptimize(id);
+		block_store_release(bs, id);
+	}
+	hw.report(state);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_allocate)->Arg(0)->Arg(99);
+
+// Release a block and allocate again on a mostly full device, scanning (0) or through
+//  the recently-released stack (1)
+static void BM_block_store_churn(benchmark::State &state)
+{
+	block_store_t *bs = block_store_create();
+	for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; id++)
+		block_store_request(bs, id);
+	block_store_set_reuse_depth(bs, state.range(0) ? 16 : 0);
+	size_t id = BLOCK_STORE_NUM_BLOCKS - 1;
+	for (auto _ : state)
+	{
+		block_store_release(bs, id);
+		id = block_store_allocate(bs);
+		benchmark::DoNotOptimize(id);
+	}
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_churn)->Arg(0)->Arg(1);
+
+// allocate + release on a shared device, where the FBM is only updated with atomics
+static void BM_block_store_shared_allocate(benchmark::State &state)
+{
+	std::string name = "/hw3_bench_shared_" + std::to_string(getpid());
+	block_store_t *bs = block_store_create_shared(name.c_str(), 0600);
+	if (!bs)
+	{
+		state.SkipWithError("no shared memory");
+		return;
+	}
+	size_t in_use = BLOCK_STORE_NUM_BLOCKS * state.range(0) / 100;
+	for (size_t id = 0; id < in_use; id++)
+		block_store_request(bs, id);
+	for (auto _ : state)
+	{
+		size_t id = block_store_allocate(bs);
+		benchmark::DoNotOptimize(id);
+		block_store_release(bs, id);
+	}
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_shared_allocate)->Arg(0)->Arg(99);
+
+// Create a device, touch a block, destroy it: 0 goes through block_store_create, 1 through a pool
+static void BM_block_store_create_destroy(benchmark::State &state)
+{
+	block_store_pool_t *pool = state.range(0) ? block_store_pool_create(1) : nullptr;
+	for (auto _ : state)
+	{
+		block_store_t *bs = pool ? block_store_create_pooled(pool) : block_store_create();
+		benchmark::DoNotOptimize(block_store_allocate(bs));
+		block_store_destroy(bs);
+	}
+	state.SetLabel(pool ? "pooled" : "create");
+	block_store_pool_destroy(pool);
+}
+BENCHMARK(BM_block_store_create_destroy)->Arg(0)->Arg(1);
+
+// Devices to run the data path benchmarks against
+enum { IN_MEMORY, FILE_BACKED };
+
+static block_store_t *make_device(int64_t kind)
+{
+	if (kind == IN_MEMORY)
+		return block_store_create();
+	unlink("bench.bs");
+	return block_store_open("bench.bs", BLOCK_STORE_OPEN_CREATE);
+}
+
+static void fill_device(block_store_t *bs)
+{
+	uint8_t block[BLOCK_SIZE_BYTES];
+	memset(block, 0x5A, sizeof(block));
+	for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; id++)
+		if (block_store_request(bs, id))
+			block_store_write(bs, id, block);
+}
+
+static void BM_block_store_read(benchmark::State &state)
+{
+	block_store_t *bs = make_device(state.range(0));
+	fill_device(bs);
+	uint8_t block[BLOCK_SIZE_BYTES];
+	size_t id = 0;
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_read(bs, id, block));
+		id = (id + 1) % BLOCK_STORE_NUM_BLOCKS;
+	}
+	hw.report(state);
+	state.SetBytesProcessed(state.iterations() * BLOCK_SIZE_BYTES);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_read)->Arg(IN_MEMORY)->Arg(FILE_BACKED);
+
+static void BM_block_store_write(benchmark::State &state)
+{
+	block_store_t *bs = make_device(state.range(0));
+	fill_device(bs);
+	uint8_t block[BLOCK_SIZE_BYTES];
+	memset(block, 0xA5, sizeof(block));
+	size_t id = 0;
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_write(bs, id, block));
+		id = (id + 1) % BLOCK_STORE_NUM_BLOCKS;
+	}
+	hw.report(state);
+	state.SetBytesProcessed(state.iterations() * BLOCK_SIZE_BYTES);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_write)->Arg(IN_MEMORY)->Arg(FILE_BACKED);
+
+// Random reads over a 64 MiB device, with and without huge pages (the difference is TLB misses)
+static void BM_block_store_random_read(benchmark::State &state)
+{
+	const size_t blocks = 1 << 21;
+	block_store_t *bs = block_store_create_ex(blocks, (unsigned)state.range(0));
+	uint8_t block[BLOCK_SIZE_BYTES];
+	memset(block, 0x5A, sizeof(block));
+	for (size_t id = 0; id < blocks; id++)
+		if (block_store_request(bs, id))
+			block_store_write(bs, id, block);
+	state.SetLabel(block_store_get_backing(bs) == BLOCK_STORE_BACKING_HUGETLB ? "hugetlb"
+			: block_store_get_backing(bs) == BLOCK_STORE_BACKING_THP ? "thp" : "pages");
+	uint64_t x = 88172645463325252ull;
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		// xorshift, cheap enough not to drown out the read
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		benchmark::DoNotOptimize(block_store_read(bs, x & (blocks - 1), block));
+	}
+	hw.report(state);
+	state.SetBytesProcessed(state.iterations() * BLOCK_SIZE_BYTES);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_block_store_random_read)->Arg(0)->Arg(BLOCK_STORE_CREATE_HUGE_PAGES);
+
+static void BM_block_store_serialize(benchmark::State &state)
+{
+	block_store_t *bs = make_device(state.range(0));
+	fill_device(bs);
+	HwCounters hw;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(block_store_serialize(bs, "bench_image.bs"));
+	hw.report(state);
+	state.SetBytesProcessed(state.iterations() * BLOCK_STORE_NUM_BYTES);
+	block_store_destroy(bs);
+	unlink("bench_image.bs");
+}
+BENCHMARK(BM_block_store_serialize)->Arg(IN_MEMORY)->Arg(FILE_BACKED)->UseRealTime();
+
+static void BM_block_store_deserialize(benchmark::State &state)
+{
+	block_store_t *bs = make_device(IN_MEMORY);
+	fill_device(bs);
+	block_store_serialize(bs, "bench_image.bs");
+	block_store_destroy(bs);
+	HwCounters hw;
+	for (auto _ : state)
+	{
+		bs = block_store_deserialize("bench_image.bs");
+		benchmark::DoNotOptimize(bs);
+		block_store_destroy(bs);
+	}
+	hw.report(state);
+	state.SetBytesProcessed(state.iterations() * BLOCK_STORE_NUM_BYTES);
+	unlink("bench_image.bs");
+}
+BENCHMARK(BM_block_store_deserialize)->UseRealTime();
+
+int main(int argc, char **argv)
+{
+	// JSON by default, anything given on the command line wins
+	std::vector<char *> args(argv, argv + argc);
+	static char json[] = "--benchmark_format=json";
+	bool format_given = false;
+	for (int i = 1; i < argc; i++)
+		if (std::string(argv[i]).rfind("--benchmark_format", 0) == 0)
+			format_given = true;
+	if (!format_given)
+		args.insert(args.begin() + 1, json);
+	int count = (int)args.size();
+	::benchmark::Initialize(&count, args.data());
+	if (::benchmark::ReportUnrecognizedArguments(count, args.data()))
+		return 1;
+	::benchmark::RunSpecifiedBenchmarks();
+	::benchmark::Shutdown();
+	unlink("bench.bs");
+	return 0;
+}
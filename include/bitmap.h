@@ -12,6 +12,15 @@
 
 typedef struct bitmap bitmap_t;
 
+// Room for a bitmap_t inside something else, so the header needs no allocation of its own
+//  (see bitmap_overlay_at); treat it as opaque
+typedef union
+{
+	uint8_t bytes[48];
+	size_t align;
+	void *align_ptr;
+} bitmap_header_t;
+
 // WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
 // This was originally a high performance C++ library, so the C translation assumes you're using it right.
 
@@ -46,6 +55,33 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets bit in bitmap as one atomic step, for bits other threads or processes write
+///  at the same time (an overlay of MAP_SHARED memory, say): of everyone racing to set
+///  the same clear bit, exactly one gets true back
+/// Acquires: whatever the last bitmap_reset_atomic of the bit published is visible after
+/// (Compressed bitmaps can't be shared, so for them this is just a test and a set)
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return true if this call set it, false if it was set already
+///
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Clears bit in bitmap as one atomic step, releasing earlier writes to whoever sets it next
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+///
+void bitmap_reset_atomic(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Finds a clear bit and sets it, atomically, like bitmap_ffz then bitmap_test_and_set_atomic
+///  but without losing the bit to someone else in between
+/// \param bitmap The bitmap
+/// \return The bit this call set, SIZE_MAX if none are clear
+///
+size_t bitmap_ffz_claim_atomic(bitmap_t *const bitmap);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
@@ -72,6 +108,57 @@ size_t bitmap_ffz(const bitmap_t *const bitmap);
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+
+///
+/// Count the bits set in part of the bitmap
+/// \param bitmap the bitmap
+/// \param first First bit to count
+/// \param end One past the last bit to count
+/// \return the number of bits set in [first, end), 0 if that's empty or out of bounds
+///
+size_t bitmap_total_set_in(const bitmap_t *const bitmap, const size_t first, const size_t end);
+
+///
+/// Finds the first set bit at or after from, skipping 64 clear bits at a time
+/// \param bitmap The bitmap
+/// \param from Where to start looking
+/// \return The bit, SIZE_MAX if there are none (or from is past the end)
+///
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Finds the first clear bit at or after from, skipping 64 set bits at a time
+/// \param bitmap The bitmap
+/// \param from Where to start looking
+/// \return The bit, SIZE_MAX if there are none (or from is past the end)
+///
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// bitmap_next_set, but only looking at bits before end
+/// \param bitmap The bitmap
+/// \param from Where to start looking
+/// \param end One past the last bit to look at
+/// \return The bit, SIZE_MAX if there are none (or the range is empty or out of bounds)
+///
+size_t bitmap_next_set_in(const bitmap_t *const bitmap, const size_t from, const size_t end);
+
+///
+/// bitmap_next_zero, but only looking at bits before end
+/// \param bitmap The bitmap
+/// \param from Where to start looking
+/// \param end One past the last bit to look at
+/// \return The bit, SIZE_MAX if there are none (or the range is empty or out of bounds)
+///
+size_t bitmap_next_zero_in(const bitmap_t *const bitmap, const size_t from, const size_t end);
+
+///
+/// Loops bit (a size_t declared by the macro) over every set bit, in order
+///  for when a callback per bit is too much: BITMAP_FOR_EACH_SET(fbm, id) { ... }
+///
+#define BITMAP_FOR_EACH_SET(bitmap, bit) \
+	for (size_t bit = bitmap_next_set((bitmap), 0); bit != SIZE_MAX; bit = bitmap_next_set((bitmap), bit + 1))
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
@@ -81,6 +168,81 @@ size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+// Most bits bitmap_for_each_batch hands over at once
+#define BITMAP_BATCH_SIZE 256
+
+///
+/// For each loop for all set bits that hands them over in batches, in order
+///  (cost goes with the number of set bits, not the size of the bitmap)
+/// \param bitmap The bitmap
+/// \param func Gets an array of bit numbers, how many there are (up to BITMAP_BATCH_SIZE), and arg
+/// \param arg A generic pointer to pass to the called function
+///
+void bitmap_for_each_batch(const bitmap_t *const bitmap, void (*func)(const size_t *, size_t, void *), void *arg);
+
+///
+/// Calls func once for every maximal run of zero bits, in order
+///  (a single pass that looks at 64 bits at a time)
+/// \param bitmap The bitmap
+/// \param func Gets the first bit of the run, its length and arg
+/// \param arg A generic pointer to pass to the called function
+///
+void bitmap_for_each_zero_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg);
+
+///
+/// Finds the run of zero bits a bit sits in
+/// \param bitmap The bitmap
+/// \param bit The bit to look at
+/// \param start Set to the first bit of the run (if there is one), may be NULL
+/// \return Length of the run, 0 if the bit is set or out of range
+///
+size_t bitmap_zero_run_at(const bitmap_t *const bitmap, const size_t bit, size_t *const start);
+
+///
+/// dst = a & b, word by word. dst may be a or b to work in place
+///  (all three must be the same number of bits)
+/// \param dst Where the result goes
+/// \param a The first operand
+/// \param b The second operand
+/// \return true on success, false if the sizes don't match
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// dst = a | b, same rules as bitmap_and
+///
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// dst = a ^ b, same rules as bitmap_and
+///
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// dst = a & ~b (the bits set in a but not in b), same rules as bitmap_and
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// Counts the bits that differ between two bitmaps of the same size
+/// \param a The first bitmap
+/// \param b The second bitmap
+/// \return Number of differing bits, SIZE_MAX if the sizes don't match
+///
+size_t bitmap_diff_count(const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// Calls func for every bit that differs between two bitmaps of the same size, in order
+///  (64 bits at a time, so stretches that match cost next to nothing)
+/// \param a The first bitmap
+/// \param b The second bitmap
+/// \param func Gets the bit number, whether it's set in a, and arg
+/// \param arg A generic pointer to pass to the called function
+/// \return Number of differing bits, SIZE_MAX if the sizes don't match
+///
+size_t bitmap_diff_for_each(const bitmap_t *const a, const bitmap_t *const b,
+		void (*func)(size_t, bool, void *), void *arg);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -104,6 +266,13 @@ size_t bitmap_get_bits(const bitmap_t *const bitmap);
 ///
 size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 
+///
+/// Gets how much memory the bitmap's bits actually take up
+/// \param bitmap The bitmap
+/// \return bitmap_get_bytes for a flat bitmap, the containers and chunk table for a compressed one
+///
+size_t bitmap_get_resident_bytes(const bitmap_t *const bitmap);
+
 ///
 /// Creates a bitmap to contain n bits (zero initialized)
 /// \param n_bits
@@ -111,9 +280,22 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_create(const size_t n_bits);
 
+///
+/// Creates a compressed bitmap to contain n bits (zero initialized)
+/// Every bitmap_ call works on it the same as on a flat one, but each 64Ki-bit chunk
+///  is kept as nothing (all clear), an array of set bits, a list of runs (all set is one run)
+///  or plain words, whichever is smallest, so huge mostly-empty or mostly-full maps stay small
+/// Can't be overlaid; export flattens it (see bitmap_export)
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_compressed(const size_t n_bits);
+
 ///
 /// Gets pointer to the internal data for exporting
 /// Be sure to query the bit and byte size if it's unknown
+/// A compressed bitmap is flattened into a copy first; that copy doesn't follow later
+///  changes and is good until the next export or the bitmap's destruction
 /// \param bitmap The bitmap
 /// \return Pointer for writing
 ///
@@ -129,6 +311,14 @@ const uint8_t *bitmap_export(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 
+///
+/// bitmap_import, but into a compressed bitmap
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The (flat) data to import
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_import_compressed(const size_t n_bits, const void *const bitmap_data);
+
 ///
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
@@ -139,6 +329,17 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
+///
+/// bitmap_overlay, but the bitmap_t is set up in the caller's header rather than malloc'd
+/// Calling it again on the same header just points it somewhere else (nothing to destroy first),
+///  and bitmap_destroy frees neither the header nor the data
+/// \param header Where the bitmap_t goes, has to outlive it
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to use
+/// \return The bitmap (header, really), NULL on error
+///
+bitmap_t *bitmap_overlay_at(bitmap_header_t *const header, const size_t n_bits, void *const bitmap_data);
+
 ///
 /// Destructs and destroys bitmap object
 /// \param bitmap The bitmap
@@ -0,0 +1,262 @@
+#ifndef BITMAP_HPP__
+#define BITMAP_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include "bitmap.h"
+
+// The C++ side of bitmap.h, header-only.
+// hw3::bitmap<N> has its size baked in: the word count and the mask for the last word
+//  are constants, so for something like the 512-bit FBM every loop has a fixed trip count
+//  the compiler can unroll and no call goes through struct bitmap's pointers.
+// hw3::dynamic_bitmap owns a bitmap_t (flat or compressed) for when the size is only
+//  known at run time.
+// Both lay bits out the same way bitmap_t does (bit i in byte i / 8, bit i % 8), so the
+//  two can be handed back and forth with overlay()/load() and get()/export.
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "bitmap.hpp stores bits in 64-bit words, which only matches bitmap_t's bytes on little-endian machines"
+#endif
+
+namespace hw3
+{
+	template <std::size_t N>
+	class bitmap
+	{
+		static_assert(N > 0, "a bitmap needs at least one bit");
+
+		public:
+			static constexpr std::size_t bits = N;
+			static constexpr std::size_t words = (N + 63) / 64;
+			static constexpr std::size_t bytes = (N + 7) / 8;
+			static constexpr std::size_t leftover_bits = N % 64;
+			// Bits of the last word that are in the bitmap
+			static constexpr uint64_t last_mask = leftover_bits ? ((uint64_t)1 << leftover_bits) - 1 : ~(uint64_t)0;
+
+			constexpr bitmap() : w{} {}
+
+			constexpr void set(const std::size_t bit) { w[bit / 64] |= (uint64_t)1 << (bit % 64); }
+			constexpr void reset(const std::size_t bit) { w[bit / 64] &= ~((uint64_t)1 << (bit % 64)); }
+			constexpr void flip(const std::size_t bit) { w[bit / 64] ^= (uint64_t)1 << (bit % 64); }
+			constexpr bool test(const std::size_t bit) const { return (w[bit / 64] >> (bit % 64)) & 1; }
+
+			constexpr void invert()
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] = ~w[i];
+				w[words - 1] &= last_mask;
+			}
+
+			// Same as bitmap_format: every byte set to pattern
+			constexpr void format(const uint8_t pattern)
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] = pattern * (uint64_t)0x0101010101010101;
+				w[words - 1] &= last_mask;
+			}
+
+			constexpr std::size_t total_set() const
+			{
+				std::size_t total = 0;
+				for (std::size_t i = 0; i < words; i++)
+					total += (std::size_t)__builtin_popcountll(word(i));
+				return total;
+			}
+
+			constexpr bool none() const
+			{
+				uint64_t any = 0;
+				for (std::size_t i = 0; i < words; i++)
+					any |= word(i);
+				return !any;
+			}
+
+			constexpr bool all() const { return ffz() == SIZE_MAX; }
+
+			/// \return First set bit at or after from, SIZE_MAX if there isn't one
+			constexpr std::size_t next_set(const std::size_t from) const
+			{
+				if (from >= N)
+					return SIZE_MAX;
+				std::size_t i = from / 64;
+				uint64_t x = word(i) & (~(uint64_t)0 << (from % 64));
+				while (!x && ++i < words)
+					x = word(i);
+				return x ? i * 64 + (std::size_t)__builtin_ctzll(x) : SIZE_MAX;
+			}
+
+			/// \return First clear bit at or after from, SIZE_MAX if there isn't one
+			constexpr std::size_t next_zero(const std::size_t from) const
+			{
+				if (from >= N)
+					return SIZE_MAX;
+				std::size_t i = from / 64;
+				uint64_t x = ~word_or_padding(i) & (~(uint64_t)0 << (from % 64));
+				while (!x && ++i < words)
+					x = ~word_or_padding(i);
+				return x ? i * 64 + (std::size_t)__builtin_ctzll(x) : SIZE_MAX;
+			}
+
+			constexpr std::size_t ffs() const { return next_set(0); }
+			constexpr std::size_t ffz() const { return next_zero(0); }
+
+			/// Calls func(bit) for every set bit, in order
+			template <typename F>
+			constexpr void for_each(F &&func) const
+			{
+				for (std::size_t i = 0; i < words; i++)
+					for (uint64_t x = word(i); x; x &= x - 1)
+						func(i * 64 + (std::size_t)__builtin_ctzll(x));
+			}
+
+			constexpr bitmap &operator&=(const bitmap &other)
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] &= other.w[i];
+				return *this;
+			}
+
+			constexpr bitmap &operator|=(const bitmap &other)
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] |= other.w[i];
+				return *this;
+			}
+
+			constexpr bitmap &operator^=(const bitmap &other)
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] ^= other.w[i];
+				return *this;
+			}
+
+			/// Clears every bit set in other (bitmap_andnot)
+			constexpr bitmap &andnot(const bitmap &other)
+			{
+				for (std::size_t i = 0; i < words; i++)
+					w[i] &= ~other.w[i];
+				return *this;
+			}
+
+			constexpr bool operator==(const bitmap &other) const
+			{
+				uint64_t diff = 0;
+				for (std::size_t i = 0; i < words; i++)
+					diff |= word(i) ^ other.word(i);
+				return !diff;
+			}
+
+			constexpr bool operator!=(const bitmap &other) const { return !(*this == other); }
+
+			/// \return Bits that differ between the two
+			constexpr std::size_t diff_count(const bitmap &other) const
+			{
+				std::size_t total = 0;
+				for (std::size_t i = 0; i < words; i++)
+					total += (std::size_t)__builtin_popcountll(word(i) ^ other.word(i));
+				return total;
+			}
+
+			/// Raw bits, laid out the way bitmap_export's are
+			const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(w); }
+			uint8_t *data() { return reinterpret_cast<uint8_t *>(w); }
+
+			/// A bitmap_t over this bitmap's own bits (see bitmap_overlay); changes show up on
+			///  both sides. Destroy it before this goes away
+			/// \return The overlay, NULL on error
+			bitmap_t *overlay() { return bitmap_overlay(N, w); }
+
+			/// Copies the bits out of a bitmap_t (flat or compressed) of the same size
+			/// \return false (and no change) if the sizes don't match or it can't be exported
+			bool load(const bitmap_t *const other)
+			{
+				const uint8_t *src = other && bitmap_get_bits(other) == N ? bitmap_export(other) : nullptr;
+				if (!src)
+					return false;
+				std::memcpy(w, src, bytes);
+				return true;
+			}
+
+		private:
+			// The spare bits past N are whatever a C call through an overlay left there
+			//  (bitmap_invert flips them, say), so they're masked off whenever it matters.
+			//  i is a loop counter with a fixed range, so this folds away everywhere but the last word
+			constexpr uint64_t word(const std::size_t i) const
+			{
+				return i == words - 1 ? w[i] & last_mask : w[i];
+			}
+
+			// Spare bits at the end read as set, so they never turn up as free
+			constexpr uint64_t word_or_padding(const std::size_t i) const
+			{
+				return i == words - 1 ? w[i] | ~last_mask : w[i];
+			}
+
+			uint64_t w[words];
+	};
+
+	// Owns a bitmap_t, flat or compressed, sized at run time
+	class dynamic_bitmap
+	{
+		public:
+			explicit dynamic_bitmap(const std::size_t n_bits, const bool compressed = false)
+				: b(compressed ? bitmap_create_compressed(n_bits) : bitmap_create(n_bits)) {}
+
+			/// Takes ownership of a bitmap_t (from bitmap_import and friends)
+			explicit dynamic_bitmap(bitmap_t *const owned) : b(owned) {}
+
+			/// Copies a fixed-size bitmap
+			template <std::size_t N>
+			explicit dynamic_bitmap(const bitmap<N> &other, const bool compressed = false)
+				: b(compressed ? bitmap_import_compressed(N, other.data()) : bitmap_import(N, other.data())) {}
+
+			dynamic_bitmap(dynamic_bitmap &&other) noexcept : b(other.b) { other.b = nullptr; }
+			dynamic_bitmap &operator=(dynamic_bitmap &&other) noexcept
+			{
+				std::swap(b, other.b);
+				return *this;
+			}
+			dynamic_bitmap(const dynamic_bitmap &) = delete;
+			dynamic_bitmap &operator=(const dynamic_bitmap &) = delete;
+			~dynamic_bitmap() { bitmap_destroy(b); }
+
+			/// false if creating it failed
+			explicit operator bool() const { return b != nullptr; }
+			bitmap_t *get() { return b; }
+			const bitmap_t *get() const { return b; }
+
+			std::size_t size() const { return bitmap_get_bits(b); }
+			void set(const std::size_t bit) { bitmap_set(b, bit); }
+			void reset(const std::size_t bit) { bitmap_reset(b, bit); }
+			void flip(const std::size_t bit) { bitmap_flip(b, bit); }
+			bool test(const std::size_t bit) const { return bitmap_test(b, bit); }
+			void invert() { bitmap_invert(b); }
+			void format(const uint8_t pattern) { bitmap_format(b, pattern); }
+			std::size_t total_set() const { return bitmap_total_set(b); }
+			std::size_t next_set(const std::size_t from) const { return bitmap_next_set(b, from); }
+			std::size_t next_zero(const std::size_t from) const { return bitmap_next_zero(b, from); }
+			std::size_t ffs() const { return bitmap_ffs(b); }
+			std::size_t ffz() const { return bitmap_ffz(b); }
+			std::size_t diff_count(const dynamic_bitmap &other) const { return bitmap_diff_count(b, other.b); }
+
+			/// Calls func(bit) for every set bit, in order
+			template <typename F>
+			void for_each(F &&func) const
+			{
+				BITMAP_FOR_EACH_SET(b, bit)
+					func(bit);
+			}
+
+			/// Copies the bits into a fixed-size bitmap
+			/// \return false if the sizes don't match
+			template <std::size_t N>
+			bool store(bitmap<N> &out) const { return out.load(b); }
+
+		private:
+			bitmap_t *b;
+	};
+}
+
+#endif
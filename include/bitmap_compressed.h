@@ -0,0 +1,109 @@
+#ifndef BITMAP_COMPRESSED_H__
+#define BITMAP_COMPRESSED_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// The storage behind bitmap_create_compressed; bitmap.c is the only caller.
+// Bits are grouped into chunks of 64Ki and each chunk keeps whichever container
+//  is smallest for what's in it (roaring bitmap style):
+//   nothing at all for a chunk with no bits set,
+//   a sorted array of offsets while there are only a few bits set,
+//   a sorted list of runs when the set bits come in long stretches (a full chunk is one run),
+//   plain words otherwise.
+// Containers switch as bits come and go, with some slack either way so a bit going back
+//  and forth doesn't convert the chunk every time.
+// Bits past the end of the last chunk are always clear.
+
+#define COMPRESSED_CHUNK_BITS ((size_t) 1 << 16)
+#define COMPRESSED_CHUNK_WORDS (COMPRESSED_CHUNK_BITS / 64)
+
+typedef struct compressed compressed_t;
+
+///
+/// \param bits How many bits, all clear to start with
+/// \return New storage, NULL on error
+///
+compressed_t *compressed_create(const size_t bits);
+
+///
+/// \param bits How many bits
+/// \param data Flat bitmap (bit i in byte i / 8, bit i % 8) to copy them from
+/// \return New storage, NULL on error
+///
+compressed_t *compressed_import(const size_t bits, const uint8_t *const data);
+
+void compressed_destroy(compressed_t *const c);
+
+///
+/// Sets a bit. If a container can't grow, says so on stderr and leaves the bit alone
+///
+void compressed_set(compressed_t *const c, const size_t bit);
+void compressed_reset(compressed_t *const c, const size_t bit);
+bool compressed_test(const compressed_t *const c, const size_t bit);
+
+///
+/// \return First bit in [from, end) that is set (or clear, going by value), end if there isn't one
+///
+size_t compressed_next(const compressed_t *const c, const size_t from, const size_t end, const bool value);
+
+///
+/// \return Last set bit before bit, SIZE_MAX if there isn't one
+///
+size_t compressed_prev_set(const compressed_t *const c, const size_t bit);
+
+///
+/// \return Bits set in [first, end)
+///
+size_t compressed_count(const compressed_t *const c, const size_t first, const size_t end);
+
+void compressed_invert(compressed_t *const c);
+
+///
+/// Sets every byte's worth of bits to pattern
+///
+void compressed_fill(compressed_t *const c, const uint8_t pattern);
+
+///
+/// \return 0 if nothing in the chunk is set, 1 if all of it is, -1 for anything in between
+///
+int compressed_chunk_uniform(const compressed_t *const c, const size_t chunk);
+
+///
+/// Clears or sets a whole chunk
+///
+void compressed_fill_chunk(compressed_t *const c, const size_t chunk, const bool value);
+
+///
+/// Writes a chunk out as COMPRESSED_CHUNK_WORDS words (bit i in words[i / 64], bit i % 64)
+///
+void compressed_load_chunk(const compressed_t *const c, const size_t chunk, uint64_t *const words);
+
+///
+/// Replaces a chunk with the given words, picking the best container for them
+///  (bits past the end are cleared in words first)
+/// \return false (and no change) if there wasn't the memory
+///
+bool compressed_store_chunk(compressed_t *const c, const size_t chunk, uint64_t *const words);
+
+///
+/// Flattens everything into a buffer of (bits + 7) / 8 bytes
+/// \return The buffer, good until the next export or destroy; NULL on error
+///
+const uint8_t *compressed_export(compressed_t *const c);
+
+///
+/// \return Bytes of memory the containers and chunk table take up
+///
+size_t compressed_resident_bytes(const compressed_t *const c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
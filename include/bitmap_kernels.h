@@ -0,0 +1,49 @@
+#ifndef BITMAP_KERNELS_H__
+#define BITMAP_KERNELS_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Whole-buffer loops behind bitmap_total_set and bitmap_invert.
+// There's a portable byte-at-a-time version and, on x86, SSE2/AVX2/AVX-512 ones;
+//  bitmap_kernels() picks the best one the CPU can run the first time it's called.
+
+typedef enum
+{
+	BITMAP_KERNELS_SCALAR,
+	BITMAP_KERNELS_SSE2,
+	BITMAP_KERNELS_AVX2,
+	BITMAP_KERNELS_AVX512,  // needs VPOPCNTDQ
+	BITMAP_KERNELS_COUNT
+} BITMAP_KERNELS;
+
+typedef struct
+{
+	const char *name;
+	/// \return Bits set in len bytes of data
+	size_t (*popcount)(const uint8_t *data, size_t len);
+	/// Flips every bit in len bytes of data
+	void (*invert)(uint8_t *data, size_t len);
+} bitmap_kernels_t;
+
+///
+/// \return The fastest set of kernels this CPU supports
+///
+const bitmap_kernels_t *bitmap_kernels(void);
+
+///
+/// Gets one set of kernels in particular (for tests and benchmarks)
+/// \param which The set to get
+/// \return The kernels, NULL if this build or CPU can't run them
+///
+const bitmap_kernels_t *bitmap_kernels_for(const BITMAP_KERNELS which);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
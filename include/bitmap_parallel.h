@@ -0,0 +1,81 @@
+#ifndef BITMAP_PARALLEL_H__
+#define BITMAP_PARALLEL_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdlib.h>
+#include "bitmap.h"
+
+// Whole-bitmap scans split across a pool of threads, for bitmaps big enough
+//  (billions of bits) that one core walking the word array is the bottleneck.
+// The bitmap is cut into chunks of BITMAP_PARALLEL_CHUNK_BITS that the threads
+//  claim in order; anything smaller than two chunks is just done on the caller's thread.
+// The bitmap must not change while a scan is running.
+
+// Bits per unit of work (32 KiB of bitmap)
+#define BITMAP_PARALLEL_CHUNK_BITS ((size_t) 1 << 18)
+
+typedef struct bitmap_pool bitmap_pool_t;
+
+///
+/// Starts a pool of threads for the parallel scans
+/// \param threads How many threads take part in a scan, counting the caller's; 0 for one per online CPU
+/// \return New pool, NULL on error
+///
+bitmap_pool_t *bitmap_pool_create(const unsigned threads);
+
+///
+/// \return How many threads take part in a scan (the size for bitmap_for_each_parallel's contexts), 1 for NULL
+///
+unsigned bitmap_pool_threads(const bitmap_pool_t *const pool);
+
+///
+/// Stops the threads and frees the pool
+///
+void bitmap_pool_destroy(bitmap_pool_t *const pool);
+
+///
+/// bitmap_total_set, with the counting spread over the pool
+/// \param bitmap The bitmap
+/// \param pool Threads to use, NULL to do it all on this one
+/// \return The total number of bits set
+///
+size_t bitmap_total_set_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool);
+
+///
+/// bitmap_ffs, with the search spread over the pool
+///  Threads stop picking up chunks past the best hit so far
+/// \param bitmap The bitmap
+/// \param pool Threads to use, NULL to do it all on this one
+/// \return The first set bit, SIZE_MAX if there are none
+///
+size_t bitmap_ffs_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool);
+
+///
+/// bitmap_ffz, with the search spread over the pool
+/// \param bitmap The bitmap
+/// \param pool Threads to use, NULL to do it all on this one
+/// \return The first zero bit, SIZE_MAX if there are none
+///
+size_t bitmap_ffz_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool);
+
+///
+/// bitmap_for_each, with the bits spread over the pool
+///  Each thread hands func its own context, so there's nothing to lock if every
+///  context is only ever touched by its thread; merge them afterwards.
+///  Bits come in order within a chunk, but chunks run concurrently.
+/// \param bitmap The bitmap
+/// \param pool Threads to use, NULL to do it all on this one
+/// \param func The function to call with every set bit and the calling thread's context
+/// \param contexts bitmap_pool_threads(pool) of them, the first used by the caller's thread (may be NULL)
+///
+void bitmap_for_each_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool,
+		void (*func)(size_t, void *), void *const *contexts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
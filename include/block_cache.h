@@ -0,0 +1,129 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+#include "bitmap.h"
+
+	// Write-back buffer cache over a file of fixed-size blocks.
+	// A bounded number of frames are resident; CLOCK picks who gets evicted,
+	//  and dirty frames are written out on eviction or flush.
+	// Sequential reads are detected and the next window is prefetched asynchronously.
+	// This is what lets file-backed block stores be bigger than memory.
+	typedef struct block_cache block_cache_t;
+
+	// A batch of dirty frames copied out for writing back without holding whatever
+	//  guards the cache. Its frames stay pinned (and dirty) until the batch ends.
+	typedef struct block_cache_wb block_cache_wb_t;
+
+	///
+	/// Creates a cache of capacity frames over fd
+	/// \param fd File the blocks live in (not owned)
+	/// \param block_size Bytes per block
+	/// \param capacity Number of resident frames, must be non-zero
+	/// \param num_blocks Blocks in the file (readahead stops there)
+	/// \return New cache, NULL on error
+	///
+	block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t capacity,
+			const size_t num_blocks);
+
+	///
+	/// Copies a block out, faulting it in if it isn't resident
+	/// \return true on success
+	///
+	bool block_cache_read(block_cache_t *const cache, const size_t block_id, void *buffer);
+
+	///
+	/// Overwrites a whole block in the cache and marks it dirty (no read needed)
+	/// \return true on success
+	///
+	bool block_cache_write(block_cache_t *const cache, const size_t block_id, const void *buffer);
+
+	///
+	/// Starts async fills for the non-resident blocks in [first, first + count)
+	///  (capped at half the cache so a hint can't push out its own work)
+	/// \return Number of fills started
+	///
+	size_t block_cache_prefetch(block_cache_t *const cache, const size_t first, const size_t count);
+
+	///
+	/// Caps the readahead window (0 turns sequential readahead off)
+	///
+	void block_cache_set_readahead(block_cache_t *const cache, const size_t max_window);
+
+	///
+	/// Keeps prefetch and readahead away from the blocks set in skip, whose newest copy
+	///  isn't in the file (the bitmap stays the caller's and is only read under its lock)
+	/// \param skip Blocks never to fill in the background, NULL for none
+	///
+	void block_cache_set_skip(block_cache_t *const cache, const bitmap_t *const skip);
+
+	///
+	/// Copies a block out only if it's already resident; touches no counters or reference bits
+	/// \return true if the block was resident
+	///
+	bool block_cache_peek(const block_cache_t *const cache, const size_t block_id, void *buffer);
+
+	///
+	/// Drops a block from the cache without writing it back
+	///
+	void block_cache_invalidate(block_cache_t *const cache, const size_t block_id);
+
+	///
+	/// Writes back every dirty frame (they stay resident)
+	/// \return true if everything made it out
+	///
+	bool block_cache_flush(block_cache_t *const cache);
+
+	///
+	/// \return Number of dirty frames
+	///
+	size_t block_cache_dirty(const block_cache_t *const cache);
+
+	///
+	/// \return When the oldest dirty frame was first dirtied (CLOCK_MONOTONIC ns), 0 if none are
+	///
+	uint64_t block_cache_oldest_dirty(const block_cache_t *const cache);
+
+	///
+	/// Pins up to max_frames dirty frames and copies them out in block order
+	/// \return The batch, NULL if nothing was dirty or on error
+	///
+	block_cache_wb_t *block_cache_writeback_begin(block_cache_t *const cache, const size_t max_frames);
+
+	///
+	/// Writes a batch out, merging adjacent blocks into single writes
+	///  Touches only the batch, so the cache may be in use meanwhile
+	/// \return true if every write made it
+	///
+	bool block_cache_writeback_run(block_cache_wb_t *const wb);
+
+	///
+	/// Unpins a batch and frees it; frames nobody wrote to since begin are clean now if ok
+	/// \return Number of frames cleaned
+	///
+	size_t block_cache_writeback_end(block_cache_t *const cache, block_cache_wb_t *const wb, const bool ok);
+
+	///
+	/// Fills in hit/miss/eviction/writeback counters and occupancy
+	///
+	void block_cache_get_stats(const block_cache_t *const cache, block_store_cache_stats_t *const stats);
+
+	///
+	/// Flushes and frees the cache
+	/// \return true if the final flush made it out
+	///
+	bool block_cache_destroy(block_cache_t *const cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef BLOCK_IO_H__
+#define BLOCK_IO_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+	// Asynchronous positional I/O against a single file descriptor.
+	// Requests go through io_uring when the kernel lets us have one, otherwise
+	//  a small pool of threads doing pread/pwrite stands in for it.
+	// Either way, completion callbacks only ever run inside block_io_poll
+	//  (or a submit that had to make room), on the caller's thread.
+	// Submissions to the ring are batched: they reach the kernel in one io_uring_enter
+	//  at the next poll, flush or block_io_submit_pending, or once enough have queued up.
+	typedef struct block_io block_io_t;
+
+	///
+	/// Completion callback
+	/// \param arg The pointer given at submission
+	/// \param result Bytes transferred (0 for a flush) or a negative errno
+	///
+	typedef void (*block_io_callback_t)(void *arg, ssize_t result);
+
+	typedef enum {
+		BLOCK_IO_BACKEND_URING,
+		BLOCK_IO_BACKEND_THREADS
+	} block_io_backend_t;
+
+	///
+	/// Creates an I/O engine for the given descriptor
+	/// Setting BLOCK_IO_BACKEND=threads in the environment skips io_uring
+	/// \param fd Open file descriptor (not owned, not closed on destroy)
+	/// \param depth Maximum number of outstanding requests
+	/// \return New engine, NULL on error
+	///
+	block_io_t *block_io_create(const int fd, const unsigned depth);
+
+	///
+	/// Queues a read of len bytes at offset into buf
+	/// If the queue is full, this reaps completions (running their callbacks) first
+	/// \return true if the request was queued
+	///
+	bool block_io_submit_read(block_io_t *const io, void *buf, const size_t len, const off_t offset,
+			block_io_callback_t cb, void *arg);
+
+	///
+	/// Queues a write of len bytes from buf at offset
+	/// buf must stay valid until the callback runs
+	/// \return true if the request was queued
+	///
+	bool block_io_submit_write(block_io_t *const io, const void *buf, const size_t len, const off_t offset,
+			block_io_callback_t cb, void *arg);
+
+	///
+	/// Queues an fdatasync that starts after everything queued before it has completed
+	/// \return true if the request was queued
+	///
+	bool block_io_submit_flush(block_io_t *const io, block_io_callback_t cb, void *arg);
+
+	///
+	/// Delivers completions, blocking until at least min_complete have been delivered
+	///  (or nothing is left in flight)
+	/// \param io The engine
+	/// \param min_complete Completions to wait for, 0 to only reap what is ready
+	/// \return Number of callbacks run
+	///
+	size_t block_io_poll(block_io_t *const io, const size_t min_complete);
+
+	///
+	/// Hands everything queued so far to the kernel now, in one go, rather than at the next poll
+	///  (for when the caller has other work to get on with before polling)
+	/// \param io The engine
+	///
+	void block_io_submit_pending(block_io_t *const io);
+
+	///
+	/// \return Requests submitted but not yet delivered through poll
+	///
+	size_t block_io_inflight(const block_io_t *const io);
+
+	///
+	/// \return Which backend the engine ended up with
+	///
+	block_io_backend_t block_io_backend(const block_io_t *const io);
+
+	///
+	/// Synchronous pread that doesn't give up on short reads or EINTR
+	/// \return true if all len bytes were read
+	///
+	bool block_io_pread(const int fd, void *buf, const size_t len, const off_t offset);
+
+	///
+	/// Synchronous pwrite that doesn't give up on short writes or EINTR
+	/// \return true if all len bytes were written
+	///
+	bool block_io_pwrite(const int fd, const void *buf, const size_t len, const off_t offset);
+
+	///
+	/// Waits for everything in flight (running callbacks), then tears the engine down
+	/// \param io The engine
+	///
+	void block_io_destroy(block_io_t *const io);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
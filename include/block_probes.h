@@ -0,0 +1,40 @@
+#ifndef BLOCK_PROBES_H__
+#define BLOCK_PROBES_H__
+
+// USDT (SystemTap-style) static probes for attaching bpftrace/perf/stap to a live process:
+//   bpftrace -e 'usdt:./libblock_store.so:block_store:read_return { @[arg2] = count(); }'
+// Each one is a single nop in the code and a note in the ELF until something attaches.
+// Without <sys/sdt.h> (or with BLOCK_STORE_NO_PROBES defined) they compile to nothing.
+//
+// Provider "block_store", probes and arguments:
+//   allocate_entry(bs)                  allocate_return(bs, block_id)      block_id SIZE_MAX on failure
+//   release_entry(bs, block_id)         release_return(bs, block_id)
+//   read_entry(bs, block_id)            read_return(bs, block_id, bytes)   bytes 0 on failure
+//   write_entry(bs, block_id)           write_return(bs, block_id, bytes)  bytes 0 on failure
+//   serialize_entry(bs)                 serialize_return(bs, bytes)
+//   serialize_io(bs, offset, len, result)      one per write in the serialize loop
+//   deserialize_entry()                 deserialize_return(bs)             bs NULL on failure
+//   deserialize_io(offset, len, result)        one per read in the deserialize loop
+
+#if !defined(BLOCK_STORE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BLOCK_STORE_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef BLOCK_STORE_HAVE_PROBES
+#define BLOCK_PROBE0(name) STAP_PROBE(block_store, name)
+#define BLOCK_PROBE1(name, a) STAP_PROBE1(block_store, name, a)
+#define BLOCK_PROBE2(name, a, b) STAP_PROBE2(block_store, name, a, b)
+#define BLOCK_PROBE3(name, a, b, c) STAP_PROBE3(block_store, name, a, b, c)
+#define BLOCK_PROBE4(name, a, b, c, d) STAP_PROBE4(block_store, name, a, b, c, d)
+#else
+#define BLOCK_PROBE0(name) do {} while (0)
+#define BLOCK_PROBE1(name, a) do {} while (0)
+#define BLOCK_PROBE2(name, a, b) do {} while (0)
+#define BLOCK_PROBE3(name, a, b, c) do {} while (0)
+#define BLOCK_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
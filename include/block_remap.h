@@ -0,0 +1,97 @@
+#ifndef BLOCK_REMAP_H__
+#define BLOCK_REMAP_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bitmap.h"
+
+	// Logical to physical block translation for compaction.
+	// Callers keep using the ids they were given (logical, what the FBM tracks);
+	//  the remap says which physical slot holds each one, so blocks can be moved
+	//  around underneath them to pack the used slots together.
+	// A range of pinned blocks (the FBM itself) always stays where it is.
+	// Not thread-safe, whoever guards the FBM guards this too.
+	typedef struct block_remap block_remap_t;
+
+	///
+	/// Starts out as the identity for every block set in fbm
+	/// \param fbm Logical allocation map
+	/// \param pinned_first First block that may never move
+	/// \param pinned_count How many blocks from there may never move
+	/// \return New remap, NULL on error
+	///
+	block_remap_t *block_remap_create(const bitmap_t *const fbm, const size_t pinned_first, const size_t pinned_count);
+
+	///
+	/// \return Physical slot holding a logical block, SIZE_MAX if it has none
+	///
+	size_t block_remap_lookup(const block_remap_t *const remap, const size_t logical);
+
+	///
+	/// Gives a newly allocated logical block the lowest free physical slot
+	/// \return The slot, SIZE_MAX if it already had one or there are none
+	///
+	size_t block_remap_assign(block_remap_t *const remap, const size_t logical);
+
+	///
+	/// Frees a logical block's physical slot
+	///
+	void block_remap_unassign(block_remap_t *const remap, const size_t logical);
+
+	///
+	/// Brings the remap in line with an FBM that changed wholesale: allocated blocks
+	///  without a slot get one, slots of blocks no longer allocated are freed
+	/// \param remap The remap
+	/// \param fbm Logical allocation map
+	///
+	void block_remap_sync(block_remap_t *const remap, const bitmap_t *const fbm);
+
+	///
+	/// Changes how many blocks there are; new slots come in free
+	///  Shrinking needs both the ids and the slots being cut off to be unused
+	/// \param remap The remap
+	/// \param num_blocks New block count
+	/// \return true on success, false (and no change) if something is in the way or on error
+	///
+	bool block_remap_resize(block_remap_t *const remap, const size_t num_blocks);
+
+	///
+	/// Picks the next move that packs things tighter: the lowest used slot above the lowest
+	///  free one moves into it, so blocks keep their relative order as they slide down
+	/// \param remap The remap
+	/// \param from Slot to copy out of
+	/// \param to Slot to copy into
+	/// \return false once nothing is left to move
+	///
+	bool block_remap_next_move(block_remap_t *const remap, size_t *const from, size_t *const to);
+
+	///
+	/// Records that the data in slot from has been copied to slot to
+	///
+	void block_remap_moved(block_remap_t *const remap, const size_t from, const size_t to);
+
+	///
+	/// \return Slots in the longest run of free physical slots
+	///
+	size_t block_remap_largest_free(const block_remap_t *const remap);
+
+	///
+	/// \return Which physical slots are in use
+	///
+	const bitmap_t *block_remap_used(const block_remap_t *const remap);
+
+	///
+	/// Frees the remap
+	///
+	void block_remap_destroy(block_remap_t *const remap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
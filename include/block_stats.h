@@ -0,0 +1,90 @@
+#ifndef BLOCK_STATS_H__
+#define BLOCK_STATS_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// Per-operation call/failure/byte counters and log2 latency histograms.
+	// Counters are striped across cache-line-aligned slots picked per thread, so
+	//  threads hammering the same store don't bounce one line between them.
+	// Building without BLOCK_STORE_STATS turns every call here into nothing.
+	typedef struct block_stats block_stats_t;
+
+	// What block_stats_begin notes down for block_stats_end
+	typedef struct {
+		uint64_t start;
+		bool hw;
+		uint64_t hw_start[BLOCK_STORE_HW_COUNT];
+	} block_stats_probe_t;
+
+#ifdef BLOCK_STORE_STATS
+
+	///
+	/// \return Fresh zeroed counters (sampling hardware counters if BLOCK_STORE_PERF is set), NULL on error
+	///
+	block_stats_t *block_stats_create(void);
+
+	///
+	/// \return Counters for calls that have no device to count against (a failed
+	///  block_store_deserialize), made on first use and kept until exit; NULL on error
+	///
+	block_stats_t *block_stats_process(void);
+
+	///
+	/// Notes the time (and hardware counters, if sampling) at the start of a call
+	/// \param stats Counters, NULL just takes the time
+	/// \param probe Filled in for block_stats_end
+	///
+	void block_stats_begin(const block_stats_t *const stats, block_stats_probe_t *const probe);
+
+	///
+	/// Counts one call of op
+	/// \param stats Counters, NULL is ignored
+	/// \param op Which operation
+	/// \param probe From block_stats_begin
+	/// \param ok Whether the call succeeded
+	/// \param bytes Bytes moved by the call
+	///
+	void block_stats_end(block_stats_t *const stats, const block_store_op_t op, const block_stats_probe_t *const probe,
+			const bool ok, const size_t bytes);
+
+	///
+	/// Turns hardware counter sampling on or off
+	/// \return false if turning it on and the calling thread has no counters
+	///
+	bool block_stats_set_hw(block_stats_t *const stats, const bool enabled);
+
+	///
+	/// Sums the stripes and works out the percentiles
+	///
+	void block_stats_collect(const block_stats_t *const stats, block_store_stats_t *const out);
+
+	///
+	/// Frees the counters
+	///
+	void block_stats_destroy(block_stats_t *const stats);
+
+#else
+
+	static inline block_stats_t *block_stats_create(void) { return NULL; }
+	static inline block_stats_t *block_stats_process(void) { return NULL; }
+	static inline void block_stats_begin(const block_stats_t *const stats, block_stats_probe_t *const probe) { (void)stats; (void)probe; }
+	static inline void block_stats_end(block_stats_t *const stats, const block_store_op_t op, const block_stats_probe_t *const probe,
+			const bool ok, const size_t bytes) { (void)stats; (void)op; (void)probe; (void)ok; (void)bytes; }
+	static inline bool block_stats_set_hw(block_stats_t *const stats, const bool enabled) { (void)stats; (void)enabled; return false; }
+	static inline void block_stats_collect(const block_stats_t *const stats, block_store_stats_t *const out) { (void)stats; (void)out; }
+	static inline void block_stats_destroy(block_stats_t *const stats) { (void)stats; }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,8 +6,10 @@ extern "C"
 {
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 	// Constants
 #define BLOCK_STORE_NUM_BLOCKS 512        // 2^9 data block
@@ -24,12 +26,150 @@ extern "C"
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// Slots for many small in-memory devices, see block_store_pool_create
+	typedef struct block_store_pool block_store_pool_t;
+
+	// Flags for block_store_open
+#define BLOCK_STORE_OPEN_CREATE 0x01        // make a fresh device if the file is missing or empty
+#define BLOCK_STORE_OPEN_JOURNAL 0x02       // log updates to <filename>.wal and group-commit them
+
+	// Flags for block_store_create_ex
+#define BLOCK_STORE_CREATE_THIN 0x01        // only keep memory for pages that hold written, allocated blocks
+#define BLOCK_STORE_CREATE_HUGE_PAGES 0x02  // back device memory with huge pages (see block_store_get_backing)
+
+	// What a device's blocks live in
+	typedef enum {
+		BLOCK_STORE_BACKING_NONE,     // no device
+		BLOCK_STORE_BACKING_PAGES,    // ordinary pages
+		BLOCK_STORE_BACKING_THP,      // transparent huge pages were asked for (the kernel may still use small ones)
+		BLOCK_STORE_BACKING_HUGETLB,  // explicit huge pages from the hugetlb pool
+		BLOCK_STORE_BACKING_FILE,     // a file, see block_store_open
+		BLOCK_STORE_BACKING_POOL,     // a slot of a pool, see block_store_create_pooled
+		BLOCK_STORE_BACKING_SHARED,   // POSIX shared memory, see block_store_create_shared
+	} block_store_backing_t;
+
+	///
+	/// Completion callback for the async block API
+	/// \param block_id The block the request was for (SIZE_MAX for a flush)
+	/// \param success Whether the whole block made it
+	/// \param arg The pointer given at submission
+	///
+	typedef void (*block_store_callback_t)(size_t block_id, bool success, void *arg);
+
+	// Buffer cache counters for file-backed devices
+	typedef struct {
+		size_t hits;        // lookups served from memory
+		size_t misses;      // lookups that had to claim a frame
+		size_t evictions;   // frames taken back for another block
+		size_t writebacks;  // dirty frames written to the file
+		size_t resident;    // frames currently holding a block
+		size_t capacity;    // frames in total
+		size_t prefetched;        // async fills started by readahead or hints
+		size_t prefetch_hits;     // prefetched blocks that were read before eviction
+		size_t prefetch_wasted;   // prefetched blocks evicted unread
+		size_t readahead_window;  // current sequential window, 0 if readahead is off
+		size_t dirty;             // frames with changes the file doesn't have yet
+		size_t flush_writes;      // write calls the background writer needed (adjacent blocks merge)
+	} block_store_cache_stats_t;
+
+	// When the background writer of a file-backed device kicks in
+	typedef struct {
+		size_t dirty_blocks;  // start writing back once this many blocks are dirty
+		size_t dirty_bytes;   // ...or this many bytes are
+		unsigned max_age_ms;  // ...or the oldest change is this old
+		size_t limit_blocks;  // writers wait for the flusher past this many dirty blocks (0 = twice dirty_blocks)
+	} block_store_flush_policy_t;
+
+	// Write-ahead journal counters for devices opened with BLOCK_STORE_OPEN_JOURNAL
+	typedef struct {
+		size_t commits;      // groups made durable (one fdatasync each)
+		size_t records;      // block after-images those groups carried
+		size_t checkpoints;  // times the log was folded into the image and emptied
+		size_t replayed;     // groups recovered from the log at open
+		size_t log_bytes;    // current size of the log file
+	} block_store_journal_stats_t;
+
+	// Operations block_store_get_stats keeps counters for
+	typedef enum {
+		BLOCK_STORE_OP_ALLOCATE,
+		BLOCK_STORE_OP_REQUEST,
+		BLOCK_STORE_OP_RELEASE,
+		BLOCK_STORE_OP_READ,
+		BLOCK_STORE_OP_WRITE,
+		BLOCK_STORE_OP_SERIALIZE,
+		BLOCK_STORE_OP_DESERIALIZE,
+		BLOCK_STORE_OP_COUNT
+	} block_store_op_t;
+
+	// Hardware counters that can be attributed to operations (see block_store_set_hw_counters)
+	typedef enum {
+		BLOCK_STORE_HW_CYCLES,
+		BLOCK_STORE_HW_INSTRUCTIONS,
+		BLOCK_STORE_HW_L1D_MISSES,
+		BLOCK_STORE_HW_LLC_MISSES,
+		BLOCK_STORE_HW_BRANCH_MISSES,
+		BLOCK_STORE_HW_COUNT
+	} block_store_hw_counter_t;
+
+	// Latency histogram bucket b counts calls that took [2^b, 2^(b+1)) ns (the last one catches the rest)
+#define BLOCK_STORE_LATENCY_BUCKETS 32
+
+	typedef struct {
+		uint64_t calls;
+		uint64_t failures;
+		uint64_t bytes;     // block data moved (or image bytes for serialize/deserialize)
+		uint64_t latency[BLOCK_STORE_LATENCY_BUCKETS];
+		uint64_t p50_ns;    // percentiles, as the upper edge of their histogram bucket
+		uint64_t p99_ns;
+		uint64_t p999_ns;
+		uint64_t hw_calls;  // calls measured with hardware counters, divide hw by this for per-call figures
+		uint64_t hw[BLOCK_STORE_HW_COUNT];
+	} block_store_op_stats_t;
+
+	typedef struct {
+		block_store_op_stats_t ops[BLOCK_STORE_OP_COUNT];  // indexed by block_store_op_t
+		uint32_t hw_available;  // bit c set if ops[].hw[c] was actually counted
+	} block_store_stats_t;
+
+	// Free extent histogram bucket b counts free runs of [2^b, 2^(b+1)) blocks
+#define BLOCK_STORE_EXTENT_BUCKETS 32
+
+	// Shape of the free space, see block_store_get_free_extents
+	typedef struct {
+		size_t free_blocks;  // same as block_store_get_free_blocks
+		size_t extents;      // maximal runs of free blocks
+		size_t largest;      // blocks in the longest run (the biggest contiguous allocation that fits)
+		size_t histogram[BLOCK_STORE_EXTENT_BUCKETS];
+	} block_store_free_extents_t;
+
+	// What a block_store_compact call got done
+	typedef struct {
+		size_t moved;           // blocks relocated by this call
+		size_t largest_before;  // longest run of free physical blocks when the call started
+		size_t largest_after;   // ...and when it returned
+		bool done;              // nothing left to move, used blocks are packed at the bottom
+	} block_store_compact_report_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// Creates an in-memory BS device with a chosen size and options
+	///  With BLOCK_STORE_CREATE_THIN, device memory is taken a page at a time on the first
+	///  write into it, reads of never-written blocks are served from a zero block, and
+	///  pages left with no allocated blocks are handed back to the kernel
+	///  With BLOCK_STORE_CREATE_HUGE_PAGES, device memory comes from the hugetlb pool if it
+	///  has room, otherwise transparent huge pages are asked for, otherwise ordinary pages do
+	///  (thin devices only ever try transparent huge pages)
+	/// \param num_blocks Blocks on the device, at least 129 (see block_store_resize)
+	/// \param flags BLOCK_STORE_CREATE_* flags
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const unsigned flags);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -37,8 +177,76 @@ extern "C"
 	///
 	void block_store_destroy(block_store_t *const bs);
 
+	///
+	/// Sets up a pool for creating and destroying lots of short-lived in-memory devices
+	///  of the default size cheaply. Every device and its FBM header come out of one region
+	///  mapped up front, so taking one or giving it back is a free list push or pop: no
+	///  malloc, no mmap, and the slot reused next is the one freed last
+	/// \param n How many devices it can hold at once
+	/// \return The pool, NULL on error
+	///
+	block_store_pool_t *block_store_pool_create(const size_t n);
+
+	///
+	/// Takes a fresh device from a pool; block_store_destroy gives it back
+	///  Pooled devices work like block_store_create's except they can't be resized and
+	///  keep no per-operation stats (see block_store_get_stats)
+	/// \param pool The pool
+	/// \return Pointer to a new block storage device, NULL on error or if the pool is used up
+	///
+	block_store_t *block_store_create_pooled(block_store_pool_t *const pool);
+
+	///
+	/// Counts the devices a pool can still hand out
+	/// \param pool The pool
+	/// \return Free slots, 0 on error
+	///
+	size_t block_store_pool_available(block_store_pool_t *const pool);
+
+	///
+	/// Frees a pool
+	/// \param pool The pool, every device taken from it destroyed already
+	///
+	void block_store_pool_destroy(block_store_pool_t *const pool);
+
+	///
+	/// Creates an in-memory BS device of the default size in a named POSIX shared memory
+	///  object, so other processes can block_store_attach_shared it and work on the same
+	///  blocks with no copies. FBM updates are atomic, so allocate/request/release from any
+	///  number of processes at once never hand out a block twice; reads and writes of a
+	///  block are plain memory copies, so who may touch which block is the callers' business
+	///  The object is removed once the last live process destroys its handle. Processes that
+	///  exit or crash without doing so don't keep it around, but blocks are not owned by
+	///  anyone: whatever a crashed process had allocated stays allocated until some live
+	///  process releases it. Shared devices can't be resized or compacted and have no free
+	///  extents summary; stats and traces are per handle
+	/// \param name Shared memory object name ("/something"), mustn't name a live device (one
+	///  left behind by a creator that died before finishing is replaced)
+	/// \param mode Permissions for it
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_shared(const char *const name, const mode_t mode);
+
+	///
+	/// Attaches this process to a device made by block_store_create_shared;
+	///  block_store_destroy detaches it again
+	/// \param name Shared memory object name
+	/// \return Pointer to the block storage device, NULL if there's no such device (or it's
+	///  still being created or on its way out) or on error
+	///
+	block_store_t *block_store_attach_shared(const char *const name);
+
+	///
+	/// Counts the processes that have a shared device attached
+	/// \param bs BS device
+	/// \return Live attachments (one per create or attach), counting this one;
+	///  0 on error or if the device isn't shared
+	///
+	size_t block_store_get_shared_attached(const block_store_t *const bs);
+
 	///
 	/// Searches for a free block, marks it as in use, and returns the block's id
+	///  That's the lowest free one unless block_store_set_reuse_depth says otherwise
 	/// \param bs BS device
 	/// \return Allocated block's id, SIZE_MAX on error
 	///
@@ -59,6 +267,20 @@ extern "C"
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Has block_store_allocate hand back recently released blocks, newest first, before
+	///  falling back to the lowest free one. Churn (release, then allocate soon after) then
+	///  reuses a block whose data and FBM byte are still in the caches, without a scan
+	///  Remembers the last depth releases; ids taken some other way in the meantime
+	///  (block_store_request, an FBM write) are forgotten as they're taken, so picking
+	///  one is O(1). On a shared device another process can still get to one first, and
+	///  then allocate falls back to the lowest free block
+	/// \param bs BS device
+	/// \param depth Ids to remember, 0 (the default) to always take the lowest free block
+	/// \return true on success, false on error
+	///
+	bool block_store_set_reuse_depth(block_store_t *const bs, const size_t depth);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -80,6 +302,45 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the number of blocks on a device, which only differs from
+	///  block_store_get_total_blocks once it has been resized
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_num_blocks(const block_store_t *const bs);
+
+	///
+	/// Grows or shrinks an in-memory device in place
+	///  Device memory is grown with mremap, so no block is copied; the FBM moves out of
+	///  blocks 127-128 into a buffer of its own once it needs more than their 512 bits
+	///  (those blocks read and write the start of it from then on)
+	///  Shrinking only works when every block past the new end is free, and on a
+	///  compacted device when no data sits there either (compact first)
+	///  Resized devices can't be serialized until they're back to block_store_get_total_blocks,
+	///  and file-backed devices can't be resized
+	///  Like every call on an in-memory device, not safe alongside other calls on it
+	/// \param bs BS device
+	/// \param num_blocks New number of blocks, at least 129 (the FBM blocks have to stay)
+	/// \return true on success, false if blocks past the new end are in use or on error
+	///
+	bool block_store_resize(block_store_t *const bs, const size_t num_blocks);
+
+	///
+	/// Reports what kind of memory a device ended up with
+	/// \param bs BS device
+	/// \return The backing, BLOCK_STORE_BACKING_NONE on error
+	///
+	block_store_backing_t block_store_get_backing(const block_store_t *const bs);
+
+	///
+	/// Returns how much device memory an in-memory device is holding on to: the whole
+	///  device normally, only the pages the kernel has behind it for thin ones (see mincore)
+	/// \param bs BS device
+	/// \return Bytes, SIZE_MAX on error or for file-backed devices
+	///
+	size_t block_store_get_resident_bytes(const block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
@@ -107,12 +368,208 @@ extern "C"
 
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	///  The image goes to a temporary file that is synced and renamed over filename,
+	///  so a crash leaves either the old image or the new one
 	/// \param bs BS device
 	/// \param filename The file to write to
 	/// \return Number of bytes written, 0 on error
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Opens a BS device that lives in the given file rather than in memory
+	///  Only the FBM and a bounded buffer cache are resident; blocks are faulted in
+	///  on demand and dirty ones are written back on eviction or block_store_sync
+	///  The file uses the same layout as block_store_serialize
+	///  With BLOCK_STORE_OPEN_JOURNAL, FBM and block updates are logged to <filename>.wal and
+	///  committed in groups (one fdatasync per group); the log is replayed here and
+	///  checkpointed into the image in the background; until then updates are held in memory,
+	///  the image never sees an uncommitted one
+	/// \param filename The device image
+	/// \param flags BLOCK_STORE_OPEN_* flags
+	/// \return Pointer to the BS device, NULL on error
+	///
+	block_store_t *block_store_open(const char *const filename, const unsigned flags);
+
+	///
+	/// Resizes the buffer cache of a file-backed device, writing back what it held
+	/// \param bs BS device
+	/// \param blocks Number of blocks to keep resident (0 sends everything straight to the file)
+	/// \return true on success, false for in-memory devices or on error
+	///
+	bool block_store_set_cache_size(block_store_t *const bs, const size_t blocks);
+
+	///
+	/// Caps the sequential readahead window of a file-backed device
+	///  Once ascending reads are seen, the next window of blocks is fetched asynchronously;
+	///  the window doubles while prefetched blocks keep getting read and halves when they don't
+	/// \param bs BS device
+	/// \param max_blocks Largest window in blocks, 0 turns readahead off
+	/// \return true on success, false for in-memory devices or devices without a cache
+	///
+	bool block_store_set_readahead(block_store_t *const bs, const size_t max_blocks);
+
+	///
+	/// Hints that the given blocks will be read soon so they can be fetched in the background
+	/// \param bs BS device
+	/// \param first First block of the range
+	/// \param n Number of blocks
+	/// \return true if the hint was taken (always for in-memory devices)
+	///
+	bool block_store_prefetch(block_store_t *const bs, const size_t first, const size_t n);
+
+	///
+	/// Reports the buffer cache counters of a file-backed device
+	/// \param bs BS device
+	/// \param stats Filled in on success
+	/// \return true on success, false if the device has no cache
+	///
+	bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+	///
+	/// Writes out the cache and FBM and waits for a file-backed device to be on disk
+	///  Journaled devices only commit the open group; the image catches up at the next checkpoint
+	/// \param bs BS device
+	/// \return true on success (always for in-memory devices)
+	///
+	bool block_store_sync(block_store_t *const bs);
+
+	///
+	/// Starts, retunes or (with a NULL policy) stops a background writer that pushes dirty
+	///  cached blocks and the FBM of a file-backed device to the file once a threshold is crossed
+	///  Writes stay memory-speed until limit_blocks are dirty, then wait for the writer
+	/// \param bs BS device
+	/// \param policy Thresholds, NULL to stop the writer
+	/// \return true on success, false for in-memory devices or on error
+	///
+	bool block_store_set_flush_policy(block_store_t *const bs, const block_store_flush_policy_t *const policy);
+
+	///
+	/// Barrier: returns once everything written before the call is on stable storage
+	///  With a background writer running this hands it the work; otherwise it's block_store_sync
+	/// \param bs BS device
+	/// \return true on success (always for in-memory devices)
+	///
+	bool block_store_flush_wait(block_store_t *const bs);
+
+	///
+	/// Reports per-operation call, failure and byte counts and latency percentiles
+	///  Only available when the library is built with BLOCK_STORE_STATS (off by default)
+	///  Deserialize counts are for the whole process, failed calls included
+	/// \param bs BS device
+	/// \param stats Filled in on success
+	/// \return true on success, false if stats were compiled out
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+	///
+	/// Turns hardware counter sampling around each operation on or off
+	///  Costs two extra syscalls per call, so it's meant for diagnosis; setting the
+	///  BLOCK_STORE_PERF environment variable turns it on for every new device
+	///  Counters are per thread and user space only
+	/// \param bs BS device
+	/// \param enabled Whether to sample
+	/// \return true if sampling is now as asked, false if stats were compiled out or the
+	///  calling thread has no counters (no PMU, or not allowed, e.g. in a container)
+	///
+	bool block_store_set_hw_counters(block_store_t *const bs, const bool enabled);
+
+	///
+	/// Starts recording every allocate/request/release/read/write call, with a timestamp,
+	///  to a compact binary trace that tools/block_store_replay can play back
+	///  Start and stop while no other thread is using the device
+	/// \param bs BS device
+	/// \param path Trace file, overwritten
+	/// \return true on success, false if already recording or on error
+	///
+	bool block_store_trace_start(block_store_t *const bs, const char *const path);
+
+	///
+	/// Stops recording and closes the trace file (block_store_destroy does this too)
+	/// \param bs BS device
+	/// \return true if the whole trace made it to the file
+	///
+	bool block_store_trace_stop(block_store_t *const bs);
+
+	///
+	/// Describes how the free blocks are laid out: how many runs there are, the longest one
+	///  and a power-of-two histogram of run lengths
+	///  The first call makes one pass over the FBM; after that the figures are kept up to date
+	///  by allocate/request/release, so polling is cheap
+	/// \param bs BS device
+	/// \param report Filled in on success
+	/// \return true on success, false on error
+	///
+	bool block_store_get_free_extents(const block_store_t *const bs, block_store_free_extents_t *const report);
+
+	///
+	/// Packs allocated blocks together by sliding them down into the gaps below them,
+	///  keeping them in the order they were in (blocks laid out in a run stay one)
+	///  Block ids don't change: a remap from the ids callers hold to where the data now
+	///  lives is kept, and serialized images are written in id order as before
+	///  Each call moves at most budget blocks, so compaction can be run a slice at a time
+	///  between other operations until the report says it's done
+	///  Only in-memory devices can be compacted
+	/// \param bs BS device
+	/// \param budget Most blocks to move this call, 0 to run until done
+	/// \param report Filled in on success
+	/// \return true on success, false on error or for file-backed devices
+	///
+	bool block_store_compact(block_store_t *const bs, const size_t budget, block_store_compact_report_t *const report);
+
+	///
+	/// Reports write-ahead journal counters
+	/// \param bs BS device
+	/// \param stats Filled in on success
+	/// \return true on success, false if the device has no journal
+	///
+	bool block_store_get_journal_stats(const block_store_t *const bs, block_store_journal_stats_t *const stats);
+
+	///
+	/// Starts reading a block into buffer
+	///  Requests on a file-backed device go through io_uring (or a thread pool if that's
+	///  unavailable) and cb runs from block_store_poll; anything already in memory completes inline
+	///  Ring submissions are batched: they reach the kernel together at the next block_store_poll
+	///  or flush, or once enough have queued up
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to, must stay valid until cb runs
+	/// \param cb Completion callback, may be NULL
+	/// \param arg Passed to cb
+	/// \return true if the read was started
+	///
+	bool block_store_submit_read(block_store_t *const bs, const size_t block_id, void *buffer,
+			block_store_callback_t cb, void *arg);
+
+	///
+	/// Starts writing buffer to a block, same completion rules as block_store_submit_read
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param buffer Data buffer to read from, must stay valid until cb runs
+	/// \param cb Completion callback, may be NULL
+	/// \param arg Passed to cb
+	/// \return true if the write was started
+	///
+	bool block_store_submit_write(block_store_t *const bs, const size_t block_id, const void *buffer,
+			block_store_callback_t cb, void *arg);
+
+	///
+	/// Starts a flush of the FBM and every write submitted before it to stable storage
+	/// \param bs BS device
+	/// \param cb Completion callback (gets SIZE_MAX as the block id), may be NULL
+	/// \param arg Passed to cb
+	/// \return true if the flush was started
+	///
+	bool block_store_submit_flush(block_store_t *const bs, block_store_callback_t cb, void *arg);
+
+	///
+	/// Runs callbacks for finished async requests
+	/// \param bs BS device
+	/// \param min_complete How many to wait for, 0 to only collect what's already done
+	/// \return Number of callbacks run
+	///
+	size_t block_store_poll(block_store_t *const bs, const size_t min_complete);
+
 #ifdef __cplusplus
 }
 #endif
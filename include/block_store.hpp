@@ -0,0 +1,190 @@
+#ifndef BLOCK_STORE_HPP__
+#define BLOCK_STORE_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include "block_store.h"
+
+// The C++ side of block_store.h, header-only.
+// hw3::BlockStore<NumBlocks, BlockSize> owns one device: the only state it carries is the
+//  block_store_t pointer, so moving one around costs a pointer copy and the device is
+//  destroyed exactly once, by whoever holds it last.
+// The geometry is part of the type, so the sizes and offsets below are compile-time constants,
+//  and block contents go straight between the device and the caller's object (read_as/write_as)
+//  without a staging buffer whenever the object is exactly one block.
+// Errors come back the same way the C calls report them (false, SIZE_MAX, an empty optional,
+//  or an empty BlockStore); nothing here throws.
+
+namespace hw3
+{
+	template <std::size_t NumBlocks, std::size_t BlockSize = BLOCK_SIZE_BYTES>
+	class BlockStore
+	{
+		static_assert(BlockSize == BLOCK_SIZE_BYTES, "the block store only does BLOCK_SIZE_BYTES blocks");
+		static_assert(NumBlocks >= BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS,
+				"a device needs room for the FBM blocks (at least 129)");
+		static_assert(NumBlocks <= SIZE_MAX / BlockSize, "device size doesn't fit in a size_t");
+
+		public:
+			static constexpr std::size_t num_blocks = NumBlocks;
+			static constexpr std::size_t block_size = BlockSize;
+			static constexpr std::size_t device_bytes = NumBlocks * BlockSize;
+			// Only the default geometry can be serialized or opened from a file
+			static constexpr bool file_compatible = NumBlocks == BLOCK_STORE_NUM_BLOCKS;
+
+			using block = std::array<std::byte, BlockSize>;
+
+			/// \return Byte offset of a block within the device
+			static constexpr std::size_t offset_of(const std::size_t id) { return id * BlockSize; }
+
+			/// A fresh in-memory device (empty if creating it failed)
+			/// \param flags BLOCK_STORE_CREATE_* flags
+			explicit BlockStore(const unsigned flags = 0)
+				: bs(file_compatible && !flags ? block_store_create() : block_store_create_ex(NumBlocks, flags)) {}
+
+			/// Takes ownership of a device, which is destroyed straight away if its size isn't NumBlocks
+			static BlockStore adopt(block_store_t *const owned)
+			{
+				BlockStore out{empty{}};
+				if (owned && block_store_get_num_blocks(owned) != NumBlocks)
+					block_store_destroy(owned);
+				else
+					out.bs = owned;
+				return out;
+			}
+
+			/// A file-backed device (see block_store_open)
+			static BlockStore open(const char *const filename, const unsigned flags = 0)
+			{
+				static_assert(file_compatible, "file-backed devices have BLOCK_STORE_NUM_BLOCKS blocks");
+				return adopt(block_store_open(filename, flags));
+			}
+
+			/// An in-memory device loaded from an image (see block_store_deserialize)
+			static BlockStore deserialize(const char *const filename)
+			{
+				static_assert(file_compatible, "device images have BLOCK_STORE_NUM_BLOCKS blocks");
+				return adopt(block_store_deserialize(filename));
+			}
+
+			BlockStore(BlockStore &&other) noexcept : bs(other.bs) { other.bs = nullptr; }
+			BlockStore &operator=(BlockStore &&other) noexcept
+			{
+				if (this != &other)
+				{
+					block_store_destroy(bs);
+					bs = other.bs;
+					other.bs = nullptr;
+				}
+				return *this;
+			}
+			BlockStore(const BlockStore &) = delete;
+			BlockStore &operator=(const BlockStore &) = delete;
+			~BlockStore() { block_store_destroy(bs); }
+
+			/// false if creating or opening the device failed (or it has been moved from)
+			explicit operator bool() const { return bs != nullptr; }
+
+			/// The device, for anything only the C API does
+			block_store_t *get() { return bs; }
+			const block_store_t *get() const { return bs; }
+
+			/// Gives up ownership without destroying the device
+			block_store_t *detach()
+			{
+				block_store_t *out = bs;
+				bs = nullptr;
+				return out;
+			}
+
+			/// \return Allocated block's id, SIZE_MAX if there's none free
+			std::size_t allocate() { return block_store_allocate(bs); }
+			bool request(const std::size_t id) { return block_store_request(bs, id); }
+			void release(const std::size_t id) { block_store_release(bs, id); }
+			std::size_t used_blocks() const { return block_store_get_used_blocks(bs); }
+			std::size_t free_blocks() const { return block_store_get_free_blocks(bs); }
+
+			bool read(const std::size_t id, block &out) const
+			{
+				return block_store_read(bs, id, out.data()) == BlockSize;
+			}
+
+			bool write(const std::size_t id, const block &in)
+			{
+				return block_store_write(bs, id, in.data()) == BlockSize;
+			}
+
+			/// Reads the start of a block as a T
+			/// \return The T, nothing if the block isn't allocated
+			template <typename T>
+			std::optional<T> read_as(const std::size_t id) const
+			{
+				check_fits<T>();
+				std::optional<T> out(std::in_place);
+				if constexpr (sizeof(T) == BlockSize)
+				{
+					// straight into the caller's object
+					if (block_store_read(bs, id, &*out) != BlockSize)
+						out.reset();
+				}
+				else
+				{
+					block raw;
+					if (read(id, raw))
+						std::memcpy(&*out, raw.data(), sizeof(T));
+					else
+						out.reset();
+				}
+				return out;
+			}
+
+			/// Writes a T at the start of a block, zeroing whatever of the block it doesn't cover
+			template <typename T>
+			bool write_as(const std::size_t id, const T &value)
+			{
+				check_fits<T>();
+				if constexpr (sizeof(T) == BlockSize)
+				{
+					return block_store_write(bs, id, &value) == BlockSize;
+				}
+				else
+				{
+					block raw{};
+					std::memcpy(raw.data(), &value, sizeof(T));
+					return write(id, raw);
+				}
+			}
+
+			/// \return Bytes written, 0 on error
+			std::size_t serialize(const char *const filename) const
+			{
+				static_assert(file_compatible, "device images have BLOCK_STORE_NUM_BLOCKS blocks");
+				return block_store_serialize(bs, filename);
+			}
+
+			bool sync() { return block_store_sync(bs); }
+
+		private:
+			// An empty one, for adopt to fill in
+			struct empty {};
+			explicit BlockStore(empty) : bs(nullptr) {}
+
+			template <typename T>
+			static constexpr void check_fits()
+			{
+				static_assert(std::is_trivially_copyable<T>::value, "blocks hold plain bytes");
+				static_assert(sizeof(T) <= BlockSize, "doesn't fit in a block");
+			}
+
+			block_store_t *bs;
+	};
+
+	// The geometry block_store_create gives you
+	using DefaultBlockStore = BlockStore<BLOCK_STORE_NUM_BLOCKS>;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef BLOCK_TRACE_H__
+#define BLOCK_TRACE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// Compact binary trace of block store calls, for replaying real workloads offline.
+	// A small header, then one fixed 16-byte record per call, in call order.
+	// Records are buffered and appended a few thousand at a time.
+	typedef struct block_trace block_trace_t;
+	typedef struct block_trace_reader block_trace_reader_t;
+
+	// No block involved (e.g. an allocate that failed)
+#define BLOCK_TRACE_NO_BLOCK UINT32_MAX
+
+	typedef struct {
+		uint64_t time_ns;   // since the trace started
+		uint32_t block_id;  // the block asked for, or the one allocate handed out
+		uint8_t op;         // block_store_op_t
+		uint8_t ok;         // whether the call succeeded
+		uint16_t reserved;
+	} block_trace_record_t;
+
+	///
+	/// Starts a trace in a new file (overwriting one that's there)
+	/// \param path Trace file
+	/// \param num_blocks Blocks on the traced device
+	/// \return The trace, NULL on error
+	///
+	block_trace_t *block_trace_create(const char *const path, const size_t num_blocks);
+
+	///
+	/// Records one call; safe to call from several threads
+	///
+	void block_trace_log(block_trace_t *const trace, const block_store_op_t op, const size_t block_id, const bool ok);
+
+	///
+	/// Writes out what's buffered and closes the trace
+	/// \return true if every record made it to the file
+	///
+	bool block_trace_close(block_trace_t *const trace);
+
+	///
+	/// Opens a trace for reading
+	/// \param path Trace file
+	/// \param num_blocks Set to the block count of the traced device, may be NULL
+	/// \return The reader, NULL if the file isn't a trace
+	///
+	block_trace_reader_t *block_trace_open(const char *const path, size_t *const num_blocks);
+
+	///
+	/// Reads the next record
+	/// \return false at the end of the trace
+	///
+	bool block_trace_next(block_trace_reader_t *const reader, block_trace_record_t *const record);
+
+	///
+	/// Closes a reader
+	///
+	void block_trace_reader_close(block_trace_reader_t *const reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
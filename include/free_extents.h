@@ -0,0 +1,58 @@
+#ifndef FREE_EXTENTS_H__
+#define FREE_EXTENTS_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bitmap.h"
+#include "block_store.h"
+
+	// Running summary of the zero runs in a free block map.
+	// Built with one pass, then patched on every single-bit change: setting a bit
+	//  splits at most one run, clearing one merges at most two, so each update only
+	//  has to find the runs either side of the bit.
+	// Not thread-safe, whoever guards the map guards this too.
+	typedef struct free_extents free_extents_t;
+
+	///
+	/// Summarizes the zero runs in fbm as it is now
+	/// \param fbm The map to track
+	/// \return New tracker, NULL on error
+	///
+	free_extents_t *free_extents_create(const bitmap_t *const fbm);
+
+	///
+	/// Accounts for bit going from zero to one, call before setting it in fbm
+	/// \param extents The tracker
+	/// \param fbm The tracked map, still with bit clear
+	/// \param bit The bit about to be set
+	///
+	void free_extents_allocated(free_extents_t *const extents, const bitmap_t *const fbm, const size_t bit);
+
+	///
+	/// Accounts for bit going from one to zero, call before clearing it in fbm
+	/// \param extents The tracker
+	/// \param fbm The tracked map, still with bit set
+	/// \param bit The bit about to be cleared
+	///
+	void free_extents_released(free_extents_t *const extents, const bitmap_t *const fbm, const size_t bit);
+
+	///
+	/// Copies the current figures out
+	///
+	void free_extents_report(const free_extents_t *const extents, block_store_free_extents_t *const report);
+
+	///
+	/// Frees the tracker
+	///
+	void free_extents_destroy(free_extents_t *const extents);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
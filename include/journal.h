@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+	// Redo-only write-ahead log of whole-block after-images.
+	// Records pile up in memory as an open group; a commit appends the whole group
+	//  plus a commit record in one write and makes it durable with one fdatasync.
+	// Replay applies every committed group newer than the last checkpoint to the image.
+	// Not thread-safe by itself: appends and seals must be serialized with each other,
+	//  and group writes and resets with each other (in seal order), but a sealed group
+	//  can be written while the next one is being filled.
+	typedef struct journal journal_t;
+	typedef struct journal_group journal_group_t;
+
+	///
+	/// Opens (creating if needed) the log at path
+	/// \param path Log file
+	/// \param block_size Bytes per block record
+	/// \return New journal, NULL on error
+	///
+	journal_t *journal_open(const char *const path, const size_t block_size);
+
+	///
+	/// Applies committed groups to image_fd, syncs it, and empties the log
+	///  Stops at the first torn or corrupt record; anything after it was never committed
+	/// \param journal The journal
+	/// \param image_fd Device image to apply to
+	/// \return Number of groups applied, SIZE_MAX on error
+	///
+	size_t journal_replay(journal_t *const journal, const int image_fd);
+
+	///
+	/// Adds a block after-image to the open group
+	/// \return true on success
+	///
+	bool journal_append(journal_t *const journal, const size_t block_id, const void *data);
+
+	///
+	/// Closes the open group (adding its commit record) and detaches it
+	/// \return The sealed group, NULL if nothing was pending or on error
+	///
+	journal_group_t *journal_seal(journal_t *const journal);
+
+	///
+	/// Appends a sealed group to the log with one write and one fdatasync, then frees it
+	/// \return true if the group is durable
+	///
+	bool journal_write_group(journal_t *const journal, journal_group_t *const group);
+
+	///
+	/// Seals and writes the open group in one go
+	/// \return true if the group is durable (or there was nothing to commit)
+	///
+	bool journal_commit(journal_t *const journal);
+
+	///
+	/// \return Records waiting in the open group
+	///
+	size_t journal_pending(const journal_t *const journal);
+
+	///
+	/// \return Bytes in the log file
+	///
+	size_t journal_size(const journal_t *const journal);
+
+	///
+	/// \return Sequence number of the newest durable group
+	///
+	uint64_t journal_committed_seq(const journal_t *const journal);
+
+	///
+	/// Empties the log once every group in it has made it to the (synced) image
+	/// \return true on success
+	///
+	bool journal_checkpoint(journal_t *const journal);
+
+	///
+	/// Frees the journal (the open group is dropped, commit first)
+	///
+	void journal_close(journal_t *const journal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PERF_COUNTERS_H__
+#define PERF_COUNTERS_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+	// Hardware performance counters for the calling thread, via perf_event_open.
+	// Counts user space only, which is all an unprivileged process (or a container)
+	//  usually gets. Counters the machine or kernel won't give us are just marked
+	//  unavailable; with none at all, perf_counters_open returns NULL and callers carry on.
+	typedef struct perf_counters perf_counters_t;
+
+	typedef enum {
+		PERF_CYCLES,
+		PERF_INSTRUCTIONS,
+		PERF_L1D_MISSES,
+		PERF_LLC_MISSES,
+		PERF_BRANCH_MISSES,
+		PERF_COUNTER_COUNT
+	} perf_counter_t;
+
+	typedef struct {
+		uint64_t value[PERF_COUNTER_COUNT];  // running totals, scaled up if the kernel multiplexed
+		uint32_t available;                  // bit c set if value[c] means anything
+	} perf_sample_t;
+
+	///
+	/// Opens and starts the counters for the calling thread
+	/// \return The counters, NULL if none could be opened
+	///
+	perf_counters_t *perf_counters_open(void);
+
+	///
+	/// The calling thread's counters, opened on first use and closed when it exits
+	/// \return The counters, NULL if unavailable (that answer is cached too)
+	///
+	perf_counters_t *perf_counters_thread(void);
+
+	///
+	/// Reads the current totals (one syscall for the whole group)
+	/// \return true on success
+	///
+	bool perf_counters_read(perf_counters_t *const counters, perf_sample_t *const sample);
+
+	///
+	/// \return Short name of a counter, for reports
+	///
+	const char *perf_counter_name(const perf_counter_t counter);
+
+	///
+	/// Stops and frees the counters
+	///
+	void perf_counters_close(perf_counters_t *const counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef SHARED_SEGMENT_H__
+#define SHARED_SEGMENT_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+	// A named POSIX shared memory object for the device of block_store_create_shared.
+	// It opens with a header page (what's in it, a robust process-shared lock, and a table
+	//  of the processes that have it mapped); the data starts on the next page.
+	// Entries of processes that died without detaching are cleared by the next attach or
+	//  detach, so a crash can't keep the segment around forever: the last live process to
+	//  detach removes the name.
+	// Nothing here touches the data itself; keeping that consistent between processes is
+	//  up to whoever uses it (block_store.c does it with atomic FBM updates).
+	typedef struct shared_segment shared_segment_t;
+
+	///
+	/// Makes a new segment, its data all zeroes, attached to this process
+	///  Nobody can attach until shared_segment_publish; until then the creator holds an
+	///  flock on the object, so one whose creator died first (unpublished and unlocked)
+	///  is recognized as leftovers and replaced
+	/// \param name Shared memory object name ("/something"), mustn't name a live segment
+	/// \param mode Permissions for it
+	/// \param data_bytes Size of the data
+	/// \return The segment, NULL on error
+	///
+	shared_segment_t *shared_segment_create(const char *const name, const mode_t mode, const size_t data_bytes);
+
+	///
+	/// Opens the segment up to shared_segment_attach once the creator has set the data up
+	///
+	void shared_segment_publish(shared_segment_t *const seg);
+
+	///
+	/// Maps an existing, published segment into this process
+	/// \param name Shared memory object name
+	/// \param data_bytes Size of the data it should have
+	/// \return The segment, NULL if there isn't a published one of that size, it has been
+	///  removed, its table is full, or on error
+	///
+	shared_segment_t *shared_segment_attach(const char *const name, const size_t data_bytes);
+
+	///
+	/// \return Where the data is mapped in this process
+	///
+	uint8_t *shared_segment_data(const shared_segment_t *const seg);
+
+	///
+	/// \return Live processes with the segment attached (one per attach), counting this one
+	///
+	size_t shared_segment_attached(shared_segment_t *const seg);
+
+	///
+	/// Unmaps the segment, removing its name too if nobody alive has it attached any more
+	/// \param seg The segment, NULL is ignored
+	///
+	void shared_segment_detach(shared_segment_t *const seg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
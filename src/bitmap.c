@@ -1,9 +1,13 @@
 #include "bitmap.h"
+#include "bitmap_kernels.h"
+#include "bitmap_compressed.h"
 #include <string.h>
 
-// Just the one for now. Indicates we're an overlay and should not free
+// OVERLAY indicates we're an overlay and should not free
+// COMPRESSED means the bits live in chunk containers (bitmap_compressed.c) rather than data
+// EMBEDDED means the header itself is someone else's memory (bitmap_overlay_at)
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, COMPRESSED = 0x02, EMBEDDED = 0x04, ALL = 0xFF } BITMAP_FLAGS;
 
 struct bitmap 
 {
@@ -11,14 +15,21 @@ struct bitmap
 	BITMAP_FLAGS flags;	  // Generic place to store flags. Not enough flags to worry about width yet.
 	uint8_t *data;
 	size_t bit_count, byte_count;
+	compressed_t *compressed;  // NULL unless COMPRESSED
 };
 
+_Static_assert(sizeof(struct bitmap) <= sizeof(bitmap_header_t), "bitmap_header_t can't hold a bitmap_t");
+_Static_assert(_Alignof(struct bitmap) <= _Alignof(bitmap_header_t), "bitmap_header_t is underaligned");
+
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
 // Not sure I want these
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
 // lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
+//  Remeasured with hw3_bench (BM_bit_mask/lookup vs /shift, 5 repetitions): within
+//  noise of each other (~1%, gcc 12, default flags); the cycles/instructions columns
+//  there settle it on machines that expose hardware counters
 // Also, using native int width because it should be faster as well? - Negligible/indeterminate
 //  Won't help until bitmap uses native width for the array
 static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
@@ -34,124 +45,725 @@ static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF,
 // Since the data store is uint8_t, we already get punished for our bad alignment
 // so this doesn't really matter until everything gets moved to generic int
 
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
- */
+// Total bits set per byte used to come from a 256-entry lookup table here; that's the
+//  scalar fallback in bitmap_kernels.c now, next to the vector versions
 
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Fills in the sizes and flags of a header that's already been found room for
+static void bitmap_setup(bitmap_t *const bitmap, size_t n_bits, BITMAP_FLAGS flags);
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
+	if (bitmap->compressed)
+	{
+		compressed_set(bitmap->compressed, bit);
+		return;
+	}
 	bitmap->data[bit >> 3] |= mask[bit & 0x07];
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
+	if (bitmap->compressed)
+	{
+		compressed_reset(bitmap->compressed, bit);
+		return;
+	}
 	bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
+	if (bitmap->compressed)
+	{
+		return compressed_test(bitmap->compressed, bit);
+	}
 	return bitmap->data[bit >> 3] & mask[bit & 0x07];
 }
 
-void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit)
 {
-	bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+	if (bitmap->compressed)
+	{
+		bool was_set = compressed_test(bitmap->compressed, bit);
+		compressed_set(bitmap->compressed, bit);
+		return !was_set;
+	}
+	uint8_t old = __atomic_fetch_or(&bitmap->data[bit >> 3], mask[bit & 0x07], __ATOMIC_ACQUIRE);
+	return !(old & mask[bit & 0x07]);
 }
 
-void bitmap_invert(bitmap_t *const bitmap) 
+void bitmap_reset_atomic(bitmap_t *const bitmap, const size_t bit)
 {
-	for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+	if (bitmap->compressed)
 	{
-		bitmap->data[byte] = ~bitmap->data[byte];
+		compressed_reset(bitmap->compressed, bit);
+		return;
 	}
+	__atomic_fetch_and(&bitmap->data[bit >> 3], invert_mask[bit & 0x07], __ATOMIC_RELEASE);
 }
 
-size_t bitmap_ffs(const bitmap_t *const bitmap) 
+size_t bitmap_ffz_claim_atomic(bitmap_t *const bitmap)
 {
-	if (bitmap) 
+	if (bitmap->compressed)
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+		size_t bit = bitmap_ffz(bitmap);
+		if (bit != SIZE_MAX)
 		{
+			compressed_set(bitmap->compressed, bit);
+		}
+		return bit;
+	}
+	// A byte at a time, since that's as much as one atomic op here is sure to cover
+	//  whatever the alignment of data
+	for (size_t i = 0; i < bitmap->byte_count; i++)
+	{
+		unsigned valid = (i == bitmap->byte_count - 1 && bitmap->leftover_bits)
+			? mask_down_inclusive[bitmap->leftover_bits - 1] : 0xFF;
+		unsigned byte = __atomic_load_n(&bitmap->data[i], __ATOMIC_RELAXED);
+		while (~byte & valid)
+		{
+			unsigned clear = ~byte & valid;
+			uint8_t lowest = (uint8_t) (clear & -clear);
+			byte = __atomic_fetch_or(&bitmap->data[i], lowest, __ATOMIC_ACQUIRE);
+			if (!(byte & lowest))
+			{
+				return i * 8 + (size_t) __builtin_ctz(lowest);
+			}
+			// someone beat us to it, byte is what they left; try whatever's still clear
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
 	}
 	return SIZE_MAX;
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) 
+void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
-	if (bitmap) 
+	if (bitmap->compressed)
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+		if (compressed_test(bitmap->compressed, bit))
+		{
+			compressed_reset(bitmap->compressed, bit);
+		}
+		else
 		{
+			compressed_set(bitmap->compressed, bit);
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
+		return;
 	}
-	return SIZE_MAX;
+	bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+}
+
+void bitmap_invert(bitmap_t *const bitmap) 
+{
+	if (bitmap->compressed)
+	{
+		compressed_invert(bitmap->compressed);
+		return;
+	}
+	bitmap_kernels()->invert(bitmap->data, bitmap->byte_count);
+}
+
+// 64 bits starting at bit word * 64, bit i of the bitmap landing on bit i % 64
+// Bits past the end read as set, so they never look like free space
+// (flat bitmaps only; the compressed ones go a chunk at a time)
+static uint64_t load_word(const bitmap_t *const bitmap, const size_t word)
+{
+	uint8_t bytes[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+	size_t first = word * 8;
+	memcpy(bytes, bitmap->data + first, first + 8 <= bitmap->byte_count ? 8 : bitmap->byte_count - first);
+	uint64_t w = 0;
+	for (int i = 7; i >= 0; --i)
+	{
+		// (compiles down to a plain load on little-endian machines)
+		w = (w << 8) | bytes[i];
+	}
+	size_t first_bit = word * 64;
+	if (first_bit + 64 > bitmap->bit_count)
+	{
+		w |= ~(uint64_t) 0 << (bitmap->bit_count - first_bit);
+	}
+	return w;
+}
+
+// First set bit in [bit, end), end if there isn't one (bit < end <= bit_count)
+static size_t next_set(const bitmap_t *const bitmap, const size_t bit, const size_t end)
+{
+	if (bitmap->compressed)
+	{
+		return compressed_next(bitmap->compressed, bit, end, true);
+	}
+	size_t words = (end + 63) / 64;
+	size_t word = bit / 64;
+	uint64_t w = load_word(bitmap, word) & (~(uint64_t) 0 << (bit & 63));
+	while (!w && ++word < words)
+	{
+		w = load_word(bitmap, word);
+	}
+	if (!w)
+	{
+		return end;
+	}
+	size_t found = word * 64 + (size_t) __builtin_ctzll(w);
+	return found < end ? found : end;
+}
+
+// First zero bit in [bit, end), end if there isn't one (bit < end <= bit_count)
+static size_t next_zero(const bitmap_t *const bitmap, const size_t bit, const size_t end)
+{
+	if (bitmap->compressed)
+	{
+		return compressed_next(bitmap->compressed, bit, end, false);
+	}
+	size_t words = (end + 63) / 64;
+	size_t word = bit / 64;
+	// (bits past the end load as set, so they never turn up here)
+	uint64_t w = ~load_word(bitmap, word) & (~(uint64_t) 0 << (bit & 63));
+	while (!w && ++word < words)
+	{
+		w = ~load_word(bitmap, word);
+	}
+	if (!w)
+	{
+		return end;
+	}
+	size_t found = word * 64 + (size_t) __builtin_ctzll(w);
+	return found < end ? found : end;
+}
+
+// Last set bit before bit, SIZE_MAX if there isn't one
+static size_t prev_set(const bitmap_t *const bitmap, const size_t bit)
+{
+	if (bitmap->compressed)
+	{
+		return compressed_prev_set(bitmap->compressed, bit);
+	}
+	if (!bit)
+	{
+		return SIZE_MAX;
+	}
+	size_t word = (bit - 1) / 64;
+	unsigned top = (bit - 1) & 63;
+	uint64_t w = load_word(bitmap, word) & (top == 63 ? ~(uint64_t) 0 : ((uint64_t) 2 << top) - 1);
+	while (!w && word-- > 0)
+	{
+		w = load_word(bitmap, word);
+	}
+	return w ? word * 64 + 63 - (size_t) __builtin_clzll(w) : SIZE_MAX;
+}
+
+size_t bitmap_ffs(const bitmap_t *const bitmap) 
+{
+	return bitmap_next_set(bitmap, 0);
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) 
+{
+	return bitmap_next_zero(bitmap, 0);
+}
+
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? bitmap_next_set_in(bitmap, from, bitmap->bit_count) : SIZE_MAX;
+}
+
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? bitmap_next_zero_in(bitmap, from, bitmap->bit_count) : SIZE_MAX;
+}
+
+size_t bitmap_next_set_in(const bitmap_t *const bitmap, const size_t from, const size_t end)
+{
+	if (!bitmap || end > bitmap->bit_count || from >= end)
+	{
+		return SIZE_MAX;
+	}
+	size_t result = next_set(bitmap, from, end);
+	return (result == end ? SIZE_MAX : result);
+}
+
+size_t bitmap_next_zero_in(const bitmap_t *const bitmap, const size_t from, const size_t end)
+{
+	if (!bitmap || end > bitmap->bit_count || from >= end)
+	{
+		return SIZE_MAX;
+	}
+	size_t result = next_zero(bitmap, from, end);
+	return (result == end ? SIZE_MAX : result);
 }
 
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
 {
 	size_t total = 0;
-	if (bitmap) 
+	if (bitmap && bitmap->compressed)
+	{
+		total = compressed_count(bitmap->compressed, 0, bitmap->bit_count);
+	}
+	else if (bitmap) 
 	{
 		// If we have leftover, stop a byte early because we have to handle it differently.
 		size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-		for (size_t idx = 0; idx < stop; ++idx) 
-		{
-			total += bit_totals[bitmap->data[idx]];
-		}
+		const bitmap_kernels_t *kernels = bitmap_kernels();
+		total = kernels->popcount(bitmap->data, stop);
 		if (bitmap->leftover_bits) 
 		{
 			// haha, this is readable
 			// get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-			// then feed that to the bit_total lookup so we don't count the bits past our bit total
+			// then count that so we don't count the bits past our bit total
 			// (which whould be considered undetermined)
-			total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+			uint8_t last = bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1];
+			total += kernels->popcount(&last, 1);
 		}
 	}
 	return total;
 }
 
+size_t bitmap_total_set_in(const bitmap_t *const bitmap, const size_t first, const size_t end)
+{
+	if (!bitmap || end > bitmap->bit_count || first >= end)
+	{
+		return 0;
+	}
+	if (bitmap->compressed)
+	{
+		return compressed_count(bitmap->compressed, first, end);
+	}
+	const bitmap_kernels_t *kernels = bitmap_kernels();
+	size_t head = first >> 3, tail = (end - 1) >> 3;
+	// keep only bits first.. of the first byte and ..end - 1 of the last
+	uint8_t lo = (uint8_t) ~(first & 7 ? mask_down_inclusive[(first & 7) - 1] : 0);
+	uint8_t hi = mask_down_inclusive[(end - 1) & 7];
+	if (head == tail)
+	{
+		uint8_t only = bitmap->data[head] & lo & hi;
+		return kernels->popcount(&only, 1);
+	}
+	uint8_t edges[2] = {(uint8_t) (bitmap->data[head] & lo), (uint8_t) (bitmap->data[tail] & hi)};
+	return kernels->popcount(edges, 2) + kernels->popcount(bitmap->data + head + 1, tail - head - 1);
+}
+
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) 
 {
 	if (bitmap && func) 
 	{
-		for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+		BITMAP_FOR_EACH_SET(bitmap, idx)
+		{
+			func(idx, arg);
+		}
+	}
+}
+
+void bitmap_for_each_batch(const bitmap_t *const bitmap, void (*func)(const size_t *, size_t, void *), void *arg)
+{
+	if (!bitmap || !func)
+	{
+		return;
+	}
+	size_t batch[BITMAP_BATCH_SIZE];
+	size_t count = 0;
+	size_t words = bitmap->compressed ? 0 : (bitmap->bit_count + 63) / 64;
+	if (bitmap->compressed)
+	{
+		// empty chunks get skipped whole
+		BITMAP_FOR_EACH_SET(bitmap, bit)
+		{
+			batch[count++] = bit;
+			if (count == BITMAP_BATCH_SIZE)
+			{
+				func(batch, count, arg);
+				count = 0;
+			}
+		}
+	}
+	for (size_t word = 0; word < words; ++word)
+	{
+		uint64_t w = load_word(bitmap, word);
+		if (word * 64 + 64 > bitmap->bit_count)
+		{
+			// the padding past the end loads as set, drop it
+			w &= ~(~(uint64_t) 0 << (bitmap->bit_count - word * 64));
+		}
+		while (w)
+		{
+			batch[count++] = word * 64 + (size_t) __builtin_ctzll(w);
+			w &= w - 1;
+			if (count == BITMAP_BATCH_SIZE)
+			{
+				func(batch, count, arg);
+				count = 0;
+			}
+		}
+	}
+	if (count)
+	{
+		func(batch, count, arg);
+	}
+}
+
+void bitmap_for_each_zero_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg)
+{
+	if (!bitmap || !func)
+	{
+		return;
+	}
+	if (bitmap->compressed)
+	{
+		// hop from edge to edge, a chunk at a time where it's all one way
+		for (size_t start = bitmap_next_zero(bitmap, 0); start != SIZE_MAX;)
+		{
+			size_t end = next_set(bitmap, start, bitmap->bit_count);
+			func(start, end - start, arg);
+			start = bitmap_next_zero(bitmap, end);
+		}
+		return;
+	}
+	size_t words = (bitmap->bit_count + 63) / 64;
+	size_t run = SIZE_MAX; // start of the open run, if any
+	for (size_t word = 0; word < words; ++word)
+	{
+		uint64_t w = load_word(bitmap, word);
+		size_t base = word * 64;
+		if (w == ~(uint64_t) 0)
+		{
+			if (run != SIZE_MAX)
+			{
+				func(run, base - run, arg);
+				run = SIZE_MAX;
+			}
+			continue;
+		}
+		if (!w)
+		{
+			if (run == SIZE_MAX)
+			{
+				run = base;
+			}
+			continue;
+		}
+		// mixed word, hop from edge to edge
+		unsigned pos = 0;
+		while (pos < 64)
+		{
+			uint64_t rest = (run == SIZE_MAX ? ~w : w) >> pos;
+			if (!rest)
+			{
+				break;
+			}
+			pos += (unsigned) __builtin_ctzll(rest);
+			if (run == SIZE_MAX)
+			{
+				run = base + pos;
+			}
+			else
+			{
+				func(run, base + pos - run, arg);
+				run = SIZE_MAX;
+			}
+		}
+	}
+	if (run != SIZE_MAX)
+	{
+		func(run, bitmap->bit_count - run, arg);
+	}
+}
+
+size_t bitmap_zero_run_at(const bitmap_t *const bitmap, const size_t bit, size_t *const start)
+{
+	if (!bitmap || bit >= bitmap->bit_count || bitmap_test(bitmap, bit))
+	{
+		return 0;
+	}
+	size_t first = prev_set(bitmap, bit) + 1; // (SIZE_MAX + 1 wraps to 0)
+	if (start)
+	{
+		*start = first;
+	}
+	return next_set(bitmap, bit, bitmap->bit_count) - first;
+}
+
+typedef enum { OP_AND, OP_OR, OP_XOR, OP_ANDNOT } BITMAP_OP;
+
+// Anything involving a compressed bitmap goes a container-sized chunk at a time,
+//  so chunks that are all one way on both sides never have to be expanded
+
+static size_t chunk_count(const bitmap_t *const bitmap)
+{
+	return (bitmap->bit_count + COMPRESSED_CHUNK_BITS - 1) / COMPRESSED_CHUNK_BITS;
+}
+
+// 0 or 1 if the whole chunk is clear or set, -1 if it's mixed or we'd have to look
+static int chunk_uniform(const bitmap_t *const bitmap, const size_t chunk)
+{
+	return bitmap->compressed ? compressed_chunk_uniform(bitmap->compressed, chunk) : -1;
+}
+
+// Bits past the end come back clear
+static void load_chunk(const bitmap_t *const bitmap, const size_t chunk, uint64_t *const words)
+{
+	if (bitmap->compressed)
+	{
+		compressed_load_chunk(bitmap->compressed, chunk, words);
+		return;
+	}
+	size_t total = (bitmap->bit_count + 63) / 64;
+	for (size_t w = 0; w < COMPRESSED_CHUNK_WORDS; ++w)
+	{
+		size_t word = chunk * COMPRESSED_CHUNK_WORDS + w;
+		words[w] = word < total ? load_word(bitmap, word) : 0;
+		if (word < total && word * 64 + 64 > bitmap->bit_count)
+		{
+			words[w] &= ~(~(uint64_t) 0 << (bitmap->bit_count - word * 64));
+		}
+	}
+}
+
+static bool store_chunk(bitmap_t *const bitmap, const size_t chunk, uint64_t *const words)
+{
+	if (bitmap->compressed)
+	{
+		return compressed_store_chunk(bitmap->compressed, chunk, words);
+	}
+	size_t first = chunk * (COMPRESSED_CHUNK_BITS / 8);
+	for (size_t byte = first; byte < bitmap->byte_count && byte - first < COMPRESSED_CHUNK_BITS / 8; ++byte)
+	{
+		bitmap->data[byte] = (uint8_t) (words[(byte - first) / 8] >> (8 * ((byte - first) & 7)));
+	}
+	return true;
+}
+
+static uint64_t apply_op(const BITMAP_OP op, const uint64_t x, const uint64_t y)
+{
+	switch (op)
+	{
+		case OP_AND:
+			return x & y;
+		case OP_OR:
+			return x | y;
+		case OP_XOR:
+			return x ^ y;
+		default:
+			return x & ~y;
+	}
+}
+
+static bool combine_chunks(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b, const BITMAP_OP op)
+{
+	uint64_t x[COMPRESSED_CHUNK_WORDS], y[COMPRESSED_CHUNK_WORDS];
+	for (size_t chunk = 0; chunk < chunk_count(a); ++chunk)
+	{
+		int ua = chunk_uniform(a, chunk), ub = chunk_uniform(b, chunk);
+		if (ua >= 0 && ub >= 0 && dst->compressed)
 		{
-			if (bitmap_test(bitmap, idx)) 
+			compressed_fill_chunk(dst->compressed, chunk, apply_op(op, (uint64_t) ua, (uint64_t) ub) & 1);
+			continue;
+		}
+		load_chunk(a, chunk, x);
+		load_chunk(b, chunk, y);
+		for (size_t w = 0; w < COMPRESSED_CHUNK_WORDS; ++w)
+		{
+			x[w] = apply_op(op, x[w], y[w]);
+		}
+		if (!store_chunk(dst, chunk, x))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// One loop per op (rather than a switch per word) so each one vectorizes
+#define COMBINE_LOOP(expr) \
+	for (; idx + 8 <= bytes; idx += 8) \
+	{ \
+		uint64_t x, y; \
+		memcpy(&x, a->data + idx, 8); \
+		memcpy(&y, b->data + idx, 8); \
+		x = (expr); \
+		memcpy(dst->data + idx, &x, 8); \
+	} \
+	for (; idx < bytes; ++idx) \
+	{ \
+		uint8_t x = a->data[idx], y = b->data[idx]; \
+		dst->data[idx] = (uint8_t) (expr); \
+	}
+
+static bool combine(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b, const BITMAP_OP op)
+{
+	if (!dst || !a || !b || a->bit_count != b->bit_count || dst->bit_count != a->bit_count)
+	{
+		return false;
+	}
+	if (dst->compressed || a->compressed || b->compressed)
+	{
+		return combine_chunks(dst, a, b, op);
+	}
+	const size_t bytes = a->byte_count;
+	size_t idx = 0;
+	switch (op)
+	{
+		case OP_AND:
+			COMBINE_LOOP(x & y)
+			break;
+		case OP_OR:
+			COMBINE_LOOP(x | y)
+			break;
+		case OP_XOR:
+			COMBINE_LOOP(x ^ y)
+			break;
+		case OP_ANDNOT:
+			COMBINE_LOOP(x & ~y)
+			break;
+	}
+	return true;
+}
+
+#undef COMBINE_LOOP
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b)
+{
+	return combine(dst, a, b, OP_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b)
+{
+	return combine(dst, a, b, OP_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b)
+{
+	return combine(dst, a, b, OP_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b)
+{
+	return combine(dst, a, b, OP_ANDNOT);
+}
+
+size_t bitmap_diff_count(const bitmap_t *const a, const bitmap_t *const b)
+{
+	if (!a || !b || a->bit_count != b->bit_count)
+	{
+		return SIZE_MAX;
+	}
+	if (a->compressed || b->compressed)
+	{
+		const bitmap_kernels_t *kernels = bitmap_kernels();
+		uint64_t x[COMPRESSED_CHUNK_WORDS], y[COMPRESSED_CHUNK_WORDS];
+		size_t total = 0;
+		for (size_t chunk = 0; chunk < chunk_count(a); ++chunk)
+		{
+			int ua = chunk_uniform(a, chunk), ub = chunk_uniform(b, chunk);
+			if (ua >= 0 && ub >= 0)
+			{
+				size_t first = chunk * COMPRESSED_CHUNK_BITS;
+				size_t bits = a->bit_count - first < COMPRESSED_CHUNK_BITS ? a->bit_count - first : COMPRESSED_CHUNK_BITS;
+				total += ua == ub ? 0 : bits;
+				continue;
+			}
+			load_chunk(a, chunk, x);
+			load_chunk(b, chunk, y);
+			for (size_t w = 0; w < COMPRESSED_CHUNK_WORDS; ++w)
 			{
-				func(idx, arg);
+				x[w] ^= y[w];
 			}
+			total += kernels->popcount((const uint8_t *) x, sizeof(x));
+		}
+		return total;
+	}
+	// xor a block at a time into a scratch buffer the popcount kernel can chew through
+	const bitmap_kernels_t *kernels = bitmap_kernels();
+	uint64_t scratch[512];
+	size_t full = a->leftover_bits ? a->byte_count - 1 : a->byte_count;
+	size_t total = 0;
+	for (size_t idx = 0; idx < full; idx += sizeof(scratch))
+	{
+		size_t len = full - idx < sizeof(scratch) ? full - idx : sizeof(scratch);
+		size_t words = len / 8;
+		for (size_t w = 0; w < words; ++w)
+		{
+			uint64_t x, y;
+			memcpy(&x, a->data + idx + w * 8, 8);
+			memcpy(&y, b->data + idx + w * 8, 8);
+			scratch[w] = x ^ y;
 		}
+		uint8_t *rest = (uint8_t *) (scratch + words);
+		for (size_t i = words * 8; i < len; ++i)
+		{
+			rest[i - words * 8] = a->data[idx + i] ^ b->data[idx + i];
+		}
+		total += kernels->popcount((const uint8_t *) scratch, len);
 	}
+	if (a->leftover_bits)
+	{
+		uint8_t last = (a->data[full] ^ b->data[full]) & mask_down_inclusive[a->leftover_bits - 1];
+		total += kernels->popcount(&last, 1);
+	}
+	return total;
+}
+
+size_t bitmap_diff_for_each(const bitmap_t *const a, const bitmap_t *const b,
+		void (*func)(size_t, bool, void *), void *arg)
+{
+	if (!a || !b || a->bit_count != b->bit_count)
+	{
+		return SIZE_MAX;
+	}
+	size_t total = 0;
+	if (a->compressed || b->compressed)
+	{
+		uint64_t x[COMPRESSED_CHUNK_WORDS], y[COMPRESSED_CHUNK_WORDS];
+		for (size_t chunk = 0; chunk < chunk_count(a); ++chunk)
+		{
+			int ua = chunk_uniform(a, chunk), ub = chunk_uniform(b, chunk);
+			if (ua >= 0 && ua == ub)
+			{
+				continue;
+			}
+			load_chunk(a, chunk, x);
+			load_chunk(b, chunk, y);
+			for (size_t w = 0; w < COMPRESSED_CHUNK_WORDS; ++w)
+			{
+				for (uint64_t diff = x[w] ^ y[w]; diff; diff &= diff - 1)
+				{
+					unsigned pos = (unsigned) __builtin_ctzll(diff);
+					if (func)
+					{
+						func(chunk * COMPRESSED_CHUNK_BITS + w * 64 + pos, (x[w] >> pos) & 1, arg);
+					}
+					++total;
+				}
+			}
+		}
+		return total;
+	}
+	size_t words = (a->bit_count + 63) / 64;
+	for (size_t word = 0; word < words; ++word)
+	{
+		// (bits past the end load as set in both, so they never differ)
+		uint64_t x = load_word(a, word);
+		uint64_t diff = x ^ load_word(b, word);
+		while (diff)
+		{
+			unsigned pos = (unsigned) __builtin_ctzll(diff);
+			if (func)
+			{
+				func(word * 64 + pos, (x >> pos) & 1, arg);
+			}
+			++total;
+			diff &= diff - 1;
+		}
+	}
+	return total;
 }
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
+	if (bitmap->compressed)
+	{
+		compressed_fill(bitmap->compressed, pattern);
+		return;
+	}
 	memset(bitmap->data, pattern, bitmap->byte_count);
 }
 
@@ -165,13 +777,37 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap)
 	return bitmap->byte_count;
 }
 
+size_t bitmap_get_resident_bytes(const bitmap_t *const bitmap)
+{
+	return bitmap->compressed ? compressed_resident_bytes(bitmap->compressed) : bitmap->byte_count;
+}
+
 bitmap_t *bitmap_create(const size_t n_bits) 
 {
 	return bitmap_initialize(n_bits, NONE);
 }
 
+bitmap_t *bitmap_create_compressed(const size_t n_bits)
+{
+	bitmap_t *bitmap = bitmap_initialize(n_bits, COMPRESSED);
+	if (bitmap)
+	{
+		bitmap->compressed = compressed_create(n_bits);
+		if (!bitmap->compressed)
+		{
+			free(bitmap);
+			return NULL;
+		}
+	}
+	return bitmap;
+}
+
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) 
 {
+	if (bitmap->compressed)
+	{
+		return compressed_export(bitmap->compressed);
+	}
 	return bitmap->data;
 }
 
@@ -189,6 +825,24 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
 	return NULL;
 }
 
+bitmap_t *bitmap_import_compressed(const size_t n_bits, const void *const bitmap_data)
+{
+	if (bitmap_data)
+	{
+		bitmap_t *bitmap = bitmap_initialize(n_bits, COMPRESSED);
+		if (bitmap)
+		{
+			bitmap->compressed = compressed_import(n_bits, bitmap_data);
+			if (bitmap->compressed)
+			{
+				return bitmap;
+			}
+			free(bitmap);
+		}
+	}
+	return NULL;
+}
+
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) 
 {
 	if (bitmap_data) 
@@ -203,6 +857,18 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data)
 	return NULL;
 }
 
+bitmap_t *bitmap_overlay_at(bitmap_header_t *const header, const size_t n_bits, void *const bitmap_data)
+{
+	if (header && n_bits && bitmap_data)
+	{
+		bitmap_t *bitmap = (bitmap_t *) header;
+		bitmap_setup(bitmap, n_bits, OVERLAY | EMBEDDED);
+		bitmap->data = (uint8_t *) bitmap_data;
+		return bitmap;
+	}
+	return NULL;
+}
+
 void bitmap_destroy(bitmap_t *bitmap) 
 {
 	if (bitmap) 
@@ -212,7 +878,12 @@ void bitmap_destroy(bitmap_t *bitmap)
 			// don't free memory that isn't ours!
 			free(bitmap->data);
 		}
-		free(bitmap);
+		compressed_destroy(bitmap->compressed);
+		if (!FLAG_CHECK(bitmap, EMBEDDED))
+		{
+			// (nor the header, for that matter)
+			free(bitmap);
+		}
 	}
 }
 
@@ -229,11 +900,7 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 		bitmap_t *bitmap = (bitmap_t *) malloc(sizeof(bitmap_t));
 		if (bitmap) 
 		{
-			bitmap->flags		 = flags;
-			bitmap->bit_count	 = n_bits;
-			bitmap->byte_count	= n_bits >> 3;
-			bitmap->leftover_bits = n_bits & 0x07;
-			bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+			bitmap_setup(bitmap, n_bits, flags);
 
 			// FLAG HANDLING HERE
 
@@ -241,9 +908,9 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 			// Maybe something like if (flags) and then contain a giant if/else-if for each flag
 			// Then a return at the end
 
-			if (FLAG_CHECK(bitmap, OVERLAY)) 
+			if (FLAG_CHECK(bitmap, OVERLAY) || FLAG_CHECK(bitmap, COMPRESSED)) 
 			{
-				// don't mess with data, caller will set it
+				// don't mess with data, caller will set it (or the compressed storage)
 				bitmap->data = NULL;
 				return bitmap;
 			} 
@@ -261,3 +928,14 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 	}
 	return NULL;
 }
+
+static void bitmap_setup(bitmap_t *const bitmap, size_t n_bits, BITMAP_FLAGS flags)
+{
+	bitmap->flags		 = flags;
+	bitmap->bit_count	 = n_bits;
+	bitmap->byte_count	= n_bits >> 3;
+	bitmap->leftover_bits = n_bits & 0x07;
+	bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+	bitmap->compressed = NULL;
+	bitmap->data = NULL;
+}
@@ -0,0 +1,905 @@
+#include <stdio.h>
+#include <string.h>
+#include "bitmap_compressed.h"
+
+typedef enum { ARRAY, WORDS, RUNS } CONTAINER;
+
+// An array holds at most this many offsets (at two bytes each it's then as big as the words)
+#define ARRAY_MAX 4096
+#define WORDS_BYTES (COMPRESSED_CHUNK_WORDS * 8)
+
+// A set bit and the ones after it, inclusive both ends
+typedef struct
+{
+	uint16_t start, last;
+} run_t;
+
+typedef struct
+{
+	CONTAINER kind;
+	uint32_t card;  // bits set
+	uint32_t runs;  // stretches of set bits, kept up to date whatever the kind
+	uint32_t len, cap;  // offsets or runs in use/room for (not used by WORDS)
+	union
+	{
+		uint16_t *array;  // sorted
+		uint64_t *words;  // COMPRESSED_CHUNK_WORDS of them
+		run_t *runs;      // sorted, never touching
+		void *data;
+	} u;
+} container_t;
+
+struct compressed
+{
+	size_t bits, chunks;
+	container_t **chunk;  // NULL for a chunk with nothing set
+	uint8_t *flat;        // last export
+};
+
+//
+// Containers
+//
+
+static size_t kind_bytes(const CONTAINER kind, const uint32_t card, const uint32_t runs)
+{
+	switch (kind)
+	{
+		case ARRAY:
+			return card <= ARRAY_MAX ? card * sizeof(uint16_t) : SIZE_MAX;
+		case RUNS:
+			return runs * sizeof(run_t);
+		default:
+			return WORDS_BYTES;
+	}
+}
+
+static CONTAINER best_kind(const uint32_t card, const uint32_t runs)
+{
+	size_t array = kind_bytes(ARRAY, card, runs), run = kind_bytes(RUNS, card, runs);
+	if (run <= array && run <= WORDS_BYTES)
+	{
+		return RUNS;
+	}
+	return array <= WORDS_BYTES ? ARRAY : WORDS;
+}
+
+// First entry >= v
+static uint32_t lower_bound(const uint16_t *const array, const uint32_t len, const uint32_t v)
+{
+	uint32_t lo = 0, hi = len;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (array[mid] < v)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// First run that ends at or after v
+static uint32_t run_after(const run_t *const runs, const uint32_t len, const uint32_t v)
+{
+	uint32_t lo = 0, hi = len;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (runs[mid].last < v)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Sets bits start..last (inclusive)
+static void words_set_range(uint64_t *const words, const uint32_t start, const uint32_t last)
+{
+	for (uint32_t word = start / 64; word <= last / 64; ++word)
+	{
+		uint64_t m = ~(uint64_t) 0;
+		if (word == start / 64)
+		{
+			m &= ~(uint64_t) 0 << (start & 63);
+		}
+		if (word == last / 64 && (last & 63) != 63)
+		{
+			m &= ((uint64_t) 1 << ((last & 63) + 1)) - 1;
+		}
+		words[word] |= m;
+	}
+}
+
+static void container_to_words(const container_t *const ct, uint64_t *const words)
+{
+	if (ct && ct->kind == WORDS)
+	{
+		memcpy(words, ct->u.words, WORDS_BYTES);
+		return;
+	}
+	memset(words, 0, WORDS_BYTES);
+	if (!ct)
+	{
+		return;
+	}
+	if (ct->kind == ARRAY)
+	{
+		for (uint32_t i = 0; i < ct->len; ++i)
+		{
+			words[ct->u.array[i] / 64] |= (uint64_t) 1 << (ct->u.array[i] & 63);
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < ct->len; ++i)
+		{
+			words_set_range(words, ct->u.runs[i].start, ct->u.runs[i].last);
+		}
+	}
+}
+
+// Swaps ct's storage for the given kind built from words. card and runs must already match words
+static bool container_build(container_t *const ct, const CONTAINER kind, const uint64_t *const words)
+{
+	uint32_t len = kind == ARRAY ? ct->card : kind == RUNS ? ct->runs : 0;
+	size_t bytes = kind == WORDS ? WORDS_BYTES : (size_t) (len ? len : 1) * (kind == ARRAY ? sizeof(uint16_t) : sizeof(run_t));
+	void *data = malloc(bytes);
+	if (!data)
+	{
+		return false;
+	}
+	if (kind == WORDS)
+	{
+		memcpy(data, words, WORDS_BYTES);
+	}
+	else
+	{
+		uint16_t *array = data;
+		run_t *runs = data;
+		uint32_t n = 0;
+		for (uint32_t word = 0; word < COMPRESSED_CHUNK_WORDS; ++word)
+		{
+			for (uint64_t w = words[word]; w; w &= w - 1)
+			{
+				uint32_t bit = word * 64 + (uint32_t) __builtin_ctzll(w);
+				if (kind == ARRAY)
+				{
+					array[n++] = (uint16_t) bit;
+				}
+				else if (n && runs[n - 1].last + 1u == bit)
+				{
+					runs[n - 1].last = (uint16_t) bit;
+				}
+				else
+				{
+					runs[n].start = runs[n].last = (uint16_t) bit;
+					++n;
+				}
+			}
+		}
+	}
+	free(ct->u.data);
+	ct->u.data = data;
+	ct->kind = kind;
+	ct->len = ct->cap = len;
+	return true;
+}
+
+static void count_words(const uint64_t *const words, uint32_t *const card, uint32_t *const runs)
+{
+	uint32_t c = 0, r = 0;
+	uint64_t carry = 0;  // top bit of the word before
+	for (uint32_t word = 0; word < COMPRESSED_CHUNK_WORDS; ++word)
+	{
+		uint64_t w = words[word];
+		c += (uint32_t) __builtin_popcountll(w);
+		// a run starts wherever a set bit has a clear one before it
+		r += (uint32_t) __builtin_popcountll(w & ~((w << 1) | carry));
+		carry = w >> 63;
+	}
+	*card = c;
+	*runs = r;
+}
+
+// Moves to a smaller kind once the current one is more than twice the size of the best
+static void container_settle(container_t *const ct)
+{
+	CONTAINER best = best_kind(ct->card, ct->runs);
+	if (best != ct->kind && kind_bytes(ct->kind, ct->card, ct->runs) > 2 * kind_bytes(best, ct->card, ct->runs))
+	{
+		uint64_t words[COMPRESSED_CHUNK_WORDS];
+		container_to_words(ct, words);
+		// (if there's no memory for the new one, the old one still works)
+		container_build(ct, best, words);
+	}
+}
+
+// Makes room for one more array offset or run
+static bool container_grow(container_t *const ct)
+{
+	if (ct->len < ct->cap)
+	{
+		return true;
+	}
+	uint32_t cap = ct->cap ? ct->cap * 2 : 4;
+	void *data = realloc(ct->u.data, (size_t) cap * (ct->kind == ARRAY ? sizeof(uint16_t) : sizeof(run_t)));
+	if (!data)
+	{
+		return false;
+	}
+	ct->u.data = data;
+	ct->cap = cap;
+	return true;
+}
+
+static bool container_test(const container_t *const ct, const uint32_t v)
+{
+	if (!ct)
+	{
+		return false;
+	}
+	switch (ct->kind)
+	{
+		case ARRAY:
+		{
+			uint32_t i = lower_bound(ct->u.array, ct->len, v);
+			return i < ct->len && ct->u.array[i] == v;
+		}
+		case WORDS:
+			return (ct->u.words[v / 64] >> (v & 63)) & 1;
+		default:
+		{
+			uint32_t i = run_after(ct->u.runs, ct->len, v);
+			return i < ct->len && ct->u.runs[i].start <= v;
+		}
+	}
+}
+
+// v must not be set yet
+static bool container_set(container_t *const ct, const uint32_t v)
+{
+	if (ct->kind == ARRAY && ct->len == ARRAY_MAX)
+	{
+		uint64_t words[COMPRESSED_CHUNK_WORDS];
+		container_to_words(ct, words);
+		if (!container_build(ct, WORDS, words))
+		{
+			return false;
+		}
+	}
+	switch (ct->kind)
+	{
+		case ARRAY:
+		{
+			uint16_t *a = ct->u.array;
+			uint32_t i = lower_bound(a, ct->len, v);
+			bool left = i > 0 && a[i - 1] + 1u == v, right = i < ct->len && a[i] == v + 1;
+			if (!container_grow(ct))
+			{
+				return false;
+			}
+			a = ct->u.array;
+			memmove(a + i + 1, a + i, (ct->len - i) * sizeof(uint16_t));
+			a[i] = (uint16_t) v;
+			ct->len++;
+			ct->runs = ct->runs + 1 - left - right;
+			break;
+		}
+		case WORDS:
+		{
+			const uint64_t *w = ct->u.words;
+			bool left = v > 0 && ((w[(v - 1) / 64] >> ((v - 1) & 63)) & 1);
+			bool right = v + 1 < COMPRESSED_CHUNK_BITS && ((w[(v + 1) / 64] >> ((v + 1) & 63)) & 1);
+			ct->u.words[v / 64] |= (uint64_t) 1 << (v & 63);
+			ct->runs = ct->runs + 1 - left - right;
+			break;
+		}
+		default:
+		{
+			run_t *r = ct->u.runs;
+			uint32_t i = run_after(r, ct->len, v);
+			// v falls between runs i - 1 and i
+			bool left = i > 0 && r[i - 1].last + 1u == v, right = i < ct->len && r[i].start == v + 1;
+			if (left && right)
+			{
+				r[i - 1].last = r[i].last;
+				memmove(r + i, r + i + 1, (ct->len - i - 1) * sizeof(run_t));
+				ct->len--;
+			}
+			else if (left)
+			{
+				r[i - 1].last = (uint16_t) v;
+			}
+			else if (right)
+			{
+				r[i].start = (uint16_t) v;
+			}
+			else
+			{
+				if (!container_grow(ct))
+				{
+					return false;
+				}
+				r = ct->u.runs;
+				memmove(r + i + 1, r + i, (ct->len - i) * sizeof(run_t));
+				r[i].start = r[i].last = (uint16_t) v;
+				ct->len++;
+			}
+			ct->runs = ct->len;
+			break;
+		}
+	}
+	ct->card++;
+	return true;
+}
+
+// v must be set
+static bool container_reset(container_t *const ct, const uint32_t v)
+{
+	switch (ct->kind)
+	{
+		case ARRAY:
+		{
+			uint16_t *a = ct->u.array;
+			uint32_t i = lower_bound(a, ct->len, v);
+			bool left = i > 0 && a[i - 1] + 1u == v, right = i + 1 < ct->len && a[i + 1] == v + 1;
+			memmove(a + i, a + i + 1, (ct->len - i - 1) * sizeof(uint16_t));
+			ct->len--;
+			ct->runs = ct->runs + left + right - 1;
+			break;
+		}
+		case WORDS:
+		{
+			const uint64_t *w = ct->u.words;
+			bool left = v > 0 && ((w[(v - 1) / 64] >> ((v - 1) & 63)) & 1);
+			bool right = v + 1 < COMPRESSED_CHUNK_BITS && ((w[(v + 1) / 64] >> ((v + 1) & 63)) & 1);
+			ct->u.words[v / 64] &= ~((uint64_t) 1 << (v & 63));
+			ct->runs = ct->runs + left + right - 1;
+			break;
+		}
+		default:
+		{
+			run_t *r = ct->u.runs;
+			uint32_t i = run_after(r, ct->len, v);
+			if (r[i].start == r[i].last)
+			{
+				memmove(r + i, r + i + 1, (ct->len - i - 1) * sizeof(run_t));
+				ct->len--;
+			}
+			else if (r[i].start == v)
+			{
+				r[i].start++;
+			}
+			else if (r[i].last == v)
+			{
+				r[i].last--;
+			}
+			else
+			{
+				// splits in two
+				if (!container_grow(ct))
+				{
+					return false;
+				}
+				r = ct->u.runs;
+				memmove(r + i + 2, r + i + 1, (ct->len - i - 1) * sizeof(run_t));
+				r[i + 1].start = (uint16_t) (v + 1);
+				r[i + 1].last = r[i].last;
+				r[i].last = (uint16_t) (v - 1);
+				ct->len++;
+			}
+			ct->runs = ct->len;
+			break;
+		}
+	}
+	ct->card--;
+	return true;
+}
+
+// First offset >= v that is set (or clear), COMPRESSED_CHUNK_BITS if none
+static uint32_t container_next(const container_t *const ct, uint32_t v, const bool value)
+{
+	if (!ct)
+	{
+		return value ? COMPRESSED_CHUNK_BITS : v;
+	}
+	switch (ct->kind)
+	{
+		case ARRAY:
+		{
+			uint32_t i = lower_bound(ct->u.array, ct->len, v);
+			if (value)
+			{
+				return i < ct->len ? ct->u.array[i] : COMPRESSED_CHUNK_BITS;
+			}
+			for (; i < ct->len && ct->u.array[i] == v; ++i, ++v)
+			{
+			}
+			return v;
+		}
+		case WORDS:
+		{
+			uint32_t word = v / 64;
+			uint64_t flip = value ? 0 : ~(uint64_t) 0;
+			uint64_t w = (ct->u.words[word] ^ flip) & (~(uint64_t) 0 << (v & 63));
+			while (!w && ++word < COMPRESSED_CHUNK_WORDS)
+			{
+				w = ct->u.words[word] ^ flip;
+			}
+			return w ? word * 64 + (uint32_t) __builtin_ctzll(w) : COMPRESSED_CHUNK_BITS;
+		}
+		default:
+		{
+			uint32_t i = run_after(ct->u.runs, ct->len, v);
+			if (value)
+			{
+				return i == ct->len ? COMPRESSED_CHUNK_BITS : ct->u.runs[i].start > v ? ct->u.runs[i].start : v;
+			}
+			// runs never touch, so the bit after one is always clear
+			return i < ct->len && ct->u.runs[i].start <= v ? ct->u.runs[i].last + 1u : v;
+		}
+	}
+}
+
+// Last set offset before v, UINT32_MAX if none
+static uint32_t container_prev(const container_t *const ct, const uint32_t v)
+{
+	if (!ct || !v)
+	{
+		return UINT32_MAX;
+	}
+	switch (ct->kind)
+	{
+		case ARRAY:
+		{
+			uint32_t i = lower_bound(ct->u.array, ct->len, v);
+			return i ? ct->u.array[i - 1] : UINT32_MAX;
+		}
+		case WORDS:
+		{
+			uint32_t word = (v - 1) / 64;
+			unsigned top = (v - 1) & 63;
+			uint64_t w = ct->u.words[word] & (top == 63 ? ~(uint64_t) 0 : ((uint64_t) 2 << top) - 1);
+			while (!w && word-- > 0)
+			{
+				w = ct->u.words[word];
+			}
+			return w ? word * 64 + 63 - (uint32_t) __builtin_clzll(w) : UINT32_MAX;
+		}
+		default:
+		{
+			// the run holding v - 1 or the last one before it
+			uint32_t i = run_after(ct->u.runs, ct->len, v - 1);
+			if (i < ct->len && ct->u.runs[i].start <= v - 1)
+			{
+				return v - 1;
+			}
+			return i ? ct->u.runs[i - 1].last : UINT32_MAX;
+		}
+	}
+}
+
+// Set bits in [lo, hi)
+static uint32_t container_count(const container_t *const ct, const uint32_t lo, const uint32_t hi)
+{
+	if (!ct || lo >= hi)
+	{
+		return 0;
+	}
+	if (lo == 0 && hi == COMPRESSED_CHUNK_BITS)
+	{
+		return ct->card;
+	}
+	uint32_t total = 0;
+	switch (ct->kind)
+	{
+		case ARRAY:
+			return lower_bound(ct->u.array, ct->len, hi) - lower_bound(ct->u.array, ct->len, lo);
+		case WORDS:
+			for (uint32_t word = lo / 64; word <= (hi - 1) / 64; ++word)
+			{
+				uint64_t w = ct->u.words[word];
+				if (word == lo / 64)
+				{
+					w &= ~(uint64_t) 0 << (lo & 63);
+				}
+				if (word == (hi - 1) / 64 && (hi & 63))
+				{
+					w &= ((uint64_t) 1 << (hi & 63)) - 1;
+				}
+				total += (uint32_t) __builtin_popcountll(w);
+			}
+			return total;
+		default:
+			for (uint32_t i = run_after(ct->u.runs, ct->len, lo); i < ct->len && ct->u.runs[i].start < hi; ++i)
+			{
+				uint32_t start = ct->u.runs[i].start > lo ? ct->u.runs[i].start : lo;
+				uint32_t end = ct->u.runs[i].last + 1u < hi ? ct->u.runs[i].last + 1u : hi;
+				total += end - start;
+			}
+			return total;
+	}
+}
+
+static size_t container_bytes(const container_t *const ct)
+{
+	if (!ct)
+	{
+		return 0;
+	}
+	size_t cap = ct->kind == WORDS ? WORDS_BYTES : ct->cap * (ct->kind == ARRAY ? sizeof(uint16_t) : sizeof(run_t));
+	return sizeof(container_t) + cap;
+}
+
+static void container_destroy(container_t *const ct)
+{
+	if (ct)
+	{
+		free(ct->u.data);
+		free(ct);
+	}
+}
+
+//
+// Chunks
+//
+
+// Bits in a chunk (only the last one can come up short)
+static uint32_t chunk_bits(const compressed_t *const c, const size_t chunk)
+{
+	size_t first = chunk * COMPRESSED_CHUNK_BITS;
+	return (uint32_t) (c->bits - first < COMPRESSED_CHUNK_BITS ? c->bits - first : COMPRESSED_CHUNK_BITS);
+}
+
+// A chunk with nothing in it frees its container
+static void chunk_settle(compressed_t *const c, const size_t chunk)
+{
+	container_t *ct = c->chunk[chunk];
+	if (!ct->card)
+	{
+		container_destroy(ct);
+		c->chunk[chunk] = NULL;
+	}
+	else
+	{
+		container_settle(ct);
+	}
+}
+
+compressed_t *compressed_create(const size_t bits)
+{
+	if (!bits)
+	{
+		return NULL;
+	}
+	compressed_t *c = calloc(1, sizeof(compressed_t));
+	if (!c)
+	{
+		return NULL;
+	}
+	c->bits = bits;
+	c->chunks = (bits + COMPRESSED_CHUNK_BITS - 1) / COMPRESSED_CHUNK_BITS;
+	c->chunk = calloc(c->chunks, sizeof(container_t *));
+	if (!c->chunk)
+	{
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+compressed_t *compressed_import(const size_t bits, const uint8_t *const data)
+{
+	compressed_t *c = data ? compressed_create(bits) : NULL;
+	if (!c)
+	{
+		return NULL;
+	}
+	size_t bytes = (bits + 7) / 8;
+	uint64_t words[COMPRESSED_CHUNK_WORDS];
+	for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+	{
+		memset(words, 0, sizeof(words));
+		size_t first = chunk * (COMPRESSED_CHUNK_BITS / 8);
+		for (size_t byte = first; byte < bytes && byte - first < COMPRESSED_CHUNK_BITS / 8; ++byte)
+		{
+			words[(byte - first) / 8] |= (uint64_t) data[byte] << (8 * ((byte - first) & 7));
+		}
+		if (!compressed_store_chunk(c, chunk, words))
+		{
+			compressed_destroy(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+void compressed_destroy(compressed_t *const c)
+{
+	if (c)
+	{
+		for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+		{
+			container_destroy(c->chunk[chunk]);
+		}
+		free(c->chunk);
+		free(c->flat);
+		free(c);
+	}
+}
+
+void compressed_set(compressed_t *const c, const size_t bit)
+{
+	size_t chunk = bit / COMPRESSED_CHUNK_BITS;
+	uint32_t v = (uint32_t) (bit % COMPRESSED_CHUNK_BITS);
+	container_t *ct = c->chunk[chunk];
+	if (container_test(ct, v))
+	{
+		return;
+	}
+	if (!ct)
+	{
+		ct = calloc(1, sizeof(container_t));
+		if (!ct)
+		{
+			perror("bitmap_set");
+			return;
+		}
+		ct->kind = ARRAY;
+		c->chunk[chunk] = ct;
+	}
+	if (!container_set(ct, v))
+	{
+		perror("bitmap_set");
+	}
+	chunk_settle(c, chunk);
+}
+
+void compressed_reset(compressed_t *const c, const size_t bit)
+{
+	size_t chunk = bit / COMPRESSED_CHUNK_BITS;
+	uint32_t v = (uint32_t) (bit % COMPRESSED_CHUNK_BITS);
+	container_t *ct = c->chunk[chunk];
+	if (!container_test(ct, v))
+	{
+		return;
+	}
+	if (!container_reset(ct, v))
+	{
+		perror("bitmap_reset");
+	}
+	chunk_settle(c, chunk);
+}
+
+bool compressed_test(const compressed_t *const c, const size_t bit)
+{
+	return container_test(c->chunk[bit / COMPRESSED_CHUNK_BITS], (uint32_t) (bit % COMPRESSED_CHUNK_BITS));
+}
+
+size_t compressed_next(const compressed_t *const c, const size_t from, const size_t end, const bool value)
+{
+	for (size_t bit = from; bit < end;)
+	{
+		size_t chunk = bit / COMPRESSED_CHUNK_BITS;
+		uint32_t found = container_next(c->chunk[chunk], (uint32_t) (bit % COMPRESSED_CHUNK_BITS), value);
+		if (found < COMPRESSED_CHUNK_BITS)
+		{
+			size_t hit = chunk * COMPRESSED_CHUNK_BITS + found;
+			return hit < end ? hit : end;
+		}
+		bit = (chunk + 1) * COMPRESSED_CHUNK_BITS;
+	}
+	return end;
+}
+
+size_t compressed_prev_set(const compressed_t *const c, const size_t bit)
+{
+	if (!bit)
+	{
+		return SIZE_MAX;
+	}
+	size_t chunk = (bit - 1) / COMPRESSED_CHUNK_BITS;
+	uint32_t limit = (uint32_t) ((bit - 1) % COMPRESSED_CHUNK_BITS) + 1;
+	for (;;)
+	{
+		uint32_t found = container_prev(c->chunk[chunk], limit);
+		if (found != UINT32_MAX)
+		{
+			return chunk * COMPRESSED_CHUNK_BITS + found;
+		}
+		if (!chunk--)
+		{
+			return SIZE_MAX;
+		}
+		limit = COMPRESSED_CHUNK_BITS;
+	}
+}
+
+size_t compressed_count(const compressed_t *const c, const size_t first, const size_t end)
+{
+	size_t total = 0;
+	for (size_t chunk = first / COMPRESSED_CHUNK_BITS; chunk * COMPRESSED_CHUNK_BITS < end; ++chunk)
+	{
+		size_t base = chunk * COMPRESSED_CHUNK_BITS;
+		uint32_t lo = (uint32_t) (first > base ? first - base : 0);
+		uint32_t hi = (uint32_t) (end - base < COMPRESSED_CHUNK_BITS ? end - base : COMPRESSED_CHUNK_BITS);
+		total += container_count(c->chunk[chunk], lo, hi);
+	}
+	return total;
+}
+
+void compressed_invert(compressed_t *const c)
+{
+	uint64_t words[COMPRESSED_CHUNK_WORDS];
+	for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+	{
+		int uniform = compressed_chunk_uniform(c, chunk);
+		if (uniform >= 0)
+		{
+			compressed_fill_chunk(c, chunk, !uniform);
+			continue;
+		}
+		compressed_load_chunk(c, chunk, words);
+		for (size_t word = 0; word < COMPRESSED_CHUNK_WORDS; ++word)
+		{
+			words[word] = ~words[word];
+		}
+		if (!compressed_store_chunk(c, chunk, words))
+		{
+			perror("bitmap_invert");
+		}
+	}
+}
+
+void compressed_fill(compressed_t *const c, const uint8_t pattern)
+{
+	if (pattern == 0x00 || pattern == 0xFF)
+	{
+		for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+		{
+			compressed_fill_chunk(c, chunk, pattern);
+		}
+		return;
+	}
+	uint64_t words[COMPRESSED_CHUNK_WORDS];
+	for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+	{
+		memset(words, pattern, sizeof(words));
+		if (!compressed_store_chunk(c, chunk, words))
+		{
+			perror("bitmap_format");
+		}
+	}
+}
+
+int compressed_chunk_uniform(const compressed_t *const c, const size_t chunk)
+{
+	const container_t *ct = c->chunk[chunk];
+	if (!ct)
+	{
+		return 0;
+	}
+	return ct->card == chunk_bits(c, chunk) ? 1 : -1;
+}
+
+void compressed_fill_chunk(compressed_t *const c, const size_t chunk, const bool value)
+{
+	container_t *ct = c->chunk[chunk];
+	if (!value)
+	{
+		container_destroy(ct);
+		c->chunk[chunk] = NULL;
+		return;
+	}
+	// all set is a single run
+	run_t *run = malloc(sizeof(run_t));
+	if (!run || (!ct && !(ct = calloc(1, sizeof(container_t)))))
+	{
+		free(run);
+		perror("bitmap_format");
+		return;
+	}
+	free(ct->u.data);
+	run->start = 0;
+	run->last = (uint16_t) (chunk_bits(c, chunk) - 1);
+	ct->u.runs = run;
+	ct->kind = RUNS;
+	ct->card = chunk_bits(c, chunk);
+	ct->runs = ct->len = ct->cap = 1;
+	c->chunk[chunk] = ct;
+}
+
+void compressed_load_chunk(const compressed_t *const c, const size_t chunk, uint64_t *const words)
+{
+	container_to_words(c->chunk[chunk], words);
+}
+
+bool compressed_store_chunk(compressed_t *const c, const size_t chunk, uint64_t *const words)
+{
+	uint32_t bits = chunk_bits(c, chunk);
+	if (bits < COMPRESSED_CHUNK_BITS)
+	{
+		if (bits & 63)
+		{
+			words[bits / 64] &= ((uint64_t) 1 << (bits & 63)) - 1;
+		}
+		memset(words + (bits + 63) / 64, 0, (COMPRESSED_CHUNK_WORDS - (bits + 63) / 64) * sizeof(uint64_t));
+	}
+	uint32_t card, runs;
+	count_words(words, &card, &runs);
+	if (!card)
+	{
+		compressed_fill_chunk(c, chunk, false);
+		return true;
+	}
+	container_t *ct = c->chunk[chunk];
+	bool fresh = !ct;
+	if (fresh && !(ct = calloc(1, sizeof(container_t))))
+	{
+		return false;
+	}
+	container_t was = *ct;
+	ct->card = card;
+	ct->runs = runs;
+	if (!container_build(ct, best_kind(card, runs), words))
+	{
+		if (fresh)
+		{
+			free(ct);
+		}
+		else
+		{
+			*ct = was;
+		}
+		return false;
+	}
+	c->chunk[chunk] = ct;
+	return true;
+}
+
+const uint8_t *compressed_export(compressed_t *const c)
+{
+	size_t bytes = (c->bits + 7) / 8;
+	uint8_t *flat = realloc(c->flat, bytes);
+	if (!flat)
+	{
+		return NULL;
+	}
+	c->flat = flat;
+	uint64_t words[COMPRESSED_CHUNK_WORDS];
+	for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+	{
+		size_t first = chunk * (COMPRESSED_CHUNK_BITS / 8);
+		if (!c->chunk[chunk])
+		{
+			size_t len = bytes - first < COMPRESSED_CHUNK_BITS / 8 ? bytes - first : COMPRESSED_CHUNK_BITS / 8;
+			memset(flat + first, 0, len);
+			continue;
+		}
+		compressed_load_chunk(c, chunk, words);
+		for (size_t byte = first; byte < bytes && byte - first < COMPRESSED_CHUNK_BITS / 8; ++byte)
+		{
+			flat[byte] = (uint8_t) (words[(byte - first) / 8] >> (8 * ((byte - first) & 7)));
+		}
+	}
+	return flat;
+}
+
+size_t compressed_resident_bytes(const compressed_t *const c)
+{
+	size_t total = sizeof(compressed_t) + c->chunks * sizeof(container_t *);
+	for (size_t chunk = 0; chunk < c->chunks; ++chunk)
+	{
+		total += container_bytes(c->chunk[chunk]);
+	}
+	return total;
+}
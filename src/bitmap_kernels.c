@@ -0,0 +1,182 @@
+#include "bitmap_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_KERNELS_X86
+#endif
+
+// Total bits set in the given byte in a handy lookup table
+// Macros, man...
+// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
+#define B2(n) n, n + 1, n + 1, n + 2
+#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
+#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
+static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
+#undef B6
+#undef B4
+#undef B2
+
+// There is an alternative for getting bit count that only loops as many times as there are bits set
+// but that's still a loop and this table is 256B.
+/*
+   unsigned int v; // count the number of bits set in v
+   unsigned int c; // c accumulates the total bits set in v
+
+   for (c = 0; v; v >>= 1)
+   {
+   c += v & 1;
+   }
+ */
+
+// The original loops, and the fallback everywhere else
+static size_t popcount_scalar(const uint8_t *data, size_t len)
+{
+	size_t total = 0;
+	for (size_t idx = 0; idx < len; ++idx)
+	{
+		total += bit_totals[data[idx]];
+	}
+	return total;
+}
+
+static void invert_scalar(uint8_t *data, size_t len)
+{
+	for (size_t byte = 0; byte < len; ++byte)
+	{
+		data[byte] = ~data[byte];
+	}
+}
+
+static const bitmap_kernels_t kernels_scalar = {"scalar", popcount_scalar, invert_scalar};
+
+#ifdef BITMAP_KERNELS_X86
+
+// SSE2 has no byte shuffle, so count 16 bytes at a time the bit-twiddling way
+//  and let psadbw add the byte counts up
+__attribute__((target("sse2"))) static size_t popcount_sse2(const uint8_t *data, size_t len)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0F);
+	__m128i acc = _mm_setzero_si128();
+	size_t idx = 0;
+	for (; idx + 16 <= len; idx += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (data + idx));
+		v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+		v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+		v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	return (size_t) (lanes[0] + lanes[1]) + popcount_scalar(data + idx, len - idx);
+}
+
+__attribute__((target("sse2"))) static void invert_sse2(uint8_t *data, size_t len)
+{
+	const __m128i ones = _mm_set1_epi8((char) 0xFF);
+	size_t idx = 0;
+	for (; idx + 16 <= len; idx += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (data + idx));
+		_mm_storeu_si128((__m128i *) (data + idx), _mm_xor_si128(v, ones));
+	}
+	invert_scalar(data + idx, len - idx);
+}
+
+// Nibble lookup with vpshufb (Mula's method), summed with vpsadbw every vector
+__attribute__((target("avx2"))) static size_t popcount_avx2(const uint8_t *data, size_t len)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	__m256i acc = _mm256_setzero_si256();
+	size_t idx = 0;
+	for (; idx + 32 <= len; idx += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (data + idx));
+		__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+		__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return (size_t) (lanes[0] + lanes[1] + lanes[2] + lanes[3]) + popcount_scalar(data + idx, len - idx);
+}
+
+__attribute__((target("avx2"))) static void invert_avx2(uint8_t *data, size_t len)
+{
+	const __m256i ones = _mm256_set1_epi8((char) 0xFF);
+	size_t idx = 0;
+	for (; idx + 32 <= len; idx += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (data + idx));
+		_mm256_storeu_si256((__m256i *) (data + idx), _mm256_xor_si256(v, ones));
+	}
+	invert_scalar(data + idx, len - idx);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static size_t popcount_avx512(const uint8_t *data, size_t len)
+{
+	__m512i acc = _mm512_setzero_si512();
+	size_t idx = 0;
+	for (; idx + 64 <= len; idx += 64)
+	{
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512((const void *) (data + idx))));
+	}
+	return (size_t) _mm512_reduce_add_epi64(acc) + popcount_scalar(data + idx, len - idx);
+}
+
+__attribute__((target("avx512f"))) static void invert_avx512(uint8_t *data, size_t len)
+{
+	const __m512i ones = _mm512_set1_epi32(-1);
+	size_t idx = 0;
+	for (; idx + 64 <= len; idx += 64)
+	{
+		__m512i v = _mm512_loadu_si512((const void *) (data + idx));
+		_mm512_storeu_si512((void *) (data + idx), _mm512_xor_si512(v, ones));
+	}
+	invert_scalar(data + idx, len - idx);
+}
+
+static const bitmap_kernels_t kernels_sse2 = {"sse2", popcount_sse2, invert_sse2};
+static const bitmap_kernels_t kernels_avx2 = {"avx2", popcount_avx2, invert_avx2};
+static const bitmap_kernels_t kernels_avx512 = {"avx512", popcount_avx512, invert_avx512};
+
+#endif
+
+const bitmap_kernels_t *bitmap_kernels_for(const BITMAP_KERNELS which)
+{
+	switch (which)
+	{
+		case BITMAP_KERNELS_SCALAR:
+			return &kernels_scalar;
+#ifdef BITMAP_KERNELS_X86
+		case BITMAP_KERNELS_SSE2:
+			return __builtin_cpu_supports("sse2") ? &kernels_sse2 : NULL;
+		case BITMAP_KERNELS_AVX2:
+			return __builtin_cpu_supports("avx2") ? &kernels_avx2 : NULL;
+		case BITMAP_KERNELS_AVX512:
+			return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq") ? &kernels_avx512 : NULL;
+#endif
+		default:
+			return NULL;
+	}
+}
+
+const bitmap_kernels_t *bitmap_kernels(void)
+{
+	// Every thread works out the same answer, so racing to store it is harmless
+	static const bitmap_kernels_t *best;
+	const bitmap_kernels_t *kernels = __atomic_load_n(&best, __ATOMIC_RELAXED);
+	if (!kernels)
+	{
+		for (int which = BITMAP_KERNELS_COUNT - 1; !kernels; --which)
+		{
+			kernels = bitmap_kernels_for((BITMAP_KERNELS) which);
+		}
+		__atomic_store_n(&best, kernels, __ATOMIC_RELAXED);
+	}
+	return kernels;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bitmap_parallel.h"
+
+// Never start more threads than this, however many CPUs there are
+#define BITMAP_POOL_MAX_THREADS 256
+
+struct bitmap_pool
+{
+	unsigned threads;  // counting the caller's
+	pthread_t *workers;
+	unsigned joined;   // hands out worker numbers
+	pthread_mutex_t run_lock;  // one scan at a time
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long generation;  // bumped for every scan
+	unsigned busy;             // workers yet to finish the current one
+	void (*job)(void *, unsigned);
+	void *arg;
+	bool stopping;
+};
+
+static void *worker_main(void *arg)
+{
+	bitmap_pool_t *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	// 0 is the caller
+	unsigned worker = ++pool->joined;
+	// (starts from 0 rather than the current generation so a scan that
+	//  began before this thread got here isn't missed)
+	unsigned long seen = 0;
+	for (;;)
+	{
+		while (!pool->stopping && pool->generation == seen)
+		{
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->stopping)
+		{
+			break;
+		}
+		seen = pool->generation;
+		void (*job)(void *, unsigned) = pool->job;
+		void *job_arg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+		job(job_arg, worker);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+		{
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+bitmap_pool_t *bitmap_pool_create(const unsigned threads)
+{
+	unsigned want = threads;
+	if (!want)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		want = cpus > 0 ? (unsigned) cpus : 1;
+	}
+	if (want > BITMAP_POOL_MAX_THREADS)
+	{
+		want = BITMAP_POOL_MAX_THREADS;
+	}
+	bitmap_pool_t *pool = calloc(1, sizeof(bitmap_pool_t));
+	if (!pool)
+	{
+		return NULL;
+	}
+	pool->workers = calloc(want, sizeof(pthread_t));
+	if (!pool->workers)
+	{
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	// make do with however many threads we managed to start
+	for (pool->threads = 1; pool->threads < want; ++pool->threads)
+	{
+		if (pthread_create(&pool->workers[pool->threads - 1], NULL, worker_main, pool))
+		{
+			break;
+		}
+	}
+	return pool;
+}
+
+unsigned bitmap_pool_threads(const bitmap_pool_t *const pool)
+{
+	return pool ? pool->threads : 1;
+}
+
+void bitmap_pool_destroy(bitmap_pool_t *const pool)
+{
+	if (!pool)
+	{
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i + 1 < pool->threads; ++i)
+	{
+		pthread_join(pool->workers[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+	free(pool->workers);
+	free(pool);
+}
+
+// Runs job on every thread in the pool (the caller's as worker 0) and waits for them all
+static void pool_run(bitmap_pool_t *const pool, void (*job)(void *, unsigned), void *arg)
+{
+	pthread_mutex_lock(&pool->run_lock);
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->arg = arg;
+	pool->busy = pool->threads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	job(arg, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+	{
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->run_lock);
+}
+
+typedef enum { SCAN_COUNT, SCAN_FIRST_SET, SCAN_FIRST_ZERO, SCAN_EACH } SCAN;
+
+struct scan
+{
+	SCAN what;
+	const bitmap_t *bitmap;
+	size_t bits;
+	size_t chunks;
+	size_t next_chunk;  // claimed in order, atomically
+	size_t result;      // total, or best hit so far
+	void (*func)(size_t, void *);
+	void *const *contexts;
+};
+
+static void scan_job(void *arg, unsigned worker)
+{
+	struct scan *scan = arg;
+	size_t total = 0;
+	for (;;)
+	{
+		size_t chunk = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED);
+		if (chunk >= scan->chunks)
+		{
+			break;
+		}
+		size_t first = chunk * BITMAP_PARALLEL_CHUNK_BITS;
+		size_t end = first + BITMAP_PARALLEL_CHUNK_BITS < scan->bits ? first + BITMAP_PARALLEL_CHUNK_BITS : scan->bits;
+		if (scan->what == SCAN_COUNT)
+		{
+			total += bitmap_total_set_in(scan->bitmap, first, end);
+		}
+		else if (scan->what == SCAN_EACH)
+		{
+			void *context = scan->contexts ? scan->contexts[worker] : NULL;
+			for (size_t bit = bitmap_next_set_in(scan->bitmap, first, end); bit != SIZE_MAX;
+					bit = bitmap_next_set_in(scan->bitmap, bit + 1, end))
+			{
+				scan->func(bit, context);
+			}
+		}
+		else
+		{
+			// Chunks are handed out in order, so once something earlier has turned up
+			//  every chunk still to come is too late to matter
+			if (first >= __atomic_load_n(&scan->result, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+			size_t hit = scan->what == SCAN_FIRST_SET ? bitmap_next_set_in(scan->bitmap, first, end)
+				: bitmap_next_zero_in(scan->bitmap, first, end);
+			if (hit != SIZE_MAX)
+			{
+				size_t best = __atomic_load_n(&scan->result, __ATOMIC_RELAXED);
+				while (hit < best && !__atomic_compare_exchange_n(&scan->result, &best, hit, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				{
+				}
+				break;
+			}
+		}
+	}
+	if (scan->what == SCAN_COUNT)
+	{
+		__atomic_fetch_add(&scan->result, total, __ATOMIC_RELAXED);
+	}
+}
+
+static size_t run_scan(struct scan *const scan, bitmap_pool_t *const pool)
+{
+	scan->bits = bitmap_get_bits(scan->bitmap);
+	scan->chunks = (scan->bits + BITMAP_PARALLEL_CHUNK_BITS - 1) / BITMAP_PARALLEL_CHUNK_BITS;
+	scan->next_chunk = 0;
+	scan->result = scan->what == SCAN_COUNT ? 0 : SIZE_MAX;
+	if (pool && pool->threads > 1 && scan->chunks > 1)
+	{
+		pool_run(pool, scan_job, scan);
+	}
+	else
+	{
+		scan_job(scan, 0);
+	}
+	return scan->result;
+}
+
+size_t bitmap_total_set_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool)
+{
+	if (!bitmap)
+	{
+		return 0;
+	}
+	struct scan scan = {.what = SCAN_COUNT, .bitmap = bitmap};
+	return run_scan(&scan, pool);
+}
+
+size_t bitmap_ffs_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool)
+{
+	if (!bitmap)
+	{
+		return SIZE_MAX;
+	}
+	struct scan scan = {.what = SCAN_FIRST_SET, .bitmap = bitmap};
+	return run_scan(&scan, pool);
+}
+
+size_t bitmap_ffz_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool)
+{
+	if (!bitmap)
+	{
+		return SIZE_MAX;
+	}
+	struct scan scan = {.what = SCAN_FIRST_ZERO, .bitmap = bitmap};
+	return run_scan(&scan, pool);
+}
+
+void bitmap_for_each_parallel(const bitmap_t *const bitmap, bitmap_pool_t *const pool,
+		void (*func)(size_t, void *), void *const *contexts)
+{
+	if (bitmap && func)
+	{
+		struct scan scan = {.what = SCAN_EACH, .bitmap = bitmap, .func = func, .contexts = contexts};
+		run_scan(&scan, pool);
+	}
+}
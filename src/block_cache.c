@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "block_cache.h"
+#include "block_io.h"
+
+// Readahead kicks in after this many back-to-back sequential reads
+#define RA_TRIGGER 2
+// Window a fresh stream starts with (it doubles while prefetches keep getting used)
+#define RA_MIN_WINDOW 4
+// Fills the cache keeps in flight at most
+#define RA_IO_DEPTH 32
+
+struct frame {
+    size_t block_id;
+    int next;        // hash chain
+    bool valid;
+    bool dirty;
+    bool ref;        // CLOCK second-chance bit
+    bool loading;    // async fill in flight, pinned until it lands
+    bool orphan;     // invalidated mid-fill, already out of the hash
+    bool prefetched; // brought in by readahead and not read yet
+    bool writing;    // copied into a writeback batch, pinned until it's done
+    uint64_t dirtied;   // when it went from clean to dirty (CLOCK_MONOTONIC ns)
+    uint64_t version;   // bumped on every write so a writeback knows if it's stale
+};
+
+// Async fills need to find their way back to the frame
+struct fill {
+    block_cache_t *cache;
+    int frame;
+};
+
+struct block_cache {
+    int fd;
+    size_t block_size;
+    size_t capacity;
+    size_t num_blocks;
+    struct frame *frames;
+    struct fill *fills;
+    uint8_t *slab;        // capacity * block_size bytes of frame data
+    int *buckets;         // block id -> first frame in chain
+    size_t bucket_mask;
+    size_t hand;          // CLOCK hand
+    block_io_t *io;       // only made once something gets prefetched
+
+    // sequential stream detection
+    size_t next_expected; // block right after the last one read
+    size_t streak;        // back-to-back sequential reads so far
+    size_t ra_next;       // first block the current stream hasn't prefetched
+    size_t ra_window;
+    size_t ra_max_window; // 0 turns readahead off
+    const bitmap_t *skip; // blocks the file is behind on, never prefetched
+
+    block_store_cache_stats_t stats;
+};
+
+struct wb_entry {
+    size_t block_id;
+    int frame;
+    uint64_t version;   // frame version when it was copied
+};
+
+// Dirty frames copied out, sorted by block, so they can be written without the cache
+struct block_cache_wb {
+    int fd;
+    size_t block_size;
+    size_t count;
+    size_t writes;      // write calls it took once runs were merged
+    struct wb_entry *entries;
+    uint8_t *data;      // count blocks, in entries order
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint8_t *frame_data(const block_cache_t *const cache, const size_t f)
+{
+    return cache->slab + f * cache->block_size;
+}
+
+static inline off_t frame_offset(const block_cache_t *const cache, const size_t f)
+{
+    return (off_t)(cache->frames[f].block_id * cache->block_size);
+}
+
+static int lookup(const block_cache_t *const cache, const size_t block_id)
+{
+    int f = cache->buckets[block_id & cache->bucket_mask];
+    while (f >= 0 && cache->frames[f].block_id != block_id) {
+        f = cache->frames[f].next;
+    }
+    return f;
+}
+
+static void hash_insert(block_cache_t *const cache, const int f)
+{
+    int *head = &cache->buckets[cache->frames[f].block_id & cache->bucket_mask];
+    cache->frames[f].next = *head;
+    *head = f;
+}
+
+static void hash_remove(block_cache_t *const cache, const int f)
+{
+    int *link = &cache->buckets[cache->frames[f].block_id & cache->bucket_mask];
+    while (*link != f) {
+        link = &cache->frames[*link].next;
+    }
+    *link = cache->frames[f].next;
+}
+
+static bool write_back(block_cache_t *const cache, const size_t f)
+{
+    if (!block_io_pwrite(cache->fd, frame_data(cache, f), cache->block_size, frame_offset(cache, f))) {
+        perror("cache: write back failed");
+        return false;
+    }
+    cache->frames[f].dirty = false;
+    cache->stats.dirty--;
+    cache->stats.writebacks++;
+    return true;
+}
+
+static void drop(block_cache_t *const cache, const int f)
+{
+    struct frame *fr = &cache->frames[f];
+    if (!fr->orphan) {
+        hash_remove(cache, f);
+    }
+    if (fr->prefetched) {
+        // read ahead for nothing, so the stream was less sequential than it looked
+        cache->stats.prefetch_wasted++;
+        if (cache->ra_window > RA_MIN_WINDOW) {
+            cache->ra_window >>= 1;
+        }
+    }
+    if (fr->dirty) {
+        cache->stats.dirty--;
+    }
+    fr->valid = false;
+    fr->dirty = false;
+    fr->loading = false;
+    fr->orphan = false;
+    fr->prefetched = false;
+    fr->writing = false;
+    cache->stats.resident--;
+}
+
+static void fill_done(void *arg, ssize_t result)
+{
+    struct fill *fill = arg;
+    block_cache_t *cache = fill->cache;
+    struct frame *fr = &cache->frames[fill->frame];
+    fr->loading = false;
+    if (fr->orphan || result != (ssize_t)cache->block_size) {
+        fr->prefetched = false; // not its fault
+        drop(cache, fill->frame);
+    }
+}
+
+// Lands whatever fills have finished without waiting on the rest
+static void reap(block_cache_t *const cache)
+{
+    if (cache->io && block_io_inflight(cache->io)) {
+        block_io_poll(cache->io, 0);
+    }
+}
+
+// CLOCK: sweep until something without its reference bit turns up
+// The first lap passes over dirty frames too, the background writer will get to them
+// Two full laps without luck means everything is pinned or refused to write back
+static int find_victim(block_cache_t *const cache)
+{
+    for (;;) {
+        for (size_t step = 0; step < 2 * cache->capacity + 1; ++step) {
+            size_t f = cache->hand;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            struct frame *fr = &cache->frames[f];
+            if (!fr->valid) {
+                return (int)f;
+            }
+            if (fr->loading || fr->writing || ((fr->prefetched || fr->dirty) && step < cache->capacity)) {
+                // unread prefetches and dirty frames only go once a whole lap turned up nothing better
+                continue;
+            }
+            if (fr->ref) {
+                fr->ref = false;
+                continue;
+            }
+            if (fr->dirty && !write_back(cache, f)) {
+                continue;
+            }
+            drop(cache, (int)f);
+            cache->stats.evictions++;
+            return (int)f;
+        }
+        // wait out a fill and go again, unless there's nothing to wait for
+        if (!cache->io || !block_io_poll(cache->io, 1)) {
+            return -1;
+        }
+    }
+}
+
+// Claims a frame for block_id, without touching its contents
+static int install(block_cache_t *const cache, const size_t block_id)
+{
+    int f = find_victim(cache);
+    if (f < 0) {
+        return -1;
+    }
+    struct frame *fr = &cache->frames[f];
+    fr->block_id = block_id;
+    fr->valid = true;
+    fr->dirty = false;
+    fr->ref = true;
+    fr->loading = false;
+    fr->orphan = false;
+    fr->prefetched = false;
+    hash_insert(cache, f);
+    cache->stats.resident++;
+    return f;
+}
+
+static void wait_loaded(block_cache_t *const cache, const int f)
+{
+    while (cache->frames[f].loading && block_io_poll(cache->io, 1)) {
+    }
+}
+
+// Looks a block up for use, waiting out a fill if one is in flight
+// Returns -1 on a miss (or if the fill failed)
+static int use(block_cache_t *const cache, const size_t block_id)
+{
+    int f = lookup(cache, block_id);
+    if (f >= 0 && cache->frames[f].loading) {
+        wait_loaded(cache, f);
+        f = lookup(cache, block_id);
+    }
+    if (f >= 0) {
+        struct frame *fr = &cache->frames[f];
+        cache->stats.hits++;
+        fr->ref = true;
+        if (fr->prefetched) {
+            fr->prefetched = false;
+            cache->stats.prefetch_hits++;
+        }
+    }
+    return f;
+}
+
+// Watches the read pattern and keeps the next window in flight for sequential streams
+static void read_ahead(block_cache_t *const cache, const size_t block_id)
+{
+    if (block_id == cache->next_expected) {
+        cache->streak++;
+    } else {
+        cache->streak = 1;
+        cache->ra_window = RA_MIN_WINDOW;
+        cache->ra_next = block_id + 1;
+    }
+    cache->next_expected = block_id + 1;
+    if (!cache->ra_max_window || cache->streak < RA_TRIGGER) {
+        return;
+    }
+
+    if (cache->ra_next < block_id + 1) {
+        cache->ra_next = block_id + 1;
+    }
+    // top up once less than half a window is left ahead of the reader
+    if (cache->ra_next - (block_id + 1) < cache->ra_window / 2 && cache->ra_next < cache->num_blocks) {
+        size_t window = cache->ra_window < cache->ra_max_window ? cache->ra_window : cache->ra_max_window;
+        block_cache_prefetch(cache, cache->ra_next, window);
+        cache->ra_next += window;
+        if (cache->ra_window < cache->ra_max_window) {
+            cache->ra_window <<= 1;
+        }
+    }
+}
+
+bool block_cache_read(block_cache_t *const cache, const size_t block_id, void *buffer)
+{
+    reap(cache);
+    int f = use(cache, block_id);
+    if (f < 0) {
+        cache->stats.misses++;
+        f = install(cache, block_id);
+        if (f < 0) {
+            return false;
+        }
+        if (!block_io_pread(cache->fd, frame_data(cache, f), cache->block_size, frame_offset(cache, f))) {
+            drop(cache, f);
+            return false;
+        }
+    }
+    memcpy(buffer, frame_data(cache, f), cache->block_size);
+    read_ahead(cache, block_id);
+    return true;
+}
+
+bool block_cache_write(block_cache_t *const cache, const size_t block_id, const void *buffer)
+{
+    reap(cache);
+    int f = use(cache, block_id);
+    if (f < 0) {
+        // the whole block gets overwritten, so no need to read it first
+        cache->stats.misses++;
+        f = install(cache, block_id);
+        if (f < 0) {
+            return false;
+        }
+    }
+    memcpy(frame_data(cache, f), buffer, cache->block_size);
+    struct frame *fr = &cache->frames[f];
+    if (!fr->dirty) {
+        fr->dirty = true;
+        fr->dirtied = now_ns();
+        cache->stats.dirty++;
+    }
+    fr->version++;
+    return true;
+}
+
+size_t block_cache_prefetch(block_cache_t *const cache, const size_t first, const size_t count)
+{
+    if (!cache->io) {
+        cache->io = block_io_create(cache->fd, RA_IO_DEPTH);
+        if (!cache->io) {
+            return 0;
+        }
+    }
+    // never prefetch so much that it pushes out its own work
+    size_t n = count < cache->capacity / 2 ? count : cache->capacity / 2;
+    size_t issued = 0;
+    for (size_t id = first; id < first + n && id < cache->num_blocks; ++id) {
+        if (lookup(cache, id) >= 0 || (cache->skip && bitmap_test(cache->skip, id))) {
+            continue;
+        }
+        int f = install(cache, id);
+        if (f < 0) {
+            break;
+        }
+        struct frame *fr = &cache->frames[f];
+        fr->loading = true;
+        fr->prefetched = true;
+        fr->ref = false; // hasn't earned its second chance yet
+        cache->fills[f].cache = cache;
+        cache->fills[f].frame = f;
+        if (!block_io_submit_read(cache->io, frame_data(cache, f), cache->block_size, frame_offset(cache, f),
+                                  fill_done, &cache->fills[f])) {
+            fr->loading = false;
+            fr->prefetched = false;
+            drop(cache, f);
+            break;
+        }
+        issued++;
+    }
+    // the whole window goes to the kernel in one call, and has to go now to be ahead of the reader
+    block_io_submit_pending(cache->io);
+    cache->stats.prefetched += issued;
+    return issued;
+}
+
+void block_cache_set_readahead(block_cache_t *const cache, const size_t max_window)
+{
+    cache->ra_max_window = max_window < cache->capacity / 2 ? max_window : cache->capacity / 2;
+    cache->ra_window = RA_MIN_WINDOW;
+}
+
+void block_cache_set_skip(block_cache_t *const cache, const bitmap_t *const skip)
+{
+    cache->skip = skip;
+}
+
+bool block_cache_peek(const block_cache_t *const cache, const size_t block_id, void *buffer)
+{
+    int f = lookup(cache, block_id);
+    if (f < 0 || cache->frames[f].loading) {
+        return false;
+    }
+    memcpy(buffer, frame_data(cache, f), cache->block_size);
+    return true;
+}
+
+void block_cache_invalidate(block_cache_t *const cache, const size_t block_id)
+{
+    int f = lookup(cache, block_id);
+    if (f >= 0) {
+        if (cache->frames[f].loading || cache->frames[f].writing) {
+            // can't hand the frame out while I/O is using it, whoever finishes drops it
+            hash_remove(cache, f);
+            cache->frames[f].orphan = true;
+        } else {
+            drop(cache, f);
+        }
+    }
+}
+
+bool block_cache_flush(block_cache_t *const cache)
+{
+    bool ok = true;
+    for (size_t f = 0; f < cache->capacity; ++f) {
+        if (cache->frames[f].valid && cache->frames[f].dirty) {
+            ok = write_back(cache, f) && ok;
+        }
+    }
+    return ok;
+}
+
+size_t block_cache_dirty(const block_cache_t *const cache)
+{
+    return cache->stats.dirty;
+}
+
+uint64_t block_cache_oldest_dirty(const block_cache_t *const cache)
+{
+    uint64_t oldest = 0;
+    for (size_t f = 0; f < cache->capacity && cache->stats.dirty; ++f) {
+        const struct frame *fr = &cache->frames[f];
+        if (fr->valid && fr->dirty && (!oldest || fr->dirtied < oldest)) {
+            oldest = fr->dirtied;
+        }
+    }
+    return oldest;
+}
+
+static int wb_entry_cmp(const void *a, const void *b)
+{
+    size_t x = ((const struct wb_entry *)a)->block_id;
+    size_t y = ((const struct wb_entry *)b)->block_id;
+    return (x > y) - (x < y);
+}
+
+block_cache_wb_t *block_cache_writeback_begin(block_cache_t *const cache, const size_t max_frames)
+{
+    size_t n = 0;
+    block_cache_wb_t *wb = calloc(1, sizeof(block_cache_wb_t));
+    size_t cap = max_frames < cache->stats.dirty ? max_frames : cache->stats.dirty;
+    if (!wb || !cap) {
+        free(wb);
+        return NULL;
+    }
+    wb->entries = malloc(cap * sizeof(struct wb_entry));
+    wb->data = malloc(cap * cache->block_size);
+    if (!wb->entries || !wb->data) {
+        block_cache_writeback_end(cache, wb, false);
+        return NULL;
+    }
+    for (size_t f = 0; f < cache->capacity && n < cap; ++f) {
+        struct frame *fr = &cache->frames[f];
+        if (fr->valid && fr->dirty && !fr->writing && !fr->loading) {
+            fr->writing = true;
+            wb->entries[n].block_id = fr->block_id;
+            wb->entries[n].frame = (int)f;
+            wb->entries[n].version = fr->version;
+            n++;
+        }
+    }
+    // oldest first would be fairer, but block order is what lets runs merge
+    qsort(wb->entries, n, sizeof(struct wb_entry), wb_entry_cmp);
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(wb->data + i * cache->block_size, frame_data(cache, wb->entries[i].frame), cache->block_size);
+    }
+    wb->fd = cache->fd;
+    wb->block_size = cache->block_size;
+    wb->count = n;
+    return wb;
+}
+
+bool block_cache_writeback_run(block_cache_wb_t *const wb)
+{
+    bool ok = true;
+    for (size_t i = 0; i < wb->count;) {
+        // blocks next to each other on disk go out in one write
+        size_t run = 1;
+        while (i + run < wb->count && wb->entries[i + run].block_id == wb->entries[i].block_id + run) {
+            run++;
+        }
+        if (!block_io_pwrite(wb->fd, wb->data + i * wb->block_size, run * wb->block_size,
+                             (off_t)(wb->entries[i].block_id * wb->block_size))) {
+            perror("cache: background write back failed");
+            ok = false;
+        }
+        wb->writes++;
+        i += run;
+    }
+    return ok;
+}
+
+size_t block_cache_writeback_end(block_cache_t *const cache, block_cache_wb_t *const wb, const bool ok)
+{
+    size_t cleaned = 0;
+    for (size_t i = 0; i < wb->count; ++i) {
+        int f = wb->entries[i].frame;
+        struct frame *fr = &cache->frames[f];
+        fr->writing = false;
+        if (fr->orphan) {
+            drop(cache, f);
+        } else if (ok && fr->dirty && fr->version == wb->entries[i].version) {
+            // nobody wrote to it in the meantime, so the file has what the frame has
+            fr->dirty = false;
+            cache->stats.dirty--;
+            cache->stats.writebacks++;
+            cleaned++;
+        }
+    }
+    cache->stats.flush_writes += wb->writes;
+    free(wb->data);
+    free(wb->entries);
+    free(wb);
+    return cleaned;
+}
+
+void block_cache_get_stats(const block_cache_t *const cache, block_store_cache_stats_t *const stats)
+{
+    *stats = cache->stats;
+    stats->readahead_window = cache->ra_max_window ? cache->ra_window : 0;
+}
+
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t capacity,
+                                  const size_t num_blocks)
+{
+    if (fd < 0 || !block_size || !capacity || capacity > INT32_MAX) {
+        return NULL;
+    }
+    block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    // about one chain per frame
+    size_t buckets = 1;
+    while (buckets < capacity) {
+        buckets <<= 1;
+    }
+    cache->fd = fd;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->num_blocks = num_blocks;
+    cache->bucket_mask = buckets - 1;
+    cache->next_expected = SIZE_MAX;
+    cache->stats.capacity = capacity;
+    block_cache_set_readahead(cache, SIZE_MAX);
+    cache->frames = calloc(capacity, sizeof(struct frame));
+    cache->fills = calloc(capacity, sizeof(struct fill));
+    cache->slab = malloc(capacity * block_size);
+    cache->buckets = malloc(buckets * sizeof(int));
+    if (!cache->frames || !cache->fills || !cache->slab || !cache->buckets) {
+        block_cache_destroy(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0xFF, buckets * sizeof(int)); // all -1
+    return cache;
+}
+
+bool block_cache_destroy(block_cache_t *const cache)
+{
+    bool ok = true;
+    if (cache) {
+        // fills land in our frames, so they go first
+        block_io_destroy(cache->io);
+        if (cache->frames && cache->slab) {
+            ok = block_cache_flush(cache);
+        }
+        free(cache->buckets);
+        free(cache->slab);
+        free(cache->fills);
+        free(cache->frames);
+        free(cache);
+    }
+    return ok;
+}
@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "block_io.h"
+
+// Raw syscalls instead of liburing so there's nothing extra to install.
+// If the headers are too old we just never try it.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Never more than this many threads pretending to be a ring
+#define MAX_WORKERS 4
+
+// Queued sqes go to the kernel once this many pile up, if nothing has sent them sooner
+#define SUBMIT_BATCH 16
+
+typedef enum { OP_READ, OP_WRITE, OP_FLUSH } IO_OP;
+
+struct request {
+    IO_OP op;
+    struct iovec iov;      // the ring wants a pointer that outlives the sqe
+    off_t offset;
+    block_io_callback_t cb;
+    void *arg;
+    ssize_t result;
+    int next;              // free list, work queue or done list, never more than one
+};
+
+struct block_io {
+    int fd;
+    block_io_backend_t backend;
+    unsigned depth;
+    size_t inflight;       // only touched by the submitting thread
+    struct request *reqs;
+    int free_head;
+    int failed_head;       // the kernel wouldn't take these, delivered by the next poll
+
+#ifdef HAVE_IO_URING
+    struct {
+        int fd;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size, sqes_size;
+        unsigned pending;  // sqes past the tail the kernel hasn't consumed yet
+    } ring;
+#endif
+
+    // thread backend
+    pthread_t workers[MAX_WORKERS];
+    unsigned n_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready, work_done, drained;
+    int queue_head, queue_tail;  // submitted, not picked up yet
+    int done_head, done_tail;    // finished, not delivered yet
+    unsigned running;            // workers in the middle of a read/write
+    bool draining;               // a flush is waiting for the others to finish
+    bool stopping;
+};
+
+//
+// Shared bits
+//
+
+static ssize_t run_request(const int fd, struct request *const r)
+{
+    size_t done = 0;
+    switch (r->op) {
+    case OP_FLUSH:
+        return fdatasync(fd) ? -errno : 0;
+    case OP_READ:
+        while (done < r->iov.iov_len) {
+            ssize_t got = pread(fd, (uint8_t *)r->iov.iov_base + done, r->iov.iov_len - done, r->offset + done);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (got == 0) break; // EOF, hand back the short count
+            done += (size_t)got;
+        }
+        return (ssize_t)done;
+    case OP_WRITE:
+        while (done < r->iov.iov_len) {
+            ssize_t put = pwrite(fd, (uint8_t *)r->iov.iov_base + done, r->iov.iov_len - done, r->offset + done);
+            if (put < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (put == 0) return -EIO;
+            done += (size_t)put;
+        }
+        return (ssize_t)done;
+    }
+    return -EINVAL;
+}
+
+static void release_request(block_io_t *const io, const int idx)
+{
+    io->reqs[idx].next = io->free_head;
+    io->free_head = idx;
+}
+
+//
+// io_uring backend
+//
+
+#ifdef HAVE_IO_URING
+
+static bool uring_setup(block_io_t *const io, const unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (rfd < 0) {
+        return false; // ENOSYS, EPERM under seccomp, ...
+    }
+
+    io->ring.fd = rfd;
+    io->ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (io->ring.cq_ring_size > io->ring.sq_ring_size) io->ring.sq_ring_size = io->ring.cq_ring_size;
+        io->ring.cq_ring_size = io->ring.sq_ring_size;
+    }
+
+    io->ring.sq_ring = mmap(NULL, io->ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    if (io->ring.sq_ring == MAP_FAILED) {
+        close(rfd);
+        return false;
+    }
+    io->ring.cq_ring = single ? io->ring.sq_ring
+                              : mmap(NULL, io->ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    if (io->ring.cq_ring == MAP_FAILED) {
+        munmap(io->ring.sq_ring, io->ring.sq_ring_size);
+        close(rfd);
+        return false;
+    }
+    io->ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->ring.sqes = mmap(NULL, io->ring.sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    if (io->ring.sqes == MAP_FAILED) {
+        if (!single) munmap(io->ring.cq_ring, io->ring.cq_ring_size);
+        munmap(io->ring.sq_ring, io->ring.sq_ring_size);
+        close(rfd);
+        return false;
+    }
+
+    uint8_t *sq = io->ring.sq_ring;
+    uint8_t *cq = io->ring.cq_ring;
+    io->ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    io->ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    io->ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+    io->ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    io->ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    io->ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+static void uring_teardown(block_io_t *const io)
+{
+    munmap(io->ring.sqes, io->ring.sqes_size);
+    if (io->ring.cq_ring != io->ring.sq_ring) {
+        munmap(io->ring.cq_ring, io->ring.cq_ring_size);
+    }
+    munmap(io->ring.sq_ring, io->ring.sq_ring_size);
+    close(io->ring.fd);
+}
+
+static int uring_enter(block_io_t *const io, const unsigned to_submit, const unsigned min_complete)
+{
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, io->ring.fd, to_submit, min_complete,
+                           min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Hands every queued sqe to the kernel in one io_uring_enter, waiting for min_complete
+// completions in the same call
+static bool uring_submit(block_io_t *const io, const unsigned min_complete)
+{
+    while (io->ring.pending) {
+        int ret = uring_enter(io, io->ring.pending, min_complete);
+        if (ret > 0) {
+            // (it may take fewer than asked, the rest stay at the front)
+            io->ring.pending -= (unsigned)ret < io->ring.pending ? (unsigned)ret : io->ring.pending;
+            if (min_complete) {
+                return true;
+            }
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EBUSY)) {
+            // out of room for now, try again on the next poll
+            return false;
+        }
+        // it's not going to take them: they're still ours, so take them back and fail them
+        int err = ret < 0 ? -errno : -EIO;
+        unsigned tail = *io->ring.sq_tail;
+        for (unsigned t = tail - io->ring.pending; t != tail; ++t) {
+            int idx = (int)io->ring.sqes[t & *io->ring.sq_mask].user_data;
+            io->reqs[idx].result = err;
+            io->reqs[idx].next = io->failed_head;
+            io->failed_head = idx;
+        }
+        __atomic_store_n(io->ring.sq_tail, tail - io->ring.pending, __ATOMIC_RELEASE);
+        io->ring.pending = 0;
+        return false;
+    }
+    return min_complete == 0 || uring_enter(io, 0, min_complete) >= 0;
+}
+
+static bool uring_push(block_io_t *const io, const int idx)
+{
+    struct request *r = &io->reqs[idx];
+    // we're the only producer, so the tail can't move under us
+    unsigned tail = *io->ring.sq_tail;
+    unsigned slot = tail & *io->ring.sq_mask;
+    struct io_uring_sqe *sqe = &io->ring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+
+    switch (r->op) {
+    case OP_READ:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case OP_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    case OP_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_IO_DRAIN; // barrier against everything before it
+        break;
+    }
+    sqe->fd = io->fd;
+    if (r->op != OP_FLUSH) {
+        sqe->addr = (uintptr_t)&r->iov;
+        sqe->len = 1;
+        sqe->off = (uint64_t)r->offset;
+    }
+    sqe->user_data = (uint64_t)idx;
+    io->ring.sq_array[slot] = slot;
+    __atomic_store_n(io->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // a burst of submissions costs one syscall rather than one each: the kernel hears
+    // about them at the next poll, flush or block_io_submit_pending, or once enough pile up
+    if (++io->ring.pending >= SUBMIT_BATCH || r->op == OP_FLUSH) {
+        uring_submit(io, 0);
+    }
+    return true;
+}
+
+// Returns a done list (linked through next), -1 if nothing finished
+static int uring_reap(block_io_t *const io, const bool wait)
+{
+    for (;;) {
+        unsigned head = *io->ring.cq_head;
+        unsigned tail = __atomic_load_n(io->ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            int list = -1, last = -1;
+            for (; head != tail; ++head) {
+                struct io_uring_cqe *cqe = &io->ring.cqes[head & *io->ring.cq_mask];
+                int idx = (int)cqe->user_data;
+                io->reqs[idx].result = cqe->res;
+                io->reqs[idx].next = -1;
+                if (last < 0) list = idx;
+                else io->reqs[last].next = idx;
+                last = idx;
+            }
+            __atomic_store_n(io->ring.cq_head, head, __ATOMIC_RELEASE);
+            return list;
+        }
+        if (!wait || !uring_submit(io, 1)) {
+            return -1;
+        }
+    }
+}
+
+#endif
+
+//
+// Thread pool backend
+//
+
+static void *worker_main(void *arg)
+{
+    block_io_t *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->stopping && (io->queue_head < 0 || io->draining)) {
+            pthread_cond_wait(&io->work_ready, &io->lock);
+        }
+        if (io->stopping) {
+            break;
+        }
+
+        int idx = io->queue_head;
+        struct request *r = &io->reqs[idx];
+        io->queue_head = r->next;
+        if (io->queue_head < 0) io->queue_tail = -1;
+
+        if (r->op == OP_FLUSH) {
+            // hold everyone else off and wait for what's already running
+            io->draining = true;
+            while (io->running) {
+                pthread_cond_wait(&io->drained, &io->lock);
+            }
+            pthread_mutex_unlock(&io->lock);
+            r->result = run_request(io->fd, r);
+            pthread_mutex_lock(&io->lock);
+            io->draining = false;
+            pthread_cond_broadcast(&io->work_ready);
+        } else {
+            io->running++;
+            pthread_mutex_unlock(&io->lock);
+            r->result = run_request(io->fd, r);
+            pthread_mutex_lock(&io->lock);
+            if (--io->running == 0 && io->draining) {
+                pthread_cond_signal(&io->drained);
+            }
+        }
+
+        r->next = -1;
+        if (io->done_tail < 0) io->done_head = idx;
+        else io->reqs[io->done_tail].next = idx;
+        io->done_tail = idx;
+        pthread_cond_signal(&io->work_done);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void threads_stop(block_io_t *const io)
+{
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->work_ready);
+    pthread_mutex_unlock(&io->lock);
+    for (unsigned i = 0; i < io->n_workers; ++i) {
+        pthread_join(io->workers[i], NULL);
+    }
+    pthread_cond_destroy(&io->drained);
+    pthread_cond_destroy(&io->work_done);
+    pthread_cond_destroy(&io->work_ready);
+    pthread_mutex_destroy(&io->lock);
+}
+
+static bool threads_start(block_io_t *const io, const unsigned depth)
+{
+    io->queue_head = io->queue_tail = -1;
+    io->done_head = io->done_tail = -1;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work_ready, NULL);
+    pthread_cond_init(&io->work_done, NULL);
+    pthread_cond_init(&io->drained, NULL);
+
+    unsigned want = depth < MAX_WORKERS ? depth : MAX_WORKERS;
+    for (; io->n_workers < want; ++io->n_workers) {
+        if (pthread_create(&io->workers[io->n_workers], NULL, worker_main, io)) {
+            break;
+        }
+    }
+    if (!io->n_workers) {
+        threads_stop(io);
+        return false;
+    }
+    return true;
+}
+
+static bool threads_push(block_io_t *const io, const int idx)
+{
+    pthread_mutex_lock(&io->lock);
+    io->reqs[idx].next = -1;
+    if (io->queue_tail < 0) io->queue_head = idx;
+    else io->reqs[io->queue_tail].next = idx;
+    io->queue_tail = idx;
+    pthread_cond_signal(&io->work_ready);
+    pthread_mutex_unlock(&io->lock);
+    return true;
+}
+
+static int threads_reap(block_io_t *const io, const bool wait)
+{
+    pthread_mutex_lock(&io->lock);
+    while (wait && io->done_head < 0) {
+        pthread_cond_wait(&io->work_done, &io->lock);
+    }
+    int list = io->done_head;
+    io->done_head = io->done_tail = -1;
+    pthread_mutex_unlock(&io->lock);
+    return list;
+}
+
+//
+// Public API
+//
+
+static bool submit(block_io_t *const io, const IO_OP op, void *buf, const size_t len, const off_t offset,
+                   block_io_callback_t cb, void *arg)
+{
+    if (!io) {
+        return false;
+    }
+    while (io->free_head < 0) {
+        // full up, make some room
+        if (!block_io_poll(io, 1)) {
+            return false;
+        }
+    }
+
+    int idx = io->free_head;
+    struct request *r = &io->reqs[idx];
+    io->free_head = r->next;
+    r->op = op;
+    r->iov.iov_base = buf;
+    r->iov.iov_len = len;
+    r->offset = offset;
+    r->cb = cb;
+    r->arg = arg;
+    r->result = 0;
+
+    bool queued = false;
+#ifdef HAVE_IO_URING
+    if (io->backend == BLOCK_IO_BACKEND_URING) {
+        queued = uring_push(io, idx);
+    }
+#endif
+    if (io->backend == BLOCK_IO_BACKEND_THREADS) {
+        queued = threads_push(io, idx);
+    }
+    if (!queued) {
+        release_request(io, idx);
+        return false;
+    }
+    io->inflight++;
+    return true;
+}
+
+bool block_io_submit_read(block_io_t *const io, void *buf, const size_t len, const off_t offset,
+                          block_io_callback_t cb, void *arg)
+{
+    return buf && len && submit(io, OP_READ, buf, len, offset, cb, arg);
+}
+
+bool block_io_submit_write(block_io_t *const io, const void *buf, const size_t len, const off_t offset,
+                           block_io_callback_t cb, void *arg)
+{
+    // the iovec isn't const, but nobody writes through it for a write
+    return buf && len && submit(io, OP_WRITE, (void *)buf, len, offset, cb, arg);
+}
+
+bool block_io_submit_flush(block_io_t *const io, block_io_callback_t cb, void *arg)
+{
+    return submit(io, OP_FLUSH, NULL, 0, 0, cb, arg);
+}
+
+size_t block_io_poll(block_io_t *const io, const size_t min_complete)
+{
+    if (!io) {
+        return 0;
+    }
+    size_t delivered = 0;
+    size_t want = min_complete < io->inflight ? min_complete : io->inflight;
+#ifdef HAVE_IO_URING
+    if (io->backend == BLOCK_IO_BACKEND_URING) {
+        uring_submit(io, 0);
+    }
+#endif
+    do {
+        int list = -1;
+        if (io->failed_head >= 0) {
+            list = io->failed_head;
+            io->failed_head = -1;
+        }
+#ifdef HAVE_IO_URING
+        else if (io->backend == BLOCK_IO_BACKEND_URING) {
+            list = uring_reap(io, delivered < want);
+        }
+#endif
+        if (list < 0 && io->backend == BLOCK_IO_BACKEND_THREADS) {
+            list = threads_reap(io, delivered < want);
+        }
+        if (list < 0 && delivered < want) {
+            break; // the ring refused to wait, don't spin on it
+        }
+        while (list >= 0) {
+            struct request *r = &io->reqs[list];
+            int next = r->next;
+            block_io_callback_t cb = r->cb;
+            void *arg = r->arg;
+            ssize_t result = r->result;
+            // recycle first so the callback is free to submit more
+            release_request(io, list);
+            io->inflight--;
+            delivered++;
+            if (cb) {
+                cb(arg, result);
+            }
+            list = next;
+        }
+    } while (delivered < want);
+    return delivered;
+}
+
+void block_io_submit_pending(block_io_t *const io)
+{
+#ifdef HAVE_IO_URING
+    if (io && io->backend == BLOCK_IO_BACKEND_URING) {
+        uring_submit(io, 0);
+    }
+#else
+    (void)io;
+#endif
+}
+
+size_t block_io_inflight(const block_io_t *const io)
+{
+    return io ? io->inflight : 0;
+}
+
+block_io_backend_t block_io_backend(const block_io_t *const io)
+{
+    return io->backend;
+}
+
+bool block_io_pread(const int fd, void *buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        done += (size_t)got;
+    }
+    return true;
+}
+
+bool block_io_pwrite(const int fd, const void *buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return false;
+        done += (size_t)put;
+    }
+    return true;
+}
+
+block_io_t *block_io_create(const int fd, const unsigned depth)
+{
+    if (fd < 0 || !depth) {
+        return NULL;
+    }
+    block_io_t *io = calloc(1, sizeof(block_io_t));
+    if (!io) {
+        return NULL;
+    }
+    io->reqs = calloc(depth, sizeof(struct request));
+    if (!io->reqs) {
+        free(io);
+        return NULL;
+    }
+    io->fd = fd;
+    io->depth = depth;
+    io->free_head = -1;
+    io->failed_head = -1;
+    for (int i = (int)depth - 1; i >= 0; --i) {
+        release_request(io, i);
+    }
+
+    const char *forced = getenv("BLOCK_IO_BACKEND");
+    bool try_ring = !(forced && !strcmp(forced, "threads"));
+#ifdef HAVE_IO_URING
+    if (try_ring && uring_setup(io, depth)) {
+        io->backend = BLOCK_IO_BACKEND_URING;
+        return io;
+    }
+#else
+    (void)try_ring;
+#endif
+    if (threads_start(io, depth)) {
+        io->backend = BLOCK_IO_BACKEND_THREADS;
+        return io;
+    }
+    free(io->reqs);
+    free(io);
+    return NULL;
+}
+
+void block_io_destroy(block_io_t *const io)
+{
+    if (io) {
+        while (io->inflight && block_io_poll(io, io->inflight)) {
+        }
+#ifdef HAVE_IO_URING
+        if (io->backend == BLOCK_IO_BACKEND_URING) {
+            uring_teardown(io);
+        }
+#endif
+        if (io->backend == BLOCK_IO_BACKEND_THREADS) {
+            threads_stop(io);
+        }
+        free(io->reqs);
+        free(io);
+    }
+}
@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include "block_remap.h"
+
+struct block_remap {
+    size_t num_blocks;
+    size_t pinned_first;
+    size_t pinned_count;
+    // physical slots in use
+    bitmap_t *used;
+    size_t *to_phys;  // by logical id, SIZE_MAX if unallocated
+    size_t *to_log;   // by physical slot, SIZE_MAX if free
+};
+
+static bool is_pinned(const block_remap_t *const remap, const size_t block)
+{
+    return block >= remap->pinned_first && block - remap->pinned_first < remap->pinned_count;
+}
+
+static void map(block_remap_t *const remap, const size_t logical, const size_t physical)
+{
+    remap->to_phys[logical] = physical;
+    remap->to_log[physical] = logical;
+    bitmap_set(remap->used, physical);
+}
+
+block_remap_t *block_remap_create(const bitmap_t *const fbm, const size_t pinned_first, const size_t pinned_count)
+{
+    if (!fbm) {
+        return NULL;
+    }
+    block_remap_t *remap = calloc(1, sizeof(block_remap_t));
+    if (!remap) {
+        return NULL;
+    }
+    remap->num_blocks = bitmap_get_bits(fbm);
+    remap->pinned_first = pinned_first;
+    remap->pinned_count = pinned_count;
+    remap->used = bitmap_create(remap->num_blocks);
+    remap->to_phys = malloc(remap->num_blocks * sizeof(size_t));
+    remap->to_log = malloc(remap->num_blocks * sizeof(size_t));
+    if (!remap->used || !remap->to_phys || !remap->to_log) {
+        block_remap_destroy(remap);
+        return NULL;
+    }
+    for (size_t id = 0; id < remap->num_blocks; ++id) {
+        remap->to_phys[id] = remap->to_log[id] = SIZE_MAX;
+    }
+    for (size_t id = pinned_first; id < pinned_first + pinned_count && id < remap->num_blocks; ++id) {
+        map(remap, id, id);
+    }
+    BITMAP_FOR_EACH_SET(fbm, id) {
+        if (!is_pinned(remap, id)) {
+            map(remap, id, id);
+        }
+    }
+    return remap;
+}
+
+size_t block_remap_lookup(const block_remap_t *const remap, const size_t logical)
+{
+    return remap && logical < remap->num_blocks ? remap->to_phys[logical] : SIZE_MAX;
+}
+
+size_t block_remap_assign(block_remap_t *const remap, const size_t logical)
+{
+    if (!remap || logical >= remap->num_blocks || remap->to_phys[logical] != SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    // lowest free slot, so new blocks don't undo a compaction
+    size_t slot = bitmap_ffz(remap->used);
+    if (slot == SIZE_MAX || slot >= remap->num_blocks) {
+        return SIZE_MAX;
+    }
+    map(remap, logical, slot);
+    return slot;
+}
+
+void block_remap_unassign(block_remap_t *const remap, const size_t logical)
+{
+    if (!remap || logical >= remap->num_blocks || is_pinned(remap, logical)) {
+        return;
+    }
+    size_t slot = remap->to_phys[logical];
+    if (slot != SIZE_MAX) {
+        bitmap_reset(remap->used, slot);
+        remap->to_log[slot] = SIZE_MAX;
+        remap->to_phys[logical] = SIZE_MAX;
+    }
+}
+
+void block_remap_sync(block_remap_t *const remap, const bitmap_t *const fbm)
+{
+    if (!remap || !fbm) {
+        return;
+    }
+    // free first so the newly allocated ones have somewhere to go
+    for (size_t id = bitmap_next_zero(fbm, 0); id != SIZE_MAX; id = bitmap_next_zero(fbm, id + 1)) {
+        block_remap_unassign(remap, id);
+    }
+    BITMAP_FOR_EACH_SET(fbm, id) {
+        if (remap->to_phys[id] == SIZE_MAX) {
+            block_remap_assign(remap, id);
+        }
+    }
+}
+
+bool block_remap_resize(block_remap_t *const remap, const size_t num_blocks)
+{
+    if (!remap || num_blocks < remap->pinned_first + remap->pinned_count) {
+        return false;
+    }
+    for (size_t id = num_blocks; id < remap->num_blocks; ++id) {
+        if (remap->to_phys[id] != SIZE_MAX || remap->to_log[id] != SIZE_MAX) {
+            return false;
+        }
+    }
+    bitmap_t *used = bitmap_create(num_blocks);
+    size_t *to_phys = malloc(num_blocks * sizeof(size_t));
+    size_t *to_log = malloc(num_blocks * sizeof(size_t));
+    if (!used || !to_phys || !to_log) {
+        bitmap_destroy(used);
+        free(to_phys);
+        free(to_log);
+        return false;
+    }
+    for (size_t id = 0; id < num_blocks; ++id) {
+        bool kept = id < remap->num_blocks;
+        to_phys[id] = kept ? remap->to_phys[id] : SIZE_MAX;
+        to_log[id] = kept ? remap->to_log[id] : SIZE_MAX;
+        if (kept && bitmap_test(remap->used, id)) {
+            bitmap_set(used, id);
+        }
+    }
+    bitmap_destroy(remap->used);
+    free(remap->to_phys);
+    free(remap->to_log);
+    remap->used = used;
+    remap->to_phys = to_phys;
+    remap->to_log = to_log;
+    remap->num_blocks = num_blocks;
+    return true;
+}
+
+bool block_remap_next_move(block_remap_t *const remap, size_t *const from, size_t *const to)
+{
+    if (!remap || !from || !to) {
+        return false;
+    }
+    // the lowest hole takes the next block above it rather than the highest one, so blocks
+    // slide down in the order they were in and runs of them stay runs
+    size_t hole = bitmap_ffz(remap->used);
+    if (hole == SIZE_MAX || hole >= remap->num_blocks) {
+        return false;
+    }
+    size_t next = hole;
+    do {
+        next = bitmap_next_set(remap->used, next + 1);
+    } while (next != SIZE_MAX && is_pinned(remap, next));
+    if (next == SIZE_MAX || next >= remap->num_blocks) {
+        return false;
+    }
+    *from = next;
+    *to = hole;
+    return true;
+}
+
+void block_remap_moved(block_remap_t *const remap, const size_t from, const size_t to)
+{
+    if (!remap || from >= remap->num_blocks || to >= remap->num_blocks || remap->to_log[from] == SIZE_MAX
+            || remap->to_log[to] != SIZE_MAX || is_pinned(remap, from)) {
+        return;
+    }
+    size_t logical = remap->to_log[from];
+    bitmap_reset(remap->used, from);
+    remap->to_log[from] = SIZE_MAX;
+    map(remap, logical, to);
+}
+
+static void longest_run(size_t start, size_t len, void *arg)
+{
+    (void)start;
+    size_t *longest = arg;
+    if (len > *longest) {
+        *longest = len;
+    }
+}
+
+size_t block_remap_largest_free(const block_remap_t *const remap)
+{
+    size_t longest = 0;
+    if (remap) {
+        bitmap_for_each_zero_run(remap->used, longest_run, &longest);
+    }
+    return longest;
+}
+
+const bitmap_t *block_remap_used(const block_remap_t *const remap)
+{
+    return remap ? remap->used : NULL;
+}
+
+void block_remap_destroy(block_remap_t *const remap)
+{
+    if (remap) {
+        bitmap_destroy(remap->used);
+        free(remap->to_phys);
+        free(remap->to_log);
+        free(remap);
+    }
+}
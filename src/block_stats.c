@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <time.h>
+#include "block_stats.h"
+#include "perf_counters.h"
+
+#ifdef BLOCK_STORE_STATS
+
+// Slots the counters are spread over; threads past this many share
+#define STATS_STRIPES 8
+#define CACHE_LINE 64
+
+struct op_counters {
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t bytes;
+    uint64_t latency[BLOCK_STORE_LATENCY_BUCKETS];
+    uint64_t hw_calls;
+    uint64_t hw[BLOCK_STORE_HW_COUNT];
+};
+
+// One thread's worth of counters, alone on its cache lines
+struct stripe {
+    alignas(CACHE_LINE) struct op_counters ops[BLOCK_STORE_OP_COUNT];
+};
+
+struct block_stats {
+    struct stripe stripes[STATS_STRIPES];
+    bool hw;            // sample hardware counters around every call
+    uint32_t hw_available;
+};
+
+// The public counter list is the perf one under another name
+_Static_assert((int)BLOCK_STORE_HW_COUNT == (int)PERF_COUNTER_COUNT, "hardware counter lists out of step");
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Which stripe this thread uses, handed out round robin on first use
+static _Thread_local unsigned thread_stripe = STATS_STRIPES;
+static unsigned next_stripe;
+
+static struct op_counters *my_counters(block_stats_t *const stats, const block_store_op_t op)
+{
+    if (thread_stripe == STATS_STRIPES) {
+        thread_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % STATS_STRIPES;
+    }
+    return &stats->stripes[thread_stripe].ops[op];
+}
+
+static unsigned latency_bucket(const uint64_t ns)
+{
+    unsigned b = 63 - (unsigned)__builtin_clzll(ns | 1);
+    return b < BLOCK_STORE_LATENCY_BUCKETS ? b : BLOCK_STORE_LATENCY_BUCKETS - 1;
+}
+
+// Upper edge of the bucket the given fraction of calls falls under
+static uint64_t percentile(const uint64_t *const latency, const uint64_t calls, const double fraction)
+{
+    if (!calls) {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(fraction * (double)calls);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < BLOCK_STORE_LATENCY_BUCKETS; ++b) {
+        seen += latency[b];
+        if (seen > want) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return (uint64_t)2 << (BLOCK_STORE_LATENCY_BUCKETS - 1);
+}
+
+block_stats_t *block_stats_create(void)
+{
+    block_stats_t *stats = aligned_alloc(CACHE_LINE, sizeof(block_stats_t));
+    if (stats) {
+        memset(stats, 0, sizeof(block_stats_t));
+        if (getenv("BLOCK_STORE_PERF")) {
+            // (no counters just means nothing gets sampled)
+            block_stats_set_hw(stats, true);
+        }
+    }
+    return stats;
+}
+
+block_stats_t *block_stats_process(void)
+{
+    static block_stats_t *process;
+    block_stats_t *stats = __atomic_load_n(&process, __ATOMIC_ACQUIRE);
+    if (!stats) {
+        block_stats_t *fresh = block_stats_create();
+        if (fresh && !__atomic_compare_exchange_n(&process, &stats, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // somebody else got there first, stats is theirs
+            block_stats_destroy(fresh);
+        } else {
+            stats = fresh;
+        }
+    }
+    return stats;
+}
+
+bool block_stats_set_hw(block_stats_t *const stats, const bool enabled)
+{
+    perf_counters_t *counters = enabled ? perf_counters_thread() : NULL;
+    stats->hw = counters != NULL;
+    if (counters) {
+        perf_sample_t sample;
+        if (perf_counters_read(counters, &sample)) {
+            stats->hw_available = sample.available;
+        }
+    }
+    return stats->hw == enabled;
+}
+
+void block_stats_begin(const block_stats_t *const stats, block_stats_probe_t *const probe)
+{
+    probe->hw = false;
+    if (stats && stats->hw) {
+        perf_sample_t sample;
+        if (perf_counters_read(perf_counters_thread(), &sample)) {
+            probe->hw = true;
+            memcpy(probe->hw_start, sample.value, sizeof(probe->hw_start));
+        }
+    }
+    // time last so the counter read isn't in it
+    probe->start = now_ns();
+}
+
+void block_stats_end(block_stats_t *const stats, const block_store_op_t op, const block_stats_probe_t *const probe,
+                     const bool ok, const size_t bytes)
+{
+    if (!stats) {
+        return;
+    }
+    uint64_t elapsed = now_ns() - probe->start;
+    perf_sample_t sample;
+    bool hw = probe->hw && perf_counters_read(perf_counters_thread(), &sample);
+    struct op_counters *c = my_counters(stats, op);
+    // relaxed is enough, nobody orders anything by these and a stripe is rarely shared
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+    if (!ok) {
+        __atomic_fetch_add(&c->failures, 1, __ATOMIC_RELAXED);
+    }
+    if (bytes) {
+        __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&c->latency[latency_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    if (hw) {
+        __atomic_fetch_add(&c->hw_calls, 1, __ATOMIC_RELAXED);
+        for (unsigned h = 0; h < BLOCK_STORE_HW_COUNT; ++h) {
+            __atomic_fetch_add(&c->hw[h], sample.value[h] - probe->hw_start[h], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void block_stats_collect(const block_stats_t *const stats, block_store_stats_t *const out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!stats) {
+        return;
+    }
+    out->hw_available = stats->hw_available;
+    for (unsigned op = 0; op < BLOCK_STORE_OP_COUNT; ++op) {
+        block_store_op_stats_t *o = &out->ops[op];
+        for (unsigned s = 0; s < STATS_STRIPES; ++s) {
+            const struct op_counters *c = &stats->stripes[s].ops[op];
+            o->calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+            o->failures += __atomic_load_n(&c->failures, __ATOMIC_RELAXED);
+            o->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+            for (unsigned b = 0; b < BLOCK_STORE_LATENCY_BUCKETS; ++b) {
+                o->latency[b] += __atomic_load_n(&c->latency[b], __ATOMIC_RELAXED);
+            }
+            o->hw_calls += __atomic_load_n(&c->hw_calls, __ATOMIC_RELAXED);
+            for (unsigned h = 0; h < BLOCK_STORE_HW_COUNT; ++h) {
+                o->hw[h] += __atomic_load_n(&c->hw[h], __ATOMIC_RELAXED);
+            }
+        }
+        // the histogram may be a call or two ahead of calls, go by its own total
+        uint64_t total = 0;
+        for (unsigned b = 0; b < BLOCK_STORE_LATENCY_BUCKETS; ++b) {
+            total += o->latency[b];
+        }
+        o->p50_ns = percentile(o->latency, total, 0.5);
+        o->p99_ns = percentile(o->latency, total, 0.99);
+        o->p999_ns = percentile(o->latency, total, 0.999);
+    }
+}
+
+void block_stats_destroy(block_stats_t *const stats)
+{
+    free(stats);
+}
+
+#endif
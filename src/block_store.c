@@ -1,328 +1,2505 @@
+#define _GNU_SOURCE   // posix_fadvise, mremap
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "bitmap.h"
 #include "block_store.h"
+#include "block_io.h"
+#include "block_cache.h"
+#include "journal.h"
+#include "block_stats.h"
+#include "block_trace.h"
+#include "free_extents.h"
+#include "block_remap.h"
+#include "shared_segment.h"
+#include "block_probes.h"
+#include <pthread.h>
+#include <time.h>
 // include more if you need
 #include <fcntl.h>    // for open()
 #include <sys/stat.h> // for mode constants
 #include <unistd.h>   // for write(), close()
 #include <errno.h>    // for errno
+#include <sys/mman.h> // for mmap(), mremap()
 #include <string.h>
 
 // You might find this handy. I put it around unused parameters, but you should
 // remove it before you submit. Just allows things to compile initially.
 #define UNUSED(x) (void)(x)
 
+// How many async requests a file-backed store keeps in flight
+#define BLOCK_STORE_IO_DEPTH 64
+
+// Frames a file-backed store keeps resident unless told otherwise
+#define BLOCK_STORE_CACHE_BLOCKS 64
+
+// Journaled stores commit the open group at least this often...
+#define BLOCK_STORE_COMMIT_MS 10
+// ...and right away once it holds this many records
+#define BLOCK_STORE_COMMIT_RECORDS 256
+// The log gets folded into the image once it grows past this
+#define BLOCK_STORE_CHECKPOINT_BYTES (256 * 1024)
+
+// Longest the background writer sleeps before looking at the thresholds again
+#define BLOCK_STORE_FLUSH_TICK_MS 10
+
+// Size (and alignment) of the huge pages BLOCK_STORE_CREATE_HUGE_PAGES goes for
+#define BLOCK_STORE_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+// What never-written blocks of a thin device read as
+static const uint8_t zero_block[BLOCK_SIZE_BYTES];
+
+// Where an id sits in the recently released list (see recent_links)
+struct recent_link {
+    size_t newer;  // RECENT_END at the head
+    size_t older;  // RECENT_END at the tail, RECENT_UNLISTED if the id isn't in the list
+};
+#define RECENT_END SIZE_MAX
+#define RECENT_UNLISTED (SIZE_MAX - 1)
+
 // struct def
 struct block_store {
-    // arr for "disk" data
-    uint8_t data[BLOCK_STORE_NUM_BYTES];
-    // free block map
+    // "disk" data, NULL when the data lives in a file instead
+    uint8_t *data;
+    // length of data's mapping
+    size_t data_bytes;
+    // data came from the heap rather than a mapping of its own (see device_map)
+    bool data_heap;
+    // what kind of memory data is
+    block_store_backing_t backing;
+    // blocks on the device, only in-memory ones can be resized away from BLOCK_STORE_NUM_BLOCKS
+    size_t num_blocks;
+    // fbm of an in-memory device grown past what blocks 127-128 can hold (NULL until then),
+    // those blocks read and write the start of it from then on
+    uint8_t *fbm_ext;
+    size_t fbm_ext_bytes;
+    // thin devices: chunks of data written to since they were last given back, NULL otherwise;
+    // a chunk is a page, the least the kernel can take back
+    bitmap_t *chunks;
+    size_t chunk_bytes;
+    // free block map, its header lives in fbm_header
     bitmap_t *fbm;
+    bitmap_header_t fbm_header;
+    // backing file for stores from block_store_open, -1 otherwise
+    int fd;
+    // resident fbm has changes the file doesn't
+    bool fbm_dirty;
+    // async engine, only made once someone submits
+    block_io_t *io;
+    // buffer cache in front of fd, NULL to go straight to the file
+    block_cache_t *cache;
+    // file-backed stores are shared with a background thread, this guards everything above
+    pthread_mutex_t lock;
+    // write-ahead log, NULL unless opened with BLOCK_STORE_OPEN_JOURNAL
+    journal_t *journal;
+    // resident fbm has changes the log doesn't
+    bool fbm_unlogged;
+    // after-images of blocks written since the last checkpoint; until then they're only
+    // in the log and here, never in the cache or the image
+    uint8_t *staged;
+    bitmap_t *staged_map;
+    // a group write failed and took some of their records with it
+    bool staged_unlogged;
+    // serializes group writes and checkpoints (taken before lock, never after)
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_wake;
+    pthread_t committer;
+    bool committer_running;
+    bool committer_stop;
+    block_store_journal_stats_t journal_stats;
+    // per-operation counters, NULL when compiled out
+    block_stats_t *stats;
+    // call recording, NULL unless block_store_trace_start was called
+    block_trace_t *trace;
+    // background writer, see block_store_set_flush_policy
+    block_store_flush_policy_t flush_policy;
+    // held for a whole writeback round (taken before lock, after commit_lock)
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_wake;   // something for the writer to look at
+    pthread_cond_t flush_done;   // a batch or round finished
+    pthread_t flusher;
+    bool flusher_running;
+    bool flusher_stop;
+    bool flush_failed;           // last round didn't get everything out
+    uint64_t flush_requested;    // barriers asked for
+    uint64_t flush_completed;    // barriers finished
+    uint64_t fbm_dirtied;        // when fbm_dirty went up (CLOCK_MONOTONIC ns)
+    // free run summary, built by the first block_store_get_free_extents (NULL until then)
+    free_extents_t *extents;
+    // where each block really lives in data, NULL (the identity) until block_store_compact runs
+    block_remap_t *remap;
+    // ids released most recently, allocate hands these out first (see block_store_set_reuse_depth):
+    // a list threaded through recent_links by id, newest at recent_head, at most recent_depth
+    // long, so once it's full each release pushes out the oldest. Ids leave it however they
+    // get allocated, so it only ever holds free ones. NULL while turned off
+    struct recent_link *recent_links;
+    size_t recent_ids;    // how many ids recent_links covers (at least num_blocks)
+    size_t recent_depth;
+    size_t recent_count;
+    size_t recent_head;
+    size_t recent_tail;
+    // the pool a store from block_store_create_pooled goes back to, NULL otherwise
+    block_store_pool_t *pool;
+    // where data lives for block_store_create_shared/attach_shared stores, NULL otherwise;
+    // other processes change the fbm under these, so it's only ever updated atomically
+    shared_segment_t *shared;
+    // next free slot while it's sitting in the pool
+    block_store_t *next_free;
+    // the whole device for pooled stores (other in-memory ones map theirs); for file-backed
+    // ones the fbm, then the last committed copy of it (what a checkpoint puts in the image)
+    uint8_t mem[];
 };
 
+// One region carved into equal slots, each a block_store_t with its device right behind it
+struct block_store_pool {
+    uint8_t *region;
+    size_t region_bytes;
+    size_t slot_bytes;
+    size_t slots;
+    size_t available;
+    // free slots, most recently returned first (its memory is the warmest)
+    block_store_t *free_list;
+    pthread_mutex_t lock;
+};
+
+// Bookkeeping for one async block request
+struct io_ticket {
+    block_store_callback_t cb;
+    void *arg;
+    size_t block_id;
+    ssize_t expect;
+};
+
+static block_store_t *block_store_alloc(const size_t mem_bytes)
+{
+    block_store_t *bs = calloc(1, sizeof(block_store_t) + mem_bytes);
+    if (bs) {
+        bs->fd = -1;
+        bs->num_blocks = BLOCK_STORE_NUM_BLOCKS;
+        bs->stats = block_stats_create();
+    }
+    return bs;
+}
+
+// In-memory device memory is (once resized) an anonymous mapping of its own, so it can grow in place
+static size_t device_bytes(const block_store_t *const bs, const size_t num_blocks)
+{
+    size_t page = bs->backing == BLOCK_STORE_BACKING_HUGETLB ? BLOCK_STORE_HUGE_PAGE_BYTES
+                                                             : (size_t)sysconf(_SC_PAGESIZE);
+    return (num_blocks * BLOCK_SIZE_BYTES + page - 1) / page * page;
+}
+
+// Anonymous memory starting on a huge page boundary, so transparent huge pages can back all of it
+static void *map_aligned(const size_t len)
+{
+    size_t span = len + BLOCK_STORE_HUGE_PAGE_BYTES;
+    uint8_t *mem = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    uint8_t *aligned = (uint8_t *)(((uintptr_t)mem + BLOCK_STORE_HUGE_PAGE_BYTES - 1)
+                                   & ~(uintptr_t)(BLOCK_STORE_HUGE_PAGE_BYTES - 1));
+    if (aligned > mem) {
+        munmap(mem, (size_t)(aligned - mem));
+    }
+    size_t tail = span - (size_t)(aligned - mem) - len;
+    if (tail) {
+        munmap(aligned + len, tail);
+    }
+    return aligned;
+}
+
+// Maps room for num_blocks, in huge pages if asked and they can be had.
+// A plain device of the standard size just gets heap memory: a mapping per device makes
+// create and destroy cost two syscalls, and only pays off once it's resized (which
+// moves it into one, see device_grow).
+static bool device_map(block_store_t *const bs, const size_t num_blocks, const unsigned flags)
+{
+    if (!flags && num_blocks == BLOCK_STORE_NUM_BLOCKS) {
+        bs->backing = BLOCK_STORE_BACKING_PAGES;
+        bs->data = calloc(1, BLOCK_STORE_NUM_BYTES);
+        if (!bs->data) {
+            perror("create: calloc failed");
+            return false;
+        }
+        bs->data_bytes = BLOCK_STORE_NUM_BYTES;
+        bs->data_heap = true;
+        return true;
+    }
+    void *mem = MAP_FAILED;
+    size_t len = 0;
+    // (thin devices give memory back a chunk at a time, which hugetlb pages can't do)
+    if ((flags & BLOCK_STORE_CREATE_HUGE_PAGES) && !(flags & BLOCK_STORE_CREATE_THIN)) {
+        bs->backing = BLOCK_STORE_BACKING_HUGETLB;
+        len = device_bytes(bs, num_blocks);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        // no pool to take them from, fall back to ordinary pages
+        bs->backing = BLOCK_STORE_BACKING_PAGES;
+        len = device_bytes(bs, num_blocks);
+        if (flags & BLOCK_STORE_CREATE_HUGE_PAGES) {
+            mem = map_aligned(len);
+            if (mem != MAP_FAILED && madvise(mem, len, MADV_HUGEPAGE) == 0) {
+                bs->backing = BLOCK_STORE_BACKING_THP;
+            }
+        } else {
+            mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+    }
+    if (mem == MAP_FAILED) {
+        perror("create: mmap failed");
+        return false;
+    }
+    bs->data = mem;
+    bs->data_bytes = len;
+    return true;
+}
+
+// Makes room for len bytes of device memory; the kernel moves page tables, not the blocks
+// themselves, once the device has a mapping of its own
+static bool device_grow(block_store_t *const bs, const size_t len)
+{
+    void *grown = MAP_FAILED;
+    if (bs->data_heap) {
+        grown = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown != MAP_FAILED) {
+            memcpy(grown, bs->data, bs->data_bytes);
+            free(bs->data);
+            bs->data_heap = false;
+        }
+    } else {
+        grown = mremap(bs->data, bs->data_bytes, len, MREMAP_MAYMOVE);
+    }
+    if (grown == MAP_FAILED) {
+        perror("resize: mremap failed");
+        return false;
+    }
+    bs->data = grown;
+    bs->data_bytes = len;
+    return true;
+}
+
+static bool is_fbm_block(const size_t block_id)
+{
+    return block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS;
+}
+
+static void bs_lock(const block_store_t *const bs)
+{
+    if (bs->fd >= 0) {
+        pthread_mutex_lock((pthread_mutex_t *)&bs->lock);
+    }
+}
+
+static void bs_unlock(const block_store_t *const bs)
+{
+    if (bs->fd >= 0) {
+        pthread_mutex_unlock((pthread_mutex_t *)&bs->lock);
+    }
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Notes an fbm change for whoever has to get it to disk
+static void fbm_touched(block_store_t *const bs)
+{
+    if (bs->journal) {
+        bs->fbm_unlogged = true;
+    } else if (!bs->fbm_dirty) {
+        bs->fbm_dirty = true;
+        bs->fbm_dirtied = monotonic_ns();
+    }
+}
+
+// Takes an id out of the recently released list, if it's there
+static void recent_unlink(block_store_t *const bs, const size_t block_id)
+{
+    if (!bs->recent_links || block_id >= bs->recent_ids) {
+        return;
+    }
+    struct recent_link *link = &bs->recent_links[block_id];
+    if (link->older == RECENT_UNLISTED) {
+        return;
+    }
+    if (link->newer == RECENT_END) {
+        bs->recent_head = link->older;
+    } else {
+        bs->recent_links[link->newer].older = link->older;
+    }
+    if (link->older == RECENT_END) {
+        bs->recent_tail = link->newer;
+    } else {
+        bs->recent_links[link->older].newer = link->newer;
+    }
+    link->older = RECENT_UNLISTED;
+    bs->recent_count--;
+}
+
+// Puts a just released id at the head of the list, pushing the oldest out if it's full
+static void recent_push(block_store_t *const bs, const size_t block_id)
+{
+    if (!bs->recent_links || block_id >= bs->recent_ids) {
+        return;
+    }
+    recent_unlink(bs, block_id);
+    if (bs->recent_count == bs->recent_depth) {
+        recent_unlink(bs, bs->recent_tail);
+    }
+    struct recent_link *link = &bs->recent_links[block_id];
+    link->newer = RECENT_END;
+    link->older = bs->recent_count ? bs->recent_head : RECENT_END;
+    if (bs->recent_count) {
+        bs->recent_links[bs->recent_head].newer = block_id;
+    } else {
+        bs->recent_tail = block_id;
+    }
+    bs->recent_head = block_id;
+    bs->recent_count++;
+}
+
+// Makes the list cover ids up to (not including) ids; it never gets smaller, a device
+// shrunk and grown again just reuses what's there
+static bool recent_resize(block_store_t *const bs, const size_t ids)
+{
+    if (ids <= bs->recent_ids) {
+        return true;
+    }
+    struct recent_link *links = realloc(bs->recent_links, ids * sizeof(struct recent_link));
+    if (!links) {
+        return false;
+    }
+    for (size_t id = bs->recent_ids; id < ids; ++id) {
+        links[id].older = RECENT_UNLISTED;
+    }
+    bs->recent_links = links;
+    bs->recent_ids = ids;
+    return true;
+}
+
+// Drops remembered ids the fbm no longer has free (or at all), for when it changed
+// other than a bit at a time
+static void recent_prune(block_store_t *const bs)
+{
+    for (size_t id = bs->recent_count ? bs->recent_head : RECENT_END; id != RECENT_END;) {
+        size_t older = bs->recent_links[id].older;
+        if (id >= bs->num_blocks || bitmap_test(bs->fbm, id)) {
+            recent_unlink(bs, id);
+        }
+        id = older;
+    }
+}
+
+// The fbm was overwritten wholesale rather than a bit at a time, so the free run
+// summary is rebuilt on its next use
+static void fbm_replaced(block_store_t *const bs)
+{
+    free_extents_destroy(bs->extents);
+    bs->extents = NULL;
+    block_remap_sync(bs->remap, bs->fbm);
+    recent_prune(bs);
+}
+
+// Where a block's data sits in an in-memory store, NULL if it has nowhere
+static uint8_t *block_data(const block_store_t *const bs, const size_t block_id)
+{
+    if (bs->fbm_ext && is_fbm_block(block_id)) {
+        return bs->fbm_ext + (block_id - BITMAP_START_BLOCK) * BLOCK_SIZE_BYTES;
+    }
+    size_t slot = bs->remap ? block_remap_lookup(bs->remap, block_id) : block_id;
+    return slot < bs->num_blocks ? bs->data + slot * BLOCK_SIZE_BYTES : NULL;
+}
+
+// Chunk of a thin device a block pointer falls in, SIZE_MAX if it isn't in data
+static size_t chunk_of(const block_store_t *const bs, const uint8_t *const block)
+{
+    if (!bs->chunks || block < bs->data || block >= bs->data + bs->data_bytes) {
+        return SIZE_MAX;
+    }
+    return (size_t)(block - bs->data) / bs->chunk_bytes;
+}
+
+// Whether a block has memory behind it (always, unless the device is thin)
+static bool chunk_resident(const block_store_t *const bs, const uint8_t *const block)
+{
+    size_t chunk = chunk_of(bs, block);
+    return chunk == SIZE_MAX || bitmap_test(bs->chunks, chunk);
+}
+
+static void chunk_written(block_store_t *const bs, const uint8_t *const block)
+{
+    size_t chunk = chunk_of(bs, block);
+    if (chunk != SIZE_MAX) {
+        bitmap_set(bs->chunks, chunk);
+    }
+}
+
+// A block just went free; if its whole chunk is free now, the memory goes back
+static void chunk_released(block_store_t *const bs, const uint8_t *const block)
+{
+    size_t chunk = chunk_of(bs, block);
+    if (chunk == SIZE_MAX || !bitmap_test(bs->chunks, chunk)) {
+        return;
+    }
+    // (what's in use is the physical slots once a compaction has moved things)
+    const bitmap_t *used = bs->remap ? block_remap_used(bs->remap) : bs->fbm;
+    size_t chunk_blocks = bs->chunk_bytes / BLOCK_SIZE_BYTES;
+    size_t first = chunk * chunk_blocks;
+    size_t end = first + chunk_blocks < bs->num_blocks ? first + chunk_blocks : bs->num_blocks;
+    size_t start = 0;
+    size_t len = bitmap_zero_run_at(used, first, &start);
+    if (!len || start + len < end) {
+        return;
+    }
+    // private anonymous memory comes back zeroed, so free blocks stay clean
+    if (madvise(bs->data + chunk * bs->chunk_bytes, bs->chunk_bytes, MADV_DONTNEED) < 0) {
+        perror("release: madvise failed");
+        return;
+    }
+    bitmap_reset(bs->chunks, chunk);
+}
+
+// Grows or shrinks the chunk map of a thin device along with it
+static bool chunks_resize(block_store_t *const bs, const size_t num_blocks)
+{
+    if (!bs->chunks) {
+        return true;
+    }
+    size_t chunk_blocks = bs->chunk_bytes / BLOCK_SIZE_BYTES;
+    size_t count = (num_blocks + chunk_blocks - 1) / chunk_blocks;
+    bitmap_t *chunks = bitmap_create(count);
+    if (!chunks) {
+        return false;
+    }
+    size_t keep = bitmap_get_bits(bs->chunks) < count ? bitmap_get_bits(bs->chunks) : count;
+    for (size_t chunk = 0; chunk < keep; ++chunk) {
+        if (bitmap_test(bs->chunks, chunk)) {
+            bitmap_set(chunks, chunk);
+        }
+    }
+    bitmap_destroy(bs->chunks);
+    bs->chunks = chunks;
+    return true;
+}
+
+// A block just got allocated; in a compacted store it needs a slot, and a clean one
+static void block_allocated(block_store_t *const bs, const size_t block_id)
+{
+    if (bs->remap) {
+        block_remap_assign(bs->remap, block_id);
+    }
+}
+
+// Where a block lives in the resident fbm of a file-backed store
+static uint8_t *fbm_block_ptr(block_store_t *const bs, const size_t block_id)
+{
+    return bs->mem + (block_id - BITMAP_START_BLOCK) * BLOCK_SIZE_BYTES;
+}
+
+static bool write_fbm(block_store_t *const bs)
+{
+    if (bs->fbm_dirty) {
+        if (!block_io_pwrite(bs->fd, bs->mem, BITMAP_SIZE_BYTES, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES)) {
+            return false;
+        }
+        bs->fbm_dirty = false;
+    }
+    return true;
+}
+
+// Block I/O for file-backed stores: the fbm blocks are resident, the rest go
+// through the cache if there is one
+static bool file_read_block(block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    if (is_fbm_block(block_id)) {
+        memcpy(buffer, fbm_block_ptr(bs, block_id), BLOCK_SIZE_BYTES);
+        return true;
+    }
+    if (bs->journal && bitmap_test(bs->staged_map, block_id)) {
+        memcpy(buffer, bs->staged + block_id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        return true;
+    }
+    if (bs->cache) {
+        return block_cache_read(bs->cache, block_id, buffer);
+    }
+    return block_io_pread(bs->fd, buffer, BLOCK_SIZE_BYTES, block_id * BLOCK_SIZE_BYTES);
+}
+
+static bool file_write_block(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    if (is_fbm_block(block_id)) {
+        memcpy(fbm_block_ptr(bs, block_id), buffer, BLOCK_SIZE_BYTES);
+        fbm_touched(bs);
+        fbm_replaced(bs);
+        return true;
+    }
+    if (bs->journal) {
+        // the log only redoes, so nothing may reach the image before it's committed
+        if (!journal_append(bs->journal, block_id, buffer)) {
+            return false;
+        }
+        memcpy(bs->staged + block_id * BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        bitmap_set(bs->staged_map, block_id);
+        if (bs->cache) {
+            block_cache_invalidate(bs->cache, block_id);
+        }
+        return true;
+    }
+    if (bs->cache) {
+        return block_cache_write(bs->cache, block_id, buffer);
+    }
+    return block_io_pwrite(bs->fd, buffer, BLOCK_SIZE_BYTES, block_id * BLOCK_SIZE_BYTES);
+}
+
+// Copies part of the device image out, wherever the device happens to live
+static bool image_read(const block_store_t *const bs, uint8_t *buf, const size_t len, const size_t offset)
+{
+    if (bs->data && !bs->remap && !bs->fbm_ext) {
+        memcpy(buf, bs->data + offset, len);
+        return true;
+    }
+    if (bs->data) {
+        // the image is laid out by logical id whatever compaction did
+        for (size_t done = 0; done < len;) {
+            size_t within = (offset + done) % BLOCK_SIZE_BYTES;
+            size_t n = BLOCK_SIZE_BYTES - within < len - done ? BLOCK_SIZE_BYTES - within : len - done;
+            const uint8_t *src = block_data(bs, (offset + done) / BLOCK_SIZE_BYTES);
+            if (src) {
+                memcpy(buf + done, src + within, n);
+            } else {
+                memset(buf + done, 0, n);
+            }
+            done += n;
+        }
+        return true;
+    }
+    if (!block_io_pread(bs->fd, buf, len, offset)) {
+        return false;
+    }
+    // the file's copy of the fbm may be stale, patch in the resident one
+    const size_t fbm_start = BITMAP_START_BLOCK * BLOCK_SIZE_BYTES;
+    const size_t fbm_end = fbm_start + BITMAP_SIZE_BYTES;
+    size_t lo = offset > fbm_start ? offset : fbm_start;
+    size_t hi = offset + len < fbm_end ? offset + len : fbm_end;
+    if (lo < hi) {
+        memcpy(buf + (lo - offset), bs->mem + (lo - fbm_start), hi - lo);
+    }
+    // and anything still dirty in the cache is newer than the file too
+    if (bs->cache) {
+        for (size_t id = offset / BLOCK_SIZE_BYTES; id < (offset + len) / BLOCK_SIZE_BYTES; ++id) {
+            if (!is_fbm_block(id)) {
+                block_cache_peek(bs->cache, id, buf + (id * BLOCK_SIZE_BYTES - offset));
+            }
+        }
+    }
+    // as is anything a journaled store hasn't checkpointed yet
+    if (bs->journal) {
+        for (size_t id = offset / BLOCK_SIZE_BYTES; id < (offset + len) / BLOCK_SIZE_BYTES; ++id) {
+            if (!is_fbm_block(id) && bitmap_test(bs->staged_map, id)) {
+                memcpy(buf + (id * BLOCK_SIZE_BYTES - offset), bs->staged + id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+            }
+        }
+    }
+    return true;
+}
+
+// The last committed fbm of a journaled store
+static uint8_t *fbm_snapshot(block_store_t *const bs)
+{
+    return bs->mem + BITMAP_SIZE_BYTES;
+}
+
+// Adds what the log is behind on to the open group: the fbm, and every staged block
+// once a failed group has lost some of them. Caller holds lock.
+static bool append_unlogged(block_store_t *const bs)
+{
+    if (bs->staged_unlogged) {
+        // their newest contents supersede whatever the lost group had for them
+        for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+            if (bitmap_test(bs->staged_map, id)
+                    && !journal_append(bs->journal, id, bs->staged + id * BLOCK_SIZE_BYTES)) {
+                return false;
+            }
+        }
+        bs->staged_unlogged = false;
+    }
+    if (bs->fbm_unlogged) {
+        // the fbm rides along as two ordinary block records
+        for (size_t i = 0; i < BITMAP_NUM_BLOCKS; ++i) {
+            if (!journal_append(bs->journal, BITMAP_START_BLOCK + i, bs->mem + i * BLOCK_SIZE_BYTES)) {
+                return false;
+            }
+        }
+        memcpy(fbm_snapshot(bs), bs->mem, BITMAP_SIZE_BYTES);
+        bs->fbm_unlogged = false;
+    }
+    return true;
+}
+
+// Seals the open group and makes it durable. Caller holds commit_lock; with hold_lock
+// it holds lock too and keeps it throughout, otherwise it doesn't and the next group
+// fills up while this one is being written.
+static bool commit_group(block_store_t *const bs, const bool hold_lock)
+{
+    if (!hold_lock) {
+        bs_lock(bs);
+    }
+    if (!append_unlogged(bs)) {
+        if (!hold_lock) {
+            bs_unlock(bs);
+        }
+        return false;
+    }
+    size_t records = journal_pending(bs->journal);
+    journal_group_t *group = journal_seal(bs->journal);
+    if (!hold_lock) {
+        bs_unlock(bs);
+    }
+    if (!records) {
+        return true;
+    }
+    bool ok = group && journal_write_group(bs->journal, group);
+    if (!hold_lock) {
+        bs_lock(bs);
+    }
+    if (ok) {
+        bs->journal_stats.commits++;
+        bs->journal_stats.records += records;
+    } else {
+        // the group is gone, so the next one has to carry the fbm and everything staged
+        // again; until one makes it nothing counts as committed
+        bs->fbm_unlogged = true;
+        bs->staged_unlogged = true;
+    }
+    bs->journal_stats.log_bytes = journal_size(bs->journal);
+    if (!hold_lock) {
+        bs_unlock(bs);
+    }
+    return ok;
+}
+
+// Puts everything committed into the image and empties the log.
+// Caller holds commit_lock but not lock.
+static bool checkpoint_log(block_store_t *const bs)
+{
+    // lock is held from the commit through the image writes, so the staged blocks and
+    // the fbm snapshot that go out are exactly what the log has just made durable
+    bs_lock(bs);
+    bool ok = commit_group(bs, true);
+    for (size_t id = 0; ok && id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        if (bitmap_test(bs->staged_map, id)) {
+            ok = block_io_pwrite(bs->fd, bs->staged + id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, id * BLOCK_SIZE_BYTES);
+            // reads go back to the cache once the map is cleared, so no frame may be
+            // left holding an older copy (one still loading gets orphaned)
+            if (bs->cache) {
+                block_cache_invalidate(bs->cache, id);
+            }
+        }
+    }
+    ok = ok && block_io_pwrite(bs->fd, fbm_snapshot(bs), BITMAP_SIZE_BYTES, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES);
+    if (ok) {
+        // the image has them now (the log still does too until it's emptied below)
+        bitmap_format(bs->staged_map, 0x00);
+    }
+    bs_unlock(bs);
+    ok = ok && fdatasync(bs->fd) == 0 && journal_checkpoint(bs->journal);
+    bs_lock(bs);
+    if (ok) {
+        bs->journal_stats.checkpoints++;
+    }
+    bs->journal_stats.log_bytes = journal_size(bs->journal);
+    bs_unlock(bs);
+    return ok;
+}
+
+// Background group commit and checkpointing for journaled stores
+static void *committer_main(void *arg)
+{
+    block_store_t *bs = arg;
+    bs_lock(bs);
+    while (!bs->committer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += BLOCK_STORE_COMMIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&bs->commit_wake, &bs->lock, &deadline);
+        if (bs->committer_stop) {
+            break;
+        }
+        bs_unlock(bs);
+
+        pthread_mutex_lock(&bs->commit_lock);
+        if (!commit_group(bs, false)) {
+            perror("journal: group commit failed");
+        } else if (journal_size(bs->journal) >= BLOCK_STORE_CHECKPOINT_BYTES && !checkpoint_log(bs)) {
+            perror("journal: checkpoint failed");
+        }
+        pthread_mutex_unlock(&bs->commit_lock);
+        bs_lock(bs);
+    }
+    bs_unlock(bs);
+    return NULL;
+}
+
+// Has the background writer got anything to do? Caller holds lock.
+static bool flush_due(block_store_t *const bs)
+{
+    const block_store_flush_policy_t *policy = &bs->flush_policy;
+    if (bs->flush_requested != bs->flush_completed) {
+        return true;
+    }
+    size_t dirty = bs->cache ? block_cache_dirty(bs->cache) : 0;
+    if (dirty && (dirty >= policy->dirty_blocks || dirty * BLOCK_SIZE_BYTES >= policy->dirty_bytes)) {
+        return true;
+    }
+    uint64_t oldest = bs->cache ? block_cache_oldest_dirty(bs->cache) : 0;
+    if (bs->fbm_dirty && (!oldest || bs->fbm_dirtied < oldest)) {
+        oldest = bs->fbm_dirtied;
+    }
+    return oldest && monotonic_ns() - oldest >= (uint64_t)policy->max_age_ms * 1000000u;
+}
+
+// Writes back whatever was dirty when it started, a batch at a time, dropping lock
+// around the I/O so writers keep going meanwhile. Caller holds flush_lock and lock.
+static bool flush_round(block_store_t *const bs)
+{
+    bool ok = true, wrote = false;
+    size_t batch = 1, rounds = 0;
+    if (bs->cache) {
+        // half the cache at most so eviction always has unpinned frames to pick from
+        block_store_cache_stats_t stats;
+        block_cache_get_stats(bs->cache, &stats);
+        batch = stats.capacity / 2 ? stats.capacity / 2 : 1;
+        // dirt made during the round waits for the next one, or a busy writer could keep us here forever
+        rounds = stats.dirty / batch + 1;
+    }
+    bool fbm = bs->fbm_dirty && !bs->journal;
+    do {
+        block_cache_wb_t *wb = rounds ? block_cache_writeback_begin(bs->cache, batch) : NULL;
+        uint8_t fbm_copy[BITMAP_SIZE_BYTES];
+        if (fbm) {
+            memcpy(fbm_copy, bs->mem, BITMAP_SIZE_BYTES);
+            bs->fbm_dirty = false;
+        }
+        if (!wb && !fbm) {
+            break;
+        }
+        bs_unlock(bs);
+        bool done = (!wb || block_cache_writeback_run(wb))
+                    && (!fbm || block_io_pwrite(bs->fd, fbm_copy, BITMAP_SIZE_BYTES, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
+        bs_lock(bs);
+        if (wb) {
+            block_cache_writeback_end(bs->cache, wb, done);
+        }
+        if (fbm && !done) {
+            fbm_touched(bs);
+        }
+        // throttled writers may be able to go again
+        pthread_cond_broadcast(&bs->flush_done);
+        ok = ok && done;
+        wrote = true;
+        fbm = false;
+    } while (ok && rounds && --rounds);
+    if (ok && wrote) {
+        bs_unlock(bs);
+        ok = fdatasync(bs->fd) == 0;
+        bs_lock(bs);
+    }
+    return ok;
+}
+
+static void *flusher_main(void *arg)
+{
+    block_store_t *bs = arg;
+    bs_lock(bs);
+    while (!bs->flusher_stop) {
+        if (!flush_due(bs)) {
+            unsigned tick = bs->flush_policy.max_age_ms / 2;
+            tick = tick < 1 ? 1 : tick > BLOCK_STORE_FLUSH_TICK_MS ? BLOCK_STORE_FLUSH_TICK_MS : tick;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += tick * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&bs->flush_wake, &bs->lock, &deadline);
+            continue;
+        }
+        uint64_t target = bs->flush_requested;
+        // lock order is flush_lock then lock, so step out to take it
+        bs_unlock(bs);
+        pthread_mutex_lock(&bs->flush_lock);
+        bs_lock(bs);
+        bool ok = flush_round(bs);
+        pthread_mutex_unlock(&bs->flush_lock);
+        if (!ok) {
+            perror("flusher: write back failed");
+        }
+        bs->flush_failed = !ok;
+        bs->flush_completed = target;
+        pthread_cond_broadcast(&bs->flush_done);
+    }
+    bs_unlock(bs);
+    return NULL;
+}
+
+// Holds a writer back while the cache has more dirt than the policy allows. Caller holds lock.
+static void throttle_writer(block_store_t *const bs)
+{
+    size_t dirty = block_cache_dirty(bs->cache);
+    if (dirty >= bs->flush_policy.dirty_blocks || dirty * BLOCK_SIZE_BYTES >= bs->flush_policy.dirty_bytes) {
+        pthread_cond_signal(&bs->flush_wake);
+    }
+    while (bs->flusher_running && !bs->flush_failed && block_cache_dirty(bs->cache) >= bs->flush_policy.limit_blocks) {
+        pthread_cond_wait(&bs->flush_done, (pthread_mutex_t *)&bs->lock);
+    }
+}
+
+static void stop_flusher(block_store_t *const bs)
+{
+    bs_lock(bs);
+    bool running = bs->flusher_running;
+    bs->flusher_stop = true;
+    pthread_cond_signal(&bs->flush_wake);
+    bs_unlock(bs);
+    if (running) {
+        pthread_join(bs->flusher, NULL);
+    }
+    bs_lock(bs);
+    bs->flusher_running = false;
+    bs->flusher_stop = false;
+    // nobody's left to finish these
+    bs->flush_completed = bs->flush_requested;
+    pthread_cond_broadcast(&bs->flush_done);
+    bs_unlock(bs);
+}
+
+// Lays the fbm over blocks 127-128 of a fresh device and marks them in use
+static bool device_format(block_store_t *const bs)
+{
+    // find loc for fbm
+    uint8_t *loc = bs->data + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES);
+
+    // overlay the bitmap (the header is part of bs, so there's nothing to allocate)
+    //
+    bs->fbm = bitmap_overlay_at(&bs->fbm_header, BITMAP_SIZE_BITS, loc);
+    if (!bs->fbm) {
+        return false; // corner case
+    }
+
+    // :o
+    for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++) {
+        block_store_request(bs, i); // see minimal request impl below
+    }
+    return true;
+}
+
+static block_store_t *create_device(const size_t map_blocks, const unsigned flags)
+{
+    // create store
+    block_store_t *bs = block_store_alloc(0);
+    if (!bs) {
+        // corner case
+        return NULL;
+    }
+    if (!device_map(bs, map_blocks, flags) || !device_format(bs)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// This creates a new BS device, ready to go
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create()
+{
+    return create_device(BLOCK_STORE_NUM_BLOCKS, 0);
+}
+
+///
+/// Creates an in-memory BS device with a chosen size and options
+/// \param num_blocks Blocks on the device
+/// \param flags BLOCK_STORE_CREATE_* flags
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_ex(const size_t num_blocks, const unsigned flags)
+{
+    if (num_blocks < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS) {
+        return NULL;
+    }
+    block_store_t *bs = create_device(num_blocks > BLOCK_STORE_NUM_BLOCKS ? num_blocks : BLOCK_STORE_NUM_BLOCKS, flags);
+    if (!bs) {
+        return NULL;
+    }
+    if (flags & BLOCK_STORE_CREATE_THIN) {
+        bs->chunk_bytes = (size_t)sysconf(_SC_PAGESIZE);
+        size_t chunk_blocks = bs->chunk_bytes / BLOCK_SIZE_BYTES;
+        bs->chunks = bitmap_create((BLOCK_STORE_NUM_BLOCKS + chunk_blocks - 1) / chunk_blocks);
+        if (!bs->chunks) {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        if (bs->backing == BLOCK_STORE_BACKING_PAGES) {
+            // a huge page would only go back once all of it is free (and no THP at all is fine too)
+            madvise(bs->data, bs->data_bytes, MADV_NOHUGEPAGE);
+        }
+        // the fbm has been written to already (its two blocks straddle a chunk boundary)
+        for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++) {
+            chunk_written(bs, bs->data + i * BLOCK_SIZE_BYTES);
+        }
+    }
+    if (!block_store_resize(bs, num_blocks)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+// Hands a destroyed store's slot back to its pool
+static void pool_put(block_store_pool_t *const pool, block_store_t *const bs)
+{
+    pthread_mutex_lock(&pool->lock);
+    bs->next_free = pool->free_list;
+    pool->free_list = bs;
+    pool->available++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+///
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+///
+void block_store_destroy(block_store_t *const bs)
+{
+    if (bs) {
+        if (bs->fd >= 0) {
+            stop_flusher(bs);
+            if (bs->committer_running) {
+                bs_lock(bs);
+                bs->committer_stop = true;
+                pthread_cond_signal(&bs->commit_wake);
+                bs_unlock(bs);
+                pthread_join(bs->committer, NULL);
+            }
+            if (bs->journal) {
+                // a clean close leaves an empty log behind
+                pthread_mutex_lock(&bs->commit_lock);
+                if (!checkpoint_log(bs)) {
+                    perror("destroy: checkpoint failed");
+                }
+                pthread_mutex_unlock(&bs->commit_lock);
+                journal_close(bs->journal);
+                pthread_cond_destroy(&bs->commit_wake);
+                pthread_mutex_destroy(&bs->commit_lock);
+            }
+            // let anything in flight land, then push out the cache and fbm
+            block_io_destroy(bs->io);
+            // (a journaled store's fbm only reaches the image through a checkpoint)
+            if (!block_cache_destroy(bs->cache) || (!bs->journal && !write_fbm(bs))) {
+                perror("destroy: fbm write failed");
+            }
+            close(bs->fd);
+            pthread_cond_destroy(&bs->flush_done);
+            pthread_cond_destroy(&bs->flush_wake);
+            pthread_mutex_destroy(&bs->flush_lock);
+            pthread_mutex_destroy(&bs->lock);
+        }
+        // free overlay
+        if (bs->fbm) {
+            bitmap_destroy(bs->fbm);
+        }
+        free_extents_destroy(bs->extents);
+        block_remap_destroy(bs->remap);
+        if (bs->data_heap) {
+            free(bs->data);
+        } else if (bs->data && !bs->pool && !bs->shared) {
+            munmap(bs->data, bs->data_bytes);
+        }
+        shared_segment_detach(bs->shared);
+        free(bs->fbm_ext);
+        free(bs->recent_links);
+        free(bs->staged);
+        bitmap_destroy(bs->staged_map);
+        bitmap_destroy(bs->chunks);
+        block_stats_destroy(bs->stats);
+        if (bs->trace && !block_trace_close(bs->trace)) {
+            perror("destroy: trace write failed");
+        }
+        if (bs->pool) {
+            pool_put(bs->pool, bs);
+        } else {
+            free(bs);
+        }
+    }
+}
+
+///
+/// Sets up a pool of slots for in-memory devices of the default size
+/// \param n How many devices it can hold at once
+/// \return The pool, NULL on error
+///
+block_store_pool_t *block_store_pool_create(const size_t n)
+{
+    // (slots start on a cache line so neighbouring stores don't share one)
+    size_t slot_bytes = (sizeof(block_store_t) + BLOCK_STORE_NUM_BYTES + 63) & ~(size_t)63;
+    if (!n || n > SIZE_MAX / slot_bytes) {
+        return NULL;
+    }
+    block_store_pool_t *pool = calloc(1, sizeof(block_store_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->region_bytes = n * slot_bytes;
+    pool->region = mmap(NULL, pool->region_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->region == MAP_FAILED) {
+        perror("pool: mmap failed");
+        free(pool);
+        return NULL;
+    }
+    pool->slot_bytes = slot_bytes;
+    pool->slots = n;
+    pool->available = n;
+    // linked back to front, so the first slot is the first handed out
+    for (size_t i = n; i-- > 0;) {
+        block_store_t *slot = (block_store_t *)(pool->region + i * slot_bytes);
+        slot->next_free = pool->free_list;
+        pool->free_list = slot;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+///
+/// Takes a fresh device from a pool; block_store_destroy gives it back
+/// \param pool The pool
+/// \return Pointer to a new block storage device, NULL on error or if every slot is in use
+///
+block_store_t *block_store_create_pooled(block_store_pool_t *const pool)
+{
+    if (!pool) {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    block_store_t *bs = pool->free_list;
+    if (bs) {
+        pool->free_list = bs->next_free;
+        pool->available--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!bs) {
+        return NULL;
+    }
+    // a slot comes back with whatever its last device left in it
+    memset(bs, 0, pool->slot_bytes);
+    bs->fd = -1;
+    bs->num_blocks = BLOCK_STORE_NUM_BLOCKS;
+    bs->pool = pool;
+    bs->data = bs->mem;
+    bs->data_bytes = BLOCK_STORE_NUM_BYTES;
+    bs->backing = BLOCK_STORE_BACKING_POOL;
+    if (!device_format(bs)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// Counts the slots of a pool nobody is using
+/// \param pool The pool
+/// \return Free slots, 0 on error
+///
+size_t block_store_pool_available(block_store_pool_t *const pool)
+{
+    if (!pool) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    size_t available = pool->available;
+    pthread_mutex_unlock(&pool->lock);
+    return available;
+}
+
+///
+/// Frees a pool and the memory of every slot in it
+/// \param pool The pool, every device taken from it destroyed already
+///
+void block_store_pool_destroy(block_store_pool_t *const pool)
+{
+    if (pool) {
+        if (pool->available != pool->slots) {
+            fprintf(stderr, "pool: destroyed with %zu devices still out\n", pool->slots - pool->available);
+        }
+        munmap(pool->region, pool->region_bytes);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+///
+/// Creates an in-memory BS device in a named shared memory object other processes can attach
+/// \param name Shared memory object name ("/something"), mustn't exist yet
+/// \param mode Permissions for it
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_shared(const char *const name, const mode_t mode)
+{
+    block_store_t *bs = block_store_alloc(0);
+    if (!bs) {
+        return NULL;
+    }
+    bs->shared = shared_segment_create(name, mode, BLOCK_STORE_NUM_BYTES);
+    if (!bs->shared) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    bs->data = shared_segment_data(bs->shared);
+    bs->data_bytes = BLOCK_STORE_NUM_BYTES;
+    bs->backing = BLOCK_STORE_BACKING_SHARED;
+    if (!device_format(bs)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    // only now can anyone attach, so nobody sees the fbm blocks free
+    shared_segment_publish(bs->shared);
+    return bs;
+}
+
+///
+/// Maps a device made by block_store_create_shared into this process
+/// \param name Shared memory object name
+/// \return Pointer to the block storage device, NULL on error
+///
+block_store_t *block_store_attach_shared(const char *const name)
+{
+    block_store_t *bs = block_store_alloc(0);
+    if (!bs) {
+        return NULL;
+    }
+    bs->shared = shared_segment_attach(name, BLOCK_STORE_NUM_BYTES);
+    if (!bs->shared) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    bs->data = shared_segment_data(bs->shared);
+    bs->data_bytes = BLOCK_STORE_NUM_BYTES;
+    bs->backing = BLOCK_STORE_BACKING_SHARED;
+    bs->fbm = bitmap_overlay_at(&bs->fbm_header, BITMAP_SIZE_BITS, bs->data + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES);
+    if (!bs->fbm) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// Counts the processes that have a shared device attached
+/// \param bs BS device
+/// \return Live attachments, counting this one; 0 on error or if the device isn't shared
+///
+size_t block_store_get_shared_attached(const block_store_t *const bs)
+{
+    return bs ? shared_segment_attached(bs->shared) : 0;
+}
+
+// Marks a block in use, false if it was already
+static bool fbm_claim(block_store_t *const bs, const size_t block_id)
+{
+    // (allocated is allocated, whoever did it: it mustn't be handed out again as reused)
+    recent_unlink(bs, block_id);
+    if (bs->shared) {
+        // the test and the set have to be one step, other processes are racing for it
+        return bitmap_test_and_set_atomic(bs->fbm, block_id);
+    }
+    if (bitmap_test(bs->fbm, block_id)) {
+        return false;
+    }
+    free_extents_allocated(bs->extents, bs->fbm, block_id);
+    bitmap_set(bs->fbm, block_id);
+    return true;
+}
+
+// Changed: Originally used bitmap_ffs (which finds a set bit),
+// but now uses bitmap_ffz (which looks for a 0).
+static size_t allocate_block(block_store_t *const bs) {
+    if (!bs) {
+        return SIZE_MAX; // invalid pointer
+    }
+    bs_lock(bs);
+    // the block released last is the one still warm in the caches. Whatever else takes
+    // an id drops it from the list, so the head is free; only another process sharing the
+    // fbm can beat us to it, and then it's the scan after all
+    size_t freeBlock = SIZE_MAX;
+    if (bs->recent_count) {
+        size_t id = bs->recent_head;
+        if (fbm_claim(bs, id)) {
+            freeBlock = id;
+        }
+    }
+    if (freeBlock == SIZE_MAX && bs->shared) {
+        // find and take it in one go, or another process could get there in between
+        freeBlock = bitmap_ffz_claim_atomic(bs->fbm);
+        if (freeBlock < bs->num_blocks) {
+            recent_unlink(bs, freeBlock);
+        }
+    } else if (freeBlock == SIZE_MAX) {
+        // find first free (zero) bit in the bitmap
+        freeBlock = bitmap_ffz(bs->fbm);
+        // mark the block as allocated
+        if (freeBlock < bs->num_blocks) {
+            fbm_claim(bs, freeBlock);
+        }
+    }
+    // check if no free block found or out of range
+    if (freeBlock == SIZE_MAX || freeBlock >= bs->num_blocks) {
+        bs_unlock(bs);
+        return SIZE_MAX;
+    }
+    block_allocated(bs, freeBlock);
+    fbm_touched(bs);
+    bs_unlock(bs);
+    return freeBlock;
+}
+
+///
+/// Searches for a free block, marks it as in use, and returns the block's id
+/// \param bs BS device
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate(block_store_t *const bs)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE1(allocate_entry, bs);
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    size_t id = allocate_block(bs);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_ALLOCATE, &probe, id != SIZE_MAX, 0);
+        block_trace_log(bs->trace, BLOCK_STORE_OP_ALLOCATE, id, id != SIZE_MAX);
+    }
+    BLOCK_PROBE2(allocate_return, bs, id);
+    return id;
+}
+
+static bool request_block(block_store_t *const bs, const size_t block_id)
+{
+    if (!bs) return false;
+    if (block_id >= bs->num_blocks) return false;
+    bs_lock(bs);
+    // if bit set, fail, else set bit
+    bool taken = !fbm_claim(bs, block_id);
+    if (!taken) {
+        block_allocated(bs, block_id);
+        fbm_touched(bs);
+    }
+    bs_unlock(bs);
+    return !taken;
+}
+
+///
+/// Attempts to allocate the requested block id
+/// \param bs the block store object
+/// \block_id the requested block identifier
+/// \return boolean indicating succes of operation
+///
+
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    block_stats_probe_t probe;
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    bool ok = request_block(bs, block_id);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_REQUEST, &probe, ok, 0);
+        block_trace_log(bs->trace, BLOCK_STORE_OP_REQUEST, block_id, ok);
+    }
+    return ok;
+}
+
+static void release_block(block_store_t *const bs, const size_t block_id)
+{
+    //check for valid input
+    if(bs && block_id < bs->num_blocks)
+    {
+        bs_lock(bs);
+        // Clear :o
+        uint8_t *dst = bs->data ? block_data(bs, block_id) : NULL;
+        if (bs->data) {
+            if (dst && chunk_resident(bs, dst)) {
+                memset(dst, 0, BLOCK_SIZE_BYTES);
+            }
+            if (is_fbm_block(block_id)) {
+                fbm_replaced(bs);
+            }
+        } else {
+            if (!file_write_block(bs, block_id, zero_block)) {
+                perror("release: clear failed");
+            }
+        }
+
+        //release the bit
+        free_extents_released(bs->extents, bs->fbm, block_id);
+        if (bs->shared) {
+            // (after the clear above, so whoever takes it next sees zeroes)
+            bitmap_reset_atomic(bs->fbm, block_id);
+        } else {
+            bitmap_reset(bs->fbm, block_id);
+        }
+        block_remap_unassign(bs->remap, block_id);
+        if (dst) {
+            chunk_released(bs, dst);
+        }
+        recent_push(bs, block_id);
+        fbm_touched(bs);
+        bs_unlock(bs);
+    }
+}
+
+///
+/// Frees the specified block
+/// \param bs BS device
+/// \param block_id The block to free
+///
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE2(release_entry, bs, block_id);
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    release_block(bs, block_id);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_RELEASE, &probe, block_id < bs->num_blocks, 0);
+        block_trace_log(bs->trace, BLOCK_STORE_OP_RELEASE, block_id, block_id < bs->num_blocks);
+    }
+    BLOCK_PROBE2(release_return, bs, block_id);
+}
+
+///
+/// Sets how many recently released ids block_store_allocate tries before the lowest free one
+/// \param bs BS device
+/// \param depth Ids to remember, 0 to turn it off
+/// \return true on success, false on error
+///
+bool block_store_set_reuse_depth(block_store_t *const bs, const size_t depth)
+{
+    if (!bs) {
+        return false;
+    }
+    bs_lock(bs);
+    if (depth && !bs->recent_links && !recent_resize(bs, bs->num_blocks)) {
+        bs_unlock(bs);
+        return false;
+    }
+    // keep the newest of what's remembered already
+    bs->recent_depth = depth;
+    while (bs->recent_count > depth) {
+        recent_unlink(bs, bs->recent_tail);
+    }
+    if (!depth) {
+        free(bs->recent_links);
+        bs->recent_links = NULL;
+        bs->recent_ids = 0;
+    }
+    bs_unlock(bs);
+    return true;
+}
+
+///
+/// Counts the number of blocks marked as in use
+/// \param bs BS device
+/// \return Total blocks in use, SIZE_MAX on error
+///
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    //check for valid inputs, return amount of total set bits if yes
+	return bs && bs->fbm ? bitmap_total_set(bs->fbm) : SIZE_MAX;
+}
+
+///
+/// Counts the number of blocks marked free for use
+/// \param bs BS device
+/// \return Total blocks free, SIZE_MAX on error
+///
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    //check for valid inputs, return total bits - total set bits if yes
+	if (!bs || !bs->fbm)
+	{
+		return SIZE_MAX; // return error
+	}
+	return bitmap_get_bits(bs->fbm) - bitmap_total_set(bs->fbm);
+}
+
+///
+/// Describes how the free blocks are laid out
+/// \param bs BS device
+/// \param report Filled in on success
+/// \return true on success, false on error
+///
+bool block_store_get_free_extents(const block_store_t *const bs, block_store_free_extents_t *const report)
+{
+    // (a summary of a shared fbm would be out of date as soon as another process touched it)
+    if (!bs || !bs->fbm || !report || bs->shared) {
+        return false;
+    }
+    bs_lock(bs);
+    // (like the cache, the summary is allowed to change under a const store)
+    block_store_t *mut = (block_store_t *)bs;
+    if (!mut->extents) {
+        mut->extents = free_extents_create(bs->fbm);
+    }
+    free_extents_report(bs->extents, report);
+    bool ok = bs->extents != NULL;
+    bs_unlock(bs);
+    return ok;
+}
+
+///
+/// Moves allocated blocks down into the gaps below them, a bounded number per call
+/// \param bs BS device
+/// \param budget Most blocks to move this call, 0 to run until done
+/// \param report Filled in on success
+/// \return true on success, false on error or for file-backed devices
+///
+bool block_store_compact(block_store_t *const bs, const size_t budget, block_store_compact_report_t *const report)
+{
+    if (!bs || !bs->fbm || !report) {
+        return false;
+    }
+    if (!bs->data || bs->shared) {
+        // the remap only lives in this process's memory, the file's (or other
+        // processes') layout has to stay as the fbm says
+        return false;
+    }
+    if (!bs->remap) {
+        bs->remap = block_remap_create(bs->fbm, BITMAP_START_BLOCK, BITMAP_NUM_BLOCKS);
+        if (!bs->remap) {
+            return false;
+        }
+    }
+    report->moved = 0;
+    report->largest_before = block_remap_largest_free(bs->remap);
+    size_t from, to;
+    bool more = block_remap_next_move(bs->remap, &from, &to);
+    while (more && (!budget || report->moved < budget)) {
+        uint8_t *src = bs->data + from * BLOCK_SIZE_BYTES;
+        uint8_t *dst = bs->data + to * BLOCK_SIZE_BYTES;
+        // (a never-written block of a thin device is zeroes, and so is the free slot already)
+        if (chunk_resident(bs, src)) {
+            memcpy(dst, src, BLOCK_SIZE_BYTES);
+            chunk_written(bs, dst);
+            // free slots stay zeroed, so whoever gets this one next starts clean
+            memset(src, 0, BLOCK_SIZE_BYTES);
+        }
+        block_remap_moved(bs->remap, from, to);
+        chunk_released(bs, src);
+        report->moved++;
+        more = block_remap_next_move(bs->remap, &from, &to);
+    }
+    report->done = !more;
+    report->largest_after = block_remap_largest_free(bs->remap);
+    return true;
+}
+
+// Points the fbm at num_blocks bits: blocks 127-128 while they fit, a buffer of its
+// own once they don't (and for good after that)
+static bool fbm_resize(block_store_t *const bs, const size_t num_blocks)
+{
+    size_t old = bs->num_blocks;
+    uint8_t *bits = bs->data + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES;
+    uint8_t *ext = NULL;
+    size_t ext_bytes = 0;
+    if (bs->fbm_ext || num_blocks > BITMAP_SIZE_BITS) {
+        ext_bytes = (num_blocks + 7) / 8 > BITMAP_SIZE_BYTES ? (num_blocks + 7) / 8 : BITMAP_SIZE_BYTES;
+        ext = calloc(1, ext_bytes);
+        if (!ext) {
+            return false;
+        }
+        const uint8_t *from = bs->fbm_ext ? bs->fbm_ext : bits;
+        size_t have = bs->fbm_ext ? bs->fbm_ext_bytes : BITMAP_SIZE_BYTES;
+        memcpy(ext, from, have < ext_bytes ? have : ext_bytes);
+        bits = ext;
+    }
+    // (re-pointing the embedded header can't fail once bits is there)
+    bs->fbm = bitmap_overlay_at(&bs->fbm_header, num_blocks, bits);
+    if (ext) {
+        free(bs->fbm_ext);
+        bs->fbm_ext = ext;
+        bs->fbm_ext_bytes = ext_bytes;
+    }
+    // whatever was left in the bits past the old end doesn't describe the new blocks
+    size_t dirty_end = ((old + 7) / 8) * 8 > BITMAP_SIZE_BITS ? ((old + 7) / 8) * 8 : BITMAP_SIZE_BITS;
+    for (size_t bit = old; bit < num_blocks && bit < dirty_end; ++bit) {
+        bitmap_reset(bs->fbm, bit);
+    }
+    return true;
+}
+
+///
+/// Grows or shrinks an in-memory device in place
+/// \param bs BS device
+/// \param num_blocks New number of blocks
+/// \return true on success, false if blocks past the new end are in use, on error, or for file-backed,
+///  pooled or shared devices
+///
+bool block_store_resize(block_store_t *const bs, const size_t num_blocks)
+{
+    if (!bs || !bs->fbm || !bs->data || bs->pool || bs->shared || num_blocks < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS) {
+        return false;
+    }
+    size_t old = bs->num_blocks;
+    if (num_blocks == old) {
+        return true;
+    }
+    if (num_blocks < old) {
+        // only a free tail can be cut off
+        size_t start = 0;
+        size_t len = bitmap_zero_run_at(bs->fbm, num_blocks, &start);
+        if (!len || start + len != old) {
+            return false;
+        }
+    }
+    size_t len = device_bytes(bs, num_blocks);
+    if (len > bs->data_bytes && !device_grow(bs, len)) {
+        return false;
+    }
+    // (remap before fbm: a bigger remap only ever hands out slots the mapping already has)
+    // (the chunk map and reuse list may be bigger than needed but never smaller)
+    if (num_blocks > old && (!chunks_resize(bs, num_blocks) || (bs->recent_links && !recent_resize(bs, num_blocks)))) {
+        return false;
+    }
+    if ((bs->remap && !block_remap_resize(bs->remap, num_blocks)) || !fbm_resize(bs, num_blocks)) {
+        if (bs->remap) {
+            block_remap_resize(bs->remap, old);
+        }
+        return false;
+    }
+    bs->num_blocks = num_blocks;
+    if (num_blocks < old) {
+        chunks_resize(bs, num_blocks);
+        recent_prune(bs);
+    }
+    if (len < bs->data_bytes && !bs->data_heap) {
+        void *shrunk = mremap(bs->data, bs->data_bytes, len, 0);
+        if (shrunk != MAP_FAILED) {
+            bs->data_bytes = len;
+        }
+    }
+    // the summary was sized for the old device
+    free_extents_destroy(bs->extents);
+    bs->extents = NULL;
+    return true;
+}
+
+///
+/// Reports what kind of memory a device ended up with
+/// \param bs BS device
+/// \return The backing, BLOCK_STORE_BACKING_NONE on error
+///
+block_store_backing_t block_store_get_backing(const block_store_t *const bs)
+{
+    if (!bs) {
+        return BLOCK_STORE_BACKING_NONE;
+    }
+    return bs->data ? bs->backing : BLOCK_STORE_BACKING_FILE;
+}
+
+///
+/// Returns how much device memory an in-memory device holds
+/// \param bs BS device
+/// \return Bytes, SIZE_MAX on error or for file-backed devices
+///
+size_t block_store_get_resident_bytes(const block_store_t *const bs)
+{
+    if (!bs || !bs->data) {
+        return SIZE_MAX;
+    }
+    if (!bs->chunks) {
+        return bs->data_bytes;
+    }
+    // what the kernel actually has behind the mapping, not what the chunk map thinks
+    size_t pages = bs->data_bytes / bs->chunk_bytes;
+    unsigned char *vec = malloc(pages);
+    if (!vec || mincore(bs->data, bs->data_bytes, vec) < 0) {
+        free(vec);
+        return SIZE_MAX;
+    }
+    size_t resident = 0;
+    for (size_t page = 0; page < pages; ++page) {
+        resident += vec[page] & 1;
+    }
+    free(vec);
+    return resident * bs->chunk_bytes;
+}
+
+///
+/// Returns the number of blocks on a device, which differs from
+///  block_store_get_total_blocks only once it has been resized
+/// \param bs BS device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_get_num_blocks(const block_store_t *const bs)
+{
+    return bs ? bs->num_blocks : SIZE_MAX;
+}
+
+///
+/// Returns the total number of user-addressable blocks
+/// \return Total blocks
+///
+size_t block_store_get_total_blocks()
+{
+    return BLOCK_STORE_NUM_BLOCKS;
+}
+
+static size_t read_block(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    //check for valid inputs
+    if(bs && buffer && block_id < bs->num_blocks && bitmap_test(bs->fbm, block_id))
+    {
+        //copy memory and return sizes
+        if (bs->data) {
+            const uint8_t *src = block_data(bs, block_id);
+            memcpy(buffer, chunk_resident(bs, src) ? src : zero_block, BLOCK_SIZE_BYTES);
+            return BLOCK_SIZE_BYTES;
+        }
+        bs_lock(bs);
+        // (the cache is the one bit of a const store that's allowed to change)
+        bool ok = file_read_block((block_store_t *)bs, block_id, buffer);
+        bs_unlock(bs);
+        return ok ? BLOCK_SIZE_BYTES : 0;
+    }
+
+	return 0;
+}
+
+///
+/// Reads data from the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE2(read_entry, bs, block_id);
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    size_t n = read_block(bs, block_id, buffer);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_READ, &probe, n != 0, n);
+        block_trace_log(bs->trace, BLOCK_STORE_OP_READ, block_id, n != 0);
+    }
+    BLOCK_PROBE3(read_return, bs, block_id, n);
+    return n;
+}
+
+static size_t write_block(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+	//check for valid inputs
+    if(bs && buffer && block_id < bs->num_blocks && bitmap_test(bs->fbm, block_id))
+    {
+        //copy memory and return sizes
+        if (bs->data) {
+            uint8_t *dst = block_data(bs, block_id);
+            memcpy(dst, buffer, BLOCK_SIZE_BYTES);
+            chunk_written(bs, dst);
+            if (is_fbm_block(block_id)) {
+                fbm_replaced(bs);
+            }
+            return BLOCK_SIZE_BYTES;
+        }
+        bs_lock(bs);
+        bool ok = file_write_block(bs, block_id, buffer);
+        bool full = bs->journal && journal_pending(bs->journal) >= BLOCK_STORE_COMMIT_RECORDS;
+        if (full) {
+            // don't let a burst of writes run too far ahead of the log
+            pthread_cond_signal(&bs->commit_wake);
+        }
+        if (bs->flusher_running && bs->cache) {
+            throttle_writer(bs);
+        }
+        bs_unlock(bs);
+        return ok ? BLOCK_SIZE_BYTES : 0;
+    }
+
+	return 0;
+}
+
+///
+/// Reads data from the specified buffer and writes it to the designated block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE2(write_entry, bs, block_id);
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    size_t n = write_block(bs, block_id, buffer);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_WRITE, &probe, n != 0, n);
+        block_trace_log(bs->trace, BLOCK_STORE_OP_WRITE, block_id, n != 0);
+    }
+    BLOCK_PROBE3(write_return, bs, block_id, n);
+    return n;
+}
+
+static block_store_t *deserialize_image(const char *const filename)
+{
+    // Return NULL on error
+    if (!filename) {
+        return NULL;
+    }
+
+    // Open file for reading only
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("deserialize: open failed");
+        return NULL;
+    }
+
+    // Allocate a fresh block_store_t
+    //   We'll read data into bs->data
+    block_store_t *bs = block_store_alloc(0);
+    if (!bs || !device_map(bs, BLOCK_STORE_NUM_BLOCKS, 0)) {
+        block_store_destroy(bs);
+        close(fd);
+        return NULL;
+    }
+
+    // We'll loop to read exactly BLOCK_STORE_NUM_BYTES (or hit EOF early)
+    size_t total_got = 0;
+    size_t bytes_left = BLOCK_STORE_NUM_BYTES;
+    while (bytes_left > 0) {
+        ssize_t got = read(fd, bs->data + total_got, bytes_left);
+        BLOCK_PROBE3(deserialize_io, total_got, bytes_left, got);
+        if (got < 0) {
+            // read error
+            perror("deserialize: read failed");
+            block_store_destroy(bs); 
+            close(fd);
+            return NULL;
+        }
+        if (got == 0) {
+            // EOF reached; break out
+            break;
+        }
+        total_got  += (size_t)got;
+        bytes_left -= (size_t)got;
+    }
+    close(fd);
+
+    // If we didn't get the full BLOCK_STORE_NUM_BYTES, 
+    // pad the remainder with zero
+    if (bytes_left > 0) {
+        memset(bs->data + total_got, 0, bytes_left);
+    }
+
+    // Now that bs->data is filled (fully or partially), 
+    // overlay the bitmap so we have a valid fbm pointer
+    bs->fbm = bitmap_overlay_at(&bs->fbm_header, BITMAP_SIZE_BITS,
+                                bs->data + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
+    if (!bs->fbm) {
+        // If overlay fails, clean up
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // Return the fresh block_store_t 
+    // The fbm is now pointed at the portion of bs->data holding bitmap bits
+    return bs;
+}
+
+///
+/// Imports BS device from the given file - for grads/bonus
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+///
+
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE0(deserialize_entry);
+    // (a failure leaves no store to count against, so these are process-wide)
+    block_stats_t *stats = block_stats_process();
+    block_stats_begin(stats, &probe);
+    block_store_t *bs = deserialize_image(filename);
+    block_stats_end(stats, BLOCK_STORE_OP_DESERIALIZE, &probe, bs != NULL, bs ? BLOCK_STORE_NUM_BYTES : 0);
+    BLOCK_PROBE1(deserialize_return, bs);
+    return bs;
+}
+
+static size_t serialize_image(const block_store_t *const bs, const char *const filename)
+{
+    // Return 0 on any error (null pointers, open failure, write failure, etc.)
+    if (!bs || !filename) {
+        // minimal early-out, no need for big error message
+        return 0;
+    }
+    if (bs->num_blocks != BLOCK_STORE_NUM_BLOCKS) {
+        // the image format only has room for the standard geometry
+        fprintf(stderr, "serialize: device was resized to %zu blocks, images hold %d\n", bs->num_blocks,
+                BLOCK_STORE_NUM_BLOCKS);
+        return 0;
+    }
+
+    // Write to a temp file next to the target and rename it over at the end,
+    // so a crash mid-write never leaves a truncated image behind
+    size_t name_len = strlen(filename) + sizeof(".tmp");
+    char *tmp_name = malloc(name_len);
+    if (!tmp_name) {
+        return 0;
+    }
+    snprintf(tmp_name, name_len, "%s.tmp", filename);
+
+    // Open the file for writing (create if needed), truncate to empty
+    // 0666 gives read/write perms (umask can restrict it further if needed)
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("serialize: open failed");
+        free(tmp_name);
+        return 0;
+    }
+
+    // We want to write all BLOCK_STORE_NUM_BYTES from bs->data
+    // (file-backed stores get staged through a bounce buffer a chunk at a time)
+    uint8_t bounce[4096];
+    // (so do compacted or once-grown in-memory ones, their blocks are out of order)
+    const uint8_t *data_ptr = bs->remap || bs->fbm_ext ? NULL : bs->data;
+    size_t total_written = 0;
+    size_t bytes_left    = BLOCK_STORE_NUM_BYTES;
+
+    // We'll loop until we write all bytes or an error occurs
+    while (bytes_left > 0) {
+        size_t chunk = bytes_left;
+        const uint8_t *src = bounce;
+        if (data_ptr) {
+            src = data_ptr + total_written;
+        } else {
+            chunk = bytes_left < sizeof(bounce) ? bytes_left : sizeof(bounce);
+            bs_lock(bs);
+            bool got = image_read(bs, bounce, chunk, total_written);
+            bs_unlock(bs);
+            if (!got) {
+                perror("serialize: read failed");
+                break;
+            }
+        }
+        ssize_t written = write(fd, src, chunk);
+        BLOCK_PROBE4(serialize_io, bs, total_written, chunk, written);
+        if (written < 0) {
+            // If write fails, print error and bail
+            perror("serialize: write failed");
+            break;
+        }
+        // written can be 0 if the filesystem is full or something else
+        if (written == 0) {
+            // We can't proceed further; the partial temp file gets thrown away
+            break;
+        }
+        total_written += (size_t)written;
+        bytes_left    -= (size_t)written;
+    }
+
+    // Done writing everything, it has to be on disk before it can replace anything
+    bool ok = bytes_left == 0 && fsync(fd) == 0;
+    if (close(fd) < 0) {
+        ok = false;
+    }
+    if (ok && rename(tmp_name, filename) < 0) {
+        perror("serialize: rename failed");
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp_name);
+    }
+    free(tmp_name);
+
+    // If we wrote exactly BLOCK_STORE_NUM_BYTES, return that 
+    return ok ? total_written : 0;
+}
+
+///
+/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+    block_stats_probe_t probe;
+    BLOCK_PROBE1(serialize_entry, bs);
+    block_stats_begin(bs ? bs->stats : NULL, &probe);
+    size_t n = serialize_image(bs, filename);
+    if (bs) {
+        block_stats_end(bs->stats, BLOCK_STORE_OP_SERIALIZE, &probe, n != 0, n);
+    }
+    BLOCK_PROBE2(serialize_return, bs, n);
+    return n;
+}
+
+
+///
+/// Opens a BS device that lives in the given file rather than in memory
+/// \param filename The device image
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open(const char *const filename, const unsigned flags)
+{
+    if (!filename) {
+        return NULL;
+    }
+
+    int fd = open(filename, O_RDWR | ((flags & BLOCK_STORE_OPEN_CREATE) ? O_CREAT : 0), 0666);
+    if (fd < 0) {
+        perror("open: open failed");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("open: stat failed");
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0 && !(flags & BLOCK_STORE_OPEN_CREATE)) {
+        // nothing in there and we weren't asked to make anything
+        close(fd);
+        return NULL;
+    }
+
+    // only the fbm (and its committed copy) is resident, block data stays in the file
+    block_store_t *bs = block_store_alloc(2 * BITMAP_SIZE_BYTES);
+    if (!bs) {
+        close(fd);
+        return NULL;
+    }
+    bs->fbm = bitmap_overlay_at(&bs->fbm_header, BITMAP_SIZE_BITS, bs->mem);
+    if (!bs->fbm) {
+        // (fd isn't the store's yet, so destroy leaves it alone)
+        block_store_destroy(bs);
+        close(fd);
+        return NULL;
+    }
+    bs->fd = fd;
+    pthread_mutex_init(&bs->lock, NULL);
+    pthread_mutex_init(&bs->flush_lock, NULL);
+    pthread_cond_init(&bs->flush_wake, NULL);
+    pthread_cond_init(&bs->flush_done, NULL);
+
+    bool fresh = st.st_size == 0;
+    // short images get zero padded, same as deserialize
+    if (st.st_size < BLOCK_STORE_NUM_BYTES && ftruncate(fd, BLOCK_STORE_NUM_BYTES) < 0) {
+        perror("open: truncate failed");
+        block_store_destroy(bs);
+        return NULL;
+    }
+    if (flags & BLOCK_STORE_OPEN_JOURNAL) {
+        // redo whatever was committed before the last crash, before anything reads the image
+        size_t name_len = strlen(filename) + sizeof(".wal");
+        char *log_name = malloc(name_len);
+        if (log_name) {
+            snprintf(log_name, name_len, "%s.wal", filename);
+            bs->journal = journal_open(log_name, BLOCK_SIZE_BYTES);
+            free(log_name);
+        }
+        bs->staged = malloc(BLOCK_STORE_NUM_BYTES);
+        bs->staged_map = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+        if (!bs->journal || !bs->staged || !bs->staged_map) {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        pthread_mutex_init(&bs->commit_lock, NULL);
+        pthread_cond_init(&bs->commit_wake, NULL);
+        bs->journal_stats.replayed = journal_replay(bs->journal, fd);
+        if (bs->journal_stats.replayed == SIZE_MAX) {
+            bs->journal_stats.replayed = 0;
+            block_store_destroy(bs);
+            return NULL;
+        }
+        bs->journal_stats.log_bytes = journal_size(bs->journal);
+    }
+    if (fresh) {
+        for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++) {
+            block_store_request(bs, i);
+        }
+        // get the starting fbm down now, a device that crashes before its first sync
+        // should still reopen as a valid (empty) one
+        bs->fbm_dirty = true;
+        if (!write_fbm(bs) || fdatasync(fd) < 0) {
+            perror("open: fbm write failed");
+            block_store_destroy(bs);
+            return NULL;
+        }
+        bs->fbm_unlogged = false;
+    } else if (!block_io_pread(fd, bs->mem, BITMAP_SIZE_BYTES, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES)) {
+        perror("open: fbm read failed");
+        block_store_destroy(bs);
+        return NULL;
+    }
+    if (!block_store_set_cache_size(bs, BLOCK_STORE_CACHE_BLOCKS)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    if (bs->journal) {
+        // the image's fbm is the committed one, whatever a fresh device starts with isn't yet
+        if (!block_io_pread(fd, fbm_snapshot(bs), BITMAP_SIZE_BYTES, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES)
+                || pthread_create(&bs->committer, NULL, committer_main, bs) != 0) {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        bs->committer_running = true;
+    }
+    return bs;
+}
+
 ///
-/// This creates a new BS device, ready to go
-/// \return Pointer to a new block storage device, NULL on error
+/// Writes out the fbm and waits for a file-backed device to be on disk
+/// \param bs BS device
+/// \return true on success (always for in-memory devices)
 ///
-block_store_t *block_store_create()
+bool block_store_sync(block_store_t *const bs)
 {
-    // create store
-    block_store_t *bs = calloc(1, sizeof(block_store_t));
     if (!bs) {
-        // corner case
-        return NULL;
+        return false;
     }
-    // find loc for fbm
-    uint8_t *loc = bs->data + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES);
-
-    // overlay the bitmap
-    //
-    bs->fbm = bitmap_overlay(BITMAP_SIZE_BITS, loc);
-    if (!bs->fbm) {
-        free(bs);
-        return NULL; // corner case
+    if (bs->fd < 0) {
+        return true;
     }
-
-    // :o
-    for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++) {
-        block_store_request(bs, i); // see minimal request impl below
+    if (bs->journal) {
+        // once the group is in the log it's as good as in the image
+        pthread_mutex_lock(&bs->commit_lock);
+        bool ok = commit_group(bs, false);
+        pthread_mutex_unlock(&bs->commit_lock);
+        return ok;
     }
-    return bs;
+    // a writeback round in progress may have taken the fbm already, let it land first
+    pthread_mutex_lock(&bs->flush_lock);
+    bs_lock(bs);
+    bool ok = (!bs->cache || block_cache_flush(bs->cache)) && write_fbm(bs);
+    bs_unlock(bs);
+    ok = ok && fdatasync(bs->fd) == 0;
+    pthread_mutex_unlock(&bs->flush_lock);
+    if (!ok) {
+        perror("sync: failed");
+    }
+    return ok;
 }
 
 ///
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
+/// Resizes the buffer cache of a file-backed store (0 turns it off)
 /// \param bs BS device
+/// \param blocks Number of blocks to keep resident
+/// \return true on success, false for in-memory stores or on error
 ///
-void block_store_destroy(block_store_t *const bs)
+bool block_store_set_cache_size(block_store_t *const bs, const size_t blocks)
 {
-    if (bs) {
-        // free overlay
-        if (bs->fbm) {
-            bitmap_destroy(bs->fbm);
+    if (!bs || bs->fd < 0) {
+        return false;
+    }
+    block_cache_t *cache = NULL;
+    if (blocks) {
+        cache = block_cache_create(bs->fd, BLOCK_SIZE_BYTES, blocks, BLOCK_STORE_NUM_BLOCKS);
+        if (!cache) {
+            return false;
         }
-        free(bs);
+        // staged blocks are newer than the image, a background fill would cache the old ones
+        block_cache_set_skip(cache, bs->staged_map);
     }
+    // the background writer may be halfway through a batch of the old cache's frames
+    pthread_mutex_lock(&bs->flush_lock);
+    bs_lock(bs);
+    // the old frames go out before the new cache can be asked about them
+    if (!block_cache_destroy(bs->cache)) {
+        perror("set_cache_size: write back failed");
+    }
+    bs->cache = cache;
+    bs_unlock(bs);
+    pthread_mutex_unlock(&bs->flush_lock);
+    return true;
 }
 
 ///
-/// Searches for a free block, marks it as in use, and returns the block's id
+/// Caps the sequential readahead window of a file-backed store
 /// \param bs BS device
-/// \return Allocated block's id, SIZE_MAX on error
+/// \param max_blocks Largest window in blocks, 0 turns readahead off
+/// \return true on success, false if there's no cache
 ///
-// Changed: Originally used bitmap_ffs (which finds a set bit),
-// but now uses bitmap_ffz (which looks for a 0).
-size_t block_store_allocate(block_store_t *const bs) {
-    if (!bs) {
-        return SIZE_MAX; // invalid pointer
-    }
-    // find first free (zero) bit in the bitmap
-    size_t freeBlock = bitmap_ffz(bs->fbm);
-    // check if no free block found or out of range
-    if (freeBlock == SIZE_MAX || freeBlock >= BLOCK_STORE_NUM_BLOCKS) {
-        return SIZE_MAX;
+bool block_store_set_readahead(block_store_t *const bs, const size_t max_blocks)
+{
+    if (!bs || !bs->cache) {
+        return false;
     }
-    // mark the block as allocated
-    bitmap_set(bs->fbm, freeBlock);
-    return freeBlock;
+    bs_lock(bs);
+    block_cache_set_readahead(bs->cache, max_blocks);
+    bs_unlock(bs);
+    return true;
 }
 
 ///
-/// Attempts to allocate the requested block id
-/// \param bs the block store object
-/// \block_id the requested block identifier
-/// \return boolean indicating succes of operation
+/// Hints that the given blocks will be read soon
+/// \param bs BS device
+/// \param first First block of the range
+/// \param n Number of blocks
+/// \return true if the hint was taken
 ///
+bool block_store_prefetch(block_store_t *const bs, const size_t first, const size_t n)
+{
+    if (!bs || first >= BLOCK_STORE_NUM_BLOCKS) {
+        return false;
+    }
+    size_t count = n < BLOCK_STORE_NUM_BLOCKS - first ? n : BLOCK_STORE_NUM_BLOCKS - first;
+    if (bs->data || !count) {
+        return true;
+    }
+    if (bs->cache) {
+        bs_lock(bs);
+        block_cache_prefetch(bs->cache, first, count);
+        bs_unlock(bs);
+        return true;
+    }
+    // no cache of our own, so ask the kernel's to do it
+    return !posix_fadvise(bs->fd, first * BLOCK_SIZE_BYTES, count * BLOCK_SIZE_BYTES, POSIX_FADV_WILLNEED);
+}
 
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+///
+/// Reports hit/miss counters for a file-backed store's buffer cache
+/// \param bs BS device
+/// \param stats Filled in on success
+/// \return true on success, false if there's no cache
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats)
 {
-    if (!bs) return false;
-    if (block_id >= BLOCK_STORE_NUM_BLOCKS) return false;
-    // if bit set, fail
-    if (bitmap_test(bs->fbm, block_id)) return false;
-    // else set bit
-    bitmap_set(bs->fbm, block_id);
+    if (!bs || !bs->cache || !stats) {
+        return false;
+    }
+    bs_lock(bs);
+    block_cache_get_stats(bs->cache, stats);
+    bs_unlock(bs);
     return true;
 }
 
 ///
-/// Frees the specified block
+/// Starts, retunes or stops the background writer of a file-backed store
 /// \param bs BS device
-/// \param block_id The block to free
+/// \param policy Thresholds, NULL to stop the writer
+/// \return true on success, false for in-memory stores or on error
 ///
-void block_store_release(block_store_t *const bs, const size_t block_id)
+bool block_store_set_flush_policy(block_store_t *const bs, const block_store_flush_policy_t *const policy)
 {
-    //check for valid input
-    if(bs && block_id < BLOCK_STORE_NUM_BLOCKS)
-    {
-        // Clear :o
-        memset(bs->data + block_id * BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES);
-
-        //release the bit
-	    bitmap_reset(bs->fbm, block_id);
+    if (!bs || bs->fd < 0) {
+        return false;
+    }
+    if (!policy) {
+        stop_flusher(bs);
+        return true;
     }
+    bs_lock(bs);
+    bs->flush_policy = *policy;
+    if (!bs->flush_policy.limit_blocks) {
+        // no count threshold means write back as soon as anything's dirty, which needs no throttle
+        bs->flush_policy.limit_blocks = policy->dirty_blocks ? 2 * policy->dirty_blocks : SIZE_MAX;
+    }
+    bool start = !bs->flusher_running;
+    bs->flusher_running = true;
+    pthread_cond_signal(&bs->flush_wake);
+    bs_unlock(bs);
+    if (start && pthread_create(&bs->flusher, NULL, flusher_main, bs) != 0) {
+        bs_lock(bs);
+        bs->flusher_running = false;
+        bs_unlock(bs);
+        return false;
+    }
+    return true;
 }
 
 ///
-/// Counts the number of blocks marked as in use
+/// Waits until everything written so far is on stable storage
 /// \param bs BS device
-/// \return Total blocks in use, SIZE_MAX on error
+/// \return true on success (always for in-memory stores)
 ///
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+bool block_store_flush_wait(block_store_t *const bs)
 {
-    //check for valid inputs, return amount of total set bits if yes
-	return bs && bs->fbm ? bitmap_total_set(bs->fbm) : SIZE_MAX;
+    if (!bs) {
+        return false;
+    }
+    if (bs->fd < 0) {
+        return true;
+    }
+    bs_lock(bs);
+    if (!bs->flusher_running) {
+        bs_unlock(bs);
+        return block_store_sync(bs);
+    }
+    // a round that starts after this covers everything written before it
+    uint64_t ticket = ++bs->flush_requested;
+    pthread_cond_signal(&bs->flush_wake);
+    while (bs->flush_completed < ticket) {
+        pthread_cond_wait(&bs->flush_done, &bs->lock);
+    }
+    bool ok = !bs->flush_failed;
+    bs_unlock(bs);
+    if (ok && bs->journal) {
+        // the fbm of a journaled store only gets out through the log
+        ok = block_store_sync(bs);
+    }
+    return ok;
 }
 
 ///
-/// Counts the number of blocks marked free for use
+/// Reports per-operation counters and latency percentiles
 /// \param bs BS device
-/// \return Total blocks free, SIZE_MAX on error
+/// \param stats Filled in on success
+/// \return true on success, false if stats were compiled out
 ///
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats)
 {
-    //check for valid inputs, return total bits - total set bits if yes
-	if (!bs || !bs->fbm)
-	{
-		return SIZE_MAX; // return error
-	}
-	return bitmap_get_bits(bs->fbm) - bitmap_total_set(bs->fbm);
+    if (!bs || !bs->stats || !stats) {
+        return false;
+    }
+    block_stats_collect(bs->stats, stats);
+    // deserialize is counted for the whole process, see block_store_deserialize
+    block_store_stats_t process;
+    block_stats_collect(block_stats_process(), &process);
+    stats->ops[BLOCK_STORE_OP_DESERIALIZE] = process.ops[BLOCK_STORE_OP_DESERIALIZE];
+    return true;
 }
 
 ///
-/// Returns the total number of user-addressable blocks
-/// \return Total blocks
+/// Turns hardware counter sampling around each operation on or off
+/// \param bs BS device
+/// \param enabled Whether to sample
+/// \return true if sampling is now as asked
 ///
-size_t block_store_get_total_blocks()
+bool block_store_set_hw_counters(block_store_t *const bs, const bool enabled)
 {
-    return BLOCK_STORE_NUM_BLOCKS;
+    return bs && bs->stats && block_stats_set_hw(bs->stats, enabled);
 }
 
 ///
-/// Reads data from the specified block and writes it to the designated buffer
+/// Starts recording allocate/request/release/read/write calls to a trace file
 /// \param bs BS device
-/// \param block_id Source block id
-/// \param buffer Data buffer to write to
-/// \return Number of bytes read, 0 on error
+/// \param path Trace file, overwritten
+/// \return true on success, false if already recording or on error
 ///
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+bool block_store_trace_start(block_store_t *const bs, const char *const path)
 {
-    //check for valid inputs
-    if(bs && buffer && block_id < BLOCK_STORE_NUM_BLOCKS && bitmap_test(bs->fbm, block_id))
-    {
-        //copy memory and return sizes
-        memcpy(buffer, bs->data + (block_id * BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+    if (!bs || !path || bs->trace) {
+        return false;
     }
-
-	return 0;
+    bs->trace = block_trace_create(path, bs->num_blocks);
+    return bs->trace != NULL;
 }
 
 ///
-/// Reads data from the specified buffer and writes it to the designated block
+/// Stops recording and closes the trace file
 /// \param bs BS device
-/// \param block_id Destination block id
-/// \param buffer Data buffer to read from
-/// \return Number of bytes written, 0 on error
+/// \return true if the whole trace made it to the file
 ///
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+bool block_store_trace_stop(block_store_t *const bs)
 {
-	//check for valid inputs
-    if(bs && buffer && block_id < BLOCK_STORE_NUM_BLOCKS && bitmap_test(bs->fbm, block_id))
-    {
-        //copy memory and return sizes
-        memcpy(bs->data + (block_id * BLOCK_SIZE_BYTES), buffer, BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+    if (!bs || !bs->trace) {
+        return false;
     }
-
-	return 0;
+    bool ok = block_trace_close(bs->trace);
+    bs->trace = NULL;
+    return ok;
 }
 
 ///
-/// Imports BS device from the given file - for grads/bonus
-/// \param filename The file to load
-/// \return Pointer to new BS device, NULL on error
+/// Reports write-ahead journal counters
+/// \param bs BS device
+/// \param stats Filled in on success
+/// \return true on success, false if the device has no journal
 ///
-
-block_store_t *block_store_deserialize(const char *const filename)
+bool block_store_get_journal_stats(const block_store_t *const bs, block_store_journal_stats_t *const stats)
 {
-    // Return NULL on error
-    if (!filename) {
-        return NULL;
+    if (!bs || !bs->journal || !stats) {
+        return false;
     }
+    bs_lock(bs);
+    *stats = bs->journal_stats;
+    bs_unlock(bs);
+    return true;
+}
 
-    // Open file for reading only
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        perror("deserialize: open failed");
-        return NULL;
+static bool ensure_io(block_store_t *const bs)
+{
+    if (!bs->io) {
+        bs->io = block_io_create(bs->fd, BLOCK_STORE_IO_DEPTH);
     }
+    return bs->io != NULL;
+}
 
-    // Allocate a fresh block_store_t
-    //   We'll read data into bs->data
-    block_store_t *bs = calloc(1, sizeof(block_store_t));
-    if (!bs) {
-        close(fd);
-        return NULL;
+static void io_ticket_done(void *arg, ssize_t result)
+{
+    struct io_ticket *ticket = arg;
+    if (ticket->cb) {
+        ticket->cb(ticket->block_id, result == ticket->expect, ticket->arg);
     }
+    free(ticket);
+}
 
-    // We'll loop to read exactly BLOCK_STORE_NUM_BYTES (or hit EOF early)
-    size_t total_got = 0;
-    size_t bytes_left = BLOCK_STORE_NUM_BYTES;
-    while (bytes_left > 0) {
-        ssize_t got = read(fd, bs->data + total_got, bytes_left);
-        if (got < 0) {
-            // read error
-            perror("deserialize: read failed");
-            block_store_destroy(bs); 
-            close(fd);
-            return NULL;
-        }
-        if (got == 0) {
-            // EOF reached; break out
-            break;
-        }
-        total_got  += (size_t)got;
-        bytes_left -= (size_t)got;
+static bool submit_ticket(block_store_t *const bs, const size_t block_id, void *buffer, const bool write,
+                          block_store_callback_t cb, void *arg)
+{
+    if (!ensure_io(bs)) {
+        return false;
     }
-    close(fd);
-
-    // If we didn't get the full BLOCK_STORE_NUM_BYTES, 
-    // pad the remainder with zero
-    if (bytes_left > 0) {
-        memset(bs->data + total_got, 0, bytes_left);
+    struct io_ticket *ticket = malloc(sizeof(struct io_ticket));
+    if (!ticket) {
+        return false;
     }
+    ticket->cb = cb;
+    ticket->arg = arg;
+    ticket->block_id = block_id;
+    ticket->expect = block_id == SIZE_MAX ? 0 : BLOCK_SIZE_BYTES;
 
-    // Now that bs->data is filled (fully or partially), 
-    // overlay the bitmap so we have a valid fbm pointer
-    bs->fbm = bitmap_overlay(BITMAP_SIZE_BITS,
-                             bs->data + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
-    if (!bs->fbm) {
-        // If overlay fails, clean up
-        block_store_destroy(bs);
-        return NULL;
+    bool queued;
+    if (block_id == SIZE_MAX) {
+        queued = block_io_submit_flush(bs->io, io_ticket_done, ticket);
+    } else if (write) {
+        queued = block_io_submit_write(bs->io, buffer, BLOCK_SIZE_BYTES, block_id * BLOCK_SIZE_BYTES,
+                                       io_ticket_done, ticket);
+    } else {
+        queued = block_io_submit_read(bs->io, buffer, BLOCK_SIZE_BYTES, block_id * BLOCK_SIZE_BYTES,
+                                      io_ticket_done, ticket);
     }
-
-    // Return the fresh block_store_t 
-    // The fbm is now pointed at the portion of bs->data holding bitmap bits
-    return bs;
+    if (!queued) {
+        free(ticket);
+    }
+    return queued;
 }
 
 ///
-/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+/// Starts reading a block into buffer, cb runs from block_store_poll once it lands
 /// \param bs BS device
-/// \param filename The file to write to
-/// \return Number of bytes written, 0 on error
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to, must stay valid until cb runs
+/// \param cb Completion callback, may be NULL
+/// \param arg Passed to cb
+/// \return true if the read was started
 ///
-
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+bool block_store_submit_read(block_store_t *const bs, const size_t block_id, void *buffer,
+                             block_store_callback_t cb, void *arg)
 {
-    // Return 0 on any error (null pointers, open failure, write failure, etc.)
-    if (!bs || !filename) {
-        // minimal early-out, no need for big error message
-        return 0;
+    if (!bs || !buffer || block_id >= bs->num_blocks || !bitmap_test(bs->fbm, block_id)) {
+        return false;
     }
-
-    // Open the file for writing (create if needed), truncate to empty
-    // 0666 gives read/write perms (umask can restrict it further if needed)
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
-        perror("serialize: open failed");
-        return 0;
+    bool resident = bs->data || is_fbm_block(block_id);
+    if (!resident && (bs->cache || bs->journal)) {
+        bs_lock(bs);
+        if (bs->journal && bitmap_test(bs->staged_map, block_id)) {
+            // the image won't have it until the next checkpoint
+            memcpy(buffer, bs->staged + block_id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+            resident = true;
+        } else if (bs->cache) {
+            resident = block_cache_peek(bs->cache, block_id, buffer);
+        }
+        bs_unlock(bs);
+    } else if (resident) {
+        block_store_read(bs, block_id, buffer);
     }
+    if (resident) {
+        // already in memory, no point queueing anything
+        if (cb) {
+            cb(block_id, true, arg);
+        }
+        return true;
+    }
+    return submit_ticket(bs, block_id, buffer, false, cb, arg);
+}
 
-    // We want to write all BLOCK_STORE_NUM_BYTES from bs->data
-    const uint8_t *data_ptr = bs->data; 
-    size_t total_written = 0;
-    size_t bytes_left    = BLOCK_STORE_NUM_BYTES;
-
-    // We'll loop until we write all bytes or an error occurs
-    while (bytes_left > 0) {
-        ssize_t written = write(fd, data_ptr + total_written, bytes_left);
-        if (written < 0) {
-            // If write fails, print error and bail
-            perror("serialize: write failed");
-            close(fd);
-            return 0;
+///
+/// Starts writing buffer to a block, cb runs from block_store_poll once it lands
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from, must stay valid until cb runs
+/// \param cb Completion callback, may be NULL
+/// \param arg Passed to cb
+/// \return true if the write was started
+///
+bool block_store_submit_write(block_store_t *const bs, const size_t block_id, const void *buffer,
+                              block_store_callback_t cb, void *arg)
+{
+    if (!bs || !buffer || block_id >= bs->num_blocks || !bitmap_test(bs->fbm, block_id)) {
+        return false;
+    }
+    if (bs->data || is_fbm_block(block_id) || bs->journal || bs->flusher_running) {
+        // journaled writes have to go through the log and background-written ones through the
+        // cache, and either way it's a memcpy for now
+        bool ok = block_store_write(bs, block_id, buffer) == BLOCK_SIZE_BYTES;
+        if (cb) {
+            cb(block_id, ok, arg);
         }
-        // written can be 0 if the filesystem is full or something else
-        if (written == 0) {
-            // We can't proceed further; partial file left, but exit anyway
-            // Could do zero-padding if needed, but typically 0 means no space
-            close(fd);
-            return 0;
+        return true;
+    }
+    if (bs->cache) {
+        // the frame gets the new data before the ticket goes out, so a read or a readahead
+        // fill racing the write can't leave the old block behind in the cache once it lands
+        bs_lock(bs);
+        if (!block_cache_write(bs->cache, block_id, buffer)) {
+            block_cache_invalidate(bs->cache, block_id);
         }
-        total_written += (size_t)written;
-        bytes_left    -= (size_t)written;
+        bs_unlock(bs);
     }
+    return submit_ticket(bs, block_id, (void *)buffer, true, cb, arg);
+}
 
-    // Done writing everything
-    close(fd);
-
-    // If we wrote exactly BLOCK_STORE_NUM_BYTES, return that 
-    return (total_written == BLOCK_STORE_NUM_BYTES) ? total_written : 0;
+///
+/// Starts a flush of everything submitted so far (and the fbm) to stable storage
+/// cb gets SIZE_MAX as its block id
+/// \param bs BS device
+/// \param cb Completion callback, may be NULL
+/// \param arg Passed to cb
+/// \return true if the flush was started
+///
+bool block_store_submit_flush(block_store_t *const bs, block_store_callback_t cb, void *arg)
+{
+    if (!bs) {
+        return false;
+    }
+    if (bs->fd < 0) {
+        if (cb) {
+            cb(SIZE_MAX, true, arg);
+        }
+        return true;
+    }
+    if (bs->journal || bs->flusher_running) {
+        // a flush is just a group commit or a writeback round, which the caller would be waiting on anyway
+        bool ok = block_store_flush_wait(bs);
+        if (cb) {
+            cb(SIZE_MAX, ok, arg);
+        }
+        return true;
+    }
+    // the fbm only has to reach the page cache here, the queued fdatasync does the rest
+    bs_lock(bs);
+    bool ok = write_fbm(bs);
+    bs_unlock(bs);
+    return ok && submit_ticket(bs, SIZE_MAX, NULL, false, cb, arg);
 }
 
+///
+/// Runs callbacks for finished async requests
+/// \param bs BS device
+/// \param min_complete How many to wait for, 0 to just collect what's done
+/// \return Number of callbacks run
+///
+size_t block_store_poll(block_store_t *const bs, const size_t min_complete)
+{
+    return bs ? block_io_poll(bs->io, min_complete) : 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "block_trace.h"
+
+#define TRACE_MAGIC 0x52545342u   // "BSTR"
+#define TRACE_VERSION 1
+// Records held in memory before they go to the file
+#define TRACE_BUFFER_RECORDS 4096
+
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t num_blocks;
+    uint64_t start_ns;    // CLOCK_REALTIME when the trace started, for lining traces up with logs
+};
+
+struct block_trace {
+    FILE *file;
+    pthread_mutex_t lock;
+    uint64_t start;       // CLOCK_MONOTONIC at the start, record times are relative to it
+    size_t used;
+    bool failed;
+    block_trace_record_t buf[TRACE_BUFFER_RECORDS];
+};
+
+struct block_trace_reader {
+    FILE *file;
+};
+
+static uint64_t clock_ns(const clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Caller holds the lock
+static void drain(block_trace_t *const trace)
+{
+    if (trace->used && fwrite(trace->buf, sizeof(block_trace_record_t), trace->used, trace->file) != trace->used) {
+        if (!trace->failed) {
+            perror("trace: write failed");
+        }
+        trace->failed = true;
+    }
+    trace->used = 0;
+}
+
+block_trace_t *block_trace_create(const char *const path, const size_t num_blocks)
+{
+    if (!path) {
+        return NULL;
+    }
+    block_trace_t *trace = calloc(1, sizeof(block_trace_t));
+    if (!trace) {
+        return NULL;
+    }
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        perror("trace: open failed");
+        free(trace);
+        return NULL;
+    }
+    struct trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(block_trace_record_t),
+        .num_blocks = num_blocks,
+        .start_ns = clock_ns(CLOCK_REALTIME),
+    };
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->start = clock_ns(CLOCK_MONOTONIC);
+    return trace;
+}
+
+void block_trace_log(block_trace_t *const trace, const block_store_op_t op, const size_t block_id, const bool ok)
+{
+    if (!trace) {
+        return;
+    }
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&trace->lock);
+    block_trace_record_t *rec = &trace->buf[trace->used++];
+    rec->time_ns = now - trace->start;
+    rec->block_id = block_id < BLOCK_TRACE_NO_BLOCK ? (uint32_t)block_id : BLOCK_TRACE_NO_BLOCK;
+    rec->op = (uint8_t)op;
+    rec->ok = ok;
+    rec->reserved = 0;
+    if (trace->used == TRACE_BUFFER_RECORDS) {
+        drain(trace);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+bool block_trace_close(block_trace_t *const trace)
+{
+    if (!trace) {
+        return false;
+    }
+    drain(trace);
+    bool ok = !trace->failed;
+    if (fclose(trace->file) != 0) {
+        ok = false;
+    }
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+    return ok;
+}
+
+block_trace_reader_t *block_trace_open(const char *const path, size_t *const num_blocks)
+{
+    if (!path) {
+        return NULL;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("trace: open failed");
+        return NULL;
+    }
+    struct trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC
+            || header.version != TRACE_VERSION || header.record_size != sizeof(block_trace_record_t)) {
+        fprintf(stderr, "trace: %s is not a block store trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+    block_trace_reader_t *reader = malloc(sizeof(block_trace_reader_t));
+    if (!reader) {
+        fclose(file);
+        return NULL;
+    }
+    reader->file = file;
+    if (num_blocks) {
+        *num_blocks = (size_t)header.num_blocks;
+    }
+    return reader;
+}
+
+bool block_trace_next(block_trace_reader_t *const reader, block_trace_record_t *const record)
+{
+    return reader && record && fread(record, sizeof(*record), 1, reader->file) == 1;
+}
+
+void block_trace_reader_close(block_trace_reader_t *const reader)
+{
+    if (reader) {
+        fclose(reader->file);
+        free(reader);
+    }
+}
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+#include "free_extents.h"
+
+struct free_extents {
+    size_t free_blocks;
+    size_t extents;
+    size_t largest;
+    size_t histogram[BLOCK_STORE_EXTENT_BUCKETS];
+    // runs of each length, so losing the largest run doesn't need another pass
+    size_t max_len;
+    size_t count_by_len[];
+};
+
+static unsigned bucket_of(const size_t len)
+{
+    unsigned b = 63 - (unsigned)__builtin_clzll((unsigned long long)len);
+    return b < BLOCK_STORE_EXTENT_BUCKETS ? b : BLOCK_STORE_EXTENT_BUCKETS - 1;
+}
+
+static void add_run(free_extents_t *const fx, const size_t len)
+{
+    if (!len) {
+        return;
+    }
+    fx->free_blocks += len;
+    fx->extents++;
+    fx->histogram[bucket_of(len)]++;
+    fx->count_by_len[len]++;
+    if (len > fx->largest) {
+        fx->largest = len;
+    }
+}
+
+static void remove_run(free_extents_t *const fx, const size_t len)
+{
+    if (!len) {
+        return;
+    }
+    fx->free_blocks -= len;
+    fx->extents--;
+    fx->histogram[bucket_of(len)]--;
+    if (--fx->count_by_len[len] == 0 && len == fx->largest) {
+        size_t next = len;
+        while (next > 0 && !fx->count_by_len[next]) {
+            --next;
+        }
+        fx->largest = next;
+    }
+}
+
+static void add_run_cb(size_t start, size_t len, void *arg)
+{
+    (void)start;
+    add_run(arg, len);
+}
+
+free_extents_t *free_extents_create(const bitmap_t *const fbm)
+{
+    if (!fbm) {
+        return NULL;
+    }
+    size_t bits = bitmap_get_bits(fbm);
+    free_extents_t *fx = calloc(1, sizeof(free_extents_t) + (bits + 1) * sizeof(size_t));
+    if (!fx) {
+        return NULL;
+    }
+    fx->max_len = bits;
+    bitmap_for_each_zero_run(fbm, add_run_cb, fx);
+    return fx;
+}
+
+void free_extents_allocated(free_extents_t *const extents, const bitmap_t *const fbm, const size_t bit)
+{
+    size_t start = 0;
+    size_t len = extents ? bitmap_zero_run_at(fbm, bit, &start) : 0;
+    if (!len) {
+        return;
+    }
+    // one run becomes the pieces either side of bit
+    remove_run(extents, len);
+    add_run(extents, bit - start);
+    add_run(extents, start + len - bit - 1);
+}
+
+void free_extents_released(free_extents_t *const extents, const bitmap_t *const fbm, const size_t bit)
+{
+    if (!extents || !fbm || bit >= extents->max_len || !bitmap_test(fbm, bit)) {
+        return;
+    }
+    // bit joins whatever runs touch it on either side
+    size_t left = bit ? bitmap_zero_run_at(fbm, bit - 1, NULL) : 0;
+    size_t right = bitmap_zero_run_at(fbm, bit + 1, NULL);
+    remove_run(extents, left);
+    remove_run(extents, right);
+    add_run(extents, left + 1 + right);
+}
+
+void free_extents_report(const free_extents_t *const extents, block_store_free_extents_t *const report)
+{
+    if (extents && report) {
+        report->free_blocks = extents->free_blocks;
+        report->extents = extents->extents;
+        report->largest = extents->largest;
+        memcpy(report->histogram, extents->histogram, sizeof(report->histogram));
+    }
+}
+
+void free_extents_destroy(free_extents_t *const extents)
+{
+    free(extents);
+}
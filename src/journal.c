@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "block_io.h"
+
+#define JOURNAL_MAGIC 0x4C415742u  // "BWAL"
+#define RECORD_MAGIC  0x44524352u  // "RCRD"
+
+typedef enum { REC_BLOCK = 1, REC_COMMIT = 2 } RECORD_TYPE;
+
+// First thing in the log file
+struct log_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t checkpoint_seq;  // groups up to here are already in the image
+    uint64_t reserved[2];
+};
+
+// Precedes every record; block records carry block_size bytes after it
+struct record {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;       // group the record belongs to
+    uint64_t block_id;
+    uint32_t len;       // payload bytes
+    uint32_t crc;       // over this header (crc zeroed) and the payload
+};
+
+struct journal {
+    int fd;
+    size_t block_size;
+    size_t size;              // bytes in the file, header included
+    uint64_t next_seq;        // seq of the open group
+    uint64_t durable_seq;     // newest group known to be in the file
+    uint64_t checkpoint_seq;
+    // the open group, not in the file yet
+    uint8_t *buf;
+    size_t buf_len, buf_cap;
+    size_t pending;
+};
+
+struct journal_group {
+    uint64_t seq;
+    uint8_t *buf;
+    size_t len;
+};
+
+// Plain table-driven CRC-32 (the zlib one)
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, const size_t len)
+{
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(struct record rec, const void *payload)
+{
+    rec.crc = 0;
+    uint32_t crc = crc32_update(0, &rec, sizeof(rec));
+    return rec.len ? crc32_update(crc, payload, rec.len) : crc;
+}
+
+static bool write_header(journal_t *const journal)
+{
+    struct log_header header = {
+        .magic = JOURNAL_MAGIC,
+        .block_size = (uint32_t)journal->block_size,
+        .checkpoint_seq = journal->checkpoint_seq,
+    };
+    return block_io_pwrite(journal->fd, &header, sizeof(header), 0);
+}
+
+static bool push_record(journal_t *const journal, const RECORD_TYPE type, const size_t block_id, const void *data)
+{
+    size_t len = type == REC_BLOCK ? journal->block_size : 0;
+    size_t need = journal->buf_len + sizeof(struct record) + len;
+    if (need > journal->buf_cap) {
+        size_t cap = journal->buf_cap ? journal->buf_cap : 4096;
+        while (cap < need) {
+            cap <<= 1;
+        }
+        uint8_t *grown = realloc(journal->buf, cap);
+        if (!grown) {
+            return false;
+        }
+        journal->buf = grown;
+        journal->buf_cap = cap;
+    }
+    struct record rec = {
+        .magic = RECORD_MAGIC,
+        .type = type,
+        .seq = journal->next_seq,
+        .block_id = block_id,
+        .len = (uint32_t)len,
+    };
+    rec.crc = record_crc(rec, data);
+    memcpy(journal->buf + journal->buf_len, &rec, sizeof(rec));
+    if (len) {
+        memcpy(journal->buf + journal->buf_len + sizeof(rec), data, len);
+    }
+    journal->buf_len = need;
+    return true;
+}
+
+journal_t *journal_open(const char *const path, const size_t block_size)
+{
+    if (!path || !block_size) {
+        return NULL;
+    }
+    pthread_once(&crc_once, crc_init);
+
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    if (!journal) {
+        return NULL;
+    }
+    journal->block_size = block_size;
+    journal->next_seq = 1;
+    journal->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (journal->fd < 0) {
+        perror("journal: open failed");
+        free(journal);
+        return NULL;
+    }
+
+    struct stat st;
+    struct log_header header;
+    if (fstat(journal->fd, &st) < 0) {
+        journal_close(journal);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(header)) {
+        // brand new (or never got its header out), start clean
+        if (ftruncate(journal->fd, 0) < 0 || !write_header(journal) || fdatasync(journal->fd) < 0) {
+            journal_close(journal);
+            return NULL;
+        }
+        journal->size = sizeof(header);
+        return journal;
+    }
+    if (!block_io_pread(journal->fd, &header, sizeof(header), 0) || header.magic != JOURNAL_MAGIC
+            || header.block_size != block_size) {
+        fprintf(stderr, "journal: %s is not a journal for this device\n", path);
+        journal_close(journal);
+        return NULL;
+    }
+    journal->checkpoint_seq = header.checkpoint_seq;
+    journal->durable_seq = header.checkpoint_seq;
+    journal->next_seq = header.checkpoint_seq + 1;
+    journal->size = (size_t)st.st_size;
+    return journal;
+}
+
+size_t journal_replay(journal_t *const journal, const int image_fd)
+{
+    if (!journal) {
+        return SIZE_MAX;
+    }
+    uint8_t *payload = malloc(journal->block_size);
+    // where the open group's block records sit in the log
+    size_t *group = NULL;
+    size_t group_len = 0, group_cap = 0;
+    uint64_t group_seq = 0, max_seq = journal->checkpoint_seq;
+    size_t applied = 0;
+    bool ok = payload != NULL;
+
+    size_t off = sizeof(struct log_header);
+    while (ok && off + sizeof(struct record) <= journal->size) {
+        struct record rec;
+        if (!block_io_pread(journal->fd, &rec, sizeof(rec), off) || rec.magic != RECORD_MAGIC
+                || (rec.len && rec.len != journal->block_size) || off + sizeof(rec) + rec.len > journal->size
+                || (rec.len && !block_io_pread(journal->fd, payload, rec.len, off + sizeof(rec)))
+                || record_crc(rec, payload) != rec.crc) {
+            break; // torn tail, nothing past here was committed
+        }
+        if (rec.seq != group_seq) {
+            group_len = 0; // a group that never got its commit record
+            group_seq = rec.seq;
+        }
+        if (rec.type == REC_BLOCK) {
+            if (group_len == group_cap) {
+                group_cap = group_cap ? group_cap * 2 : 64;
+                size_t *grown = realloc(group, group_cap * sizeof(size_t));
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                group = grown;
+            }
+            group[group_len++] = off;
+        } else if (rec.type == REC_COMMIT) {
+            if (rec.seq > journal->checkpoint_seq) {
+                for (size_t i = 0; ok && i < group_len; ++i) {
+                    struct record blk;
+                    ok = block_io_pread(journal->fd, &blk, sizeof(blk), group[i])
+                         && block_io_pread(journal->fd, payload, blk.len, group[i] + sizeof(blk))
+                         && block_io_pwrite(image_fd, payload, blk.len, (off_t)(blk.block_id * journal->block_size));
+                }
+                applied++;
+            }
+            if (rec.seq > max_seq) max_seq = rec.seq;
+            group_len = 0;
+        }
+        off += sizeof(rec) + rec.len;
+    }
+    free(group);
+    free(payload);
+
+    // the image has it all now, so the log can start over
+    if (ok && applied && fdatasync(image_fd) < 0) {
+        ok = false;
+    }
+    if (ok) {
+        journal->checkpoint_seq = max_seq;
+        journal->durable_seq = max_seq;
+        journal->next_seq = max_seq + 1;
+        ok = ftruncate(journal->fd, sizeof(struct log_header)) == 0 && write_header(journal)
+             && fdatasync(journal->fd) == 0;
+        journal->size = sizeof(struct log_header);
+    }
+    if (!ok) {
+        perror("journal: replay failed");
+        return SIZE_MAX;
+    }
+    return applied;
+}
+
+bool journal_append(journal_t *const journal, const size_t block_id, const void *data)
+{
+    if (!journal || !data || !push_record(journal, REC_BLOCK, block_id, data)) {
+        return false;
+    }
+    journal->pending++;
+    return true;
+}
+
+journal_group_t *journal_seal(journal_t *const journal)
+{
+    if (!journal || !journal->pending) {
+        return NULL;
+    }
+    journal_group_t *group = malloc(sizeof(journal_group_t));
+    if (!group || !push_record(journal, REC_COMMIT, 0, NULL)) {
+        free(group);
+        return NULL;
+    }
+    group->seq = journal->next_seq++;
+    group->buf = journal->buf;
+    group->len = journal->buf_len;
+    // the next group starts with a fresh buffer
+    journal->buf = NULL;
+    journal->buf_len = journal->buf_cap = 0;
+    journal->pending = 0;
+    return group;
+}
+
+bool journal_write_group(journal_t *const journal, journal_group_t *const group)
+{
+    if (!journal || !group) {
+        return false;
+    }
+    bool ok = block_io_pwrite(journal->fd, group->buf, group->len, journal->size)
+              && fdatasync(journal->fd) == 0;
+    if (ok) {
+        journal->size += group->len;
+        journal->durable_seq = group->seq;
+    } else {
+        // whatever made it out has no good commit record after it, replay won't
+        // touch it and the next group goes right over the top of it
+        perror("journal: commit failed");
+    }
+    free(group->buf);
+    free(group);
+    return ok;
+}
+
+bool journal_commit(journal_t *const journal)
+{
+    if (!journal) {
+        return false;
+    }
+    if (!journal->pending) {
+        return true;
+    }
+    journal_group_t *group = journal_seal(journal);
+    return group && journal_write_group(journal, group);
+}
+
+size_t journal_pending(const journal_t *const journal)
+{
+    return journal ? journal->pending : 0;
+}
+
+size_t journal_size(const journal_t *const journal)
+{
+    return journal ? journal->size : 0;
+}
+
+uint64_t journal_committed_seq(const journal_t *const journal)
+{
+    return journal ? journal->durable_seq : 0;
+}
+
+bool journal_checkpoint(journal_t *const journal)
+{
+    if (!journal) {
+        return false;
+    }
+    // the header keeps the sequence going so replay never mistakes new groups for old
+    journal->checkpoint_seq = journal->durable_seq;
+    if (ftruncate(journal->fd, sizeof(struct log_header)) < 0) {
+        return false;
+    }
+    journal->size = sizeof(struct log_header);
+    return write_header(journal) && fdatasync(journal->fd) == 0;
+}
+
+void journal_close(journal_t *const journal)
+{
+    if (journal) {
+        if (journal->fd >= 0) {
+            close(journal->fd);
+        }
+        free(journal->buf);
+        free(journal);
+    }
+}
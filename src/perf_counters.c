@@ -0,0 +1,133 @@
+#define _GNU_SOURCE   // syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf_counters.h"
+
+struct perf_counters {
+    int leader;                       // group leader fd, the first counter that opened
+    int fd[PERF_COUNTER_COUNT];       // -1 where the counter isn't available
+    uint32_t available;
+    unsigned opened;                  // how many made it into the group
+};
+
+// What each counter is in perf_event_attr terms
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} events[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "l1d_misses"},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses"},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+};
+
+static int open_event(const perf_counter_t c, const int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // this thread, any cpu
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+perf_counters_t *perf_counters_open(void)
+{
+    perf_counters_t *counters = calloc(1, sizeof(perf_counters_t));
+    if (!counters) {
+        return NULL;
+    }
+    counters->leader = -1;
+    for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        counters->fd[c] = open_event((perf_counter_t)c, counters->leader);
+        if (counters->fd[c] < 0) {
+            continue; // no PMU, not allowed, or the group is full; the rest can still go
+        }
+        if (counters->leader < 0) {
+            counters->leader = counters->fd[c];
+        }
+        counters->available |= 1u << c;
+        counters->opened++;
+    }
+    if (counters->leader < 0) {
+        free(counters);
+        return NULL;
+    }
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return counters;
+}
+
+bool perf_counters_read(perf_counters_t *const counters, perf_sample_t *const sample)
+{
+    if (!counters || !sample) {
+        return false;
+    }
+    // nr, time_enabled, time_running, then a value per group member in open order
+    uint64_t buf[3 + PERF_COUNTER_COUNT];
+    ssize_t want = (ssize_t)((3 + counters->opened) * sizeof(uint64_t));
+    if (read(counters->leader, buf, sizeof(buf)) < want) {
+        return false;
+    }
+    double scale = buf[2] && buf[2] < buf[1] ? (double)buf[1] / (double)buf[2] : 1.0;
+    memset(sample, 0, sizeof(*sample));
+    sample->available = counters->available;
+    unsigned i = 0;
+    for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        if (counters->available & (1u << c)) {
+            sample->value[c] = (uint64_t)((double)buf[3 + i++] * scale);
+        }
+    }
+    return true;
+}
+
+const char *perf_counter_name(const perf_counter_t counter)
+{
+    return counter < PERF_COUNTER_COUNT ? events[counter].name : "?";
+}
+
+void perf_counters_close(perf_counters_t *const counters)
+{
+    if (counters) {
+        for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+            if (counters->fd[c] >= 0) {
+                close(counters->fd[c]);
+            }
+        }
+        free(counters);
+    }
+}
+
+// Per-thread counters: the key's destructor closes them when the thread goes
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool thread_tried;
+
+static void thread_key_init(void)
+{
+    pthread_key_create(&thread_key, (void (*)(void *))perf_counters_close);
+}
+
+perf_counters_t *perf_counters_thread(void)
+{
+    pthread_once(&thread_once, thread_key_init);
+    if (!thread_tried) {
+        thread_tried = true;
+        pthread_setspecific(thread_key, perf_counters_open());
+    }
+    return pthread_getspecific(thread_key);
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE   // robust mutexes
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared_segment.h"
+
+// What a published segment starts with ("hw3s")
+#define SHARED_SEGMENT_MAGIC 0x68773373u
+
+// Most attaches a segment keeps track of at once
+#define SHARED_SEGMENT_MAX_ATTACH 64
+
+// Times create clears away a dead creator's leftovers before giving up
+#define SHARED_SEGMENT_CREATE_TRIES 4
+
+// The header page, the same in every process that maps it
+struct shared_layout {
+    uint32_t magic;          // written last by the creator, 0 until then
+    uint64_t header_bytes;   // where the data starts
+    uint64_t data_bytes;
+    // robust and process-shared, guards everything below
+    pthread_mutex_t lock;
+    bool unlinked;           // the name is gone, nobody else gets in
+    pid_t attached[SHARED_SEGMENT_MAX_ATTACH];  // 0 for a free entry
+};
+
+// One process's handle on a segment
+struct shared_segment {
+    char *name;
+    struct shared_layout *layout;
+    size_t map_bytes;
+    size_t entry;  // ours in layout->attached
+    int fd;        // the creator's, flock'd until shared_segment_publish; -1 after that
+};
+
+static void layout_lock(struct shared_layout *const layout)
+{
+    if (pthread_mutex_lock(&layout->lock) == EOWNERDEAD) {
+        // the last holder died holding it; everything written under it is a single store,
+        // so there's nothing half done to put right
+        pthread_mutex_consistent(&layout->lock);
+    }
+}
+
+// Clears the entries of processes that are gone
+// (a recycled pid keeps a dead entry around until that process goes too, which only
+//  delays the cleanup)
+static void reap(struct shared_layout *const layout)
+{
+    for (size_t i = 0; i < SHARED_SEGMENT_MAX_ATTACH; ++i) {
+        pid_t pid = layout->attached[i];
+        if (pid && kill(pid, 0) == -1 && errno == ESRCH) {
+            layout->attached[i] = 0;
+        }
+    }
+}
+
+// Takes a free entry for this process, SIZE_MAX if there's none (call with the lock held)
+static size_t join(struct shared_layout *const layout)
+{
+    reap(layout);
+    for (size_t i = 0; i < SHARED_SEGMENT_MAX_ATTACH; ++i) {
+        if (!layout->attached[i]) {
+            layout->attached[i] = getpid();
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t header_bytes(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (sizeof(struct shared_layout) + page - 1) / page * page;
+}
+
+static shared_segment_t *handle_create(const char *const name, void *const map, const size_t map_bytes)
+{
+    shared_segment_t *seg = calloc(1, sizeof(shared_segment_t));
+    if (seg) {
+        seg->name = strdup(name);
+        if (!seg->name) {
+            free(seg);
+            return NULL;
+        }
+        seg->layout = map;
+        seg->map_bytes = map_bytes;
+        seg->fd = -1;
+    }
+    return seg;
+}
+
+static void handle_destroy(shared_segment_t *const seg)
+{
+    if (seg->fd >= 0) {
+        close(seg->fd);
+    }
+    munmap(seg->layout, seg->map_bytes);
+    free(seg->name);
+    free(seg);
+}
+
+// Removes name if it's an object a creator died with before publishing: its creator's
+// flock is gone along with it, and the magic never got written.
+// A creator still between its shm_open and its flock looks the same, which is why
+// create checks, once it has the lock, that its name wasn't taken away in the meantime.
+static bool clear_unpublished(const char *const name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        // gone already, as good as cleared
+        return errno == ENOENT;
+    }
+    bool stale = false;
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &st) == 0) {
+        stale = true;
+        if ((size_t)st.st_size >= sizeof(struct shared_layout)) {
+            struct shared_layout *layout = mmap(NULL, sizeof(struct shared_layout), PROT_READ, MAP_SHARED, fd, 0);
+            stale = layout != MAP_FAILED && __atomic_load_n(&layout->magic, __ATOMIC_ACQUIRE) != SHARED_SEGMENT_MAGIC;
+            if (layout != MAP_FAILED) {
+                munmap(layout, sizeof(struct shared_layout));
+            }
+        }
+        if (stale) {
+            fprintf(stderr, "shared: %s was left half made, replacing it\n", name);
+            stale = shm_unlink(name) == 0 || errno == ENOENT;
+        }
+    }
+    close(fd);
+    return stale;
+}
+
+shared_segment_t *shared_segment_create(const char *const name, const mode_t mode, const size_t data_bytes)
+{
+    if (!name || !data_bytes) {
+        return NULL;
+    }
+    size_t map_bytes = header_bytes() + data_bytes;
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < SHARED_SEGMENT_CREATE_TRIES; ++tries) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+        if (fd < 0) {
+            if (errno != EEXIST) {
+                break;
+            }
+            if (!clear_unpublished(name)) {
+                // a live device, or one still being made
+                errno = EEXIST;
+                break;
+            }
+            continue;
+        }
+        // held until publish, so nobody takes us for a dead creator's leftovers
+        struct stat st;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+            // (someone did, between our shm_open and our flock)
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        perror("shared: create failed");
+        return NULL;
+    }
+    // (a fresh object is zero-filled as it grows)
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)map_bytes) == 0) {
+        map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    shared_segment_t *seg = map == MAP_FAILED ? NULL : handle_create(name, map, map_bytes);
+    if (!seg) {
+        perror("shared: create failed");
+        if (map != MAP_FAILED) {
+            munmap(map, map_bytes);
+        }
+        shm_unlink(name);
+        close(fd);
+        return NULL;
+    }
+    seg->fd = fd;
+    struct shared_layout *layout = seg->layout;
+    layout->header_bytes = header_bytes();
+    layout->data_bytes = data_bytes;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&layout->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    // (nobody else can see it yet, and the table is empty)
+    seg->entry = join(layout);
+    return seg;
+}
+
+void shared_segment_publish(shared_segment_t *const seg)
+{
+    if (seg) {
+        // everything written before this is there for whoever sees the magic
+        __atomic_store_n(&seg->layout->magic, SHARED_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+        // and from here on, a crash is what the attached table is for
+        if (seg->fd >= 0) {
+            close(seg->fd);
+            seg->fd = -1;
+        }
+    }
+}
+
+shared_segment_t *shared_segment_attach(const char *const name, const size_t data_bytes)
+{
+    if (!name) {
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shared: attach failed");
+        return NULL;
+    }
+    struct stat st;
+    size_t map_bytes = header_bytes() + data_bytes;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == map_bytes) {
+        map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "shared: %s isn't a segment of the right size\n", name);
+        return NULL;
+    }
+    struct shared_layout *layout = map;
+    if (__atomic_load_n(&layout->magic, __ATOMIC_ACQUIRE) != SHARED_SEGMENT_MAGIC
+        || layout->header_bytes != header_bytes() || layout->data_bytes != data_bytes) {
+        fprintf(stderr, "shared: %s isn't (yet) a published segment\n", name);
+        munmap(map, map_bytes);
+        return NULL;
+    }
+    shared_segment_t *seg = handle_create(name, map, map_bytes);
+    if (!seg) {
+        munmap(map, map_bytes);
+        return NULL;
+    }
+    layout_lock(layout);
+    // (the last one out may have removed the name between our open and now)
+    seg->entry = layout->unlinked ? SIZE_MAX : join(layout);
+    pthread_mutex_unlock(&layout->lock);
+    if (seg->entry == SIZE_MAX) {
+        fprintf(stderr, "shared: %s is closing down or has too many attached\n", name);
+        handle_destroy(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+uint8_t *shared_segment_data(const shared_segment_t *const seg)
+{
+    return seg ? (uint8_t *)seg->layout + seg->layout->header_bytes : NULL;
+}
+
+size_t shared_segment_attached(shared_segment_t *const seg)
+{
+    if (!seg) {
+        return 0;
+    }
+    layout_lock(seg->layout);
+    reap(seg->layout);
+    size_t live = 0;
+    for (size_t i = 0; i < SHARED_SEGMENT_MAX_ATTACH; ++i) {
+        live += seg->layout->attached[i] != 0;
+    }
+    pthread_mutex_unlock(&seg->layout->lock);
+    return live;
+}
+
+void shared_segment_detach(shared_segment_t *const seg)
+{
+    if (!seg) {
+        return;
+    }
+    struct shared_layout *layout = seg->layout;
+    layout_lock(layout);
+    layout->attached[seg->entry] = 0;
+    reap(layout);
+    bool last = !layout->unlinked;
+    for (size_t i = 0; i < SHARED_SEGMENT_MAX_ATTACH && last; ++i) {
+        last = !layout->attached[i];
+    }
+    if (last) {
+        layout->unlinked = true;
+    }
+    pthread_mutex_unlock(&layout->lock);
+    if (last && shm_unlink(seg->name) != 0) {
+        perror("shared: unlink failed");
+    }
+    handle_destroy(seg);
+}
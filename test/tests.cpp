@@ -1,6 +1,21 @@
 #include <gtest/gtest.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "block_store.h"
+#include "perf_counters.h"
+#include "block_trace.h"
+#include "block_remap.h"
+#include "bitmap.h"
+#include "bitmap_kernels.h"
+#include "bitmap_parallel.h"
+#include "bitmap.hpp"
+#include "block_store.hpp"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -514,3 +529,1844 @@ TEST(block_store_deserialize, null_filename)
 
 	score += 2;
 }
+
+
+TEST(block_store_open, create_write_reopen)
+{
+	unlink("test_open.bs");
+	ASSERT_EQ(nullptr, block_store_open("test_open.bs", 0)) << "open without CREATE should not make a device\n";
+
+	block_store_t *bs = block_store_open("test_open.bs", BLOCK_STORE_OPEN_CREATE);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	char write_buffer[BLOCK_SIZE_BYTES] = "Hello File!";
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 300, write_buffer));
+	ASSERT_EQ(true, block_store_sync(bs));
+	block_store_destroy(bs);
+
+	struct stat st;
+	stat("test_open.bs", &st);
+	ASSERT_EQ(st.st_size, BLOCK_STORE_NUM_BYTES);
+
+	// The image should look exactly like a serialized one
+	block_store_t *bsRead = block_store_deserialize("test_open.bs");
+	ASSERT_NE(nullptr, bsRead);
+	char read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsRead, 300, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(false, block_store_request(bsRead, 300));
+	block_store_destroy(bsRead);
+
+	bs = block_store_open("test_open.bs", 0);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	memset(read_buffer, 0, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+static void count_completion(size_t block_id, bool success, void *arg)
+{
+	(void)block_id;
+	if (success)
+	{
+		++*(size_t *)arg;
+	}
+}
+
+static void async_round_trip(const unsigned flags)
+{
+	unlink("test_async.bs");
+	unlink("test_async.bs.wal");
+	block_store_t *bs = block_store_open("test_async.bs", BLOCK_STORE_OPEN_CREATE | flags);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+
+	// Lots of writes in flight at once
+	static uint8_t blocks[200][BLOCK_SIZE_BYTES];
+	size_t done = 0;
+	for (size_t i = 0; i < 200; i++)
+	{
+		size_t id = block_store_allocate(bs);
+		ASSERT_NE(SIZE_MAX, id);
+		memset(blocks[i], (int)id, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(true, block_store_submit_write(bs, id, blocks[i], count_completion, &done));
+	}
+	ASSERT_EQ(true, block_store_submit_flush(bs, count_completion, &done));
+	while (done < 201 && block_store_poll(bs, 1))
+	{
+	}
+	ASSERT_EQ(201, done);
+
+	static uint8_t back[200][BLOCK_SIZE_BYTES];
+	done = 0;
+	for (size_t i = 0; i < 200; i++)
+	{
+		size_t id = i < BITMAP_START_BLOCK ? i : i + BITMAP_NUM_BLOCKS;
+		ASSERT_EQ(true, block_store_submit_read(bs, id, back[i], count_completion, &done));
+	}
+	while (done < 200 && block_store_poll(bs, 1))
+	{
+	}
+	ASSERT_EQ(200, done);
+	ASSERT_EQ(0, memcmp(blocks, back, sizeof(blocks)));
+
+	// A prefetch racing a write can't leave the old block in the cache after it lands
+	memset(blocks[0], 0x77, BLOCK_SIZE_BYTES);
+	done = 0;
+	ASSERT_EQ(true, block_store_submit_write(bs, 5, blocks[0], count_completion, &done));
+	block_store_prefetch(bs, 5, 1);
+	while (done < 1 && block_store_poll(bs, 1))
+	{
+	}
+	ASSERT_EQ(1, done);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, back[0]));
+	ASSERT_EQ(0, memcmp(blocks[0], back[0], BLOCK_SIZE_BYTES));
+
+	// Can't touch blocks that aren't allocated
+	ASSERT_EQ(false, block_store_submit_read(bs, 400, back[0], count_completion, &done));
+	block_store_destroy(bs);
+	unlink("test_async.bs.wal");
+}
+
+TEST(block_store_async, round_trip)
+{
+	async_round_trip(0);
+	// Journaled writes sit in the log until a checkpoint, reads still have to see them
+	async_round_trip(BLOCK_STORE_OPEN_JOURNAL);
+
+	score += 5;
+}
+
+TEST(block_store_async, thread_fallback)
+{
+	setenv("BLOCK_IO_BACKEND", "threads", 1);
+	async_round_trip(0);
+	unsetenv("BLOCK_IO_BACKEND");
+
+	score += 5;
+}
+
+TEST(block_store_cache, small_cache_round_trip)
+{
+	unlink("test_cache.bs");
+	block_store_t *bs = block_store_open("test_cache.bs", BLOCK_STORE_OPEN_CREATE);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_set_cache_size(bs, 4));
+
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < 50; id++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+
+	block_store_cache_stats_t stats;
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	ASSERT_EQ(4, stats.capacity);
+	ASSERT_EQ(4, stats.resident);
+	ASSERT_EQ(46, stats.evictions);
+	ASSERT_EQ(46, stats.writebacks);
+
+	// Blocks still dirty in the cache have to show up in a serialized image
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	block_store_t *copy = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, copy);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 49, buffer));
+	ASSERT_EQ(49, buffer[0]);
+	block_store_destroy(copy);
+
+	// Everything comes back, newest first, faulting in from the file as needed
+	for (size_t id = 50; id-- > 0;)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id, buffer[0]);
+		ASSERT_EQ(id, buffer[BLOCK_SIZE_BYTES - 1]);
+	}
+	// ...and the last few written were still resident
+	size_t misses = stats.misses;
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	ASSERT_EQ(misses + 46, stats.misses);
+	ASSERT_EQ(4, stats.hits);
+	block_store_destroy(bs);
+
+	// In-memory stores don't have a cache to configure
+	bs = block_store_create();
+	ASSERT_EQ(false, block_store_set_cache_size(bs, 4));
+	ASSERT_EQ(false, block_store_get_cache_stats(bs, &stats));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_cache, sequential_readahead)
+{
+	unlink("test_readahead.bs");
+	block_store_t *bs = block_store_open("test_readahead.bs", BLOCK_STORE_OPEN_CREATE);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < 120; id++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	// Start cold so every block has to come from the file
+	ASSERT_EQ(true, block_store_set_cache_size(bs, 64));
+
+	for (size_t id = 0; id < 120; id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id, buffer[0]);
+	}
+	block_store_cache_stats_t stats;
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	// Only the first couple of reads should have waited on the file
+	ASSERT_GT(stats.prefetched, 100);
+	ASSERT_GT(stats.prefetch_hits, 100);
+	ASSERT_LT(stats.misses, 5);
+	ASSERT_GT(stats.readahead_window, 4);
+
+	// Explicit hints work without any pattern at all
+	ASSERT_EQ(true, block_store_set_cache_size(bs, 64));
+	ASSERT_EQ(true, block_store_set_readahead(bs, 0));
+	ASSERT_EQ(true, block_store_prefetch(bs, 10, 8));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 17, buffer));
+	ASSERT_EQ(17, buffer[0]);
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	ASSERT_EQ(8, stats.prefetched);
+	ASSERT_EQ(0, stats.misses);
+	ASSERT_EQ(0, stats.readahead_window);
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_journal, crash_recovery)
+{
+	unlink("test_journal.bs");
+	unlink("test_journal.bs.wal");
+
+	pid_t child = fork();
+	ASSERT_NE(-1, child);
+	if (child == 0)
+	{
+		// Commit a batch, then scribble some more and die without cleaning up
+		block_store_t *bs = block_store_open("test_journal.bs", BLOCK_STORE_OPEN_CREATE | BLOCK_STORE_OPEN_JOURNAL);
+		if (!bs)
+			_exit(1);
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		for (size_t id = 0; id < 100; id++)
+		{
+			memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+			if (!block_store_request(bs, id) || block_store_write(bs, id, buffer) != BLOCK_SIZE_BYTES)
+				_exit(2);
+		}
+		if (!block_store_sync(bs))
+			_exit(3);
+		block_store_journal_stats_t stats;
+		// One fdatasync per group, not per write
+		if (!block_store_get_journal_stats(bs, &stats) || stats.commits == 0 || stats.commits > 10
+				|| stats.records < 100)
+			_exit(4);
+		block_store_request(bs, 200);
+		block_store_write(bs, 200, buffer);
+		_exit(0);
+	}
+	int status = 0;
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	block_store_t *bs = block_store_open("test_journal.bs", BLOCK_STORE_OPEN_JOURNAL);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	// Everything up to the sync survived, FBM included
+	ASSERT_LE(BITMAP_NUM_BLOCKS + 100, block_store_get_used_blocks(bs));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < 100; id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id, buffer[0]);
+		ASSERT_EQ(id, buffer[BLOCK_SIZE_BYTES - 1]);
+	}
+	block_store_journal_stats_t stats;
+	ASSERT_EQ(true, block_store_get_journal_stats(bs, &stats));
+	ASSERT_LE(1, stats.replayed);
+	block_store_destroy(bs);
+
+	// A clean close checkpoints, so the log is empty and the image stands on its own
+	struct stat st;
+	ASSERT_EQ(0, stat("test_journal.bs.wal", &st));
+	ASSERT_GT(100, st.st_size);
+	block_store_t *copy = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, copy);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 99, buffer));
+	ASSERT_EQ(99, buffer[0]);
+	block_store_destroy(copy);
+
+	// Stores without a log have no journal stats
+	bs = block_store_create();
+	ASSERT_EQ(false, block_store_get_journal_stats(bs, &stats));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_journal, release_evicted_before_commit)
+{
+	unlink("test_journal_evict.bs");
+	unlink("test_journal_evict.bs.wal");
+
+	pid_t child = fork();
+	ASSERT_NE(-1, child);
+	if (child == 0)
+	{
+		// Get block 10 into the image and out of the log (a clean close checkpoints), then
+		// release it and push it out of a tiny cache behind a pile of other writes, and
+		// die before any of that is committed
+		block_store_t *bs = block_store_open("test_journal_evict.bs", BLOCK_STORE_OPEN_CREATE | BLOCK_STORE_OPEN_JOURNAL);
+		if (!bs)
+			_exit(1);
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		memset(buffer, 0xAB, BLOCK_SIZE_BYTES);
+		if (!block_store_request(bs, 10) || block_store_write(bs, 10, buffer) != BLOCK_SIZE_BYTES)
+			_exit(2);
+		block_store_destroy(bs);
+		bs = block_store_open("test_journal_evict.bs", BLOCK_STORE_OPEN_JOURNAL);
+		if (!bs || !block_store_set_cache_size(bs, 4))
+			_exit(1);
+		block_store_release(bs, 10);
+		for (size_t id = 20; id < 70; id++)
+		{
+			memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+			if (!block_store_request(bs, id) || block_store_write(bs, id, buffer) != BLOCK_SIZE_BYTES)
+				_exit(3);
+		}
+		_exit(0);
+	}
+	int status = 0;
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	// Whatever made it into a commit, the fbm and the data have to agree: a block
+	// still allocated holds what was written to it, never the uncommitted zeroes
+	block_store_t *bs = block_store_open("test_journal_evict.bs", BLOCK_STORE_OPEN_JOURNAL);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	if (!block_store_request(bs, 10))
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, buffer));
+		ASSERT_EQ(0xAB, buffer[0]);
+		ASSERT_EQ(0xAB, buffer[BLOCK_SIZE_BYTES - 1]);
+	}
+	for (size_t id = 20; id < 70; id++)
+	{
+		if (!block_store_request(bs, id))
+		{
+			ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+			ASSERT_EQ(id, buffer[0]);
+		}
+	}
+	block_store_destroy(bs);
+	unlink("test_journal_evict.bs");
+	unlink("test_journal_evict.bs.wal");
+
+	score += 5;
+}
+
+TEST(block_store_journal, failed_group_relogged)
+{
+	unlink("test_journal_fail.bs");
+	unlink("test_journal_fail.bs.wal");
+
+	pid_t child = fork();
+	ASSERT_NE(-1, child);
+	if (child == 0)
+	{
+		// Stop the log from growing so a group write fails, then let the next one through
+		// and die before any checkpoint
+		block_store_t *bs = block_store_open("test_journal_fail.bs", BLOCK_STORE_OPEN_CREATE | BLOCK_STORE_OPEN_JOURNAL);
+		block_store_journal_stats_t stats;
+		if (!bs || !block_store_sync(bs) || !block_store_get_journal_stats(bs, &stats))
+			_exit(1);
+		signal(SIGXFSZ, SIG_IGN);
+		struct rlimit lim;
+		getrlimit(RLIMIT_FSIZE, &lim);
+		struct rlimit tight = lim;
+		tight.rlim_cur = stats.log_bytes;
+		setrlimit(RLIMIT_FSIZE, &tight);
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		for (size_t id = 0; id < 10; id++)
+		{
+			memset(buffer, (int)(0x40 + id), BLOCK_SIZE_BYTES);
+			if (!block_store_request(bs, id) || block_store_write(bs, id, buffer) != BLOCK_SIZE_BYTES)
+				_exit(2);
+		}
+		if (block_store_sync(bs))
+			_exit(3);
+		setrlimit(RLIMIT_FSIZE, &lim);
+		if (!block_store_request(bs, 50) || block_store_write(bs, 50, buffer) != BLOCK_SIZE_BYTES
+				|| !block_store_sync(bs))
+			_exit(4);
+		_exit(0);
+	}
+	int status = 0;
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	// The group that made it carried the lost one's blocks along
+	block_store_t *bs = block_store_open("test_journal_fail.bs", BLOCK_STORE_OPEN_JOURNAL);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < 10; id++)
+	{
+		ASSERT_EQ(false, block_store_request(bs, id));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(0x40 + id, buffer[0]);
+	}
+	ASSERT_EQ(false, block_store_request(bs, 50));
+	block_store_destroy(bs);
+	unlink("test_journal_fail.bs");
+	unlink("test_journal_fail.bs.wal");
+
+	score += 3;
+}
+
+TEST(block_store_journal, readahead_across_checkpoint)
+{
+	unlink("test_journal_ra.bs");
+	unlink("test_journal_ra.bs.wal");
+	block_store_t *bs = block_store_open("test_journal_ra.bs", BLOCK_STORE_OPEN_CREATE | BLOCK_STORE_OPEN_JOURNAL);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < 40; id++)
+	{
+		memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(true, block_store_request(bs, id));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	// A clean close puts all of that in the image
+	block_store_destroy(bs);
+	bs = block_store_open("test_journal_ra.bs", BLOCK_STORE_OPEN_JOURNAL);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_set_readahead(bs, 16));
+
+	// Readahead picks up the image's copies, then the writes make them stale
+	for (size_t id = 0; id < 12; id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id, buffer[0]);
+	}
+	for (size_t id = 12; id < 28; id++)
+	{
+		memset(buffer, (int)(0x80 + id), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	// and a stream over the staged blocks mustn't fetch the old ones back in
+	for (size_t id = 0; id < 40; id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id >= 12 && id < 28 ? 0x80 + id : id, buffer[0]);
+	}
+	ASSERT_EQ(true, block_store_prefetch(bs, 12, 16));
+
+	// Fill the log until the committer checkpoints it
+	ASSERT_EQ(true, block_store_request(bs, 100));
+	for (size_t i = 0; i < 5000; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 100, buffer));
+	}
+	ASSERT_EQ(true, block_store_sync(bs));
+	block_store_journal_stats_t stats;
+	for (int i = 0; i < 500; i++)
+	{
+		ASSERT_EQ(true, block_store_get_journal_stats(bs, &stats));
+		if (stats.checkpoints)
+			break;
+		usleep(10000);
+	}
+	ASSERT_LE(1, stats.checkpoints);
+
+	// The reads come from the cache again now, and it has to have the new data
+	for (size_t id = 0; id < 40; id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(id >= 12 && id < 28 ? 0x80 + id : id, buffer[0]);
+	}
+	block_store_destroy(bs);
+	unlink("test_journal_ra.bs");
+	unlink("test_journal_ra.bs.wal");
+
+	score += 5;
+}
+
+TEST(block_store_serialize, replaces_atomically)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_atomic.bs"));
+	// Nothing is left lying around next to the image
+	struct stat st;
+	ASSERT_EQ(-1, stat("test_atomic.bs.tmp", &st));
+	ASSERT_EQ(0, stat("test_atomic.bs", &st));
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+	// A failed serialize leaves nothing behind either
+	ASSERT_EQ(0, block_store_serialize(bs, "no_such_dir/test_atomic.bs"));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_flush, background_writer)
+{
+	unlink("test_flush.bs");
+	block_store_t *bs = block_store_open("test_flush.bs", BLOCK_STORE_OPEN_CREATE);
+	ASSERT_NE(nullptr, bs) << "block_store_open returned NULL when it should not have\n";
+	block_store_flush_policy_t policy = {8, 1024, 20, 16};
+	ASSERT_EQ(true, block_store_set_flush_policy(bs, &policy));
+
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	block_store_cache_stats_t stats;
+	// (clear of the FBM blocks)
+	for (size_t id = 200; id < 400; id++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		memset(buffer, (int)id, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+		// Writers never get more than the limit ahead of the disk
+		ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+		ASSERT_GE(16, stats.dirty);
+	}
+	ASSERT_EQ(true, block_store_flush_wait(bs));
+	ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	ASSERT_EQ(0, stats.dirty);
+	// Neighbouring blocks went out together
+	ASSERT_LT(stats.flush_writes, 100);
+
+	// The image is complete without a sync or a close
+	block_store_t *copy = block_store_deserialize("test_flush.bs");
+	ASSERT_NE(nullptr, copy);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 200, block_store_get_used_blocks(copy));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 399, buffer));
+	ASSERT_EQ(399 & 0xFF, buffer[0]);
+	block_store_destroy(copy);
+
+	// A lone write below the count threshold still goes out once it's old enough
+	memset(buffer, 0xAB, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 205, buffer));
+	for (int i = 0; i < 100 && stats.dirty != 0; i++)
+	{
+		usleep(5000);
+		ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+	}
+	ASSERT_EQ(0, stats.dirty);
+
+	ASSERT_EQ(true, block_store_set_flush_policy(bs, nullptr));
+	ASSERT_EQ(true, block_store_flush_wait(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_create();
+	ASSERT_EQ(false, block_store_set_flush_policy(bs, &policy));
+	ASSERT_EQ(true, block_store_flush_wait(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_stats, counts_operations)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	block_store_stats_t stats;
+#ifndef BLOCK_STORE_STATS
+	ASSERT_EQ(false, block_store_get_stats(bs, &stats));
+	block_store_destroy(bs);
+#else
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {1};
+	for (int i = 0; i < 10; i++)
+	{
+		size_t id = block_store_allocate(bs);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+	}
+	ASSERT_EQ(false, block_store_request(bs, 0));
+	ASSERT_EQ(0, block_store_read(bs, 400, buffer));
+	block_store_release(bs, 3);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_stats.bs"));
+
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(10, stats.ops[BLOCK_STORE_OP_ALLOCATE].calls);
+	ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_ALLOCATE].failures);
+	ASSERT_EQ(10 * BLOCK_SIZE_BYTES, stats.ops[BLOCK_STORE_OP_WRITE].bytes);
+	ASSERT_EQ(11, stats.ops[BLOCK_STORE_OP_READ].calls);
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_READ].failures);
+	// (create requests the FBM blocks itself)
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, stats.ops[BLOCK_STORE_OP_REQUEST].calls);
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_REQUEST].failures);
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_RELEASE].calls);
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, stats.ops[BLOCK_STORE_OP_SERIALIZE].bytes);
+
+	// The histogram accounts for every call and the percentiles are ordered
+	const block_store_op_stats_t &reads = stats.ops[BLOCK_STORE_OP_READ];
+	uint64_t total = 0;
+	for (int b = 0; b < BLOCK_STORE_LATENCY_BUCKETS; b++)
+		total += reads.latency[b];
+	ASSERT_EQ(reads.calls, total);
+	ASSERT_LT(0, reads.p50_ns);
+	ASSERT_LE(reads.p50_ns, reads.p99_ns);
+	ASSERT_LE(reads.p99_ns, reads.p999_ns);
+	block_store_destroy(bs);
+
+	// Deserialize counts are process-wide, so a failure shows up too
+	bs = block_store_deserialize("test_stats.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	uint64_t calls = stats.ops[BLOCK_STORE_OP_DESERIALIZE].calls;
+	uint64_t failures = stats.ops[BLOCK_STORE_OP_DESERIALIZE].failures;
+	ASSERT_LE(1, calls);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_stats_missing.bs"));
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(calls + 1, stats.ops[BLOCK_STORE_OP_DESERIALIZE].calls);
+	ASSERT_EQ(failures + 1, stats.ops[BLOCK_STORE_OP_DESERIALIZE].failures);
+	block_store_destroy(bs);
+#endif
+
+	score += 3;
+}
+
+TEST(block_store_stats, hardware_counters)
+{
+	// Counters may well be missing (containers, VMs); that has to be a clean no
+	perf_counters_t *counters = perf_counters_open();
+	bool have_counters = counters != nullptr;
+	if (counters)
+	{
+		perf_sample_t before, after;
+		ASSERT_EQ(true, perf_counters_read(counters, &before));
+		ASSERT_EQ(true, perf_counters_read(counters, &after));
+		ASSERT_NE(0u, before.available);
+		perf_counters_close(counters);
+	}
+	ASSERT_STREQ("cycles", perf_counter_name(PERF_CYCLES));
+
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	block_store_stats_t stats;
+#ifdef BLOCK_STORE_STATS
+	ASSERT_EQ(have_counters, block_store_set_hw_counters(bs, true));
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	size_t id = block_store_allocate(bs);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(have_counters ? 1u : 0u, stats.ops[BLOCK_STORE_OP_WRITE].hw_calls);
+	ASSERT_EQ(true, block_store_set_hw_counters(bs, false));
+#else
+	(void)have_counters;
+	ASSERT_EQ(false, block_store_set_hw_counters(bs, true));
+	ASSERT_EQ(false, block_store_get_stats(bs, &stats));
+#endif
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_trace, records_calls)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_trace_start(bs, "test_trace.bst"));
+	ASSERT_EQ(false, block_store_trace_start(bs, "test_trace.bst"));
+
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	size_t id = block_store_allocate(bs);
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	ASSERT_EQ(0, block_store_read(bs, 301, buffer));
+	block_store_release(bs, id);
+	ASSERT_EQ(true, block_store_trace_stop(bs));
+	ASSERT_EQ(false, block_store_trace_stop(bs));
+	// Nothing after the stop is recorded
+	block_store_allocate(bs);
+	block_store_destroy(bs);
+
+	size_t num_blocks = 0;
+	block_trace_reader_t *reader = block_trace_open("test_trace.bst", &num_blocks);
+	ASSERT_NE(nullptr, reader);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, num_blocks);
+	const block_trace_record_t expected[] = {
+		{0, (uint32_t)id, BLOCK_STORE_OP_ALLOCATE, 1, 0},
+		{0, 300, BLOCK_STORE_OP_REQUEST, 1, 0},
+		{0, (uint32_t)id, BLOCK_STORE_OP_WRITE, 1, 0},
+		{0, 301, BLOCK_STORE_OP_READ, 0, 0},
+		{0, (uint32_t)id, BLOCK_STORE_OP_RELEASE, 1, 0},
+	};
+	block_trace_record_t rec;
+	uint64_t last = 0;
+	for (const block_trace_record_t &want : expected)
+	{
+		ASSERT_EQ(true, block_trace_next(reader, &rec));
+		ASSERT_EQ(want.op, rec.op);
+		ASSERT_EQ(want.block_id, rec.block_id);
+		ASSERT_EQ(want.ok, rec.ok);
+		ASSERT_LE(last, rec.time_ns);
+		last = rec.time_ns;
+	}
+	ASSERT_EQ(false, block_trace_next(reader, &rec));
+	block_trace_reader_close(reader);
+
+	score += 3;
+}
+
+TEST(block_store_free_extents, tracks_runs)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	block_store_free_extents_t report;
+	ASSERT_EQ(false, block_store_get_free_extents(nullptr, &report));
+	ASSERT_EQ(false, block_store_get_free_extents(bs, nullptr));
+
+	// Fresh store: the FBM blocks split the device in two
+	ASSERT_EQ(true, block_store_get_free_extents(bs, &report));
+	ASSERT_EQ(block_store_get_free_blocks(bs), report.free_blocks);
+	ASSERT_EQ(2, report.extents);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 129, report.largest);
+	ASSERT_EQ(1, report.histogram[6]);  // 127 blocks
+	ASSERT_EQ(1, report.histogram[8]);  // 383 blocks
+
+	// Churn, then check the running figures against a recount
+	bool used[BLOCK_STORE_NUM_BLOCKS] = {false};
+	used[127] = used[128] = true;
+	unsigned seed = 7;
+	for (int i = 0; i < 4000; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		size_t id = (seed >> 8) % BLOCK_STORE_NUM_BLOCKS;
+		if (id == 127 || id == 128)
+			continue;
+		if (used[id])
+			block_store_release(bs, id);
+		else
+			ASSERT_EQ(true, block_store_request(bs, id));
+		used[id] = !used[id];
+	}
+	size_t extents = 0, largest = 0, run = 0;
+	size_t histogram[BLOCK_STORE_EXTENT_BUCKETS] = {0};
+	for (size_t id = 0; id <= BLOCK_STORE_NUM_BLOCKS; id++)
+	{
+		if (id < BLOCK_STORE_NUM_BLOCKS && !used[id])
+		{
+			run++;
+			continue;
+		}
+		if (run)
+		{
+			extents++;
+			largest = run > largest ? run : largest;
+			histogram[31 - __builtin_clz((unsigned)run)]++;
+		}
+		run = 0;
+	}
+	ASSERT_EQ(true, block_store_get_free_extents(bs, &report));
+	ASSERT_EQ(block_store_get_free_blocks(bs), report.free_blocks);
+	ASSERT_EQ(extents, report.extents);
+	ASSERT_EQ(largest, report.largest);
+	for (int b = 0; b < BLOCK_STORE_EXTENT_BUCKETS; b++)
+		ASSERT_EQ(histogram[b], report.histogram[b]);
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_compact, keeps_ids_stable)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	block_store_compact_report_t report;
+	ASSERT_EQ(false, block_store_compact(nullptr, 0, &report));
+	ASSERT_EQ(false, block_store_compact(bs, 0, nullptr));
+
+	// Every third block from 200 up is in use, each tagged with its id
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t id = 200; id < BLOCK_STORE_NUM_BLOCKS; id += 3)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		memset(buffer, (int)(id & 0xFF), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	size_t used = block_store_get_used_blocks(bs);
+
+	size_t moved = 0, slices = 0;
+	ASSERT_EQ(true, block_store_compact(bs, 10, &report));
+	size_t largest_before = report.largest_before;
+	moved += report.moved;
+	ASSERT_EQ(10, report.moved);
+	while (!report.done)
+	{
+		// Normal traffic in between slices
+		size_t id = block_store_allocate(bs);
+		ASSERT_NE(SIZE_MAX, id);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ(0, buffer[0]);
+		block_store_release(bs, id);
+		ASSERT_EQ(true, block_store_compact(bs, 10, &report));
+		ASSERT_LE(report.moved, 10);
+		moved += report.moved;
+		ASSERT_LT(++slices, 100);
+	}
+	ASSERT_LT(0, moved);
+	ASSERT_LT(largest_before, report.largest_after);
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_compact(bs, 0, &report));
+	ASSERT_EQ(0, report.moved);
+	ASSERT_EQ(true, report.done);
+
+	for (size_t id = 200; id < BLOCK_STORE_NUM_BLOCKS; id += 3)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ((uint8_t)(id & 0xFF), buffer[0]);
+		ASSERT_EQ((uint8_t)(id & 0xFF), buffer[BLOCK_SIZE_BYTES - 1]);
+	}
+	// Images are still laid out by id
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_compact.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test_compact.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	for (size_t id = 200; id < BLOCK_STORE_NUM_BLOCKS; id += 3)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+		ASSERT_EQ((uint8_t)(id & 0xFF), buffer[0]);
+	}
+	block_store_destroy(bs);
+
+	bs = block_store_open("test_compact.bs", 0);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(false, block_store_compact(bs, 0, &report));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_compact, keeps_runs_in_order)
+{
+	// Two runs and a straggler above a pinned pair; they should come out in order,
+	// back to back, with the pinned pair left where it was
+	bitmap_t *fbm = bitmap_create(64);
+	ASSERT_NE(nullptr, fbm);
+	const size_t ids[] = {10, 11, 12, 13, 40, 41, 50};
+	for (size_t id : ids)
+		bitmap_set(fbm, id);
+	block_remap_t *remap = block_remap_create(fbm, 20, 2);
+	ASSERT_NE(nullptr, remap);
+
+	size_t from, to, moves = 0;
+	while (block_remap_next_move(remap, &from, &to))
+	{
+		block_remap_moved(remap, from, to);
+		ASSERT_LT(++moves, 64u);
+	}
+	for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+		ASSERT_EQ(i, block_remap_lookup(remap, ids[i]));
+	ASSERT_EQ(20u, block_remap_lookup(remap, 20));
+	ASSERT_EQ(21u, block_remap_lookup(remap, 21));
+	ASSERT_EQ(64u - 22, block_remap_largest_free(remap));
+	block_remap_destroy(remap);
+	bitmap_destroy(fbm);
+
+	score += 2;
+}
+
+TEST(block_store_resize, grows_and_shrinks)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(false, block_store_resize(nullptr, 1024));
+	ASSERT_EQ(false, block_store_resize(bs, 128));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+
+	uint8_t buffer[BLOCK_SIZE_BYTES], fbm_block[BLOCK_SIZE_BYTES], check[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x5A, sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 300, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK, fbm_block));
+
+	// Growing keeps what was there, FBM included
+	ASSERT_EQ(true, block_store_resize(bs, 100000));
+	ASSERT_EQ(100000, block_store_get_num_blocks(bs));
+	ASSERT_EQ(100000 - 3, block_store_get_free_blocks(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK, check));
+	ASSERT_EQ(0, memcmp(fbm_block, check, sizeof(check)));
+	ASSERT_EQ(true, block_store_request(bs, 99999));
+	ASSERT_EQ(false, block_store_request(bs, 100000));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 99999, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 99999, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	// Only in the standard geometry
+	ASSERT_EQ(0, block_store_serialize(bs, "test_resize.bs"));
+
+	// Shrinking needs a free tail
+	ASSERT_EQ(false, block_store_resize(bs, 4096));
+	block_store_release(bs, 99999);
+	ASSERT_EQ(true, block_store_resize(bs, 4096));
+	ASSERT_EQ(4096 - 3, block_store_get_free_blocks(bs));
+	ASSERT_EQ(true, block_store_request(bs, 4095));
+	ASSERT_EQ(false, block_store_resize(bs, BLOCK_STORE_NUM_BLOCKS));
+	block_store_release(bs, 4095);
+
+	// A compacted device can shrink once its data is out of the way
+	ASSERT_EQ(true, block_store_request(bs, 1000));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 1000, buffer));
+	block_store_compact_report_t report;
+	ASSERT_EQ(true, block_store_compact(bs, 0, &report));
+	ASSERT_EQ(true, report.done);
+	ASSERT_EQ(false, block_store_resize(bs, BLOCK_STORE_NUM_BLOCKS));
+	block_store_release(bs, 1000);
+	ASSERT_EQ(true, block_store_resize(bs, BLOCK_STORE_NUM_BLOCKS));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 3, block_store_get_free_blocks(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_resize.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test_resize.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 3, block_store_get_free_blocks(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	block_store_destroy(bs);
+
+	bs = block_store_open("test_resize.bs", 0);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(false, block_store_resize(bs, 1024));
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_create_ex, thin_provisioned)
+{
+	ASSERT_EQ(nullptr, block_store_create_ex(100, 0));
+	block_store_t *bs = block_store_create_ex(2048, 0);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(2048, block_store_get_num_blocks(bs));
+	ASSERT_LE(2048 * BLOCK_SIZE_BYTES, block_store_get_resident_bytes(bs));
+	block_store_destroy(bs);
+
+	// 32 MiB device, only the page holding the FBM has memory to start with
+	const size_t blocks = 1 << 20;
+	bs = block_store_create_ex(blocks, BLOCK_STORE_CREATE_THIN);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(blocks - 2, block_store_get_free_blocks(bs));
+	size_t base = block_store_get_resident_bytes(bs);
+	ASSERT_LT(0, base);
+	ASSERT_GE(128 * 1024, base);
+
+	uint8_t buffer[BLOCK_SIZE_BYTES], check[BLOCK_SIZE_BYTES];
+	memset(buffer, 0xA5, sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, 500000));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 500000, check));
+	ASSERT_EQ(0, check[0]);
+	ASSERT_EQ(base, block_store_get_resident_bytes(bs));
+	// A write takes one page, not a whole run of them
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 500000, buffer));
+	ASSERT_EQ(base + page, block_store_get_resident_bytes(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 500000, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	// Emptying the page gives its memory back, and it reads as zeroes again
+	block_store_release(bs, 500000);
+	ASSERT_EQ(base, block_store_get_resident_bytes(bs));
+	ASSERT_EQ(true, block_store_request(bs, 500000));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 500000, check));
+	ASSERT_EQ(0, check[0]);
+
+	// Compaction pulls data down out of pages that then go back too
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 500000, buffer));
+	ASSERT_LT(base, block_store_get_resident_bytes(bs));
+	block_store_compact_report_t report;
+	ASSERT_EQ(true, block_store_compact(bs, 0, &report));
+	ASSERT_EQ(1, report.moved);
+	ASSERT_EQ(base, block_store_get_resident_bytes(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 500000, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	block_store_destroy(bs);
+
+	// A device small enough to keep its fbm in blocks 127-128 reads both of them back,
+	// even though the second one sits in a page of its own
+	bs = block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_STORE_CREATE_THIN);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK + 1, check));
+	ASSERT_NE(0, check[(300 - BLOCK_SIZE_BYTES * 8) / 8]);
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_create_ex, huge_pages)
+{
+	ASSERT_EQ(BLOCK_STORE_BACKING_NONE, block_store_get_backing(nullptr));
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_STORE_BACKING_PAGES, block_store_get_backing(bs));
+	block_store_destroy(bs);
+
+	// Whatever the machine has to offer, the device has to work the same
+	const size_t blocks = 1 << 17;
+	bs = block_store_create_ex(blocks, BLOCK_STORE_CREATE_HUGE_PAGES);
+	ASSERT_NE(nullptr, bs);
+	block_store_backing_t backing = block_store_get_backing(bs);
+	ASSERT_NE(BLOCK_STORE_BACKING_NONE, backing);
+	ASSERT_NE(BLOCK_STORE_BACKING_FILE, backing);
+	uint8_t buffer[BLOCK_SIZE_BYTES], check[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x3C, sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, blocks - 1));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, blocks - 1, buffer));
+	ASSERT_EQ(true, block_store_resize(bs, 2 * blocks));
+	ASSERT_EQ(backing, block_store_get_backing(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, blocks - 1, check));
+	ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+	block_store_destroy(bs);
+
+	// Thin devices stay away from the hugetlb pool
+	bs = block_store_create_ex(blocks, BLOCK_STORE_CREATE_HUGE_PAGES | BLOCK_STORE_CREATE_THIN);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_NE(BLOCK_STORE_BACKING_HUGETLB, block_store_get_backing(bs));
+	block_store_destroy(bs);
+
+	unlink("test_backing.bs");
+	bs = block_store_open("test_backing.bs", BLOCK_STORE_OPEN_CREATE);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_STORE_BACKING_FILE, block_store_get_backing(bs));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(bitmap_kernels, match_scalar)
+{
+	const bitmap_kernels_t *scalar = bitmap_kernels_for(BITMAP_KERNELS_SCALAR);
+	ASSERT_NE(nullptr, scalar);
+	ASSERT_NE(nullptr, bitmap_kernels());
+
+	// Odd lengths and offsets so every vector loop has a ragged head and tail
+	std::vector<uint8_t> data(70000), expect, got;
+	unsigned seed = 11;
+	for (uint8_t &byte : data)
+	{
+		seed = seed * 1103515245 + 12345;
+		byte = (uint8_t)(seed >> 16);
+	}
+	for (int which = 0; which < BITMAP_KERNELS_COUNT; which++)
+	{
+		const bitmap_kernels_t *kernels = bitmap_kernels_for((BITMAP_KERNELS)which);
+		if (!kernels)
+			continue;
+		for (size_t offset : {0, 1, 7})
+			for (size_t len : {0, 1, 15, 16, 33, 64, 127, 4096, 65537})
+			{
+				ASSERT_EQ(scalar->popcount(data.data() + offset, len), kernels->popcount(data.data() + offset, len))
+					<< kernels->name << " " << offset << "+" << len;
+				expect = got = data;
+				scalar->invert(expect.data() + offset, len);
+				kernels->invert(got.data() + offset, len);
+				ASSERT_EQ(expect, got) << kernels->name << " " << offset << "+" << len;
+			}
+	}
+
+	// And through the bitmap API, leftover bits and all
+	bitmap_t *bitmap = bitmap_create(100003);
+	ASSERT_NE(nullptr, bitmap);
+	for (size_t bit = 0; bit < 100003; bit += 3)
+		bitmap_set(bitmap, bit);
+	ASSERT_EQ(33335, bitmap_total_set(bitmap));
+	bitmap_invert(bitmap);
+	ASSERT_EQ(100003 - 33335, bitmap_total_set(bitmap));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+static void note_diff(size_t bit, bool in_a, void *arg)
+{
+	std::vector<std::pair<size_t, bool>> *seen = (std::vector<std::pair<size_t, bool>> *)arg;
+	seen->push_back(std::make_pair(bit, in_a));
+}
+
+TEST(bitmap_algebra, matches_bitwise)
+{
+	const size_t bits = 70001;
+	bitmap_t *a = bitmap_create(bits), *b = bitmap_create(bits), *dst = bitmap_create(bits);
+	bitmap_t *other = bitmap_create(bits + 1);
+	ASSERT_NE(nullptr, a);
+	ASSERT_NE(nullptr, b);
+	ASSERT_NE(nullptr, dst);
+	unsigned seed = 3;
+	for (size_t bit = 0; bit < bits; bit++)
+	{
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) & 1)
+			bitmap_set(a, bit);
+		if ((seed >> 17) % 5 == 0)
+			bitmap_set(b, bit);
+	}
+	ASSERT_EQ(false, bitmap_and(dst, a, other));
+	ASSERT_EQ(SIZE_MAX, bitmap_diff_count(a, other));
+	ASSERT_EQ(SIZE_MAX, bitmap_diff_for_each(a, other, nullptr, nullptr));
+
+	bool (*ops[])(bitmap_t *const, const bitmap_t *const, const bitmap_t *const) = {
+		bitmap_and, bitmap_or, bitmap_xor, bitmap_andnot};
+	for (int op = 0; op < 4; op++)
+	{
+		ASSERT_EQ(true, ops[op](dst, a, b));
+		for (size_t bit = 0; bit < bits; bit++)
+		{
+			bool x = bitmap_test(a, bit), y = bitmap_test(b, bit);
+			bool want = op == 0 ? x && y : op == 1 ? x || y : op == 2 ? x != y : x && !y;
+			ASSERT_EQ(want, bitmap_test(dst, bit)) << op << " " << bit;
+		}
+	}
+
+	size_t differ = 0;
+	std::vector<std::pair<size_t, bool>> expect, seen;
+	for (size_t bit = 0; bit < bits; bit++)
+		if (bitmap_test(a, bit) != bitmap_test(b, bit))
+		{
+			differ++;
+			expect.push_back(std::make_pair(bit, bitmap_test(a, bit)));
+		}
+	ASSERT_EQ(differ, bitmap_diff_count(a, b));
+	ASSERT_EQ(differ, bitmap_diff_for_each(a, b, note_diff, &seen));
+	ASSERT_EQ(expect, seen);
+
+	// In place: a ^= b leaves exactly the differences behind
+	ASSERT_EQ(true, bitmap_xor(a, a, b));
+	ASSERT_EQ(differ, bitmap_total_set(a));
+	bitmap_destroy(a);
+	bitmap_destroy(b);
+	bitmap_destroy(dst);
+	bitmap_destroy(other);
+
+	score += 2;
+}
+
+static void note_batch(const size_t *bits, size_t count, void *arg)
+{
+	std::vector<size_t> *seen = (std::vector<size_t> *)arg;
+	ASSERT_GE((size_t)BITMAP_BATCH_SIZE, count);
+	seen->insert(seen->end(), bits, bits + count);
+}
+
+TEST(bitmap_iterate, skips_ahead)
+{
+	// Ragged size so the last word is only partly real
+	const size_t bits = 100003;
+	bitmap_t *bitmap = bitmap_create(bits);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, 0));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+	ASSERT_EQ(0u, bitmap_ffz(bitmap));
+	ASSERT_EQ(bits - 1, bitmap_next_zero(bitmap, bits - 1));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_zero(bitmap, bits));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(nullptr, 0));
+
+	std::vector<size_t> expect;
+	unsigned seed = 43;
+	for (size_t bit = 0; bit < bits; bit++)
+	{
+		seed = seed * 1103515245 + 12345;
+		// Sparse, with a dense stretch in the middle and the very last bit
+		if ((seed >> 16) % 97 == 0 || (bit >= 50000 && bit < 51000) || bit == bits - 1)
+		{
+			bitmap_set(bitmap, bit);
+			expect.push_back(bit);
+		}
+	}
+	std::vector<size_t> seen;
+	BITMAP_FOR_EACH_SET(bitmap, bit)
+	{
+		seen.push_back(bit);
+	}
+	ASSERT_EQ(expect, seen);
+	seen.clear();
+	bitmap_for_each_batch(bitmap, note_batch, &seen);
+	ASSERT_EQ(expect, seen);
+
+	for (size_t from = 0; from < bits; from += 37)
+	{
+		size_t set = from, zero = from;
+		while (set < bits && !bitmap_test(bitmap, set))
+			set++;
+		while (zero < bits && bitmap_test(bitmap, zero))
+			zero++;
+		ASSERT_EQ(set == bits ? SIZE_MAX : set, bitmap_next_set(bitmap, from)) << from;
+		ASSERT_EQ(zero == bits ? SIZE_MAX : zero, bitmap_next_zero(bitmap, from)) << from;
+	}
+	ASSERT_EQ(expect.front(), bitmap_ffs(bitmap));
+	ASSERT_EQ(51000u, bitmap_next_zero(bitmap, 50000));
+
+	// Full: no zero anywhere, including the padding past the end
+	bitmap_invert(bitmap);
+	for (size_t bit : expect)
+		bitmap_set(bitmap, bit);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+	ASSERT_EQ(0u, bitmap_ffs(bitmap));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+static void sum_bit(size_t bit, void *context)
+{
+	std::pair<size_t, size_t> *sums = (std::pair<size_t, size_t> *)context;
+	sums->first++;
+	sums->second += bit;
+}
+
+TEST(bitmap_parallel, matches_serial)
+{
+	// A few chunks and a ragged end
+	const size_t bits = BITMAP_PARALLEL_CHUNK_BITS * 5 + 77;
+	bitmap_t *bitmap = bitmap_create(bits);
+	ASSERT_NE(nullptr, bitmap);
+	bitmap_pool_t *pool = bitmap_pool_create(4);
+	ASSERT_NE(nullptr, pool);
+	ASSERT_EQ(4u, bitmap_pool_threads(pool));
+	ASSERT_EQ(1u, bitmap_pool_threads(nullptr));
+
+	ASSERT_EQ(0u, bitmap_total_set_parallel(bitmap, pool));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs_parallel(bitmap, pool));
+	ASSERT_EQ(0u, bitmap_ffz_parallel(bitmap, pool));
+
+	// The only set bit is deep in the fourth chunk, the only zero bit right at the end
+	bitmap_set(bitmap, BITMAP_PARALLEL_CHUNK_BITS * 3 + 12345);
+	ASSERT_EQ(BITMAP_PARALLEL_CHUNK_BITS * 3 + 12345, bitmap_ffs_parallel(bitmap, pool));
+	bitmap_invert(bitmap);
+	bitmap_set(bitmap, BITMAP_PARALLEL_CHUNK_BITS * 3 + 12345);
+	bitmap_reset(bitmap, bits - 1);
+	ASSERT_EQ(bits - 1, bitmap_ffz_parallel(bitmap, pool));
+	bitmap_set(bitmap, bits - 1);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz_parallel(bitmap, pool));
+	ASSERT_EQ(bits, bitmap_total_set_parallel(bitmap, pool));
+
+	bitmap_format(bitmap, 0);
+	unsigned seed = 44;
+	for (size_t bit = 0; bit < bits; bit++)
+	{
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) % 13 == 0)
+			bitmap_set(bitmap, bit);
+	}
+	size_t count = 0, sum = 0;
+	BITMAP_FOR_EACH_SET(bitmap, bit)
+	{
+		count++;
+		sum += bit;
+	}
+	ASSERT_EQ(count, bitmap_total_set_parallel(bitmap, pool));
+	ASSERT_EQ(count, bitmap_total_set_parallel(bitmap, nullptr));
+	ASSERT_EQ(bitmap_ffs(bitmap), bitmap_ffs_parallel(bitmap, pool));
+	ASSERT_EQ(bitmap_ffz(bitmap), bitmap_ffz_parallel(bitmap, pool));
+	ASSERT_EQ(count - bitmap_total_set_in(bitmap, 0, 1000), bitmap_total_set_in(bitmap, 1000, bits));
+	ASSERT_EQ(0u, bitmap_total_set_in(bitmap, 5, 5));
+
+	// Every thread gets its own tally; together they cover every set bit once
+	std::vector<std::pair<size_t, size_t>> sums(bitmap_pool_threads(pool));
+	std::vector<void *> contexts;
+	for (auto &tally : sums)
+		contexts.push_back(&tally);
+	bitmap_for_each_parallel(bitmap, pool, sum_bit, contexts.data());
+	size_t seen = 0, seen_sum = 0;
+	for (auto &tally : sums)
+	{
+		seen += tally.first;
+		seen_sum += tally.second;
+	}
+	ASSERT_EQ(count, seen);
+	ASSERT_EQ(sum, seen_sum);
+
+	bitmap_pool_destroy(pool);
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+static void note_zero_run(size_t start, size_t len, void *arg)
+{
+	((std::vector<std::pair<size_t, size_t>> *)arg)->push_back(std::make_pair(start, len));
+}
+
+// Everything a compressed bitmap reports has to match the flat one it shadows
+static void expect_same_bitmap(const bitmap_t *flat, const bitmap_t *comp)
+{
+	const size_t bits = bitmap_get_bits(flat);
+	ASSERT_EQ(bits, bitmap_get_bits(comp));
+	ASSERT_EQ(0u, bitmap_diff_count(flat, comp));
+	ASSERT_EQ(0u, bitmap_diff_for_each(comp, flat, nullptr, nullptr));
+	ASSERT_EQ(bitmap_total_set(flat), bitmap_total_set(comp));
+	ASSERT_EQ(bitmap_ffs(flat), bitmap_ffs(comp));
+	ASSERT_EQ(bitmap_ffz(flat), bitmap_ffz(comp));
+	for (size_t from = 0; from < bits; from += 4093)
+	{
+		ASSERT_EQ(bitmap_next_set(flat, from), bitmap_next_set(comp, from)) << from;
+		ASSERT_EQ(bitmap_next_zero(flat, from), bitmap_next_zero(comp, from)) << from;
+		ASSERT_EQ(bitmap_total_set_in(flat, from, bits - from / 3), bitmap_total_set_in(comp, from, bits - from / 3));
+		size_t fs = 0, cs = 0;
+		ASSERT_EQ(bitmap_zero_run_at(flat, from, &fs), bitmap_zero_run_at(comp, from, &cs));
+		ASSERT_EQ(fs, cs);
+	}
+	std::vector<std::pair<size_t, size_t>> flat_runs, comp_runs;
+	bitmap_for_each_zero_run(flat, note_zero_run, &flat_runs);
+	bitmap_for_each_zero_run(comp, note_zero_run, &comp_runs);
+	ASSERT_EQ(flat_runs, comp_runs);
+	std::vector<size_t> flat_bits, comp_bits;
+	bitmap_for_each_batch(flat, note_batch, &flat_bits);
+	bitmap_for_each_batch(comp, note_batch, &comp_bits);
+	ASSERT_EQ(flat_bits, comp_bits);
+	// Export flattens; the last byte's spare bits are anyone's guess in the flat one
+	const uint8_t *exported = bitmap_export(comp);
+	ASSERT_NE(nullptr, exported);
+	size_t whole = bits / 8;
+	ASSERT_EQ(0, memcmp(bitmap_export(flat), exported, whole));
+	for (size_t bit = whole * 8; bit < bits; bit++)
+		ASSERT_EQ(bitmap_test(flat, bit), (exported[bit / 8] >> (bit % 8)) & 1);
+}
+
+TEST(bitmap_compressed, matches_flat)
+{
+	// Three full chunks and a short one
+	const size_t bits = 3 * 65536 + 1234;
+	bitmap_t *flat = bitmap_create(bits), *comp = bitmap_create_compressed(bits);
+	ASSERT_NE(nullptr, comp);
+	ASSERT_EQ(nullptr, bitmap_create_compressed(0));
+	expect_same_bitmap(flat, comp);
+
+	unsigned seed = 45;
+	auto next = [&seed]() { seed = seed * 1103515245 + 12345; return seed >> 8; };
+	// Sparse: array containers
+	for (int i = 0; i < 3000; i++)
+	{
+		size_t bit = next() % bits;
+		bitmap_set(flat, bit);
+		bitmap_set(comp, bit);
+	}
+	expect_same_bitmap(flat, comp);
+	// A long stretch: runs, including a chunk that ends up full
+	for (size_t bit = 60000; bit < 2 * 65536 + 100; bit++)
+	{
+		bitmap_set(flat, bit);
+		bitmap_set(comp, bit);
+	}
+	expect_same_bitmap(flat, comp);
+	// Holes punched all over: arrays overflow into words, runs break up and give way
+	for (int i = 0; i < 40000; i++)
+	{
+		size_t bit = next() % bits;
+		if (next() & 1)
+		{
+			bitmap_flip(flat, bit);
+			bitmap_flip(comp, bit);
+		}
+		else if (next() & 1)
+		{
+			bitmap_set(flat, bit);
+			bitmap_set(comp, bit);
+		}
+		else
+		{
+			bitmap_reset(flat, bit);
+			bitmap_reset(comp, bit);
+		}
+	}
+	expect_same_bitmap(flat, comp);
+	// And most of it cleared again, back down to arrays
+	for (size_t bit = 0; bit < bits; bit++)
+		if (bit % 97)
+		{
+			bitmap_reset(flat, bit);
+			bitmap_reset(comp, bit);
+		}
+	expect_same_bitmap(flat, comp);
+
+	bitmap_invert(flat);
+	bitmap_invert(comp);
+	expect_same_bitmap(flat, comp);
+
+	// Set algebra, compressed on one or both sides
+	bitmap_t *other = bitmap_create(bits);
+	for (size_t bit = 0; bit < bits; bit += 1 + next() % 5)
+		bitmap_set(other, bit);
+	bitmap_t *other_comp = bitmap_import_compressed(bits, bitmap_export(other));
+	ASSERT_NE(nullptr, other_comp);
+	expect_same_bitmap(other, other_comp);
+	ASSERT_EQ(bitmap_diff_count(flat, other), bitmap_diff_count(comp, other_comp));
+	bool (*ops[])(bitmap_t *const, const bitmap_t *const, const bitmap_t *const) = {
+		bitmap_and, bitmap_or, bitmap_xor, bitmap_andnot};
+	for (auto op : ops)
+	{
+		bitmap_t *want = bitmap_create(bits), *got = bitmap_create_compressed(bits), *mixed = bitmap_create(bits);
+		ASSERT_TRUE(op(want, flat, other));
+		ASSERT_TRUE(op(got, comp, other_comp));
+		ASSERT_TRUE(op(mixed, flat, other_comp));
+		expect_same_bitmap(want, got);
+		ASSERT_EQ(0u, bitmap_diff_count(want, mixed));
+		bitmap_destroy(want);
+		bitmap_destroy(got);
+		bitmap_destroy(mixed);
+	}
+
+	bitmap_format(flat, 0x5A);
+	bitmap_format(comp, 0x5A);
+	expect_same_bitmap(flat, comp);
+	bitmap_format(flat, 0xFF);
+	bitmap_format(comp, 0xFF);
+	expect_same_bitmap(flat, comp);
+
+	bitmap_destroy(other);
+	bitmap_destroy(other_comp);
+	bitmap_destroy(flat);
+	bitmap_destroy(comp);
+
+	score += 3;
+}
+
+TEST(bitmap_compressed, stays_small)
+{
+	// 2^32 bits would be 512 MiB flat
+	const size_t bits = (size_t)1 << 32;
+	bitmap_t *bitmap = bitmap_create_compressed(bits);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(bits / 8, bitmap_get_bytes(bitmap));
+	ASSERT_GT((size_t)1 << 20, bitmap_get_resident_bytes(bitmap));
+	bitmap_set(bitmap, 5);
+	bitmap_set(bitmap, bits - 1);
+	bitmap_set(bitmap, bits / 2);
+	ASSERT_EQ(3u, bitmap_total_set(bitmap));
+	ASSERT_EQ(bits / 2, bitmap_next_set(bitmap, 6));
+	ASSERT_EQ(bits - 1, bitmap_next_set(bitmap, bits / 2 + 1));
+
+	// Mostly full: one run per chunk, and ffz still only has to look at each chunk once
+	bitmap_format(bitmap, 0xFF);
+	ASSERT_EQ(bits, bitmap_total_set(bitmap));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+	for (size_t bit = bits / 3; bit < bits / 3 + 100000; bit++)
+		bitmap_reset(bitmap, bit);
+	ASSERT_EQ(bits / 3, bitmap_ffz(bitmap));
+	ASSERT_EQ(bits - 100000, bitmap_total_set(bitmap));
+	size_t start = 0;
+	ASSERT_EQ(100000u, bitmap_zero_run_at(bitmap, bits / 3 + 5, &start));
+	ASSERT_EQ(bits / 3, start);
+	ASSERT_GT((size_t)4 << 20, bitmap_get_resident_bytes(bitmap));
+
+	bitmap_invert(bitmap);
+	ASSERT_EQ(100000u, bitmap_total_set(bitmap));
+	ASSERT_GT((size_t)1 << 20, bitmap_get_resident_bytes(bitmap));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+// Sizes, word counts and masks are all there at compile time
+static_assert(hw3::bitmap<512>::words == 8, "512 bits is 8 words");
+static_assert(hw3::bitmap<1000>::bytes == 125, "1000 bits is 125 bytes");
+static_assert(hw3::bitmap<1000>::last_mask == 0xFFFFFFFFFF, "1000 bits leaves 40 in the last word");
+static_assert([] {
+	hw3::bitmap<130> b;
+	b.set(129);
+	b.set(64);
+	return b.ffs() == 64 && b.total_set() == 2 && b.next_set(65) == 129 && b.ffz() == 0;
+}(), "usable in constant expressions");
+
+template <std::size_t N>
+static void check_template_against_c()
+{
+	hw3::bitmap<N> fixed;
+	hw3::dynamic_bitmap c(N);
+	ASSERT_TRUE((bool)c);
+	ASSERT_EQ(N, c.size());
+	unsigned seed = 46;
+	for (int i = 0; i < 3 * (int)N; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		size_t bit = (seed >> 8) % N;
+		switch ((seed >> 4) % 3)
+		{
+			case 0:
+				fixed.set(bit);
+				c.set(bit);
+				break;
+			case 1:
+				fixed.reset(bit);
+				c.reset(bit);
+				break;
+			default:
+				fixed.flip(bit);
+				c.flip(bit);
+		}
+		if (i % 97 == 0)
+		{
+			ASSERT_EQ(c.total_set(), fixed.total_set());
+			ASSERT_EQ(c.ffs(), fixed.ffs());
+			ASSERT_EQ(c.ffz(), fixed.ffz());
+			ASSERT_EQ(c.next_set(bit), fixed.next_set(bit));
+			ASSERT_EQ(c.next_zero(bit), fixed.next_zero(bit));
+		}
+	}
+	std::vector<size_t> a, b;
+	fixed.for_each([&a](size_t bit) { a.push_back(bit); });
+	c.for_each([&b](size_t bit) { b.push_back(bit); });
+	ASSERT_EQ(b, a);
+
+	// Overlay: the C calls see (and change) the template's own bits
+	bitmap_t *view = fixed.overlay();
+	ASSERT_NE(nullptr, view);
+	ASSERT_EQ(0u, bitmap_diff_count(view, c.get()));
+	bitmap_invert(view);
+	c.invert();
+	ASSERT_EQ(c.total_set(), fixed.total_set());
+	bitmap_destroy(view);
+
+	// And back the other way, through a compressed one too
+	hw3::bitmap<N> copy;
+	ASSERT_TRUE(c.store(copy));
+	ASSERT_TRUE(copy == fixed);
+	hw3::dynamic_bitmap packed(fixed, true);
+	ASSERT_EQ(0u, packed.diff_count(c));
+	hw3::bitmap<N> other;
+	other.format(0xFF);
+	ASSERT_TRUE(other.all());
+	ASSERT_EQ(SIZE_MAX, other.ffz());
+	other.andnot(fixed);
+	ASSERT_EQ(N - fixed.total_set(), other.total_set());
+	ASSERT_EQ(N, other.diff_count(fixed));
+	other ^= fixed;
+	ASSERT_TRUE(other.all());
+	other &= fixed;
+	ASSERT_TRUE(other == fixed);
+	ASSERT_FALSE(copy.load(nullptr));
+}
+
+TEST(bitmap_template, matches_c)
+{
+	check_template_against_c<512>();
+	check_template_against_c<1000>();
+	check_template_against_c<7>();
+
+	hw3::dynamic_bitmap wrong(100);
+	hw3::bitmap<512> fbm;
+	ASSERT_FALSE(wrong.store(fbm));
+
+	score += 2;
+}
+
+static_assert(hw3::DefaultBlockStore::offset_of(3) == 3 * BLOCK_SIZE_BYTES, "offsets are constants");
+static_assert(hw3::BlockStore<1024>::device_bytes == 1024 * BLOCK_SIZE_BYTES, "so are sizes");
+static_assert(sizeof(hw3::DefaultBlockStore) == sizeof(block_store_t *), "nothing but the handle");
+
+TEST(block_store_template, raii_and_views)
+{
+	struct record
+	{
+		uint64_t key;
+		char name[24];
+	};
+	static_assert(sizeof(record) == BLOCK_SIZE_BYTES, "one block exactly");
+
+	hw3::DefaultBlockStore store;
+	ASSERT_TRUE((bool)store);
+	size_t id = store.allocate();
+	ASSERT_NE(SIZE_MAX, id);
+	record r = {42, "answer"};
+	ASSERT_TRUE(store.write_as(id, r));
+	auto back = store.read_as<record>(id);
+	ASSERT_TRUE(back.has_value());
+	ASSERT_EQ(42u, back->key);
+	ASSERT_STREQ("answer", back->name);
+
+	// Smaller than a block: the rest reads back as zeros
+	ASSERT_TRUE(store.write_as<uint16_t>(id, 0xBEEF));
+	hw3::DefaultBlockStore::block raw;
+	ASSERT_TRUE(store.read(id, raw));
+	ASSERT_EQ(0xBEEF, *store.read_as<uint16_t>(id));
+	for (size_t i = 2; i < raw.size(); i++)
+		ASSERT_EQ(std::byte{0}, raw[i]);
+	// Unallocated blocks give nothing back
+	ASSERT_FALSE(store.read_as<uint64_t>(id + 1).has_value());
+	ASSERT_FALSE(store.write_as<uint64_t>(id + 1, 1));
+
+	// Moves hand the device over; only the last holder destroys it
+	hw3::DefaultBlockStore moved(std::move(store));
+	ASSERT_FALSE((bool)store);
+	ASSERT_TRUE((bool)moved);
+	ASSERT_EQ(1u + BITMAP_NUM_BLOCKS, moved.used_blocks());
+	hw3::DefaultBlockStore other;
+	other = std::move(moved);
+	ASSERT_FALSE((bool)moved);
+	ASSERT_EQ(0xBEEF, *other.read_as<uint16_t>(id));
+
+	// Through an image and back
+	ASSERT_EQ(BLOCK_STORE_NUM_BYTES, other.serialize("test_template.bs"));
+	auto loaded = hw3::DefaultBlockStore::deserialize("test_template.bs");
+	ASSERT_TRUE((bool)loaded);
+	ASSERT_EQ(0xBEEF, *loaded.read_as<uint16_t>(id));
+	unlink("test_template.bs");
+
+	// Other sizes are other types, and adopting the wrong size is refused
+	hw3::BlockStore<1024> big;
+	ASSERT_TRUE((bool)big);
+	ASSERT_EQ(1024u, block_store_get_num_blocks(big.get()));
+	ASSERT_TRUE(big.request(1000));
+	ASSERT_TRUE(big.write_as<uint32_t>(1000, 7));
+	ASSERT_EQ(7u, *big.read_as<uint32_t>(1000));
+	auto wrong = hw3::BlockStore<1024>::adopt(block_store_create());
+	ASSERT_FALSE((bool)wrong);
+	block_store_t *raw_bs = big.detach();
+	ASSERT_FALSE((bool)big);
+	block_store_destroy(raw_bs);
+
+	score += 2;
+}
+
+TEST(block_store_pool, create_and_recycle)
+{
+	ASSERT_EQ(nullptr, block_store_pool_create(0));
+	ASSERT_EQ(nullptr, block_store_create_pooled(nullptr));
+	ASSERT_EQ(0u, block_store_pool_available(nullptr));
+	block_store_pool_destroy(nullptr);
+
+	block_store_pool_t *pool = block_store_pool_create(3);
+	ASSERT_NE(nullptr, pool);
+	ASSERT_EQ(3u, block_store_pool_available(pool));
+
+	// A pooled device looks just like a fresh block_store_create one
+	block_store_t *stores[3];
+	uint8_t block[BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < 3; i++)
+	{
+		stores[i] = block_store_create_pooled(pool);
+		ASSERT_NE(nullptr, stores[i]);
+		ASSERT_EQ(BLOCK_STORE_BACKING_POOL, block_store_get_backing(stores[i]));
+		ASSERT_EQ((size_t)BITMAP_NUM_BLOCKS, block_store_get_used_blocks(stores[i]));
+		ASSERT_EQ(0u, block_store_allocate(stores[i]));
+		memset(block, (int)i + 1, sizeof(block));
+		ASSERT_EQ((size_t)BLOCK_SIZE_BYTES, block_store_write(stores[i], 0, block));
+	}
+	// ...but it's full now
+	ASSERT_EQ(0u, block_store_pool_available(pool));
+	ASSERT_EQ(nullptr, block_store_create_pooled(pool));
+	// Neighbours don't see each other's blocks
+	for (size_t i = 0; i < 3; i++)
+	{
+		ASSERT_EQ((size_t)BLOCK_SIZE_BYTES, block_store_read(stores[i], 0, block));
+		ASSERT_EQ(i + 1, block[0]);
+		ASSERT_EQ(i + 1, block[BLOCK_SIZE_BYTES - 1]);
+	}
+	// Pooled devices stay the size they are
+	ASSERT_FALSE(block_store_resize(stores[0], 1024));
+
+	// The slot given back last is the one reused, and it comes back clean
+	block_store_t *freed = stores[1];
+	block_store_destroy(stores[1]);
+	ASSERT_EQ(1u, block_store_pool_available(pool));
+	stores[1] = block_store_create_pooled(pool);
+	ASSERT_EQ(freed, stores[1]);
+	ASSERT_EQ((size_t)BITMAP_NUM_BLOCKS, block_store_get_used_blocks(stores[1]));
+	ASSERT_EQ(0u, block_store_read(stores[1], 0, block));
+	ASSERT_TRUE(block_store_request(stores[1], 0));
+	ASSERT_EQ((size_t)BLOCK_SIZE_BYTES, block_store_read(stores[1], 0, block));
+	for (size_t i = 0; i < BLOCK_SIZE_BYTES; i++)
+		ASSERT_EQ(0, block[i]);
+
+	// An image of a pooled device loads as an ordinary one
+	ASSERT_EQ((size_t)BLOCK_STORE_NUM_BYTES, block_store_serialize(stores[2], "test_pool.bs"));
+	block_store_t *loaded = block_store_deserialize("test_pool.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ((size_t)BLOCK_SIZE_BYTES, block_store_read(loaded, 0, block));
+	ASSERT_EQ(3, block[0]);
+	block_store_destroy(loaded);
+	unlink("test_pool.bs");
+
+	for (size_t i = 0; i < 3; i++)
+		block_store_destroy(stores[i]);
+	ASSERT_EQ(3u, block_store_pool_available(pool));
+	block_store_pool_destroy(pool);
+
+	score += 2;
+}
+
+TEST(block_store_reuse, newest_release_first)
+{
+	ASSERT_FALSE(block_store_set_reuse_depth(nullptr, 4));
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	for (size_t id = 0; id < 10; id++)
+		ASSERT_TRUE(block_store_request(bs, id));
+
+	// Off by default: the lowest free block wins
+	block_store_release(bs, 7);
+	block_store_release(bs, 3);
+	ASSERT_EQ(3u, block_store_allocate(bs));
+	ASSERT_EQ(7u, block_store_allocate(bs));
+
+	ASSERT_TRUE(block_store_set_reuse_depth(bs, 3));
+	block_store_release(bs, 2);
+	block_store_release(bs, 8);
+	block_store_release(bs, 5);
+	ASSERT_EQ(5u, block_store_allocate(bs));
+	ASSERT_EQ(8u, block_store_allocate(bs));
+	ASSERT_EQ(2u, block_store_allocate(bs));
+	// Nothing remembered, back to the scan
+	ASSERT_EQ(10u, block_store_allocate(bs));
+
+	// Ids taken behind its back are skipped
+	block_store_release(bs, 4);
+	block_store_release(bs, 6);
+	ASSERT_TRUE(block_store_request(bs, 6));
+	ASSERT_EQ(4u, block_store_allocate(bs));
+
+	// Only the last depth releases are kept, the oldest falls off
+	block_store_release(bs, 1);
+	block_store_release(bs, 9);
+	block_store_release(bs, 6);
+	block_store_release(bs, 4);
+	ASSERT_EQ(4u, block_store_allocate(bs));
+	ASSERT_EQ(6u, block_store_allocate(bs));
+	ASSERT_EQ(9u, block_store_allocate(bs));
+	ASSERT_EQ(1u, block_store_allocate(bs));
+
+	// Shrinking the stack keeps the newest, turning it off forgets them all
+	block_store_release(bs, 2);
+	block_store_release(bs, 5);
+	block_store_release(bs, 8);
+	ASSERT_TRUE(block_store_set_reuse_depth(bs, 2));
+	ASSERT_EQ(8u, block_store_allocate(bs));
+	ASSERT_TRUE(block_store_set_reuse_depth(bs, 0));
+	ASSERT_EQ(2u, block_store_allocate(bs));
+	ASSERT_EQ(5u, block_store_allocate(bs));
+	ASSERT_EQ(11u + BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	// An FBM write that takes a remembered id drops it too, so allocate never
+	// hands out a block that's in use
+	ASSERT_TRUE(block_store_set_reuse_depth(bs, 4));
+	uint8_t fbm[BLOCK_SIZE_BYTES];
+	block_store_release(bs, 3);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK, fbm));
+	block_store_release(bs, 6);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, BITMAP_START_BLOCK, fbm));
+	ASSERT_EQ(3u, block_store_allocate(bs));
+	ASSERT_EQ(11u, block_store_allocate(bs));
+	ASSERT_EQ(12u + BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	block_store_destroy(bs);
+	score += 1;
+}
+
+// Allocates count blocks of a shared device and stamps each with marker
+static bool stamp_blocks(block_store_t *bs, size_t count, uint8_t marker)
+{
+	uint8_t block[BLOCK_SIZE_BYTES];
+	memset(block, marker, sizeof(block));
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t id = block_store_allocate(bs);
+		if (id == SIZE_MAX || block_store_write(bs, id, block) != BLOCK_SIZE_BYTES)
+			return false;
+	}
+	return true;
+}
+
+TEST(block_store_shared, processes_share_blocks)
+{
+	std::string name = "/hw3_test_shared_" + std::to_string(getpid());
+	ASSERT_EQ(nullptr, block_store_create_shared(nullptr, 0600));
+	ASSERT_EQ(nullptr, block_store_attach_shared(name.c_str()));
+
+	block_store_t *bs = block_store_create_shared(name.c_str(), 0600);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_STORE_BACKING_SHARED, block_store_get_backing(bs));
+	ASSERT_EQ((size_t)BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(1u, block_store_get_shared_attached(bs));
+	// The name's taken, and shared devices stay put
+	ASSERT_EQ(nullptr, block_store_create_shared(name.c_str(), 0600));
+	ASSERT_FALSE(block_store_resize(bs, 1024));
+
+	// Two other processes allocate alongside this one; the second dies without detaching
+	pid_t children[2];
+	for (int c = 0; c < 2; c++)
+	{
+		children[c] = fork();
+		ASSERT_NE(-1, children[c]);
+		if (children[c] == 0)
+		{
+			block_store_t *mine = block_store_attach_shared(name.c_str());
+			if (!mine)
+				_exit(1);
+			if (!stamp_blocks(mine, 100, (uint8_t)(c + 1)))
+				_exit(2);
+			if (c == 0)
+				block_store_destroy(mine);
+			_exit(0);
+		}
+	}
+	ASSERT_TRUE(stamp_blocks(bs, 100, 3));
+	for (int c = 0; c < 2; c++)
+	{
+		int status = 0;
+		ASSERT_EQ(children[c], waitpid(children[c], &status, 0));
+		ASSERT_EQ(0, WEXITSTATUS(status));
+	}
+
+	// No block went to two of them: each one's 100 stamps are all still there
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 300u, block_store_get_used_blocks(bs));
+	size_t stamped[4] = {0, 0, 0, 0};
+	uint8_t block[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; id++)
+	{
+		if (id >= BITMAP_START_BLOCK && id < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS)
+			continue;
+		if (block_store_read(bs, id, block) == BLOCK_SIZE_BYTES)
+		{
+			ASSERT_TRUE(block[0] >= 1 && block[0] <= 3);
+			ASSERT_EQ(block[0], block[BLOCK_SIZE_BYTES - 1]);
+			stamped[block[0]]++;
+		}
+	}
+	ASSERT_EQ(100u, stamped[1]);
+	ASSERT_EQ(100u, stamped[2]);
+	ASSERT_EQ(100u, stamped[3]);
+
+	// The crashed child doesn't count; a second handle here does
+	ASSERT_EQ(1u, block_store_get_shared_attached(bs));
+	block_store_t *again = block_store_attach_shared(name.c_str());
+	ASSERT_NE(nullptr, again);
+	ASSERT_EQ(2u, block_store_get_shared_attached(bs));
+	block_store_release(again, 0);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 299u, block_store_get_used_blocks(bs));
+	block_store_destroy(again);
+
+	// Last one out takes the name with it, crashed child or not
+	block_store_destroy(bs);
+	ASSERT_EQ(nullptr, block_store_attach_shared(name.c_str()));
+
+	// A creator that died before publishing leaves a name nobody can attach to;
+	// create replaces it, unless its creator is still at work (holding the flock)
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	ASSERT_LE(0, fd);
+	ASSERT_EQ(0, flock(fd, LOCK_EX));
+	ASSERT_EQ(nullptr, block_store_create_shared(name.c_str(), 0600));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_attach_shared(name.c_str()));
+	bs = block_store_create_shared(name.c_str(), 0600);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ((size_t)BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 2;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "block_store.h"
+#include "block_trace.h"
+
+// Replays a trace from block_store_trace_start against this build of the library
+// and reports throughput, latency percentiles and how fragmented free space ends up.
+//
+//   block_store_replay TRACE [--image FILE [--overwrite]] [--journal] [--cache BLOCKS]
+//
+// --image replays against a file-backed device made fresh for the run; an existing
+// FILE (or its FILE.wal log) is left alone unless --overwrite says to replace it.
+//
+// Allocated block ids are remapped: whatever id the traced allocate got, later calls
+// on it go to whatever id this build's allocate handed out instead, so allocator
+// changes can be compared on the same workload.
+
+#define LATENCY_BUCKETS 32
+
+static const char *const op_names[BLOCK_STORE_OP_COUNT] = {
+    [BLOCK_STORE_OP_ALLOCATE] = "allocate",
+    [BLOCK_STORE_OP_REQUEST] = "request",
+    [BLOCK_STORE_OP_RELEASE] = "release",
+    [BLOCK_STORE_OP_READ] = "read",
+    [BLOCK_STORE_OP_WRITE] = "write",
+    [BLOCK_STORE_OP_SERIALIZE] = "serialize",
+    [BLOCK_STORE_OP_DESERIALIZE] = "deserialize",
+};
+
+struct op_report {
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t diverged;    // succeeded in the trace but not here, or the other way round
+    uint64_t total_ns;
+    uint64_t latency[LATENCY_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t percentile(const struct op_report *const r, const double fraction)
+{
+    uint64_t want = (uint64_t)(fraction * (double)r->calls), seen = 0;
+    for (unsigned b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += r->latency[b];
+        if (seen > want) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return (uint64_t)2 << (LATENCY_BUCKETS - 1);
+}
+
+// Free space layout
+static bool report_fragmentation(const block_store_t *const bs)
+{
+    block_store_free_extents_t report;
+    if (!block_store_get_free_extents(bs, &report)) {
+        fprintf(stderr, "replay: couldn't summarize the free block map\n");
+        return false;
+    }
+    printf("\nfree blocks       %zu of %zu\n", report.free_blocks, (size_t)BLOCK_STORE_NUM_BLOCKS);
+    printf("free extents      %zu\n", report.extents);
+    printf("largest extent    %zu blocks\n", report.largest);
+    // 0 when all free space is one run, approaching 1 as it shatters
+    printf("fragmentation     %.3f\n",
+           report.free_blocks ? 1.0 - (double)report.largest / (double)report.free_blocks : 0.0);
+    for (int b = 0; b < BLOCK_STORE_EXTENT_BUCKETS; ++b) {
+        if (report.histogram[b]) {
+            printf("  %6zu+ blocks   %zu\n", (size_t)1 << b, report.histogram[b]);
+        }
+    }
+    return true;
+}
+
+static void usage(const char *const argv0)
+{
+    fprintf(stderr, "usage: %s TRACE [--image FILE [--overwrite]] [--journal] [--cache BLOCKS]\n", argv0);
+}
+
+// Clears the way for a fresh image: the file and its log, which block_store_open
+// would otherwise pick up (or replay) instead
+static bool prepare_image(const char *const image, const bool overwrite)
+{
+    char log[4096];
+    if (snprintf(log, sizeof(log), "%s.wal", image) >= (int)sizeof(log)) {
+        fprintf(stderr, "replay: image name too long\n");
+        return false;
+    }
+    const char *const paths[] = {image, log};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        if (access(paths[i], F_OK) != 0) {
+            continue;
+        }
+        if (!overwrite) {
+            fprintf(stderr, "replay: %s exists, pass --overwrite to replace it\n", paths[i]);
+            return false;
+        }
+        if (unlink(paths[i]) != 0) {
+            perror("replay: couldn't remove the old image");
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace_path = NULL, *image = NULL;
+    unsigned flags = BLOCK_STORE_OPEN_CREATE;
+    bool overwrite = false;
+    long cache = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            image = argv[++i];
+        } else if (!strcmp(argv[i], "--overwrite")) {
+            overwrite = true;
+        } else if (!strcmp(argv[i], "--journal")) {
+            flags |= BLOCK_STORE_OPEN_JOURNAL;
+        } else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+            cache = atol(argv[++i]);
+        } else if (!trace_path && argv[i][0] != '-') {
+            trace_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!trace_path || (overwrite && !image)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    size_t traced_blocks = 0;
+    block_trace_reader_t *reader = block_trace_open(trace_path, &traced_blocks);
+    if (!reader) {
+        return 1;
+    }
+    if (image && !prepare_image(image, overwrite)) {
+        block_trace_reader_close(reader);
+        return 1;
+    }
+    block_store_t *bs = image ? block_store_open(image, flags) : block_store_create();
+    if (!bs || (cache >= 0 && !block_store_set_cache_size(bs, (size_t)cache))) {
+        fprintf(stderr, "replay: couldn't set up the device\n");
+        block_store_destroy(bs);
+        block_trace_reader_close(reader);
+        return 1;
+    }
+
+    // traced id -> id on this device (SIZE_MAX: never allocated here)
+    size_t *remap = malloc(traced_blocks * sizeof(size_t));
+    if (!remap) {
+        perror("replay: malloc failed");
+        block_store_destroy(bs);
+        block_trace_reader_close(reader);
+        return 1;
+    }
+    for (size_t id = 0; id < traced_blocks; ++id) {
+        remap[id] = id;
+    }
+
+    struct op_report report[BLOCK_STORE_OP_COUNT];
+    memset(report, 0, sizeof(report));
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 0x5A, sizeof(buffer));
+    block_trace_record_t rec;
+    uint64_t traced_ns = 0, skipped = 0;
+    uint64_t began = now_ns();
+    while (block_trace_next(reader, &rec)) {
+        traced_ns = rec.time_ns;
+        if (rec.op >= BLOCK_STORE_OP_COUNT
+                || (rec.block_id != BLOCK_TRACE_NO_BLOCK && rec.block_id >= traced_blocks)) {
+            skipped++;
+            continue;
+        }
+        size_t id = rec.block_id == BLOCK_TRACE_NO_BLOCK ? SIZE_MAX : remap[rec.block_id];
+        bool ok = false;
+        uint64_t start = now_ns();
+        switch (rec.op) {
+            case BLOCK_STORE_OP_ALLOCATE: {
+                size_t got = block_store_allocate(bs);
+                ok = got != SIZE_MAX;
+                if (rec.block_id != BLOCK_TRACE_NO_BLOCK) {
+                    remap[rec.block_id] = got;
+                }
+                break;
+            }
+            case BLOCK_STORE_OP_REQUEST:
+                ok = block_store_request(bs, id);
+                break;
+            case BLOCK_STORE_OP_RELEASE:
+                block_store_release(bs, id);
+                ok = id < BLOCK_STORE_NUM_BLOCKS;
+                break;
+            case BLOCK_STORE_OP_READ:
+                ok = block_store_read(bs, id, buffer) == BLOCK_SIZE_BYTES;
+                break;
+            case BLOCK_STORE_OP_WRITE:
+                ok = block_store_write(bs, id, buffer) == BLOCK_SIZE_BYTES;
+                break;
+            default:
+                skipped++;
+                continue;
+        }
+        uint64_t took = now_ns() - start;
+        struct op_report *r = &report[rec.op];
+        unsigned bucket = 63 - (unsigned)__builtin_clzll(took | 1);
+        r->calls++;
+        r->failures += !ok;
+        r->diverged += ok != (bool)rec.ok;
+        r->total_ns += took;
+        r->latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    }
+    uint64_t elapsed = now_ns() - began;
+    block_trace_reader_close(reader);
+    free(remap);
+
+    uint64_t calls = 0;
+    printf("%-10s %10s %9s %9s %10s %10s %10s %10s\n", "op", "calls", "failed", "diverged", "mean ns", "p50 ns",
+           "p99 ns", "p999 ns");
+    for (int op = 0; op < BLOCK_STORE_OP_COUNT; ++op) {
+        const struct op_report *r = &report[op];
+        if (!r->calls) {
+            continue;
+        }
+        calls += r->calls;
+        printf("%-10s %10llu %9llu %9llu %10llu %10llu %10llu %10llu\n", op_names[op], (unsigned long long)r->calls,
+               (unsigned long long)r->failures, (unsigned long long)r->diverged,
+               (unsigned long long)(r->total_ns / r->calls), (unsigned long long)percentile(r, 0.5),
+               (unsigned long long)percentile(r, 0.99), (unsigned long long)percentile(r, 0.999));
+    }
+    printf("\n%llu calls in %.3f ms (%.0f calls/s), traced run took %.3f ms\n", (unsigned long long)calls,
+           (double)elapsed / 1e6, elapsed ? (double)calls * 1e9 / (double)elapsed : 0.0, (double)traced_ns / 1e6);
+    if (skipped) {
+        printf("%llu records skipped (unknown op or block out of range)\n", (unsigned long long)skipped);
+    }
+    bool ok = report_fragmentation(bs);
+    block_store_destroy(bs);
+    return ok ? 0 : 1;
+}